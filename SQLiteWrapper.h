@@ -25,11 +25,43 @@ THE SOFTWARE.
 #ifndef SQLITEWRAPPER_H
 #define SQLITEWRAPPER_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
-#include <map>
+#include <istream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <sqlite3.h>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <optional>
+#define SQLITEWRAPPER_COROUTINES 1
+#endif
+#endif
 
 /**
  * A thin C++ wrapper around sqlite C interface
@@ -49,17 +81,391 @@ typedef enum {
 
 class SQLiteDatabase;
 
+/**
+ * Non-owning view of a TEXT column value (UTF-8, not NUL terminated when
+ * the value holds NULs), valid until the statement is stepped again, reset
+ * or finalized
+ */
+struct SQLiteTextView {
+    const char *data;
+    int size;
+
+    SQLiteTextView() : data(NULL), size(0)
+    {
+    }
+    std::string str() const
+    {
+        return std::string(data != NULL ? data : "", size);
+    }
+#if __cplusplus >= 201703L
+    operator std::string_view() const
+    {
+        return std::string_view(data, size);
+    }
+#endif
+};
+
+/**
+ * Non-owning view of a BLOB column value, valid until the statement is
+ * stepped again, reset or finalized. data is NULL for an empty BLOB.
+ */
+struct SQLiteBlobView {
+    const void *data;
+    int size;
+
+    SQLiteBlobView() : data(NULL), size(0)
+    {
+    }
+};
+
+/**
+ * Receives the errors the wrapper reports: the result code, a message and
+ * the place in SQLiteWrapper.h reporting it
+ */
+typedef std::function<void(int rc, const char *message, const char *file,
+                           int line)>
+    SQLiteErrorSink;
+
+/**
+ * Profile of the runs of one SQL text, see SQLiteDatabase::setProfiling
+ * Histogram bucket 0 counts runs taking under 1024ns, bucket i (1..22) those
+ * taking [2^(9+i), 2^(10+i)) ns and the last one the rest. The counters
+ * come from sqlite3_stmt_status.
+ */
+struct SQLiteStatementProfile {
+    static const int BUCKETS = 24;
+
+    std::string sql;
+    uint64_t runs;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+    uint64_t histogram[BUCKETS];
+    uint64_t fullScanSteps; // Rows stepped over in full table scans
+    uint64_t sorts;
+    uint64_t autoIndexes; // Rows inserted into automatic indexes
+    uint64_t vmSteps;
+
+    SQLiteStatementProfile()
+        : runs(0), totalNanos(0), maxNanos(0), fullScanSteps(0), sorts(0),
+          autoIndexes(0), vmSteps(0)
+    {
+        memset(histogram, 0, sizeof(histogram));
+    }
+};
+
+/**
+ * steady_clock time of the current run of a SQLiteStatement, for its
+ * profile: the time SQLITE_TRACE_PROFILE gives has the resolution of the
+ * VFS clock only
+ */
+struct SQLiteRunClock {
+    sqlite3_stmt *stmt;
+    uint64_t nanos; // Of the calls of the run before the one under way
+    std::chrono::steady_clock::time_point since; // Start of the call
+
+    explicit SQLiteRunClock(sqlite3_stmt *stmt) : stmt(stmt), nanos(0)
+    {
+    }
+};
+
+/**
+ * Error sink and statement profiles of a connection, shared by its
+ * statements
+ */
+class SQLiteDiagnostics
+{
+public:
+    SQLiteDiagnostics()
+        : _sink(&SQLiteDiagnostics::cerrSink), _profiling(false)
+    {
+    }
+
+    /// The default sink: the message on std::cerr
+    static void cerrSink(int, const char *message, const char *file, int line)
+    {
+        std::cerr << "[" << file << ":" << line << "]" << message << std::endl;
+    }
+
+    /// Replace the sink, an empty one drops the errors
+    void setSink(const SQLiteErrorSink &sink)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sink = sink;
+    }
+
+    void report(int rc, const char *message, const char *file, int line)
+    {
+        SQLiteErrorSink sink;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            sink = _sink;
+        }
+        if (sink) {
+            sink(rc, message != NULL ? message : sqlite3_errstr(rc), file,
+                 line);
+        }
+    }
+
+    bool profiling() const
+    {
+        return _profiling.load(std::memory_order_relaxed);
+    }
+
+    void setProfiling(bool on)
+    {
+        _profiling.store(on, std::memory_order_relaxed);
+    }
+
+    /// The clock of the statement call under way on this thread, if timed
+    static SQLiteRunClock *&runClock()
+    {
+        static thread_local SQLiteRunClock *clock = NULL;
+        return clock;
+    }
+
+    /// Account a finished run of a statement
+    void record(sqlite3_stmt *stmt, uint64_t nanos)
+    {
+        const char *sql = sqlite3_sql(stmt);
+        int bucket = 0;
+        for (uint64_t v = nanos >> 10; v != 0; v >>= 1) {
+            if (++bucket == SQLiteStatementProfile::BUCKETS - 1) {
+                break;
+            }
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        SQLiteStatementProfile &profile = _profiles[sql != NULL ? sql : ""];
+        ++profile.runs;
+        profile.totalNanos += nanos;
+        profile.maxNanos = std::max(profile.maxNanos, nanos);
+        ++profile.histogram[bucket];
+        profile.fullScanSteps +=
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        profile.sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+        profile.autoIndexes +=
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        profile.vmSteps +=
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    }
+
+    /// Profiles by decreasing total time
+    std::vector<SQLiteStatementProfile> profiles() const
+    {
+        std::vector<SQLiteStatementProfile> result;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            result.reserve(_profiles.size());
+            for (ProfileMap::const_iterator it = _profiles.begin();
+                 it != _profiles.end(); ++it) {
+                result.push_back(it->second);
+                result.back().sql = it->first;
+            }
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const SQLiteStatementProfile &a,
+                     const SQLiteStatementProfile &b) {
+                      return a.totalNanos > b.totalNanos;
+                  });
+        return result;
+    }
+
+    void clearProfiles()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _profiles.clear();
+    }
+
+    /// Write the profiles as text, a line per SQL text
+    void dumpProfiles(std::ostream &out) const
+    {
+        std::vector<SQLiteStatementProfile> all = profiles();
+        for (size_t i = 0; i < all.size(); ++i) {
+            const SQLiteStatementProfile &p = all[i];
+            out << "runs=" << p.runs << " total_us=" << p.totalNanos / 1000
+                << " avg_us=" << p.totalNanos / 1000 / p.runs
+                << " max_us=" << p.maxNanos / 1000
+                << " fullscan_steps=" << p.fullScanSteps
+                << " sorts=" << p.sorts << " autoindex=" << p.autoIndexes
+                << " vm_steps=" << p.vmSteps << " histogram=";
+            for (int b = 0; b < SQLiteStatementProfile::BUCKETS; ++b) {
+                out << (b > 0 ? "," : "") << p.histogram[b];
+            }
+            out << " sql=" << p.sql << "\n";
+        }
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3014000
+    /**
+     * sqlite3_trace_v2 callback, with the diagnostics as context. The run
+     * ends inside a step, reset or finalize call: a statement timing that
+     * call has the time of its clock accounted instead of the VFS's.
+     */
+    static int trace(unsigned type, void *ctx, void *p, void *x)
+    {
+        if (type == SQLITE_TRACE_PROFILE) {
+            uint64_t nanos = (uint64_t) * (sqlite3_int64 *)x;
+            SQLiteRunClock *clock = runClock();
+            if (clock != NULL && clock->stmt == p) {
+                std::chrono::steady_clock::time_point now =
+                    std::chrono::steady_clock::now();
+                nanos = clock->nanos +
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - clock->since)
+                            .count();
+                // The rest of the call belongs to no run
+                clock->nanos = 0;
+                clock->since = now;
+            }
+            ((SQLiteDiagnostics *)ctx)->record((sqlite3_stmt *)p, nanos);
+        }
+        return 0;
+    }
+#endif
+
+private:
+    typedef std::unordered_map<std::string, SQLiteStatementProfile>
+        ProfileMap;
+
+    mutable std::mutex _mutex;
+    SQLiteErrorSink _sink;
+    ProfileMap _profiles;
+    std::atomic<bool> _profiling;
+};
+
+template <typename Row> class SQLiteRowRange;
+
+/**
+ * How a column value converts to a C++ type, for the typed rows of
+ * SQLiteStatement::rows. get() is called on a row, for a column that
+ * exists; views are valid until the statement is stepped again.
+ */
+template <typename T> struct SQLiteColumn;
+
+template <> struct SQLiteColumn<int32_t> {
+    static int32_t get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        return sqlite3_column_int(stmt, zeroBasedColIndex);
+    }
+};
+
+template <> struct SQLiteColumn<int64_t> {
+    static int64_t get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        return sqlite3_column_int64(stmt, zeroBasedColIndex);
+    }
+};
+
+template <> struct SQLiteColumn<double> {
+    static double get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        return sqlite3_column_double(stmt, zeroBasedColIndex);
+    }
+};
+
+template <> struct SQLiteColumn<SQLiteTextView> {
+    static SQLiteTextView get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        SQLiteTextView view;
+        view.data = (const char *)sqlite3_column_text(stmt, zeroBasedColIndex);
+        view.size = sqlite3_column_bytes(stmt, zeroBasedColIndex);
+        return view;
+    }
+};
+
+template <> struct SQLiteColumn<SQLiteBlobView> {
+    static SQLiteBlobView get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        SQLiteBlobView view;
+        view.data = sqlite3_column_blob(stmt, zeroBasedColIndex);
+        view.size = sqlite3_column_bytes(stmt, zeroBasedColIndex);
+        return view;
+    }
+};
+
+template <> struct SQLiteColumn<std::string> {
+    static std::string get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        return SQLiteColumn<SQLiteTextView>::get(stmt, zeroBasedColIndex)
+            .str();
+    }
+};
+
+template <> struct SQLiteColumn<std::u16string> {
+    static std::u16string get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        const char16_t *ptr =
+            (const char16_t *)sqlite3_column_text16(stmt, zeroBasedColIndex);
+        if (ptr == NULL) {
+            return std::u16string();
+        }
+        return std::u16string(
+            ptr, sqlite3_column_bytes16(stmt, zeroBasedColIndex) / 2);
+    }
+};
+
+template <> struct SQLiteColumn<std::vector<uint8_t> > {
+    static std::vector<uint8_t> get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        SQLiteBlobView view =
+            SQLiteColumn<SQLiteBlobView>::get(stmt, zeroBasedColIndex);
+        const uint8_t *ptr = (const uint8_t *)view.data;
+        return std::vector<uint8_t>(ptr, ptr + view.size);
+    }
+};
+
+#if __cplusplus >= 201703L
+template <> struct SQLiteColumn<std::string_view> {
+    static std::string_view get(sqlite3_stmt *stmt, int zeroBasedColIndex)
+    {
+        return SQLiteColumn<SQLiteTextView>::get(stmt, zeroBasedColIndex);
+    }
+};
+#endif
+
+/**
+ * How a result row decodes into a C++ type, for SQLiteStatement::rows.
+ * Tuples get their elements from the columns in order; for a struct,
+ * specialize with the number of columns it needs and
+ *     static void decode(sqlite3_stmt *stmt, Row &row)
+ * reading them with SQLiteColumn<T>::get.
+ */
+template <typename Row> struct SQLiteRowDecoder;
+
+template <typename... Args> struct SQLiteRowDecoder<std::tuple<Args...> > {
+    static const int columns = sizeof...(Args);
+
+    static void decode(sqlite3_stmt *stmt, std::tuple<Args...> &row)
+    {
+        _decode<0>(stmt, row);
+    }
+
+private:
+    template <size_t I>
+    static typename std::enable_if<I == sizeof...(Args)>::type
+    _decode(sqlite3_stmt *, std::tuple<Args...> &)
+    {
+    }
+    template <size_t I>
+    static typename std::enable_if<I < sizeof...(Args)>::type
+    _decode(sqlite3_stmt *stmt, std::tuple<Args...> &row)
+    {
+        typedef typename std::tuple_element<I, std::tuple<Args...> >::type T;
+        std::get<I>(row) = SQLiteColumn<T>::get(stmt, (int)I);
+        _decode<I + 1>(stmt, row);
+    }
+};
+
 class SQLiteStatement
 {
     friend SQLiteDatabase;
+    template <typename Row> friend class SQLiteRowRange;
 
 public:
     ~SQLiteStatement()
     {
-        int rc = sqlite3_finalize(_stmt);
+        int rc = _timed(&sqlite3_finalize);
         if (rc != SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << "Last error: " << sqlite3_errstr(rc) << std::endl;
+            _report(rc, __LINE__);
         }
         _stmt = NULL;
     }
@@ -68,10 +474,9 @@ public:
     int reset()
     {
         _clearRowData();
-        int rc = sqlite3_reset(_stmt);
+        int rc = _timed(&sqlite3_reset);
         if (rc != SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << "Last error: " << sqlite3_errstr(rc) << std::endl;
+            _report(rc, __LINE__);
         }
         return rc;
     }
@@ -79,6 +484,7 @@ public:
     /// Clear binding data
     int clearBindings()
     {
+        _owned.clear();
         return sqlite3_clear_bindings(_stmt);
     }
 
@@ -86,36 +492,98 @@ public:
     int bind(int oneBasedIndex)
     {
         int rc = sqlite3_bind_null(_stmt, oneBasedIndex);
-        return rc;
+        return _bound(oneBasedIndex, rc);
     }
 
-    /// Bind BLOB
+    int bind(int oneBasedIndex, std::nullptr_t)
+    {
+        return bind(oneBasedIndex);
+    }
+
+    /// Bind BLOB (copied)
     int bind(int oneBasedIndex, const void *data, int length)
     {
         int rc = sqlite3_bind_blob(_stmt, oneBasedIndex, data, length,
                                    SQLITE_TRANSIENT);
-        return rc;
+        return _bound(oneBasedIndex, rc);
+    }
+
+    /// Bind BLOB without copying it
+    // Caller must maintain data reference until the statement is rebound,
+    // has its bindings cleared or is finalized
+    int bindStatic(int oneBasedIndex, const void *data, int length)
+    {
+        int rc = sqlite3_bind_blob(_stmt, oneBasedIndex, data, length,
+                                   SQLITE_STATIC);
+        return _bound(oneBasedIndex, rc);
+    }
+
+    /// Bind BLOB
+    // Caller must maintain data reference until execute is called
+    int bind(int oneBasedIndex, const std::vector<uint8_t> &blob)
+    {
+        if (blob.empty()) {
+            int rc = sqlite3_bind_zeroblob(_stmt, oneBasedIndex, 0);
+            return _bound(oneBasedIndex, rc);
+        }
+        return bindStatic(oneBasedIndex, blob.data(), blob.size());
+    }
+
+    /// Bind BLOB, taking the buffer over: the statement keeps it until it
+    /// is rebound, has its bindings cleared or is finalized
+    int bind(int oneBasedIndex, std::vector<uint8_t> &&blob)
+    {
+        OwnedValue *owned = _own(oneBasedIndex);
+        if (owned == NULL) {
+            return sqlite3_stmt_busy(_stmt) ? SQLITE_MISUSE : SQLITE_RANGE;
+        }
+        owned->blob = std::move(blob);
+        owned->text.clear();
+        if (owned->blob.empty()) {
+            // An empty vector may have no buffer, which would bind NULL
+            return sqlite3_bind_zeroblob(_stmt, oneBasedIndex, 0);
+        }
+        return sqlite3_bind_blob64(_stmt, oneBasedIndex, owned->blob.data(),
+                                   owned->blob.size(), SQLITE_STATIC);
+    }
+
+    /// Bind a BLOB of zeros, to be written with incremental BLOB I/O
+    int bindZeroBlob(int oneBasedIndex, int64_t size)
+    {
+        int rc = sqlite3_bind_zeroblob64(_stmt, oneBasedIndex, size);
+        return _bound(oneBasedIndex, rc);
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3020000
+    /// Bind a pointer for an extension function or virtual table of the
+    /// given type, see sqlite3_bind_pointer
+    int bindPointer(int oneBasedIndex, void *ptr, const char *type,
+                    void (*destroy)(void *))
+    {
+        int rc = sqlite3_bind_pointer(_stmt, oneBasedIndex, ptr, type, destroy);
+        return _bound(oneBasedIndex, rc);
     }
+#endif
 
     /// Bind DOUBLE
     int bind(int oneBasedIndex, double d)
     {
         int rc = sqlite3_bind_double(_stmt, oneBasedIndex, d);
-        return rc;
+        return _bound(oneBasedIndex, rc);
     }
 
     /// Bind INT
     int bind(int oneBasedIndex, int32_t i)
     {
         int rc = sqlite3_bind_int(_stmt, oneBasedIndex, i);
-        return rc;
+        return _bound(oneBasedIndex, rc);
     }
 
     /// Bind INT64
     int bind(int oneBasedIndex, int64_t i64)
     {
         int rc = sqlite3_bind_int64(_stmt, oneBasedIndex, i64);
-        return rc;
+        return _bound(oneBasedIndex, rc);
     }
 
     /// Bind TEXT
@@ -124,27 +592,75 @@ public:
     {
         int rc = sqlite3_bind_text(_stmt, oneBasedIndex, text.data(),
                                    text.length(), SQLITE_STATIC);
-        return rc;
+        return _bound(oneBasedIndex, rc);
+    }
+
+    /// Bind TEXT, taking the string over: the statement keeps it until it
+    /// is rebound, has its bindings cleared or is finalized
+    int bind(int oneBasedIndex, std::string &&text)
+    {
+        OwnedValue *owned = _own(oneBasedIndex);
+        if (owned == NULL) {
+            return sqlite3_stmt_busy(_stmt) ? SQLITE_MISUSE : SQLITE_RANGE;
+        }
+        owned->text = std::move(text);
+        owned->blob.clear();
+        return sqlite3_bind_text64(_stmt, oneBasedIndex, owned->text.data(),
+                                   owned->text.length(), SQLITE_STATIC,
+                                   SQLITE_UTF8);
     }
 
     int bind(int oneBasedIndex, const char *text)
     {
         int rc = sqlite3_bind_text(_stmt, oneBasedIndex, text, strlen(text),
                                    SQLITE_STATIC);
-        return rc;
+        return _bound(oneBasedIndex, rc);
     }
 
     /// Bind UTF16 TEXT
-    int bind(int oneBasedIndex, const std::wstring &text)
+    // Caller must maintain data reference until execute is called
+    int bind(int oneBasedIndex, const std::u16string &text)
     {
         int rc = sqlite3_bind_text16(_stmt, oneBasedIndex, text.data(),
                                      2 * text.length(), SQLITE_STATIC);
-        return rc;
+        return _bound(oneBasedIndex, rc);
+    }
+
+    /// Bind wide TEXT (copied where wchar_t isn't UTF-16)
+    int bind(int oneBasedIndex, const std::wstring &text)
+    {
+        return _bindWide(oneBasedIndex, text.data(), text.length());
+    }
+
+    int bind(int oneBasedIndex, const wchar_t *text)
+    {
+        return _bindWide(oneBasedIndex, text, wcslen(text));
+    }
+
+    /**
+     * Bind values to the parameters from 1 on, in order, each through the
+     * bind overload for its type
+     * @return SQLITE_OK or the error of the first bind failing
+     */
+    template <typename... Args> int bindValues(const Args &... values)
+    {
+        return _bindFrom(1, values...);
     }
 
-    int bind(int oneBasedIndex, const wchar_t * text)
+    /**
+     * Execute a statement that returns no rows (or whose rows are of no
+     * interest) and reset it, keeping the bindings
+     * @return SQLITE_OK or the error
+     */
+    int executeUpdate()
     {
-        int rc = sqlite3_bind_text16(_stmt, oneBasedIndex, text, wcslen(text), SQLITE_STATIC);
+        int rc = _timed(&sqlite3_step);
+        _clearRowData();
+        _timed(&sqlite3_reset);
+        if (rc == SQLITE_DONE || rc == SQLITE_ROW) {
+            return SQLITE_OK;
+        }
+        _report(rc, __LINE__);
         return rc;
     }
 
@@ -153,7 +669,7 @@ public:
     {
         _hasRow = false;
         _columnCount = 0;
-        int rc = sqlite3_step(_stmt);
+        int rc = _timed(&sqlite3_step);
         if (rc == SQLITE_DONE) {
             // Should reset to execute another before step again
             reset();
@@ -161,23 +677,35 @@ public:
         } else if (rc == SQLITE_ROW) {
             // Have returned data, step again to retrieve more row(s)
             _columnCount = sqlite3_column_count(_stmt);
-            for (int i = 0; i < _columnCount; ++i) {
-                const char *ptr = sqlite3_column_name(_stmt, i);
-                if (ptr) {
-                    _rowNameIndex[std::string(ptr)] = i;
-                }
-            }
             _hasRow = true;
             return true;
         } else {
             // Error occurred
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << "Error: " << sqlite3_errstr(rc) << std::endl;
+            _report(rc, __LINE__);
             reset();
             return false;
         }
     }
 
+    /**
+     * Result rows decoded into tuples, for a range-based for loop, e.g.
+     *     for (const auto &row : stmt->rows<int64_t, std::string>())
+     * The statement is run from the start with its current bindings. There
+     * is one bounds check for the whole result: the loop has no rows if the
+     * statement has fewer columns than the tuple, see
+     * SQLiteRowRange::status.
+     */
+    template <typename... Args> SQLiteRowRange<std::tuple<Args...> > rows()
+    {
+        return SQLiteRowRange<std::tuple<Args...> >(this);
+    }
+
+    /// Result rows decoded into a type with a SQLiteRowDecoder
+    template <typename Row> SQLiteRowRange<Row> rowsAs()
+    {
+        return SQLiteRowRange<Row>(this);
+    }
+
     /// Indicate whether there currently is a result row (after execute or next)
     bool hasRow()
     {
@@ -187,7 +715,7 @@ public:
     /// Iterate to next result row (then check with hasRow)
     void next()
     {
-        int rc = sqlite3_step(_stmt);
+        int rc = _timed(&sqlite3_step);
         if (rc == SQLITE_DONE) {
             // Should reset to execute another before step again
             _hasRow = false;
@@ -198,15 +726,36 @@ public:
             _hasRow = true;
         } else {
             // Error occurred
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << "Error: " << sqlite3_errstr(rc) << std::endl;
+            _report(rc, __LINE__);
             reset();
         }
     }
 
+    /**
+     * Zero based index of a result column by name, -1 if there is none.
+     * The names are indexed once per statement, and again once a schema
+     * change has it prepared again; loops over many rows can resolve the
+     * index once and use the index based getters.
+     */
+    int getColumnIndex(const std::string &colName)
+    {
+        if (_columnIndexReprepares != _reprepares() ||
+            _columnIndexCount != sqlite3_column_count(_stmt)) {
+            _buildColumnIndex();
+        }
+        std::vector<std::pair<std::string, int> >::const_iterator it =
+            std::lower_bound(_columnIndex.begin(), _columnIndex.end(),
+                             std::make_pair(colName, -1));
+        if (it != _columnIndex.end() && it->first == colName) {
+            return it->second;
+        }
+        return -1;
+    }
+
     SQLiteDataType getColumnType(int zeroBasedColIndex)
     {
-        if (_hasRow) {
+        if (!_hasRow || zeroBasedColIndex < 0 ||
+            zeroBasedColIndex >= _columnCount) {
             return TYPE_UNKNOWN;
         }
         int dataType = sqlite3_column_type(_stmt, zeroBasedColIndex);
@@ -228,13 +777,8 @@ public:
 
     int getDouble(double &_return, const std::string &colName)
     {
-        std::map<std::string, int>::const_iterator it =
-            _rowNameIndex.find(colName);
-        if (it != _rowNameIndex.end()) {
-            return getDouble(_return, it->second);
-        } else {
-            return SQLITE_NOTFOUND;
-        }
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getDouble(_return, index) : SQLITE_NOTFOUND;
     }
 
     int getInt(int &_return, int zeroBasedColIndex)
@@ -249,16 +793,11 @@ public:
 
     int getInt(int &_return, const std::string &colName)
     {
-        std::map<std::string, int>::const_iterator it =
-            _rowNameIndex.find(colName);
-        if (it != _rowNameIndex.end()) {
-            return getInt(_return, it->second);
-        } else {
-            return SQLITE_NOTFOUND;
-        }
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getInt(_return, index) : SQLITE_NOTFOUND;
     }
 
-    int64_t getInt64(int64_t _return, int zeroBasedColIndex)
+    int getInt64(int64_t &_return, int zeroBasedColIndex)
     {
         if (!_hasRow || zeroBasedColIndex < 0 ||
             zeroBasedColIndex >= _columnCount) {
@@ -268,15 +807,10 @@ public:
         return SQLITE_OK;
     }
 
-    int64_t getInt64(int64_t _return, const std::string &colName)
+    int getInt64(int64_t &_return, const std::string &colName)
     {
-        std::map<std::string, int>::const_iterator it =
-            _rowNameIndex.find(colName);
-        if (it != _rowNameIndex.end()) {
-            return getInt64(_return, it->second);
-        } else {
-            return SQLITE_NOTFOUND;
-        }
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getInt64(_return, index) : SQLITE_NOTFOUND;
     }
 
     int getString(std::string &_return, int zeroBasedColIndex)
@@ -289,7 +823,7 @@ public:
         const char *ptr =
             (const char *)sqlite3_column_text(_stmt, zeroBasedColIndex);
         if (ptr != NULL) {
-            _return = std::string(ptr);
+            _return.assign(ptr, sqlite3_column_bytes(_stmt, zeroBasedColIndex));
             return SQLITE_OK;
         } else {
             _return = "";
@@ -299,13 +833,8 @@ public:
 
     int getString(std::string &_return, const std::string &colName)
     {
-        std::map<std::string, int>::const_iterator it =
-            _rowNameIndex.find(colName);
-        if (it != _rowNameIndex.end()) {
-            return getString(_return, it->second);
-        } else {
-            return SQLITE_NOTFOUND;
-        }
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getString(_return, index) : SQLITE_NOTFOUND;
     }
 
     int getString(std::wstring &_return, int zeroBasedColIndex)
@@ -315,9 +844,11 @@ public:
             _return = L"";
             return SQLITE_MISUSE;
         }
-        const void *ptr = sqlite3_column_text(_stmt, zeroBasedColIndex);
+        const char16_t *ptr =
+            (const char16_t *)sqlite3_column_text16(_stmt, zeroBasedColIndex);
         if (ptr != NULL) {
-            _return = std::wstring((const wchar_t *)ptr);
+            _utf16ToWide(_return, ptr,
+                         sqlite3_column_bytes16(_stmt, zeroBasedColIndex) / 2);
             return SQLITE_OK;
         } else {
             _return = L"";
@@ -327,178 +858,2209 @@ public:
 
     int getString(std::wstring &_return, const std::string &colName)
     {
-        std::map<std::string, int>::const_iterator it =
-            _rowNameIndex.find(colName);
-        if (it != _rowNameIndex.end()) {
-            return getString(_return, it->second);
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getString(_return, index) : SQLITE_NOTFOUND;
+    }
+
+    /// Get TEXT as UTF-16
+    int getString(std::u16string &_return, int zeroBasedColIndex)
+    {
+        if (!_hasRow || zeroBasedColIndex < 0 ||
+            zeroBasedColIndex >= _columnCount) {
+            _return.clear();
+            return SQLITE_MISUSE;
+        }
+        const char16_t *ptr =
+            (const char16_t *)sqlite3_column_text16(_stmt, zeroBasedColIndex);
+        if (ptr != NULL) {
+            int bytes = sqlite3_column_bytes16(_stmt, zeroBasedColIndex);
+            _return.assign(ptr, bytes / 2);
+            return SQLITE_OK;
         } else {
-            return SQLITE_NOTFOUND;
+            _return.clear();
+            return SQLITE_ERROR;
         }
     }
 
-private:
-    sqlite3_stmt *_stmt;
-    // Query data
-    bool _hasRow;
-    int _columnCount;
-    std::map<std::string, int> _rowNameIndex;
-
-private:
-    SQLiteStatement(sqlite3_stmt *stmt)
-        : _stmt(stmt), _hasRow(false), _columnCount(0)
+    int getString(std::u16string &_return, const std::string &colName)
     {
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getString(_return, index) : SQLITE_NOTFOUND;
     }
-    void _clearRowData()
+
+    /// Get TEXT without copying it, see SQLiteTextView
+    int getText(SQLiteTextView &_return, int zeroBasedColIndex)
+    {
+        _return = SQLiteTextView();
+        if (!_hasRow || zeroBasedColIndex < 0 ||
+            zeroBasedColIndex >= _columnCount) {
+            return SQLITE_MISUSE;
+        }
+        _return.data =
+            (const char *)sqlite3_column_text(_stmt, zeroBasedColIndex);
+        if (_return.data == NULL) {
+            return SQLITE_ERROR;
+        }
+        _return.size = sqlite3_column_bytes(_stmt, zeroBasedColIndex);
+        return SQLITE_OK;
+    }
+
+    int getText(SQLiteTextView &_return, const std::string &colName)
+    {
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getText(_return, index) : SQLITE_NOTFOUND;
+    }
+
+    /// Get BLOB without copying it, see SQLiteBlobView
+    int getBlob(SQLiteBlobView &_return, int zeroBasedColIndex)
+    {
+        _return = SQLiteBlobView();
+        if (!_hasRow || zeroBasedColIndex < 0 ||
+            zeroBasedColIndex >= _columnCount) {
+            return SQLITE_MISUSE;
+        }
+        _return.data = sqlite3_column_blob(_stmt, zeroBasedColIndex);
+        _return.size = sqlite3_column_bytes(_stmt, zeroBasedColIndex);
+        return SQLITE_OK;
+    }
+
+    int getBlob(SQLiteBlobView &_return, const std::string &colName)
+    {
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getBlob(_return, index) : SQLITE_NOTFOUND;
+    }
+
+    /// Get a copy of a BLOB
+    int getBlob(std::vector<uint8_t> &_return, int zeroBasedColIndex)
+    {
+        SQLiteBlobView view;
+        int rc = getBlob(view, zeroBasedColIndex);
+        const uint8_t *ptr = (const uint8_t *)view.data;
+        _return.assign(ptr, ptr + view.size);
+        return rc;
+    }
+
+    int getBlob(std::vector<uint8_t> &_return, const std::string &colName)
+    {
+        int index = getColumnIndex(colName);
+        return index >= 0 ? getBlob(_return, index) : SQLITE_NOTFOUND;
+    }
+
+private:
+    sqlite3_stmt *_stmt;
+    // Query data
+    bool _hasRow;
+    int _columnCount;
+    // Result column names and indexes, sorted by name, first column first
+    std::vector<std::pair<std::string, int> > _columnIndex;
+    // Reprepare count and column count it was built at, -1 if not built
+    int _columnIndexReprepares;
+    int _columnIndexCount;
+    // Values bound by move, by parameter index less one
+    struct OwnedValue {
+        std::string text;
+        std::vector<uint8_t> blob;
+    };
+    std::vector<OwnedValue> _owned;
+    std::shared_ptr<SQLiteDiagnostics> _diagnostics;
+    SQLiteRunClock _clock;
+
+private:
+    SQLiteStatement(sqlite3_stmt *stmt,
+                    const std::shared_ptr<SQLiteDiagnostics> &diagnostics)
+        : _stmt(stmt), _hasRow(false), _columnCount(0),
+          _columnIndexReprepares(-1), _columnIndexCount(-1),
+          _diagnostics(diagnostics), _clock(stmt)
+    {
+    }
+    /**
+     * Step, reset or finalize the statement, timed by _clock while the
+     * connection is profiled
+     */
+    int _timed(int (*call)(sqlite3_stmt *))
+    {
+        if (!_diagnostics->profiling()) {
+            return call(_stmt);
+        }
+        if (!sqlite3_stmt_busy(_stmt)) {
+            // A new run, or none: nothing before this call belongs to it
+            _clock.nanos = 0;
+        }
+        SQLiteRunClock *&current = SQLiteDiagnostics::runClock();
+        SQLiteRunClock *outer = current;
+        current = &_clock;
+        _clock.since = std::chrono::steady_clock::now();
+        int rc = call(_stmt);
+        _clock.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - _clock.since)
+                            .count();
+        current = outer;
+        return rc;
+    }
+    void _report(int rc, int line)
+    {
+        _diagnostics->report(rc, sqlite3_errstr(rc), __FILE__, line);
+    }
+    void _clearRowData()
+    {
+        _hasRow = false;
+        _columnCount = 0;
+    }
+    int _bindFrom(int)
+    {
+        return SQLITE_OK;
+    }
+    template <typename T, typename... Rest>
+    int _bindFrom(int oneBasedIndex, const T &value, const Rest &... rest)
+    {
+        int rc = bind(oneBasedIndex, value);
+        return rc == SQLITE_OK ? _bindFrom(oneBasedIndex + 1, rest...) : rc;
+    }
+    /// Drop the value owned for a parameter once it is bound to another
+    int _bound(int oneBasedIndex, int rc)
+    {
+        if (rc == SQLITE_OK && oneBasedIndex >= 1 &&
+            (size_t)oneBasedIndex <= _owned.size()) {
+            OwnedValue &owned = _owned[oneBasedIndex - 1];
+            std::string().swap(owned.text);
+            std::vector<uint8_t>().swap(owned.blob);
+        }
+        return rc;
+    }
+    /// Slot holding the value a parameter is bound to by move, NULL if the
+    /// parameter can't be bound (the value it holds may still be in use)
+    OwnedValue *_own(int oneBasedIndex)
+    {
+        int count = sqlite3_bind_parameter_count(_stmt);
+        if (oneBasedIndex < 1 || oneBasedIndex > count ||
+            sqlite3_stmt_busy(_stmt)) {
+            return NULL;
+        }
+        // Sized once: the bound strings mustn't move
+        if (_owned.empty()) {
+            _owned.resize(count);
+        }
+        return &_owned[oneBasedIndex - 1];
+    }
+    int _bindWide(int oneBasedIndex, const wchar_t *text, size_t length)
+    {
+        int rc;
+        if (sizeof(wchar_t) == 2) {
+            rc = sqlite3_bind_text16(_stmt, oneBasedIndex, text, 2 * length,
+                                     SQLITE_STATIC);
+        } else {
+            std::u16string utf16;
+            utf16.reserve(length);
+            for (size_t i = 0; i < length; ++i) {
+                uint32_t c = (uint32_t)text[i];
+                if (c >= 0x10000) {
+                    c -= 0x10000;
+                    utf16.push_back((char16_t)(0xD800 + (c >> 10)));
+                    c = 0xDC00 + (c & 0x3FF);
+                }
+                utf16.push_back((char16_t)c);
+            }
+            rc = sqlite3_bind_text16(_stmt, oneBasedIndex, utf16.data(),
+                                     2 * utf16.length(), SQLITE_TRANSIENT);
+        }
+        return _bound(oneBasedIndex, rc);
+    }
+    static void _utf16ToWide(std::wstring &_return, const char16_t *ptr,
+                             size_t length)
+    {
+        _return.clear();
+        _return.reserve(length);
+        for (size_t i = 0; i < length; ++i) {
+            uint32_t c = ptr[i];
+            // wchar_t holds whole code points where it is 32 bits wide
+            if (sizeof(wchar_t) > 2 && c >= 0xD800 && c < 0xDC00 &&
+                i + 1 < length && ptr[i + 1] >= 0xDC00 && ptr[i + 1] < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (ptr[i + 1] - 0xDC00);
+                ++i;
+            }
+            _return.push_back((wchar_t)c);
+        }
+    }
+    /// Times the statement was prepared again after a schema change
+    int _reprepares()
+    {
+#if SQLITE_VERSION_NUMBER >= 3020000
+        return sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+#else
+        return 0;
+#endif
+    }
+    void _buildColumnIndex()
+    {
+        int count = sqlite3_column_count(_stmt);
+        _columnIndex.clear();
+        _columnIndex.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            const char *ptr = sqlite3_column_name(_stmt, i);
+            if (ptr) {
+                _columnIndex.push_back(std::make_pair(std::string(ptr), i));
+            }
+        }
+        std::sort(_columnIndex.begin(), _columnIndex.end());
+        _columnIndexReprepares = _reprepares();
+        _columnIndexCount = count;
+    }
+};
+
+/**
+ * Result rows of a statement decoded into Row, see SQLiteStatement::rows.
+ * Iterating runs the statement from its first row; a row is valid until
+ * the iterator is advanced.
+ */
+template <typename Row> class SQLiteRowRange
+{
+public:
+    class iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Row value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Row *pointer;
+        typedef const Row &reference;
+
+        explicit iterator(SQLiteRowRange *range = NULL) : _range(range)
+        {
+        }
+        const Row &operator*() const
+        {
+            return _range->_row;
+        }
+        const Row *operator->() const
+        {
+            return &_range->_row;
+        }
+        iterator &operator++()
+        {
+            _range->_step();
+            return *this;
+        }
+        bool operator==(const iterator &other) const
+        {
+            return _atEnd() == other._atEnd();
+        }
+        bool operator!=(const iterator &other) const
+        {
+            return !(*this == other);
+        }
+
+    private:
+        SQLiteRowRange *_range;
+
+        bool _atEnd() const
+        {
+            return _range == NULL || _range->_rc != SQLITE_ROW;
+        }
+    };
+
+    explicit SQLiteRowRange(SQLiteStatement *stmt)
+        : _stmt(stmt), _rc(SQLITE_DONE)
+    {
+    }
+
+    iterator begin()
+    {
+        _stmt->_clearRowData();
+        _stmt->_timed(&sqlite3_reset);
+        if (sqlite3_column_count(_stmt->_stmt) <
+            SQLiteRowDecoder<Row>::columns) {
+            _rc = SQLITE_RANGE;
+        } else {
+            _step();
+        }
+        return iterator(this);
+    }
+
+    iterator end()
+    {
+        return iterator();
+    }
+
+    /// SQLITE_DONE once all the rows were read, otherwise the error
+    int status() const
+    {
+        return _rc;
+    }
+
+private:
+    SQLiteStatement *_stmt;
+    Row _row;
+    int _rc;
+
+    void _step()
+    {
+        _rc = _stmt->_timed(&sqlite3_step);
+        if (_rc == SQLITE_ROW) {
+            _stmt->_hasRow = true;
+            _stmt->_columnCount = sqlite3_column_count(_stmt->_stmt);
+            SQLiteRowDecoder<Row>::decode(_stmt->_stmt, _row);
+            return;
+        }
+        if (_rc != SQLITE_DONE) {
+            _stmt->_report(_rc, __LINE__);
+        }
+        _stmt->_clearRowData();
+        _stmt->_timed(&sqlite3_reset);
+    }
+};
+
+/**
+ * A statement on loan from the statement cache of a SQLiteDatabase, see
+ * SQLiteDatabase::cachedStatement. It goes back to the cache, reset and
+ * with its bindings cleared, when the handle is destroyed, and must not
+ * outlive the database.
+ */
+class SQLiteCachedStatement
+{
+    friend SQLiteDatabase;
+
+public:
+    SQLiteCachedStatement() : _db(NULL), _stmt(NULL)
+    {
+    }
+    SQLiteCachedStatement(SQLiteCachedStatement &&other)
+        : _db(other._db), _stmt(other._stmt), _sql(std::move(other._sql))
+    {
+        other._stmt = NULL;
+    }
+    SQLiteCachedStatement &operator=(SQLiteCachedStatement &&other)
+    {
+        if (this != &other) {
+            release();
+            _db = other._db;
+            _stmt = other._stmt;
+            _sql = std::move(other._sql);
+            other._stmt = NULL;
+        }
+        return *this;
+    }
+    SQLiteCachedStatement(const SQLiteCachedStatement &) = delete;
+    SQLiteCachedStatement &operator=(const SQLiteCachedStatement &) = delete;
+    ~SQLiteCachedStatement()
+    {
+        release();
+    }
+
+    /// Give the statement back to the cache now
+    inline void release();
+
+    SQLiteStatement *get() const
+    {
+        return _stmt;
+    }
+    SQLiteStatement *operator->() const
+    {
+        return _stmt;
+    }
+    SQLiteStatement &operator*() const
+    {
+        return *_stmt;
+    }
+    /// Whether the statement was prepared
+    explicit operator bool() const
+    {
+        return _stmt != NULL;
+    }
+
+private:
+    SQLiteDatabase *_db;
+    SQLiteStatement *_stmt;
+    std::string _sql;
+
+private:
+    SQLiteCachedStatement(SQLiteDatabase *db, SQLiteStatement *stmt,
+                          const std::string &sql)
+        : _db(db), _stmt(stmt), _sql(sql)
+    {
+    }
+};
+
+/**
+ * Incremental I/O on one BLOB or TEXT value, from
+ * SQLiteDatabase::openBlob. Values are read and written in pieces at a
+ * position, so large values go through a caller buffer instead of memory
+ * for the whole of them. A value can't change size: write zeroblob(n) first
+ * to fill it in. The handle aborts (SQLITE_ABORT) when its row changes, and
+ * must not outlive the database.
+ */
+class SQLiteBlobStream
+{
+    friend SQLiteDatabase;
+
+public:
+    SQLiteBlobStream() : _blob(NULL), _size(0), _offset(0)
+    {
+    }
+    SQLiteBlobStream(SQLiteBlobStream &&other)
+        : _blob(other._blob), _size(other._size), _offset(other._offset),
+          _diagnostics(std::move(other._diagnostics))
+    {
+        other._blob = NULL;
+    }
+    SQLiteBlobStream &operator=(SQLiteBlobStream &&other)
+    {
+        if (this != &other) {
+            close();
+            _blob = other._blob;
+            _size = other._size;
+            _offset = other._offset;
+            _diagnostics = std::move(other._diagnostics);
+            other._blob = NULL;
+        }
+        return *this;
+    }
+    SQLiteBlobStream(const SQLiteBlobStream &) = delete;
+    SQLiteBlobStream &operator=(const SQLiteBlobStream &) = delete;
+    ~SQLiteBlobStream()
+    {
+        close();
+    }
+
+    /// Whether the value was opened
+    explicit operator bool() const
+    {
+        return _blob != NULL;
+    }
+
+    /// Size of the value in bytes
+    int size() const
+    {
+        return _size;
+    }
+
+    /// Position of the next read or write
+    int tell() const
+    {
+        return _offset;
+    }
+
+    /// @return SQLITE_OK, SQLITE_RANGE if offset is outside of the value
+    int seek(int offset)
+    {
+        if (offset < 0 || offset > _size) {
+            return SQLITE_RANGE;
+        }
+        _offset = offset;
+        return SQLITE_OK;
+    }
+
+    /**
+     * Read up to size bytes at the position, and move past them
+     * @param _return the bytes read, 0 at the end of the value
+     */
+    int read(void *buffer, int size, int &_return)
+    {
+        _return = 0;
+        int n = std::min(size, _size - _offset);
+        if (n <= 0) {
+            return _blob ? SQLITE_OK : SQLITE_MISUSE;
+        }
+        int rc = readAt(buffer, n, _offset);
+        if (rc == SQLITE_OK) {
+            _offset += n;
+            _return = n;
+        }
+        return rc;
+    }
+
+    /// Write size bytes at the position, and move past them
+    int write(const void *buffer, int size)
+    {
+        int rc = writeAt(buffer, size, _offset);
+        if (rc == SQLITE_OK) {
+            _offset += size;
+        }
+        return rc;
+    }
+
+    /// Read exactly size bytes at offset, the position doesn't move
+    int readAt(void *buffer, int size, int offset)
+    {
+        if (!_blob) {
+            return SQLITE_MISUSE;
+        }
+        int rc = sqlite3_blob_read(_blob, buffer, size, offset);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+
+    /// Write exactly size bytes at offset, the position doesn't move
+    int writeAt(const void *buffer, int size, int offset)
+    {
+        if (!_blob) {
+            return SQLITE_MISUSE;
+        }
+        int rc = sqlite3_blob_write(_blob, buffer, size, offset);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+
+    /**
+     * Move the handle to the same column of another row of the table, at
+     * position 0. This is much cheaper than opening a new one. On failure
+     * the handle can only be closed.
+     */
+    int reopen(int64_t rowid)
+    {
+        if (!_blob) {
+            return SQLITE_MISUSE;
+        }
+        int rc = sqlite3_blob_reopen(_blob, rowid);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+            _size = 0;
+        } else {
+            _size = sqlite3_blob_bytes(_blob);
+        }
+        _offset = 0;
+        return rc;
+    }
+
+    /// Copy from the position to the end of the value into out, chunkSize
+    /// bytes at a time
+    int readTo(std::ostream &out, int chunkSize = 64 << 10)
+    {
+        std::vector<char> chunk(std::max(chunkSize, 1));
+        int rc, n;
+        while ((rc = read(chunk.data(), (int)chunk.size(), n)) == SQLITE_OK &&
+               n > 0) {
+            if (!out.write(chunk.data(), n)) {
+                return SQLITE_IOERR;
+            }
+        }
+        return rc;
+    }
+
+    /**
+     * Copy from in until its end or the end of the value, chunkSize bytes
+     * at a time
+     * @return SQLITE_OK, SQLITE_FULL if in has more than the value holds
+     */
+    int writeFrom(std::istream &in, int chunkSize = 64 << 10)
+    {
+        std::vector<char> chunk(std::max(chunkSize, 1));
+        while (in) {
+            int n = std::min((int)chunk.size(), _size - _offset);
+            if (n == 0) {
+                return in.peek() == std::istream::traits_type::eof()
+                           ? SQLITE_OK
+                           : SQLITE_FULL;
+            }
+            in.read(chunk.data(), n);
+            if (in.gcount() == 0) {
+                break;
+            }
+            int rc = write(chunk.data(), (int)in.gcount());
+            if (rc != SQLITE_OK) {
+                return rc;
+            }
+        }
+        return in.bad() ? SQLITE_IOERR : SQLITE_OK;
+    }
+
+    int close()
+    {
+        int rc = SQLITE_OK;
+        if (_blob != NULL) {
+            rc = sqlite3_blob_close(_blob);
+            _blob = NULL;
+            _size = 0;
+            _offset = 0;
+        }
+        return rc;
+    }
+
+    inline sqlite3_blob *blob()
+    {
+        return _blob;
+    }
+
+private:
+    sqlite3_blob *_blob;
+    int _size;
+    int _offset;
+    std::shared_ptr<SQLiteDiagnostics> _diagnostics;
+
+private:
+    SQLiteBlobStream(sqlite3_blob *blob,
+                     const std::shared_ptr<SQLiteDiagnostics> &diagnostics)
+        : _blob(blob), _size(sqlite3_blob_bytes(blob)), _offset(0),
+          _diagnostics(diagnostics)
+    {
+    }
+    void _report(int rc, int line)
+    {
+        _diagnostics->report(rc, sqlite3_errstr(rc), __FILE__, line);
+    }
+};
+
+/**
+ * std::streambuf over a SQLiteBlobStream, for std::istream and std::ostream
+ *     SQLiteBlobStreamBuf buf(blob);
+ *     std::istream in(&buf);
+ * It buffers chunkSize bytes and starts at the position of the blob, which
+ * must not be used directly until the buffer is synced or destroyed.
+ * Writing past the end of the value fails the stream.
+ */
+class SQLiteBlobStreamBuf : public std::streambuf
+{
+public:
+    explicit SQLiteBlobStreamBuf(SQLiteBlobStream &blob,
+                                 size_t chunkSize = 64 << 10)
+        : _blob(blob), _buffer(std::max(chunkSize, (size_t)1))
+    {
+    }
+    SQLiteBlobStreamBuf(const SQLiteBlobStreamBuf &) = delete;
+    SQLiteBlobStreamBuf &operator=(const SQLiteBlobStreamBuf &) = delete;
+    ~SQLiteBlobStreamBuf()
+    {
+        _settle();
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (_settle() != SQLITE_OK) {
+            return traits_type::eof();
+        }
+        int n;
+        if (_blob.read(_buffer.data(), (int)_buffer.size(), n) != SQLITE_OK ||
+            n == 0) {
+            return traits_type::eof();
+        }
+        setg(_buffer.data(), _buffer.data(), _buffer.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (pbase() == NULL || pptr() == epptr()) {
+            if (_settle() != SQLITE_OK) {
+                return traits_type::eof();
+            }
+            setp(_buffer.data(), _buffer.data() + _buffer.size());
+        }
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+    }
+
+    int sync() override
+    {
+        return _settle() == SQLITE_OK ? 0 : -1;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode) override
+    {
+        if (_settle() != SQLITE_OK) {
+            return pos_type(off_type(-1));
+        }
+        off_type base = dir == std::ios_base::beg   ? 0
+                        : dir == std::ios_base::cur ? _blob.tell()
+                                                    : _blob.size();
+        if (base + off < 0 || base + off > _blob.size() ||
+            _blob.seek((int)(base + off)) != SQLITE_OK) {
+            return pos_type(off_type(-1));
+        }
+        return pos_type(base + off);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+private:
+    SQLiteBlobStream &_blob;
+    std::vector<char> _buffer;
+
+private:
+    /// Write out pending bytes and move the blob back over unread ones
+    int _settle()
+    {
+        int rc = SQLITE_OK;
+        if (pbase() != NULL) {
+            int n = (int)(pptr() - pbase());
+            setp(NULL, NULL);
+            if (n > 0) {
+                rc = _blob.write(_buffer.data(), n);
+            }
+        }
+        if (eback() != NULL) {
+            int unread = (int)(egptr() - gptr());
+            setg(NULL, NULL, NULL);
+            rc = _blob.seek(_blob.tell() - unread);
+        }
+        return rc;
+    }
+};
+
+class SQLiteDatabase
+{
+    friend SQLiteCachedStatement;
+
+public:
+    SQLiteDatabase()
+        : _dbConn(NULL), _cacheCapacity(32), _cacheHits(0), _cacheMisses(0),
+          _diagnostics(std::make_shared<SQLiteDiagnostics>())
+    {
+    }
+    /// Take the connection and statement cache of another database, which
+    /// must have no statement on loan
+    SQLiteDatabase(SQLiteDatabase &&other)
+        : _dbConn(other._dbConn), _cacheList(std::move(other._cacheList)),
+          _cacheIndex(std::move(other._cacheIndex)),
+          _cacheCapacity(other._cacheCapacity), _cacheHits(other._cacheHits),
+          _cacheMisses(other._cacheMisses),
+          _diagnostics(std::move(other._diagnostics))
+    {
+        other._dbConn = NULL;
+        other._cacheList.clear();
+        other._cacheIndex.clear();
+        other._diagnostics = std::make_shared<SQLiteDiagnostics>();
+    }
+    SQLiteDatabase &operator=(SQLiteDatabase &&other)
+    {
+        if (this != &other) {
+            close();
+            _dbConn = other._dbConn;
+            _cacheList.swap(other._cacheList);
+            _cacheIndex.swap(other._cacheIndex);
+            _cacheCapacity = other._cacheCapacity;
+            _cacheHits = other._cacheHits;
+            _cacheMisses = other._cacheMisses;
+            // The profiling trace of the connection points to them
+            _diagnostics.swap(other._diagnostics);
+            other._dbConn = NULL;
+        }
+        return *this;
+    }
+    virtual ~SQLiteDatabase()
+    {
+        close();
+    }
+    /// Open a database with sqlite3_open_v2 flags and VFS
+    int open(const std::string &name, int flags, const char *vfs = NULL)
+    {
+        int rc = sqlite3_open_v2(name.c_str(), &_dbConn, flags, vfs);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+    /// Open a database
+    int open(const std::string &name)
+    {
+        int rc = sqlite3_open(name.c_str(), &_dbConn);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+
+    int open(const std::wstring &name)
+    {
+        int rc = sqlite3_open16(name.c_str(), &_dbConn);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+    /// Close a database (it stays open until the statements on loan from
+    /// the cache are given back)
+    void close()
+    {
+        if (_dbConn) {
+            clearStatementCache();
+            sqlite3_close_v2(_dbConn);
+            _dbConn = NULL;
+            _diagnostics->setProfiling(false);
+        }
+    }
+    /// Prepare a statement (allocated with new, need delete when done)
+    SQLiteStatement *prepareStatement(const std::string &sql)
+    {
+        if (!_dbConn) {
+            return NULL;
+        }
+        sqlite3_stmt *stmt;
+        int rc =
+            sqlite3_prepare_v2(_dbConn, sql.c_str(), sql.length(), &stmt, NULL);
+        if (rc == SQLITE_OK) {
+            return new SQLiteStatement(stmt, _diagnostics);
+        } else {
+            _report(rc, __LINE__);
+            return NULL;
+        }
+    }
+    /// Prepare a statement (allocated with new, need delete when done)
+    SQLiteStatement *prepareStatement(const std::wstring &sql)
+    {
+        if (!_dbConn) {
+            return NULL;
+        }
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare16_v2(_dbConn, sql.c_str(), sql.length(), &stmt,
+                                      NULL);
+        if (rc == SQLITE_OK) {
+            return new SQLiteStatement(stmt, _diagnostics);
+        } else {
+            _report(rc, __LINE__);
+            return NULL;
+        }
+    }
+
+    /**
+     * Get a prepared statement from the statement cache, keyed by its SQL
+     * text, or prepare it if the cache has none ready. The statement is
+     * taken out of the cache while on loan, so the same SQL used twice at
+     * once is prepared twice; given back, it replaces the least recently
+     * used one once the cache is full.
+     * @return an empty handle if the statement fails to prepare
+     */
+    SQLiteCachedStatement cachedStatement(const std::string &sql)
+    {
+        std::unordered_map<std::string, CacheList::iterator>::iterator it =
+            _cacheIndex.find(sql);
+        if (it != _cacheIndex.end()) {
+            SQLiteStatement *stmt = it->second->second;
+            _cacheList.erase(it->second);
+            _cacheIndex.erase(it);
+            ++_cacheHits;
+            return SQLiteCachedStatement(this, stmt, sql);
+        }
+        ++_cacheMisses;
+        if (!_dbConn) {
+            return SQLiteCachedStatement();
+        }
+        sqlite3_stmt *stmt;
+#if SQLITE_VERSION_NUMBER >= 3020000
+        int rc = sqlite3_prepare_v3(_dbConn, sql.c_str(), sql.length(),
+                                    SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+#else
+        int rc =
+            sqlite3_prepare_v2(_dbConn, sql.c_str(), sql.length(), &stmt, NULL);
+#endif
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+            return SQLiteCachedStatement();
+        }
+        return SQLiteCachedStatement(
+            this, new SQLiteStatement(stmt, _diagnostics), sql);
+    }
+
+    /**
+     * Open a value for incremental I/O, see SQLiteBlobStream
+     * @return an empty handle on failure
+     */
+    SQLiteBlobStream openBlob(const std::string &table,
+                              const std::string &column, int64_t rowid,
+                              bool writable = false,
+                              const std::string &dbName = "main")
+    {
+        if (!_dbConn) {
+            return SQLiteBlobStream();
+        }
+        sqlite3_blob *blob;
+        int rc = sqlite3_blob_open(_dbConn, dbName.c_str(), table.c_str(),
+                                   column.c_str(), rowid, writable ? 1 : 0,
+                                   &blob);
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+            return SQLiteBlobStream();
+        }
+        return SQLiteBlobStream(blob, _diagnostics);
+    }
+
+    /// Rowid of the last row inserted on the connection
+    int64_t lastInsertRowId()
+    {
+        return _dbConn ? sqlite3_last_insert_rowid(_dbConn) : 0;
+    }
+
+    /// Set how many statements the cache keeps (0 to not keep any)
+    void setStatementCacheCapacity(size_t capacity)
+    {
+        _cacheCapacity = capacity;
+        _trimStatementCache();
+    }
+
+    size_t statementCacheCapacity() const
+    {
+        return _cacheCapacity;
+    }
+
+    /// Statements currently kept in the cache
+    size_t statementCacheSize() const
+    {
+        return _cacheList.size();
+    }
+
+    /// cachedStatement calls served from the cache
+    uint64_t statementCacheHits() const
+    {
+        return _cacheHits;
+    }
+
+    /// cachedStatement calls that had to prepare the statement
+    uint64_t statementCacheMisses() const
+    {
+        return _cacheMisses;
+    }
+
+    /// Finalize the statements kept in the cache
+    void clearStatementCache()
+    {
+        for (CacheList::iterator it = _cacheList.begin();
+             it != _cacheList.end(); ++it) {
+            delete it->second;
+        }
+        _cacheList.clear();
+        _cacheIndex.clear();
+    }
+
+    /**
+     * Execute a statement once per row of a range, in transactions of
+     * rowsPerCommit rows (0 for a single one), see SQLiteBulkInserter
+     * @param sql
+     * @param rows rows as tuples, or as structs with a SQLiteRowBinder
+     * @param rowsPerCommit
+     * @return SQLITE_OK, or the error of the first row failing (the rows
+     * since the last commit are then rolled back)
+     */
+    template <typename Range>
+    int executeMany(const std::string &sql, const Range &rows,
+                    size_t rowsPerCommit = 0);
+
+    /// Begin a transaction
+    void begin()
+    {
+        directExecute("BEGIN");
+    }
+
+    /// Commit a transaction
+    void commit()
+    {
+        directExecute("COMMIT");
+    }
+
+    /// Rollback a transaction
+    void rollback()
+    {
+        directExecute("ROLLBACK");
+    }
+
+    /// Directly execute a string statement
+    int directExecute(const std::string &stmt)
+    {
+        if (!_dbConn) {
+            return SQLITE_ERROR;
+        }
+        char *errMsg = NULL;
+        int rc = sqlite3_exec(_dbConn, stmt.c_str(), NULL, NULL, &errMsg);
+        if (rc != SQLITE_OK) {
+            _diagnostics->report(rc, errMsg, __FILE__, __LINE__);
+            sqlite3_free(errMsg);
+        }
+        return rc;
+    }
+#ifdef SQLITE_HAS_CODEC
+    /// Assign a key to use with encrypted database (call right after open)
+    int key(const std::string &passPhrase)
+    {
+        int rc = sqlite3_key(_dbConn, passPhrase.data(), passPhrase.length());
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+    /**
+     * Re-assign a key to a database
+     */
+    int rekey(const std::string &passPhrase)
+    {
+        int rc = sqlite3_rekey(_dbConn, passPhrase.data(), passPhrase.length());
+        if (rc != SQLITE_OK) {
+            _report(rc, __LINE__);
+        }
+        return rc;
+    }
+#endif
+
+    /// Send the errors of the connection and its statements to a sink
+    /// instead of std::cerr (an empty sink drops them)
+    void setErrorSink(const SQLiteErrorSink &sink)
+    {
+        _diagnostics->setSink(sink);
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3014000
+    /**
+     * Profile the statements of the open connection, see
+     * SQLiteStatementProfile. This takes over sqlite3_trace_v2 and resets
+     * the sqlite3_stmt_status counters after each run. Runs of a
+     * SQLiteStatement are timed with std::chrono::steady_clock around its
+     * step, reset and finalize calls; those of directExecute have the
+     * resolution of the VFS clock, milliseconds on unix.
+     * @return SQLITE_OK, SQLITE_MISUSE if the database isn't open
+     */
+    int setProfiling(bool on)
+    {
+        if (!_dbConn) {
+            return SQLITE_MISUSE;
+        }
+        int rc = sqlite3_trace_v2(_dbConn, on ? SQLITE_TRACE_PROFILE : 0,
+                                  on ? &SQLiteDiagnostics::trace : NULL,
+                                  _diagnostics.get());
+        if (rc == SQLITE_OK) {
+            _diagnostics->setProfiling(on);
+        }
+        return rc;
+    }
+#endif
+
+    /// Statement profiles by decreasing total time
+    std::vector<SQLiteStatementProfile> statementProfiles() const
+    {
+        return _diagnostics->profiles();
+    }
+
+    void clearStatementProfiles()
+    {
+        _diagnostics->clearProfiles();
+    }
+
+    void dumpStatementProfiles(std::ostream &out) const
+    {
+        _diagnostics->dumpProfiles(out);
+    }
+
+    inline sqlite3 *dbConn()
+    {
+        return _dbConn;
+    }
+
+private:
+    // Most recently used first
+    typedef std::list<std::pair<std::string, SQLiteStatement *> > CacheList;
+
+    sqlite3 *_dbConn;
+    CacheList _cacheList;
+    std::unordered_map<std::string, CacheList::iterator> _cacheIndex;
+    size_t _cacheCapacity;
+    uint64_t _cacheHits;
+    uint64_t _cacheMisses;
+    std::shared_ptr<SQLiteDiagnostics> _diagnostics;
+
+private:
+    void _report(int rc, int line)
+    {
+        _diagnostics->report(rc, _dbConn ? sqlite3_errmsg(_dbConn) : NULL,
+                             __FILE__, line);
+    }
+
+    void _returnStatement(const std::string &sql, SQLiteStatement *stmt)
+    {
+        if (!_dbConn || sqlite3_db_handle(stmt->_stmt) != _dbConn ||
+            _cacheCapacity == 0) {
+            delete stmt;
+            return;
+        }
+        stmt->_clearRowData();
+        stmt->_timed(&sqlite3_reset);
+        stmt->clearBindings();
+        std::unordered_map<std::string, CacheList::iterator>::iterator it =
+            _cacheIndex.find(sql);
+        if (it != _cacheIndex.end()) {
+            // Prepared again while on loan, keep one
+            delete it->second->second;
+            _cacheList.erase(it->second);
+            _cacheIndex.erase(it);
+        }
+        _cacheList.push_front(std::make_pair(sql, stmt));
+        _cacheIndex[sql] = _cacheList.begin();
+        _trimStatementCache();
+    }
+
+    void _trimStatementCache()
+    {
+        while (_cacheList.size() > _cacheCapacity) {
+            _cacheIndex.erase(_cacheList.back().first);
+            delete _cacheList.back().second;
+            _cacheList.pop_back();
+        }
+    }
+};
+
+inline void SQLiteCachedStatement::release()
+{
+    if (_stmt != NULL) {
+        _db->_returnStatement(_sql, _stmt);
+        _stmt = NULL;
+    }
+}
+
+/**
+ * How a row binds to the parameters of a statement, for SQLiteBulkInserter
+ * and executeMany. Tuples and pairs bind their elements from parameter 1
+ * on; for a struct, specialize with
+ *     static int bind(SQLiteStatement &stmt, const Row &row)
+ * typically returning stmt.bindValues(row.field1, row.field2...).
+ */
+template <typename Row> struct SQLiteRowBinder;
+
+template <typename... Args> struct SQLiteRowBinder<std::tuple<Args...> > {
+    static int bind(SQLiteStatement &stmt, const std::tuple<Args...> &row)
+    {
+        return _bind<0>(stmt, row);
+    }
+
+private:
+    template <size_t I>
+    static typename std::enable_if<I == sizeof...(Args), int>::type
+    _bind(SQLiteStatement &, const std::tuple<Args...> &)
+    {
+        return SQLITE_OK;
+    }
+    template <size_t I>
+    static typename std::enable_if<I < sizeof...(Args), int>::type
+    _bind(SQLiteStatement &stmt, const std::tuple<Args...> &row)
+    {
+        int rc = stmt.bind((int)I + 1, std::get<I>(row));
+        return rc == SQLITE_OK ? _bind<I + 1>(stmt, row) : rc;
+    }
+};
+
+template <typename A, typename B> struct SQLiteRowBinder<std::pair<A, B> > {
+    static int bind(SQLiteStatement &stmt, const std::pair<A, B> &row)
+    {
+        return stmt.bindValues(row.first, row.second);
+    }
+};
+
+/**
+ * Settings a bulk load may run with, restored when it is done: values for
+ * PRAGMA synchronous and PRAGMA journal_mode, empty to leave one as is
+ */
+struct SQLiteLoadProfile {
+    std::string synchronous;
+    std::string journalMode;
+
+    SQLiteLoadProfile()
+    {
+    }
+    SQLiteLoadProfile(const std::string &synchronous,
+                      const std::string &journalMode)
+        : synchronous(synchronous), journalMode(journalMode)
+    {
+    }
+    /// synchronous=OFF, journal_mode=MEMORY: fast, the database may be
+    /// corrupted if the system crashes during the load
+    static SQLiteLoadProfile fast()
+    {
+        return SQLiteLoadProfile("OFF", "MEMORY");
+    }
+};
+
+/**
+ * Inserts (or any other statement) run for many rows through one cached
+ * prepared statement, committed every rowsPerCommit rows or once the values
+ * bound reach bytesPerCommit bytes. If the connection is already in a
+ * transaction when the inserter starts, the transaction is the caller's
+ * and nothing is committed.
+ *
+ *     SQLiteBulkInserter ins(db, "INSERT INTO Test VALUES(?,?,?)");
+ *     for (...)
+ *         rc = ins.insert(id, num, str);
+ *     rc = ins.finish();
+ */
+class SQLiteBulkInserter
+{
+public:
+    SQLiteBulkInserter(SQLiteDatabase &db, const std::string &sql,
+                       size_t rowsPerCommit = 10000,
+                       size_t bytesPerCommit = 64 << 20,
+                       const SQLiteLoadProfile &profile = SQLiteLoadProfile())
+        : _db(db), _stmt(db.cachedStatement(sql)),
+          _rowsPerCommit(rowsPerCommit), _bytesPerCommit(bytesPerCommit),
+          _rows(0), _pendingRows(0), _pendingBytes(0), _inTransaction(false),
+          _ownTransaction(false), _finished(false)
+    {
+        _applyProfile(profile);
+    }
+    SQLiteBulkInserter(const SQLiteBulkInserter &) = delete;
+    SQLiteBulkInserter &operator=(const SQLiteBulkInserter &) = delete;
+    ~SQLiteBulkInserter()
+    {
+        finish();
+    }
+
+    /// Insert a row given as values for the parameters from 1 on
+    template <typename... Args> int insert(const Args &... values)
+    {
+        int rc = _begin();
+        if (rc == SQLITE_OK) {
+            rc = _stmt->bindValues(values...);
+        }
+        return _execute(rc, _sizeOf(values...));
+    }
+
+    /// Insert a row bound by its SQLiteRowBinder
+    template <typename Row> int insertRow(const Row &row)
+    {
+        int rc = _begin();
+        if (rc == SQLITE_OK) {
+            rc = SQLiteRowBinder<Row>::bind(*_stmt, row);
+        }
+        return _execute(rc, _rowSize(row));
+    }
+
+    /// Commit the rows inserted so far
+    int flush()
+    {
+        int rc = SQLITE_OK;
+        if (_inTransaction && _ownTransaction) {
+            rc = _db.directExecute("COMMIT");
+        }
+        _inTransaction = false;
+        _pendingRows = 0;
+        _pendingBytes = 0;
+        return rc;
+    }
+
+    /// Roll back the rows inserted since the last commit
+    void cancel()
+    {
+        if (_inTransaction && _ownTransaction) {
+            _db.directExecute("ROLLBACK");
+        }
+        _inTransaction = false;
+        _pendingRows = 0;
+        _pendingBytes = 0;
+    }
+
+    /// Commit, give the statement back and restore the settings changed by
+    /// the load profile
+    int finish()
+    {
+        if (_finished) {
+            return SQLITE_OK;
+        }
+        _finished = true;
+        int rc = flush();
+        _stmt.release();
+        if (!_savedJournalMode.empty()) {
+            _db.directExecute("PRAGMA journal_mode=" + _savedJournalMode);
+        }
+        if (!_savedSynchronous.empty()) {
+            _db.directExecute("PRAGMA synchronous=" + _savedSynchronous);
+        }
+        return rc;
+    }
+
+    /// Rows inserted
+    size_t rows() const
+    {
+        return _rows;
+    }
+
+private:
+    SQLiteDatabase &_db;
+    SQLiteCachedStatement _stmt;
+    size_t _rowsPerCommit;
+    size_t _bytesPerCommit;
+    size_t _rows;
+    size_t _pendingRows;
+    size_t _pendingBytes;
+    bool _inTransaction;
+    bool _ownTransaction;
+    bool _finished;
+    std::string _savedSynchronous;
+    std::string _savedJournalMode;
+
+private:
+    int _begin()
+    {
+        if (!_stmt || _finished) {
+            return SQLITE_MISUSE;
+        }
+        if (!_inTransaction) {
+            _ownTransaction = sqlite3_get_autocommit(_db.dbConn()) != 0;
+            if (_ownTransaction) {
+                int rc = _db.directExecute("BEGIN");
+                if (rc != SQLITE_OK) {
+                    return rc;
+                }
+            }
+            _inTransaction = true;
+        }
+        return SQLITE_OK;
+    }
+
+    int _execute(int rc, size_t bytes)
+    {
+        if (rc == SQLITE_OK) {
+            rc = _stmt->executeUpdate();
+        }
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        ++_rows;
+        ++_pendingRows;
+        _pendingBytes += bytes;
+        if ((_rowsPerCommit > 0 && _pendingRows >= _rowsPerCommit) ||
+            (_bytesPerCommit > 0 && _pendingBytes >= _bytesPerCommit)) {
+            rc = flush();
+        }
+        return rc;
+    }
+
+    void _applyProfile(const SQLiteLoadProfile &profile)
+    {
+        if (!_stmt) {
+            return;
+        }
+        if (!profile.synchronous.empty()) {
+            _savedSynchronous = _pragma("synchronous");
+            _db.directExecute("PRAGMA synchronous=" + profile.synchronous);
+        }
+        if (!profile.journalMode.empty()) {
+            _savedJournalMode = _pragma("journal_mode");
+            _db.directExecute("PRAGMA journal_mode=" + profile.journalMode);
+        }
+    }
+
+    std::string _pragma(const std::string &name)
+    {
+        std::string value;
+        SQLiteStatement *stmt = _db.prepareStatement("PRAGMA " + name);
+        if (stmt != NULL) {
+            if (stmt->execute() && stmt->hasRow()) {
+                stmt->getString(value, 0);
+            }
+            delete stmt;
+        }
+        return value;
+    }
+
+    // Bytes a row adds to the transaction, roughly
+    static size_t _sizeOf()
+    {
+        return 0;
+    }
+    template <typename T, typename... Rest>
+    static size_t _sizeOf(const T &value, const Rest &... rest)
+    {
+        return _valueSize(value) + _sizeOf(rest...);
+    }
+    template <typename T> static size_t _valueSize(const T &)
+    {
+        return sizeof(T);
+    }
+    static size_t _valueSize(const std::string &value)
+    {
+        return value.size();
+    }
+    static size_t _valueSize(const char *value)
+    {
+        return strlen(value);
+    }
+    static size_t _valueSize(const std::vector<uint8_t> &value)
+    {
+        return value.size();
+    }
+    template <typename Row> static size_t _rowSize(const Row &)
+    {
+        return sizeof(Row);
+    }
+    template <typename... Args>
+    static size_t _rowSize(const std::tuple<Args...> &row)
+    {
+        return _tupleSize<0>(row);
+    }
+    template <size_t I, typename... Args>
+    static typename std::enable_if<I == sizeof...(Args), size_t>::type
+    _tupleSize(const std::tuple<Args...> &)
+    {
+        return 0;
+    }
+    template <size_t I, typename... Args>
+    static typename std::enable_if<I < sizeof...(Args), size_t>::type
+    _tupleSize(const std::tuple<Args...> &row)
+    {
+        return _valueSize(std::get<I>(row)) + _tupleSize<I + 1>(row);
+    }
+};
+
+template <typename Range>
+int SQLiteDatabase::executeMany(const std::string &sql, const Range &rows,
+                                size_t rowsPerCommit)
+{
+    SQLiteBulkInserter inserter(*this, sql, rowsPerCommit, 0);
+    for (typename Range::const_iterator it = rows.begin(); it != rows.end();
+         ++it) {
+        int rc = inserter.insertRow(*it);
+        if (rc != SQLITE_OK) {
+            inserter.cancel();
+            return rc;
+        }
+    }
+    return inserter.finish();
+}
+
+/**
+ * Settings of the connections of a SQLiteConnectionPool
+ */
+struct SQLiteConnectionPoolOptions {
+    std::string path;
+    size_t readers;         // Read-only connections, 0 to read on the writer
+    std::string passPhrase; // Key of an encrypted database, empty if none
+    bool wal;               // Put the database in WAL mode
+    int64_t mmapSize;       // PRAGMA mmap_size, -1 to leave it
+    int cacheSize;          // PRAGMA cache_size, 0 to leave it
+    std::vector<std::string> statements; // Run on every connection
+    const char *vfs;
+
+    SQLiteConnectionPoolOptions(const std::string &path = std::string(),
+                                size_t readers = 4)
+        : path(path), readers(readers), wal(true), mmapSize(-1),
+          cacheSize(0), vfs(NULL)
+    {
+    }
+};
+
+/**
+ * Lease counters of the reader or writer connections of a pool
+ */
+struct SQLiteLeaseStats {
+    uint64_t leases;       // Leases handed out
+    uint64_t waits;        // Leases that had to wait for a connection
+    uint64_t waitNanos;    // Time spent waiting
+    uint64_t maxWaitNanos; // Longest wait
+    uint64_t busyNanos;    // Time connections spent leased (ended leases)
+    uint64_t affinityHits; // Leases of the connection the thread used last
+    uint64_t uptimeNanos;  // Time since the pool opened
+    size_t connections;
+    size_t inUse;
+
+    SQLiteLeaseStats()
+        : leases(0), waits(0), waitNanos(0), maxWaitNanos(0), busyNanos(0),
+          affinityHits(0), uptimeNanos(0), connections(0), inUse(0)
     {
-        _hasRow = false;
-        _columnCount = 0;
-        _rowNameIndex.clear();
+    }
+    /// Share of the connections' time spent leased since the pool opened
+    double utilization() const
+    {
+        if (uptimeNanos == 0 || connections == 0) {
+            return 0;
+        }
+        return (double)busyNanos / ((double)uptimeNanos * connections);
     }
 };
 
-class SQLiteDatabase
+class SQLiteConnectionPool;
+
+/**
+ * A connection of a SQLiteConnectionPool and its lease state
+ */
+struct SQLitePooledConnection {
+    SQLiteDatabase db;
+    bool leased;
+    bool reader; // Counted as a reader lease
+    std::thread::id lastThread;
+    std::chrono::steady_clock::time_point leasedAt;
+
+    SQLitePooledConnection() : leased(false), reader(false)
+    {
+    }
+};
+
+/**
+ * Exclusive use of a pooled connection, given back when the lease is
+ * destroyed. Must not outlive the pool, nor be used to close the
+ * connection.
+ */
+class SQLiteConnectionLease
 {
+    friend SQLiteConnectionPool;
+
 public:
-    SQLiteDatabase() : _dbConn(NULL)
+    SQLiteConnectionLease() : _pool(NULL), _slot(NULL)
     {
     }
-    virtual ~SQLiteDatabase()
+    SQLiteConnectionLease(SQLiteConnectionLease &&other)
+        : _pool(other._pool), _slot(other._slot)
     {
-        close();
+        other._slot = NULL;
     }
-    /// Open a database
-    int open(const std::string &name)
+    SQLiteConnectionLease &operator=(SQLiteConnectionLease &&other)
     {
-        int rc = sqlite3_open(name.c_str(), &_dbConn);
-        if (rc != SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << sqlite3_errmsg(_dbConn) << std::endl;
-            ;
+        if (this != &other) {
+            release();
+            _pool = other._pool;
+            _slot = other._slot;
+            other._slot = NULL;
         }
-        return rc;
+        return *this;
+    }
+    SQLiteConnectionLease(const SQLiteConnectionLease &) = delete;
+    SQLiteConnectionLease &operator=(const SQLiteConnectionLease &) = delete;
+    ~SQLiteConnectionLease()
+    {
+        release();
     }
 
-    int open(const std::wstring &name)
+    /// Give the connection back now
+    inline void release();
+
+    SQLiteDatabase *get() const
     {
-        int rc = sqlite3_open16(name.c_str(), &_dbConn);
+        return _slot != NULL ? &_slot->db : NULL;
+    }
+    SQLiteDatabase *operator->() const
+    {
+        return get();
+    }
+    SQLiteDatabase &operator*() const
+    {
+        return *get();
+    }
+    /// Whether a connection was leased
+    explicit operator bool() const
+    {
+        return _slot != NULL;
+    }
+
+private:
+    SQLiteConnectionPool *_pool;
+    SQLitePooledConnection *_slot;
+
+private:
+    SQLiteConnectionLease(SQLiteConnectionPool *pool,
+                          SQLitePooledConnection *slot)
+        : _pool(pool), _slot(slot)
+    {
+    }
+};
+
+/**
+ * A fixed set of connections to one database, opened and keyed once: a
+ * single writer, which serializes writes, and read-only readers, which
+ * in WAL mode read concurrently. A thread asking for a reader gets the one
+ * it used last when it is free, whose page and statement caches are warm.
+ *
+ *     SQLiteConnectionPool pool(SQLiteConnectionPoolOptions("test.db", 8));
+ *     rc = pool.open();
+ *     {
+ *         SQLiteConnectionLease db = pool.reader();
+ *         SQLiteCachedStatement stmt = db->cachedStatement("SELECT ...");
+ *     }
+ */
+class SQLiteConnectionPool
+{
+    friend SQLiteConnectionLease;
+
+public:
+    explicit SQLiteConnectionPool(const SQLiteConnectionPoolOptions &options)
+        : _options(options), _open(false)
+    {
+    }
+    SQLiteConnectionPool(const SQLiteConnectionPool &) = delete;
+    SQLiteConnectionPool &operator=(const SQLiteConnectionPool &) = delete;
+    ~SQLiteConnectionPool()
+    {
+        close();
+    }
+
+    /// Open and set up the connections, the writer first
+    int open()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_open) {
+            return SQLITE_MISUSE;
+        }
+        int rc = _openSlot(_writer, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                           true);
+        for (size_t i = 0; rc == SQLITE_OK && i < _options.readers; ++i) {
+            _readers.push_back(std::unique_ptr<Slot>(new Slot()));
+            rc = _openSlot(*_readers.back(), SQLITE_OPEN_READONLY, false);
+        }
         if (rc != SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << sqlite3_errmsg(_dbConn) << std::endl;
-            ;
+            _readers.clear();
+            _writer.db.close();
+            return rc;
         }
-        return rc;
+        _openedAt = std::chrono::steady_clock::now();
+        _readerStats = SQLiteLeaseStats();
+        _writerStats = SQLiteLeaseStats();
+        _open = true;
+        return SQLITE_OK;
     }
-    /// Close a database
+
+    /// Close the connections, once all leases are given back
     void close()
     {
-        if (_dbConn) {
-            sqlite3_close(_dbConn);
-            _dbConn = NULL;
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_open) {
+            return;
         }
+        _open = false;
+        _released.wait(lock, [this] { return _inUse() == 0; });
+        _readers.clear();
+        _writer.db.close();
     }
-    /// Prepare a statement (allocated with new, need delete when done)
-    SQLiteStatement *prepareStatement(const std::string &sql)
+
+    /// Lease a reader, waiting for one to be free
+    SQLiteConnectionLease reader()
     {
-        if (!_dbConn) {
-            return NULL;
+        return _lease(true, std::chrono::steady_clock::time_point::max());
+    }
+
+    /// Lease a reader, an empty lease if none is free within the timeout
+    SQLiteConnectionLease reader(std::chrono::milliseconds timeout)
+    {
+        return _lease(true, std::chrono::steady_clock::now() + timeout);
+    }
+
+    /// Lease the writer, waiting for it to be free
+    SQLiteConnectionLease writer()
+    {
+        return _lease(false, std::chrono::steady_clock::time_point::max());
+    }
+
+    /// Lease the writer, an empty lease if it isn't free within the timeout
+    SQLiteConnectionLease writer(std::chrono::milliseconds timeout)
+    {
+        return _lease(false, std::chrono::steady_clock::now() + timeout);
+    }
+
+    /// Lease counters of the readers (of the writer if there are none)
+    SQLiteLeaseStats readerStats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats(true);
+    }
+
+    SQLiteLeaseStats writerStats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats(false);
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    typedef SQLitePooledConnection Slot;
+
+    SQLiteConnectionPoolOptions _options;
+    mutable std::mutex _mutex;
+    std::condition_variable _released;
+    Slot _writer;
+    std::vector<std::unique_ptr<Slot> > _readers;
+    SQLiteLeaseStats _readerStats;
+    SQLiteLeaseStats _writerStats;
+    Clock::time_point _openedAt;
+    bool _open;
+
+private:
+    int _openSlot(Slot &slot, int flags, bool writer)
+    {
+        SQLiteDatabase &db = slot.db;
+        // Each connection is used by one thread at a time
+        int rc = db.open(_options.path, flags | SQLITE_OPEN_NOMUTEX,
+                         _options.vfs);
+#ifdef SQLITE_HAS_CODEC
+        if (rc == SQLITE_OK && !_options.passPhrase.empty()) {
+            rc = db.key(_options.passPhrase);
         }
-        sqlite3_stmt *stmt;
-        int rc =
-            sqlite3_prepare_v2(_dbConn, sql.c_str(), sql.length(), &stmt, NULL);
-        if (rc == SQLITE_OK) {
-            return new SQLiteStatement(stmt);
-        } else {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << sqlite3_errmsg(_dbConn) << std::endl;
-            return NULL;
+#endif
+        if (rc == SQLITE_OK && writer && _options.wal) {
+            rc = db.directExecute("PRAGMA journal_mode=WAL");
+        }
+        if (rc == SQLITE_OK && _options.mmapSize >= 0) {
+            rc = db.directExecute("PRAGMA mmap_size=" +
+                                  std::to_string(_options.mmapSize));
         }
+        if (rc == SQLITE_OK && _options.cacheSize != 0) {
+            rc = db.directExecute("PRAGMA cache_size=" +
+                                  std::to_string(_options.cacheSize));
+        }
+        for (size_t i = 0; rc == SQLITE_OK && i < _options.statements.size();
+             ++i) {
+            rc = db.directExecute(_options.statements[i]);
+        }
+        return rc;
     }
-    /// Prepare a statement (allocated with new, need delete when done)
-    SQLiteStatement *prepareStatement(const std::wstring &sql)
+
+    size_t _inUse() const
     {
-        if (!_dbConn) {
-            return NULL;
-        }
-        sqlite3_stmt *stmt;
-        int rc = sqlite3_prepare16_v2(_dbConn, sql.c_str(), sql.length(), &stmt,
-                                      NULL);
-        if (rc == SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << sqlite3_errstr(rc) << std::endl;
-            ;
-            return new SQLiteStatement(stmt);
-        } else {
-            return NULL;
+        size_t count = _writer.leased ? 1 : 0;
+        for (size_t i = 0; i < _readers.size(); ++i) {
+            count += _readers[i]->leased ? 1 : 0;
         }
+        return count;
     }
 
-    /// Begin a transaction
-    void begin()
+    /// A free slot for the calling thread, NULL if there is none
+    Slot *_freeSlot(bool reader, bool &affinity)
     {
-        directExecute("BEGIN");
+        std::thread::id self = std::this_thread::get_id();
+        Slot *found = NULL;
+
+        affinity = false;
+        if (!reader || _readers.empty()) {
+            found = _writer.leased ? NULL : &_writer;
+            affinity = found != NULL && found->lastThread == self;
+            return found;
+        }
+        for (size_t i = 0; i < _readers.size(); ++i) {
+            Slot *slot = _readers[i].get();
+            if (slot->leased) {
+                continue;
+            }
+            if (slot->lastThread == self) {
+                affinity = true;
+                return slot;
+            }
+            // Otherwise rather one no other thread is attached to
+            if (found == NULL || (found->lastThread != std::thread::id() &&
+                                  slot->lastThread == std::thread::id())) {
+                found = slot;
+            }
+        }
+        return found;
     }
 
-    /// Commit a transaction
-    void commit()
+    SQLiteConnectionLease _lease(bool reader, Clock::time_point deadline)
     {
-        directExecute("COMMIT");
+        std::unique_lock<std::mutex> lock(_mutex);
+        Clock::time_point start = Clock::now();
+        bool affinity;
+        bool waited = false;
+        Slot *slot;
+
+        while (_open && (slot = _freeSlot(reader, affinity)) == NULL) {
+            waited = true;
+            if (deadline == Clock::time_point::max()) {
+                _released.wait(lock);
+            } else if (_released.wait_until(lock, deadline) ==
+                       std::cv_status::timeout) {
+                slot = _open ? _freeSlot(reader, affinity) : NULL;
+                break;
+            }
+        }
+        if (!_open || slot == NULL) {
+            return SQLiteConnectionLease();
+        }
+
+        Clock::time_point now = Clock::now();
+        uint64_t wait = (uint64_t)std::chrono::duration_cast<
+                            std::chrono::nanoseconds>(now - start)
+                            .count();
+        SQLiteLeaseStats &stats = reader ? _readerStats : _writerStats;
+        ++stats.leases;
+        if (waited) {
+            ++stats.waits;
+            stats.waitNanos += wait;
+            if (wait > stats.maxWaitNanos) {
+                stats.maxWaitNanos = wait;
+            }
+        }
+        if (affinity) {
+            ++stats.affinityHits;
+        }
+        slot->leased = true;
+        slot->reader = reader;
+        slot->lastThread = std::this_thread::get_id();
+        slot->leasedAt = now;
+        return SQLiteConnectionLease(this, slot);
     }
 
-    /// Rollback a transaction
-    void rollback()
+    void _release(Slot *slot)
     {
-        directExecute("ROLLBACK");
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            SQLiteLeaseStats &stats =
+                slot->reader ? _readerStats : _writerStats;
+            stats.busyNanos +=
+                (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - slot->leasedAt)
+                    .count();
+            slot->leased = false;
+        }
+        _released.notify_all();
     }
 
-    /// Directly execute a string statement
-    int directExecute(const std::string &stmt)
+    SQLiteLeaseStats _stats(bool reader) const
     {
-        if (!_dbConn) {
-            return SQLITE_ERROR;
+        SQLiteLeaseStats stats = reader ? _readerStats : _writerStats;
+        if (_open) {
+            stats.uptimeNanos =
+                (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - _openedAt)
+                    .count();
         }
-        char *errMsg = NULL;
-        int rc = sqlite3_exec(_dbConn, stmt.c_str(), NULL, NULL, &errMsg);
-        if (rc != SQLITE_OK) {
-            if (errMsg != NULL) {
-                std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]" << errMsg
-                          << std::endl;
-                sqlite3_free(errMsg);
+        if (reader && !_readers.empty()) {
+            stats.connections = _readers.size();
+            for (size_t i = 0; i < _readers.size(); ++i) {
+                stats.inUse += _readers[i]->leased ? 1 : 0;
             }
+        } else {
+            stats.connections = _open ? 1 : 0;
+            stats.inUse = _writer.leased ? 1 : 0;
         }
-        return rc;
+        return stats;
     }
-#ifdef SQLITE_HAS_CODEC
-    /// Assign a key to use with encrypted database (call right after open)
-    int key(const std::string &passPhrase)
+};
+
+inline void SQLiteConnectionLease::release()
+{
+    if (_slot != NULL) {
+        _pool->_release(_slot);
+        _slot = NULL;
+    }
+}
+
+/**
+ * A connection run by a worker thread of its own: work is queued and the
+ * caller gets a future, a callback (called on the worker) or, in C++20, an
+ * awaitable. Jobs run one at a time in the order queued.
+ *
+ * Writes queued one after the other are pipelined: the worker runs up to
+ * maxWriteBatch of them in one transaction, each in a savepoint of its own
+ * so that a failing write is rolled back alone, and completes them once
+ * the transaction is committed. A write whose error rolls back the whole
+ * transaction (INSERT OR ROLLBACK, SQLITE_FULL, some I/O errors) fails
+ * the writes before it in that transaction with the same error; the ones
+ * after it run in a new transaction. A write must not end the transaction
+ * itself.
+ *
+ *     SQLiteAsyncDatabase async(std::move(db));
+ *     std::future<int> done = async.write([](SQLiteDatabase &db) {
+ *         return db.cachedStatement("INSERT ...")->executeUpdate();
+ *     });
+ */
+class SQLiteAsyncDatabase
+{
+public:
+    explicit SQLiteAsyncDatabase(SQLiteDatabase &&db,
+                                 size_t maxWriteBatch = 256)
+        : _db(std::move(db)), _maxWriteBatch(maxWriteBatch), _stop(false),
+          _worker(&SQLiteAsyncDatabase::_work, this)
     {
-        int rc = sqlite3_key(_dbConn, passPhrase.data(), passPhrase.length());
-        if (rc != SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << sqlite3_errstr(rc) << std::endl;
+    }
+    SQLiteAsyncDatabase(const SQLiteAsyncDatabase &) = delete;
+    SQLiteAsyncDatabase &operator=(const SQLiteAsyncDatabase &) = delete;
+    /// Run the jobs still queued, then stop the worker
+    ~SQLiteAsyncDatabase()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
         }
-        return rc;
+        _wake.notify_one();
+        _worker.join();
+    }
+
+    /// Run f(db) on the worker; the future gets its result or exception
+    template <typename F>
+    std::future<decltype(std::declval<F &>()(std::declval<SQLiteDatabase &>()))>
+    run(F &&f)
+    {
+        typedef decltype(f(std::declval<SQLiteDatabase &>())) R;
+        std::shared_ptr<std::packaged_task<R(SQLiteDatabase &)> > task =
+            std::make_shared<std::packaged_task<R(SQLiteDatabase &)> >(
+                std::forward<F>(f));
+        std::future<R> result = task->get_future();
+        _post(Job([task](SQLiteDatabase &db) { (*task)(db); }));
+        return result;
+    }
+
+    /// Run f(db) on the worker, then callback(result) there too. An
+    /// exception of f or the callback is dropped, and the callback isn't
+    /// called for one of f: use the future to get it.
+    template <typename F, typename Callback>
+    void run(const F &f, const Callback &callback)
+    {
+        typedef decltype(f(std::declval<SQLiteDatabase &>())) R;
+        _post(Job([f, callback](SQLiteDatabase &db) {
+            try {
+                _Call<R>::apply(f, callback, db);
+            } catch (...) {
+                // Nowhere to go but the worker, which it would end
+            }
+        }));
+    }
+
+    /// Queue a write: f(db) returns SQLITE_OK or an error code, which the
+    /// future gets, or the error of the commit
+    template <typename F> std::future<int> write(const F &f)
+    {
+        std::shared_ptr<std::promise<int> > promise =
+            std::make_shared<std::promise<int> >();
+        std::future<int> result = promise->get_future();
+        _post(Job(std::function<int(SQLiteDatabase &)>(f),
+                  [promise](int rc, std::exception_ptr error) {
+                      if (error) {
+                          promise->set_exception(error);
+                      } else {
+                          promise->set_value(rc);
+                      }
+                  }));
+        return result;
+    }
+
+    /// Queue a write, then call callback(rc) on the worker. An exception
+    /// of f fails the write with SQLITE_ERROR, one of the callback is
+    /// dropped.
+    template <typename F, typename Callback>
+    void write(const F &f, const Callback &callback)
+    {
+        _post(Job(std::function<int(SQLiteDatabase &)>(f),
+                  [callback](int rc, std::exception_ptr) {
+                      try {
+                          callback(rc);
+                      } catch (...) {
+                          // Nowhere to go but the worker, which it would end
+                      }
+                  }));
+    }
+
+    /// Queue SQL statements to run without a result
+    std::future<int> execute(const std::string &sql)
+    {
+        return run([sql](SQLiteDatabase &db) { return db.directExecute(sql); });
+    }
+
+    /// Queue SQL statements to run as a write
+    std::future<int> executeWrite(const std::string &sql)
+    {
+        return write(
+            [sql](SQLiteDatabase &db) { return db.directExecute(sql); });
     }
+
+#ifdef SQLITEWRAPPER_COROUTINES
     /**
-     * Re-assign a key to a database
+     * co_await the result of f(db) run on the worker. The coroutine resumes
+     * on the worker thread, which it holds until it suspends again.
      */
-    int rekey(const std::string &passPhrase)
+    template <typename R> class Awaitable
     {
-        int rc = sqlite3_rekey(_dbConn, passPhrase.data(), passPhrase.length());
-        if (rc != SQLITE_OK) {
-            std::cerr << "[" << __FILE__ << ":" << __LINE__ << "]"
-                      << sqlite3_errmsg(_dbConn) << std::endl;
+    public:
+        Awaitable(SQLiteAsyncDatabase *async,
+                  std::function<R(SQLiteDatabase &)> f, bool write)
+            : _async(async), _f(std::move(f)), _write(write)
+        {
         }
-        return rc;
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            if (_write) {
+                std::function<int(SQLiteDatabase &)> f = _f;
+                _async->_post(Job(f, [this, handle](int rc,
+                                                    std::exception_ptr error) {
+                    _result.emplace(rc);
+                    _error = error;
+                    handle.resume();
+                }));
+                return;
+            }
+            _async->_post(Job([this, handle](SQLiteDatabase &db) {
+                try {
+                    _result.emplace(_f(db));
+                } catch (...) {
+                    _error = std::current_exception();
+                }
+                handle.resume();
+            }));
+        }
+        R await_resume()
+        {
+            if (_error) {
+                std::rethrow_exception(_error);
+            }
+            return std::move(*_result);
+        }
+
+    private:
+        SQLiteAsyncDatabase *_async;
+        std::function<R(SQLiteDatabase &)> _f;
+        bool _write;
+        std::optional<R> _result;
+        std::exception_ptr _error;
+    };
+
+    template <typename F>
+    Awaitable<decltype(std::declval<F &>()(std::declval<SQLiteDatabase &>()))>
+    co_run(F f)
+    {
+        typedef decltype(f(std::declval<SQLiteDatabase &>())) R;
+        static_assert(!std::is_void<R>::value, "co_run needs a result");
+        return Awaitable<R>(this, std::move(f), false);
     }
-#endif
 
-    inline sqlite3 *dbConn()
+    template <typename F> Awaitable<int> co_write(F f)
     {
-        return _dbConn;
+        return Awaitable<int>(this, std::move(f), true);
     }
+#endif
 
 private:
-    sqlite3 *_dbConn;
+    struct Job {
+        std::function<void(SQLiteDatabase &)> run;
+        // Writes
+        std::function<int(SQLiteDatabase &)> write;
+        std::function<void(int, std::exception_ptr)> done;
+
+        explicit Job(std::function<void(SQLiteDatabase &)> run)
+            : run(std::move(run))
+        {
+        }
+        Job(std::function<int(SQLiteDatabase &)> write,
+            std::function<void(int, std::exception_ptr)> done)
+            : write(std::move(write)), done(std::move(done))
+        {
+        }
+    };
+
+    template <typename R> struct _Call {
+        template <typename F, typename Callback>
+        static void apply(const F &f, const Callback &callback,
+                          SQLiteDatabase &db)
+        {
+            callback(f(db));
+        }
+    };
+
+    SQLiteDatabase _db;
+    size_t _maxWriteBatch;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<Job> _queue;
+    bool _stop;
+    std::thread _worker;
+
+private:
+    void _post(Job &&job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.push_back(std::move(job));
+        }
+        _wake.notify_one();
+    }
+
+    void _work()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _wake.wait(lock, [this] { return _stop || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+            if (_queue.front().run) {
+                Job job(std::move(_queue.front()));
+                _queue.pop_front();
+                lock.unlock();
+                job.run(_db);
+                lock.lock();
+                continue;
+            }
+            std::vector<Job> batch;
+            while (!_queue.empty() && !_queue.front().run &&
+                   (batch.empty() || batch.size() < _maxWriteBatch)) {
+                batch.push_back(std::move(_queue.front()));
+                _queue.pop_front();
+            }
+            lock.unlock();
+            _writeBatch(batch);
+            lock.lock();
+        }
+    }
+
+    void _writeBatch(std::vector<Job> &batch)
+    {
+        for (size_t first = 0; first < batch.size();) {
+            first = _writeTransaction(batch, first);
+        }
+    }
+
+    /// Run the writes of a batch from first on in one transaction and
+    /// complete them, up to the end or to the one whose error ended the
+    /// transaction; returns the index of the first write left
+    size_t _writeTransaction(std::vector<Job> &batch, size_t first)
+    {
+        std::vector<int> rcs(batch.size(), SQLITE_OK);
+        std::vector<std::exception_ptr> errors(batch.size());
+        // Within a transaction of a job, the writes are only savepoints
+        bool own = sqlite3_get_autocommit(_db.dbConn()) != 0;
+        int rc = own ? _db.directExecute("BEGIN IMMEDIATE") : SQLITE_OK;
+        size_t end = batch.size();
+
+        for (size_t i = first; rc == SQLITE_OK && i < end; ++i) {
+            rcs[i] = _db.directExecute("SAVEPOINT sqlitewrapper_write");
+            if (rcs[i] != SQLITE_OK) {
+                continue;
+            }
+            try {
+                rcs[i] = batch[i].write(_db);
+            } catch (...) {
+                errors[i] = std::current_exception();
+                rcs[i] = SQLITE_ERROR;
+            }
+            if (sqlite3_get_autocommit(_db.dbConn()) != 0) {
+                // Rolled back by the error, with the writes before it
+                int error = rcs[i] != SQLITE_OK ? rcs[i] : SQLITE_MISUSE;
+                for (size_t j = first; j <= i; ++j) {
+                    if (rcs[j] == SQLITE_OK) {
+                        rcs[j] = error;
+                    }
+                }
+                end = i + 1;
+                own = false;
+                break;
+            }
+            if (rcs[i] != SQLITE_OK) {
+                _db.directExecute("ROLLBACK TO sqlitewrapper_write");
+            }
+            _db.directExecute("RELEASE sqlitewrapper_write");
+        }
+        if (own && rc == SQLITE_OK) {
+            rc = _db.directExecute("COMMIT");
+            if (rc != SQLITE_OK) {
+                _db.directExecute("ROLLBACK");
+            }
+        }
+        for (size_t i = first; i < end; ++i) {
+            batch[i].done(rc != SQLITE_OK ? rc : rcs[i], errors[i]);
+        }
+        return end;
+    }
+};
+
+template <> struct SQLiteAsyncDatabase::_Call<void> {
+    template <typename F, typename Callback>
+    static void apply(const F &f, const Callback &callback, SQLiteDatabase &db)
+    {
+        f(db);
+        callback();
+    }
 };
 }
 
@@ -542,6 +3104,14 @@ VALUES(?,?,?)");
     }
     delete stmt;
 
+    // Statements run often come from the cache, and go back to it
+    {
+        SQLiteCachedStatement cached =
+            db.cachedStatement("SELECT str FROM Test WHERE id=?");
+        cached->bind(1, 7);
+        rc = cached->execute();
+    }
+
     return 0;
 }
 
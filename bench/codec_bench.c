@@ -0,0 +1,358 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2013 mudzot
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+ */
+
+/**
+ * Page codec benchmarks
+ * The codec (and with it the amalgamation) is built in, so that every
+ * backend of sqlite3crypt.c can be timed directly:
+ * - codec: SQLiteEncrypt/SQLiteDecrypt throughput for each cipher, backend
+ *   and page size from 512 to 65536, on one and more threads
+ * - sql: bulk insert, point lookups and full scans of a database, plain and
+ *   under each cipher
+ * Results are printed one JSON object per line, to be compared between
+ * builds.
+ *
+ * Usage: codec_bench [codec|sql|all] [max threads] [seconds per measure]
+ */
+
+#include "../sqlite3crypt.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_PAGES 32     /* Pages ciphered in turn by each thread */
+#define BENCH_ROWS 50000   /* Rows of the sql benchmark table */
+#define BENCH_VALUE 200    /* Bytes per row */
+#define BENCH_FILE "codec_bench.db"
+
+static const struct
+{
+    const char *name;
+    const char *key; /* NULL for the plain database */
+} benchCiphers[] = {
+    {"plain", NULL},
+    {"aes128-cbc", "aes128-cbc:codec_bench"},
+    {"aes128-xts", "aes128-xts:codec_bench"},
+    {"aes256-xts", "aes256-xts:codec_bench"},
+    {"aes256-gcm", "aes256-gcm:codec_bench"},
+};
+
+#define BENCH_CIPHERS ((int)(sizeof(benchCiphers) / sizeof(benchCiphers[0])))
+
+/**
+ * Pages ciphered by one thread until the deadline
+ */
+typedef struct
+{
+    SQLiteCipherContext *ctx;
+    int pageSize;
+    int decrypt;
+    sqlite3_uint64 deadline; /* CodecNanotime to stop at */
+    sqlite3_uint64 nPage;    /* Pages done */
+    char *plain;             /* BENCH_PAGES pages */
+    char *cipher;            /* The same encrypted */
+    char *output;
+} BenchTask;
+
+static void *BenchWork(void *pArg)
+{
+    BenchTask *task = (BenchTask *)pArg;
+    int pageSize = task->pageSize;
+    int i;
+
+    do {
+        for (i = 0; i < BENCH_PAGES; i++) {
+            size_t offset = (size_t)i * pageSize;
+            if (task->decrypt) {
+                SQLiteDecrypt(task->ctx, (Pgno)i + 1, task->cipher + offset,
+                              task->output + offset, pageSize);
+            } else {
+                SQLiteEncrypt(task->ctx, (Pgno)i + 1, task->plain + offset,
+                              task->output + offset, pageSize);
+            }
+        }
+        task->nPage += BENCH_PAGES;
+    } while (CodecNanotime() < task->deadline);
+    return NULL;
+}
+
+/**
+ * Time one cipher, backend, page size and thread count
+ * @return 0, or 1 if out of memory
+ */
+static int BenchCodecRun(const char *cipher, int backend,
+                         SQLiteCipherContext *ctx, int pageSize, int nThreads,
+                         double seconds)
+{
+    BenchTask tasks[CODEC_REKEY_MAX_THREADS];
+    size_t size = (size_t)BENCH_PAGES * pageSize;
+    int decrypt, i, j;
+
+    for (i = 0; i < nThreads; i++) {
+        tasks[i].plain = (char *)sqlite3_malloc64(3 * size);
+        if (tasks[i].plain == NULL) {
+            while (--i >= 0) {
+                sqlite3_free(tasks[i].plain);
+            }
+            return 1;
+        }
+        tasks[i].cipher = tasks[i].plain + size;
+        tasks[i].output = tasks[i].cipher + size;
+        sqlite3_randomness((int)size, tasks[i].plain);
+        for (j = 0; j < BENCH_PAGES; j++) {
+            SQLiteEncrypt(ctx, (Pgno)j + 1, tasks[i].plain + j * pageSize,
+                          tasks[i].cipher + j * pageSize, pageSize);
+        }
+    }
+
+    for (decrypt = 0; decrypt <= 1; decrypt++) {
+        sqlite3_uint64 start = CodecNanotime(), elapsed, nPage = 0;
+        for (i = 0; i < nThreads; i++) {
+            tasks[i].ctx = ctx;
+            tasks[i].pageSize = pageSize;
+            tasks[i].decrypt = decrypt;
+            tasks[i].deadline = start + (sqlite3_uint64)(seconds * 1e9);
+            tasks[i].nPage = 0;
+        }
+        CodecRunTasks(BenchWork, tasks, sizeof(tasks[0]), nThreads);
+        elapsed = CodecNanotime() - start;
+        for (i = 0; i < nThreads; i++) {
+            nPage += tasks[i].nPage;
+        }
+        printf("{\"bench\":\"codec\",\"cipher\":\"%s\",\"backend\":\"%s\","
+               "\"page_size\":%d,\"threads\":%d,\"op\":\"%s\","
+               "\"mb_per_s\":%.1f,\"ns_per_page\":%.1f}\n",
+               cipher, codecBackendNames[backend], pageSize, nThreads,
+               decrypt ? "decrypt" : "encrypt",
+               (double)nPage * pageSize * 1e3 / (double)elapsed,
+               (double)elapsed * nThreads / (double)nPage);
+        fflush(stdout);
+    }
+
+    for (i = 0; i < nThreads; i++) {
+        sqlite3_free(tasks[i].plain);
+    }
+    return 0;
+}
+
+/**
+ * Page cipher throughput of every cipher and backend
+ */
+static int BenchCodec(int maxThreads, double seconds)
+{
+    int c, backend, pageSize, nThreads;
+
+    for (c = 0; c < BENCH_CIPHERS; c++) {
+        if (benchCiphers[c].key == NULL) {
+            continue;
+        }
+        for (backend = 0; backend < CODEC_BACKEND_COUNT; backend++) {
+            SQLiteCipherContext *ctx =
+                CipherContextNew((const uint8_t *)benchCiphers[c].key,
+                                 (int)strlen(benchCiphers[c].key));
+            if (ctx == NULL) {
+                return 1;
+            }
+            /* The only reference to the key, so forcing its backend
+             * affects nothing else */
+            if (!CipherContextUseBackend(ctx, backend)) {
+                CipherContextRelease(ctx);
+                continue;
+            }
+            for (pageSize = 512; pageSize <= SQLITE_MAX_PAGE_SIZE;
+                 pageSize <<= 1) {
+                /* 1, 2, 4... threads, then maxThreads */
+                for (nThreads = 1;; nThreads *= 2) {
+                    if (nThreads > maxThreads) {
+                        nThreads = maxThreads;
+                    }
+                    if (BenchCodecRun(benchCiphers[c].name, backend, ctx,
+                                      pageSize, nThreads, seconds)) {
+                        CipherContextRelease(ctx);
+                        return 1;
+                    }
+                    if (nThreads == maxThreads) {
+                        break;
+                    }
+                }
+            }
+            CipherContextRelease(ctx);
+        }
+    }
+    return 0;
+}
+
+static void BenchSqlReport(const char *cipher, const char *op, int count,
+                           sqlite3_uint64 elapsed)
+{
+    printf("{\"bench\":\"sql\",\"cipher\":\"%s\",\"op\":\"%s\","
+           "\"count\":%d,\"seconds\":%.4f,\"per_s\":%.1f}\n",
+           cipher, op, count, (double)elapsed / 1e9,
+           (double)count * 1e9 / (double)elapsed);
+    fflush(stdout);
+}
+
+/**
+ * Bulk insert, point lookups and full scans of a database under one cipher
+ * The page cache is kept well below the database size so that lookups and
+ * scans go through the codec.
+ */
+static int BenchSqlRun(int c, double seconds)
+{
+    const char *cipher = benchCiphers[c].name;
+    const char *key = benchCiphers[c].key;
+    char value[BENCH_VALUE];
+    sqlite3_uint64 start, deadline;
+    sqlite3_stmt *stmt = NULL;
+    sqlite3 *db = NULL;
+    int count, i;
+    int rc;
+
+    sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+    vfs->xDelete(vfs, BENCH_FILE, 0);
+    vfs->xDelete(vfs, BENCH_FILE "-journal", 0);
+
+    rc = sqlite3_open(BENCH_FILE, &db);
+    if (rc == SQLITE_OK && key != NULL) {
+        rc = sqlite3_key_v2(db, "main", key, (int)strlen(key));
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, "PRAGMA cache_size=-2000;"
+                              "CREATE TABLE t(id INTEGER PRIMARY KEY, v BLOB)",
+                          NULL, NULL, NULL);
+    }
+
+    /* Bulk insert in one transaction */
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "INSERT INTO t VALUES(?, ?)", -1, &stmt,
+                                NULL);
+    }
+    if (rc == SQLITE_OK) {
+        start = CodecNanotime();
+        sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        for (i = 1; i <= BENCH_ROWS && rc == SQLITE_OK; i++) {
+            sqlite3_randomness(sizeof(value), value);
+            sqlite3_bind_int(stmt, 1, i);
+            sqlite3_bind_blob(stmt, 2, value, sizeof(value), SQLITE_STATIC);
+            rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+            sqlite3_reset(stmt);
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        }
+        BenchSqlReport(cipher, "insert", BENCH_ROWS, CodecNanotime() - start);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    /* Random point lookups */
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "SELECT length(v) FROM t WHERE id = ?",
+                                -1, &stmt, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        start = CodecNanotime();
+        deadline = start + (sqlite3_uint64)(seconds * 1e9);
+        count = 0;
+        do {
+            for (i = 0; i < 1000 && rc == SQLITE_OK; i++) {
+                unsigned int id;
+                sqlite3_randomness(sizeof(id), &id);
+                sqlite3_bind_int(stmt, 1, (int)(id % BENCH_ROWS) + 1);
+                rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+                sqlite3_reset(stmt);
+            }
+            count += i;
+        } while (rc == SQLITE_OK && CodecNanotime() < deadline);
+        BenchSqlReport(cipher, "lookup", count, CodecNanotime() - start);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    /* Full scans, rows per second */
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "SELECT sum(length(v)) FROM t", -1, &stmt,
+                                NULL);
+    }
+    if (rc == SQLITE_OK) {
+        start = CodecNanotime();
+        deadline = start + (sqlite3_uint64)(seconds * 1e9);
+        count = 0;
+        do {
+            rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+            sqlite3_reset(stmt);
+            count += BENCH_ROWS;
+        } while (rc == SQLITE_OK && CodecNanotime() < deadline);
+        BenchSqlReport(cipher, "scan", count, CodecNanotime() - start);
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", cipher, sqlite3_errmsg(db));
+    }
+    sqlite3_close(db);
+    vfs->xDelete(vfs, BENCH_FILE, 0);
+    return rc != SQLITE_OK;
+}
+
+static int BenchSql(double seconds)
+{
+    int c;
+
+    for (c = 0; c < BENCH_CIPHERS; c++) {
+        if (BenchSqlRun(c, seconds)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *what = argc > 1 ? argv[1] : "all";
+    int maxThreads = argc > 2 ? atoi(argv[2]) : 4;
+    double seconds = argc > 3 ? atof(argv[3]) : 0.2;
+    int codec = strcmp(what, "codec") == 0 || strcmp(what, "all") == 0;
+    int sql = strcmp(what, "sql") == 0 || strcmp(what, "all") == 0;
+
+    if ((!codec && !sql) || maxThreads < 1 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [codec|sql|all] [max threads] "
+                        "[seconds per measure]\n",
+                argv[0]);
+        return 1;
+    }
+    /* The keys of benchCiphers choose the format by prefix */
+    sqlite3_codec_key_forms(1);
+    if (maxThreads > CODEC_REKEY_MAX_THREADS) {
+        maxThreads = CODEC_REKEY_MAX_THREADS;
+    }
+
+    if (codec && BenchCodec(maxThreads, seconds)) {
+        return 1;
+    }
+    if (sql && BenchSql(seconds)) {
+        return 1;
+    }
+    return 0;
+}
@@ -42,6 +42,12 @@
 #if defined(MBEDTLS_AESNI_C)
 #include "mbedtls/aesni.h"
 #endif
+#if defined(MBEDTLS_ARMV8CE_C)
+#include "mbedtls/armv8ce.h"
+#endif
+#if defined(MBEDTLS_VPAES_C)
+#include "mbedtls/vpaes.h"
+#endif
 
 #if defined(MBEDTLS_SELF_TEST)
 #if defined(MBEDTLS_PLATFORM_C)
@@ -833,6 +839,11 @@ int mbedtls_aes_crypt_ecb( mbedtls_aes_context *ctx,
         return( mbedtls_aesni_crypt_ecb( ctx, mode, input, output ) );
 #endif
 
+#if defined(MBEDTLS_ARMV8CE_C)
+    if( mbedtls_armv8ce_has_support() )
+        return( mbedtls_armv8ce_crypt_ecb( ctx, mode, input, output ) );
+#endif
+
 #if defined(MBEDTLS_PADLOCK_C) && defined(MBEDTLS_HAVE_X86)
     if( aes_padlock_ace )
     {
@@ -845,6 +856,11 @@ int mbedtls_aes_crypt_ecb( mbedtls_aes_context *ctx,
     }
 #endif
 
+#if defined(MBEDTLS_VPAES_C)
+    if( mbedtls_vpaes_has_support() )
+        return( mbedtls_vpaes_crypt_ecb( ctx, mode, input, output ) );
+#endif
+
     if( mode == MBEDTLS_AES_ENCRYPT )
         mbedtls_aes_encrypt( ctx, input, output );
     else
@@ -870,6 +886,26 @@ int mbedtls_aes_crypt_cbc( mbedtls_aes_context *ctx,
     if( length % 16 )
         return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
 
+#if defined(MBEDTLS_AESNI_C) && defined(MBEDTLS_HAVE_X86_64)
+    if( mbedtls_aesni_has_support( MBEDTLS_AESNI_AES ) )
+    {
+        if( mode == MBEDTLS_AES_DECRYPT )
+            return( mbedtls_aesni_cbc_decrypt( ctx, length, iv, input, output ) );
+        else
+            return( mbedtls_aesni_cbc_encrypt( ctx, length, iv, input, output ) );
+    }
+#endif
+
+#if defined(MBEDTLS_ARMV8CE_C)
+    if( mbedtls_armv8ce_has_support() )
+    {
+        if( mode == MBEDTLS_AES_DECRYPT )
+            return( mbedtls_armv8ce_cbc_decrypt( ctx, length, iv, input, output ) );
+        else
+            return( mbedtls_armv8ce_cbc_encrypt( ctx, length, iv, input, output ) );
+    }
+#endif
+
 #if defined(MBEDTLS_PADLOCK_C) && defined(MBEDTLS_HAVE_X86)
     if( aes_padlock_ace )
     {
@@ -882,6 +918,16 @@ int mbedtls_aes_crypt_cbc( mbedtls_aes_context *ctx,
     }
 #endif
 
+#if defined(MBEDTLS_VPAES_C)
+    if( mbedtls_vpaes_has_support() )
+    {
+        if( mode == MBEDTLS_AES_DECRYPT )
+            return( mbedtls_vpaes_cbc_decrypt( ctx, length, iv, input, output ) );
+        else
+            return( mbedtls_vpaes_cbc_encrypt( ctx, length, iv, input, output ) );
+    }
+#endif
+
     if( mode == MBEDTLS_AES_DECRYPT )
     {
         while( length > 0 )
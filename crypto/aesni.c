@@ -89,6 +89,25 @@ int mbedtls_aesni_has_support( unsigned int what )
 #define xmm1_xmm0   "0xC1"
 #define xmm1_xmm2   "0xD1"
 
+/*
+ * Same opcodes with a REX.B prefix, so that the source operand is xmm8.
+ * Used by the multi-block kernels, which keep the round key in xmm8 and the
+ * blocks in flight in xmm0-xmm7.
+ */
+#define AESDEC_X8       ".byte 0x66,0x41,0x0F,0x38,0xDE,"
+#define AESDECLAST_X8   ".byte 0x66,0x41,0x0F,0x38,0xDF,"
+#define AESENC_X8       ".byte 0x66,0x41,0x0F,0x38,0xDC,"
+#define AESENCLAST_X8   ".byte 0x66,0x41,0x0F,0x38,0xDD,"
+
+#define xmm8_xmm0   "0xC0"
+#define xmm8_xmm1   "0xC8"
+#define xmm8_xmm2   "0xD0"
+#define xmm8_xmm3   "0xD8"
+#define xmm8_xmm4   "0xE0"
+#define xmm8_xmm5   "0xE8"
+#define xmm8_xmm6   "0xF0"
+#define xmm8_xmm7   "0xF8"
+
 /*
  * AES-NI AES-ECB block en(de)cryption
  */
@@ -134,6 +153,414 @@ int mbedtls_aesni_crypt_ecb( mbedtls_aes_context *ctx,
     return( 0 );
 }
 
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/*
+ * AES-NI AES-CBC buffer encryption
+ *
+ * CBC encryption is serial, but the whole buffer is handled by one loop so
+ * there is no per-block call or dispatch.
+ */
+int mbedtls_aesni_cbc_encrypt( mbedtls_aes_context *ctx,
+                       size_t length,
+                       unsigned char iv[16],
+                       const unsigned char *input,
+                       unsigned char *output )
+{
+    size_t blocks;
+    unsigned char *rk;
+    size_t nr;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    blocks = length / 16;
+    if( blocks == 0 )
+        return( 0 );
+
+    asm volatile( "movdqu    (%7), %%xmm0        \n\t" // load iv
+                  "1:                            \n\t" // block loop
+                  "mov       %5, %0              \n\t" // round keys
+                  "mov       %6, %1              \n\t" // number of rounds
+                  "movdqu    (%2), %%xmm1        \n\t" // load input
+                  "pxor      %%xmm1, %%xmm0      \n\t" // xor with previous block
+                  "movdqu    (%0), %%xmm1        \n\t" // load round key 0
+                  "pxor      %%xmm1, %%xmm0      \n\t" // round 0
+                  "add       $16, %0             \n\t" // point to next round key
+                  "sub       $1, %1              \n\t" // normal rounds = nr - 1
+
+                  "2:                            \n\t" // encryption rounds
+                  "movdqu    (%0), %%xmm1        \n\t" // load round key
+                  AESENC     xmm1_xmm0          "\n\t" // do round
+                  "add       $16, %0             \n\t" // point to next round key
+                  "sub       $1, %1              \n\t" // loop
+                  "jnz       2b                  \n\t"
+                  "movdqu    (%0), %%xmm1        \n\t" // load round key
+                  AESENCLAST xmm1_xmm0          "\n\t" // last round
+
+                  "movdqu    %%xmm0, (%3)        \n\t" // export output
+                  "add       $16, %2             \n\t" // next block
+                  "add       $16, %3             \n\t"
+                  "sub       $1, %4              \n\t"
+                  "jnz       1b                  \n\t"
+                  "movdqu    %%xmm0, (%7)        \n\t" // update iv
+                  : "=&r" (rk), "=&r" (nr), "+r" (input), "+r" (output),
+                    "+r" (blocks)
+                  : "r" (ctx->rk), "r" ( (size_t) ctx->nr ), "r" (iv)
+                  : "memory", "cc", "xmm0", "xmm1" );
+
+    return( 0 );
+}
+
+/*
+ * AES-NI AES-CBC buffer decryption
+ *
+ * Unlike encryption, CBC decryption has no dependency between blocks, so
+ * eight blocks are kept in flight through the rounds to hide the latency of
+ * AESDEC. Each round key is loaded once per eight blocks and the chaining
+ * XOR is done in registers. The ciphertext of a group is fully consumed
+ * before its plaintext is stored, so input and output may be the same buffer.
+ */
+int mbedtls_aesni_cbc_decrypt( mbedtls_aes_context *ctx,
+                       size_t length,
+                       unsigned char iv[16],
+                       const unsigned char *input,
+                       unsigned char *output )
+{
+    size_t groups;
+    unsigned char *rk;
+    size_t nr;
+    unsigned char temp[16];
+    int i;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    groups = length / 128;
+    if( groups > 0 )
+    {
+        asm volatile( "movdqu    (%7), %%xmm9        \n\t" // load iv
+                      "1:                            \n\t" // 8-block loop
+                      "mov       %5, %0              \n\t" // round keys
+                      "mov       %6, %1              \n\t" // number of rounds
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key 0
+                      "movdqu    0x00(%2), %%xmm0    \n\t" // load input
+                      "movdqu    0x10(%2), %%xmm1    \n\t"
+                      "movdqu    0x20(%2), %%xmm2    \n\t"
+                      "movdqu    0x30(%2), %%xmm3    \n\t"
+                      "movdqu    0x40(%2), %%xmm4    \n\t"
+                      "movdqu    0x50(%2), %%xmm5    \n\t"
+                      "movdqu    0x60(%2), %%xmm6    \n\t"
+                      "movdqu    0x70(%2), %%xmm7    \n\t"
+                      "pxor      %%xmm8, %%xmm0      \n\t" // round 0
+                      "pxor      %%xmm8, %%xmm1      \n\t"
+                      "pxor      %%xmm8, %%xmm2      \n\t"
+                      "pxor      %%xmm8, %%xmm3      \n\t"
+                      "pxor      %%xmm8, %%xmm4      \n\t"
+                      "pxor      %%xmm8, %%xmm5      \n\t"
+                      "pxor      %%xmm8, %%xmm6      \n\t"
+                      "pxor      %%xmm8, %%xmm7      \n\t"
+                      "add       $16, %0             \n\t" // point to next round key
+                      "sub       $1, %1              \n\t" // normal rounds = nr - 1
+
+                      "2:                            \n\t" // decryption rounds
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key
+                      AESDEC_X8  xmm8_xmm0          "\n\t" // do round
+                      AESDEC_X8  xmm8_xmm1          "\n\t"
+                      AESDEC_X8  xmm8_xmm2          "\n\t"
+                      AESDEC_X8  xmm8_xmm3          "\n\t"
+                      AESDEC_X8  xmm8_xmm4          "\n\t"
+                      AESDEC_X8  xmm8_xmm5          "\n\t"
+                      AESDEC_X8  xmm8_xmm6          "\n\t"
+                      AESDEC_X8  xmm8_xmm7          "\n\t"
+                      "add       $16, %0             \n\t" // point to next round key
+                      "sub       $1, %1              \n\t" // loop
+                      "jnz       2b                  \n\t"
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key
+                      AESDECLAST_X8 xmm8_xmm0       "\n\t" // last round
+                      AESDECLAST_X8 xmm8_xmm1       "\n\t"
+                      AESDECLAST_X8 xmm8_xmm2       "\n\t"
+                      AESDECLAST_X8 xmm8_xmm3       "\n\t"
+                      AESDECLAST_X8 xmm8_xmm4       "\n\t"
+                      AESDECLAST_X8 xmm8_xmm5       "\n\t"
+                      AESDECLAST_X8 xmm8_xmm6       "\n\t"
+                      AESDECLAST_X8 xmm8_xmm7       "\n\t"
+
+                      "pxor      %%xmm9, %%xmm0      \n\t" // xor with previous block
+                      "movdqu    0x00(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm1      \n\t"
+                      "movdqu    0x10(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm2      \n\t"
+                      "movdqu    0x20(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm3      \n\t"
+                      "movdqu    0x30(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm4      \n\t"
+                      "movdqu    0x40(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm5      \n\t"
+                      "movdqu    0x50(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm6      \n\t"
+                      "movdqu    0x60(%2), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm7      \n\t"
+                      "movdqu    0x70(%2), %%xmm9    \n\t" // next chaining value
+
+                      "movdqu    %%xmm0, 0x00(%3)    \n\t" // export output
+                      "movdqu    %%xmm1, 0x10(%3)    \n\t"
+                      "movdqu    %%xmm2, 0x20(%3)    \n\t"
+                      "movdqu    %%xmm3, 0x30(%3)    \n\t"
+                      "movdqu    %%xmm4, 0x40(%3)    \n\t"
+                      "movdqu    %%xmm5, 0x50(%3)    \n\t"
+                      "movdqu    %%xmm6, 0x60(%3)    \n\t"
+                      "movdqu    %%xmm7, 0x70(%3)    \n\t"
+                      "add       $128, %2            \n\t" // next group
+                      "add       $128, %3            \n\t"
+                      "sub       $1, %4              \n\t"
+                      "jnz       1b                  \n\t"
+                      "movdqu    %%xmm9, (%7)        \n\t" // update iv
+                      : "=&r" (rk), "=&r" (nr), "+r" (input), "+r" (output),
+                        "+r" (groups)
+                      : "r" (ctx->rk), "r" ( (size_t) ctx->nr ), "r" (iv)
+                      : "memory", "cc", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+                        "xmm5", "xmm6", "xmm7", "xmm8", "xmm9" );
+    }
+
+    /* Remaining blocks, one at a time */
+    for( length %= 128; length > 0; length -= 16 )
+    {
+        memcpy( temp, input, 16 );
+        mbedtls_aesni_crypt_ecb( ctx, MBEDTLS_AES_DECRYPT, input, output );
+
+        for( i = 0; i < 16; i++ )
+            output[i] = (unsigned char)( output[i] ^ iv[i] );
+
+        memcpy( iv, temp, 16 );
+
+        input  += 16;
+        output += 16;
+    }
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/*
+ * Multiplication of an XTS tweak by the primitive element alpha,
+ * little-endian as per IEEE P1619
+ */
+static void aesni_xts_double( unsigned char t[16] )
+{
+    unsigned char carry = (unsigned char)( t[15] >> 7 );
+    int i;
+
+    for( i = 15; i > 0; i-- )
+        t[i] = (unsigned char)( ( t[i] << 1 ) | ( t[i - 1] >> 7 ) );
+
+    t[0] = (unsigned char)( ( t[0] << 1 ) ^ ( 0x87 & -carry ) );
+}
+
+/*
+ * Carry fix-up for the tweak doubling in registers: after psrad/pshufd the
+ * sign of the high qword lands on the low dword and the sign of the low
+ * qword on the third dword
+ */
+static const uint32_t xts_mask[4] = { 0x87, 0, 1, 0 };
+
+/*
+ * xmm9 *= alpha, with xmm10 as scratch and xts_mask in xmm11
+ */
+#define XTS_NEXT_TWEAK                          \
+    "movdqa    %%xmm9, %%xmm10         \n\t"   \
+    "psrad     $31, %%xmm10            \n\t"   \
+    "pshufd    $0x13, %%xmm10, %%xmm10 \n\t"   \
+    "pand      %%xmm11, %%xmm10        \n\t"   \
+    "paddq     %%xmm9, %%xmm9          \n\t"   \
+    "pxor      %%xmm10, %%xmm9         \n\t"
+
+/*
+ * AES-NI AES-XTS buffer encryption/decryption
+ *
+ * Each block is whitened with its own tweak before and after the cipher,
+ * so blocks are independent in both directions and eight of them are kept
+ * in flight. The tweaks of a group are computed in registers and parked in
+ * a stack buffer for the final whitening. Input and output may be the same
+ * buffer.
+ */
+int mbedtls_aesni_crypt_xts( mbedtls_aes_context *ctx,
+                     int mode,
+                     size_t length,
+                     unsigned char tweak[16],
+                     const unsigned char *input,
+                     unsigned char *output )
+{
+    size_t groups;
+    unsigned char *rk;
+    size_t nr;
+    unsigned char tw[128];
+    int i;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    groups = length / 128;
+    if( groups > 0 )
+    {
+        asm volatile( "movdqu    (%7), %%xmm9        \n\t" // load tweak
+                      "movdqu    (%9), %%xmm11       \n\t" // carry mask
+                      "1:                            \n\t" // 8-block loop
+                      "movdqu    %%xmm9, 0x00(%8)    \n\t" // save tweak
+                      "movdqu    0x00(%2), %%xmm0    \n\t" // load input
+                      "pxor      %%xmm9, %%xmm0      \n\t" // xor with tweak
+                      XTS_NEXT_TWEAK                     // tweak *= alpha
+                      "movdqu    %%xmm9, 0x10(%8)    \n\t"
+                      "movdqu    0x10(%2), %%xmm1    \n\t"
+                      "pxor      %%xmm9, %%xmm1      \n\t"
+                      XTS_NEXT_TWEAK
+                      "movdqu    %%xmm9, 0x20(%8)    \n\t"
+                      "movdqu    0x20(%2), %%xmm2    \n\t"
+                      "pxor      %%xmm9, %%xmm2      \n\t"
+                      XTS_NEXT_TWEAK
+                      "movdqu    %%xmm9, 0x30(%8)    \n\t"
+                      "movdqu    0x30(%2), %%xmm3    \n\t"
+                      "pxor      %%xmm9, %%xmm3      \n\t"
+                      XTS_NEXT_TWEAK
+                      "movdqu    %%xmm9, 0x40(%8)    \n\t"
+                      "movdqu    0x40(%2), %%xmm4    \n\t"
+                      "pxor      %%xmm9, %%xmm4      \n\t"
+                      XTS_NEXT_TWEAK
+                      "movdqu    %%xmm9, 0x50(%8)    \n\t"
+                      "movdqu    0x50(%2), %%xmm5    \n\t"
+                      "pxor      %%xmm9, %%xmm5      \n\t"
+                      XTS_NEXT_TWEAK
+                      "movdqu    %%xmm9, 0x60(%8)    \n\t"
+                      "movdqu    0x60(%2), %%xmm6    \n\t"
+                      "pxor      %%xmm9, %%xmm6      \n\t"
+                      XTS_NEXT_TWEAK
+                      "movdqu    %%xmm9, 0x70(%8)    \n\t"
+                      "movdqu    0x70(%2), %%xmm7    \n\t"
+                      "pxor      %%xmm9, %%xmm7      \n\t"
+                      XTS_NEXT_TWEAK
+                      "mov       %5, %0              \n\t" // round keys
+                      "mov       %6, %1              \n\t" // number of rounds
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key 0
+                      "pxor      %%xmm8, %%xmm0      \n\t" // round 0
+                      "pxor      %%xmm8, %%xmm1      \n\t"
+                      "pxor      %%xmm8, %%xmm2      \n\t"
+                      "pxor      %%xmm8, %%xmm3      \n\t"
+                      "pxor      %%xmm8, %%xmm4      \n\t"
+                      "pxor      %%xmm8, %%xmm5      \n\t"
+                      "pxor      %%xmm8, %%xmm6      \n\t"
+                      "pxor      %%xmm8, %%xmm7      \n\t"
+                      "add       $16, %0             \n\t" // point to next round key
+                      "sub       $1, %1              \n\t" // normal rounds = nr - 1
+                      "test      %10, %10            \n\t" // mode?
+                      "jz        3f                  \n\t" // 0 = decrypt
+
+                      "2:                            \n\t" // encryption rounds
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key
+                      AESENC_X8     xmm8_xmm0      "\n\t" // do round
+                      AESENC_X8     xmm8_xmm1      "\n\t"
+                      AESENC_X8     xmm8_xmm2      "\n\t"
+                      AESENC_X8     xmm8_xmm3      "\n\t"
+                      AESENC_X8     xmm8_xmm4      "\n\t"
+                      AESENC_X8     xmm8_xmm5      "\n\t"
+                      AESENC_X8     xmm8_xmm6      "\n\t"
+                      AESENC_X8     xmm8_xmm7      "\n\t"
+                      "add       $16, %0             \n\t" // point to next round key
+                      "sub       $1, %1              \n\t" // loop
+                      "jnz       2b                  \n\t"
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key
+                      AESENCLAST_X8 xmm8_xmm0      "\n\t" // last round
+                      AESENCLAST_X8 xmm8_xmm1      "\n\t"
+                      AESENCLAST_X8 xmm8_xmm2      "\n\t"
+                      AESENCLAST_X8 xmm8_xmm3      "\n\t"
+                      AESENCLAST_X8 xmm8_xmm4      "\n\t"
+                      AESENCLAST_X8 xmm8_xmm5      "\n\t"
+                      AESENCLAST_X8 xmm8_xmm6      "\n\t"
+                      AESENCLAST_X8 xmm8_xmm7      "\n\t"
+                      "jmp       4f                  \n\t"
+
+                      "3:                            \n\t" // decryption rounds
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key
+                      AESDEC_X8     xmm8_xmm0      "\n\t" // do round
+                      AESDEC_X8     xmm8_xmm1      "\n\t"
+                      AESDEC_X8     xmm8_xmm2      "\n\t"
+                      AESDEC_X8     xmm8_xmm3      "\n\t"
+                      AESDEC_X8     xmm8_xmm4      "\n\t"
+                      AESDEC_X8     xmm8_xmm5      "\n\t"
+                      AESDEC_X8     xmm8_xmm6      "\n\t"
+                      AESDEC_X8     xmm8_xmm7      "\n\t"
+                      "add       $16, %0             \n\t" // point to next round key
+                      "sub       $1, %1              \n\t" // loop
+                      "jnz       3b                  \n\t"
+                      "movdqu    (%0), %%xmm8        \n\t" // load round key
+                      AESDECLAST_X8 xmm8_xmm0      "\n\t" // last round
+                      AESDECLAST_X8 xmm8_xmm1      "\n\t"
+                      AESDECLAST_X8 xmm8_xmm2      "\n\t"
+                      AESDECLAST_X8 xmm8_xmm3      "\n\t"
+                      AESDECLAST_X8 xmm8_xmm4      "\n\t"
+                      AESDECLAST_X8 xmm8_xmm5      "\n\t"
+                      AESDECLAST_X8 xmm8_xmm6      "\n\t"
+                      AESDECLAST_X8 xmm8_xmm7      "\n\t"
+
+                      "4:                            \n\t"
+                      "movdqu    0x00(%8), %%xmm8    \n\t" // xor with tweak
+                      "pxor      %%xmm8, %%xmm0      \n\t"
+                      "movdqu    %%xmm0, 0x00(%3)    \n\t" // export output
+                      "movdqu    0x10(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm1      \n\t"
+                      "movdqu    %%xmm1, 0x10(%3)    \n\t"
+                      "movdqu    0x20(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm2      \n\t"
+                      "movdqu    %%xmm2, 0x20(%3)    \n\t"
+                      "movdqu    0x30(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm3      \n\t"
+                      "movdqu    %%xmm3, 0x30(%3)    \n\t"
+                      "movdqu    0x40(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm4      \n\t"
+                      "movdqu    %%xmm4, 0x40(%3)    \n\t"
+                      "movdqu    0x50(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm5      \n\t"
+                      "movdqu    %%xmm5, 0x50(%3)    \n\t"
+                      "movdqu    0x60(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm6      \n\t"
+                      "movdqu    %%xmm6, 0x60(%3)    \n\t"
+                      "movdqu    0x70(%8), %%xmm8    \n\t"
+                      "pxor      %%xmm8, %%xmm7      \n\t"
+                      "movdqu    %%xmm7, 0x70(%3)    \n\t"
+                      "add       $128, %2            \n\t" // next group
+                      "add       $128, %3            \n\t"
+                      "sub       $1, %4              \n\t"
+                      "jnz       1b                  \n\t"
+                      "movdqu    %%xmm9, (%7)        \n\t" // update tweak
+                      : "=&r" (rk), "=&r" (nr), "+r" (input), "+r" (output),
+                        "+r" (groups)
+                      : "r" (ctx->rk), "r" ( (size_t) ctx->nr ), "r" (tweak),
+                        "r" (tw), "r" (xts_mask), "r" (mode)
+                      : "memory", "cc", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+                        "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10",
+                        "xmm11" );
+    }
+
+    /* Remaining blocks, one at a time */
+    for( length %= 128; length > 0; length -= 16 )
+    {
+        for( i = 0; i < 16; i++ )
+            tw[i] = (unsigned char)( input[i] ^ tweak[i] );
+
+        mbedtls_aesni_crypt_ecb( ctx, mode, tw, tw );
+
+        for( i = 0; i < 16; i++ )
+            output[i] = (unsigned char)( tw[i] ^ tweak[i] );
+
+        aesni_xts_double( tweak );
+
+        input  += 16;
+        output += 16;
+    }
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
 /*
  * GCM multiplication: c = a times b in GF(2^128)
  * Based on [CLMUL-WP] algorithms 1 (with equation 27) and 5.
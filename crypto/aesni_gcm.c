@@ -0,0 +1,295 @@
+/*
+ *  AES-GCM page kernel using AES-NI and PCLMULQDQ
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * [CLMUL-WP] http://software.intel.com/en-us/articles/intel-carry-less-multiplication-instruction-and-its-usage-for-computing-the-gcm-mode/
+ *
+ * GHASH values are kept byte-reflected, as in mbedtls_aesni_gcm_mult(), so
+ * that [CLMUL-WP] algorithm 1 and 5 apply directly. Products of eight
+ * blocks are accumulated unreduced and reduced once ([CLMUL-WP] section 4),
+ * which is valid because the shift and the reduction are linear.
+ *
+ * Like vaes.c this uses intrinsics with per-function target attributes.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_GCM_C) && defined(MBEDTLS_AESNI_C)
+
+#include "mbedtls/aesni_gcm.h"
+
+#if defined(MBEDTLS_HAVE_X86_64)
+
+#include <immintrin.h>
+#include <string.h>
+
+#define GCM_TARGET __attribute__(( target( "aes,pclmul,ssse3" ) ))
+
+/*
+ * Precompute H^1..H^8 with the existing GHASH multiplication
+ */
+void mbedtls_aesni_gcm_setkey( mbedtls_aes_context *ctx,
+                       unsigned char htable[128] )
+{
+    unsigned char h[16], p[16];
+    int i, j;
+
+    memset( h, 0, 16 );
+    mbedtls_aesni_crypt_ecb( ctx, MBEDTLS_AES_ENCRYPT, h, h );
+    memcpy( p, h, 16 );
+
+    for( i = 0; i < 8; i++ )
+    {
+        /* Store byte-reflected, the order the kernel works in */
+        for( j = 0; j < 16; j++ )
+            htable[16 * i + j] = p[15 - j];
+
+        mbedtls_aesni_gcm_mult( p, p, h );
+    }
+}
+
+/*
+ * Accumulate the unreduced 256-bit product a * b into lo:mid:hi
+ */
+GCM_TARGET
+static inline void gcm_mul_acc( __m128i a, __m128i b,
+                                __m128i *lo, __m128i *mid, __m128i *hi )
+{
+    *lo  = _mm_xor_si128( *lo, _mm_clmulepi64_si128( a, b, 0x00 ) );
+    *hi  = _mm_xor_si128( *hi, _mm_clmulepi64_si128( a, b, 0x11 ) );
+    *mid = _mm_xor_si128( *mid, _mm_clmulepi64_si128( a, b, 0x10 ) );
+    *mid = _mm_xor_si128( *mid, _mm_clmulepi64_si128( a, b, 0x01 ) );
+}
+
+/*
+ * Shift the accumulated product left by one bit ([CLMUL-WP] eq 27) and
+ * reduce it modulo x^128 + x^7 + x^2 + x + 1 ([CLMUL-WP] algorithm 5)
+ */
+GCM_TARGET
+static inline __m128i gcm_reduce( __m128i lo, __m128i mid, __m128i hi )
+{
+    __m128i x0, x1, t0, t1, t2;
+
+    x0 = _mm_xor_si128( lo, _mm_slli_si128( mid, 8 ) );
+    x1 = _mm_xor_si128( hi, _mm_srli_si128( mid, 8 ) );
+
+    /* x1:x0 <<= 1 */
+    t0 = _mm_srli_epi32( x0, 31 );
+    t1 = _mm_srli_epi32( x1, 31 );
+    x0 = _mm_slli_epi32( x0, 1 );
+    x1 = _mm_slli_epi32( x1, 1 );
+    t2 = _mm_srli_si128( t0, 12 );
+    t1 = _mm_slli_si128( t1, 4 );
+    t0 = _mm_slli_si128( t0, 4 );
+    x0 = _mm_or_si128( x0, t0 );
+    x1 = _mm_or_si128( x1, t1 );
+    x1 = _mm_or_si128( x1, t2 );
+
+    /* Reduction, first phase */
+    t0 = _mm_slli_epi32( x0, 31 );
+    t1 = _mm_slli_epi32( x0, 30 );
+    t2 = _mm_slli_epi32( x0, 25 );
+    t0 = _mm_xor_si128( t0, t1 );
+    t0 = _mm_xor_si128( t0, t2 );
+    t1 = _mm_srli_si128( t0, 4 );
+    t0 = _mm_slli_si128( t0, 12 );
+    x0 = _mm_xor_si128( x0, t0 );
+
+    /* Second phase */
+    t2 = _mm_srli_epi32( x0, 1 );
+    t0 = _mm_srli_epi32( x0, 2 );
+    t2 = _mm_xor_si128( t2, t0 );
+    t0 = _mm_srli_epi32( x0, 7 );
+    t2 = _mm_xor_si128( t2, t0 );
+    t2 = _mm_xor_si128( t2, t1 );
+    x0 = _mm_xor_si128( x0, t2 );
+
+    return( _mm_xor_si128( x1, x0 ) );
+}
+
+GCM_TARGET
+static inline __m128i gcm_mult( __m128i a, __m128i b )
+{
+    __m128i lo = _mm_setzero_si128();
+    __m128i mid = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+
+    gcm_mul_acc( a, b, &lo, &mid, &hi );
+    return( gcm_reduce( lo, mid, hi ) );
+}
+
+GCM_TARGET
+static inline __m128i gcm_encrypt_block( __m128i x, const __m128i *rk, int nr )
+{
+    int r;
+
+    x = _mm_xor_si128( x, rk[0] );
+    for( r = 1; r < nr; r++ )
+        x = _mm_aesenc_si128( x, rk[r] );
+
+    return( _mm_aesenclast_si128( x, rk[nr] ) );
+}
+
+/*
+ * AES-GCM buffer encryption/decryption
+ */
+GCM_TARGET
+int mbedtls_aesni_gcm_crypt( mbedtls_aes_context *ctx,
+                     const unsigned char htable[128],
+                     int mode,
+                     size_t length,
+                     const unsigned char iv[12],
+                     const unsigned char *add,
+                     size_t add_len,
+                     const unsigned char *input,
+                     unsigned char *output,
+                     unsigned char tag[16] )
+{
+    const __m128i bswap = _mm_set_epi8( 0, 1, 2, 3, 4, 5, 6, 7,
+                                        8, 9, 10, 11, 12, 13, 14, 15 );
+    const __m128i one = _mm_set_epi32( 0, 0, 0, 1 );
+    const __m128i *k = (const __m128i *) ctx->rk;
+    const size_t total = length;
+    const size_t add_total = add_len;
+    const int nr = ctx->nr;
+    __m128i rk[15], h[8], b, d;
+    __m128i x, j0, ctr, lo, mid, hi;
+    unsigned char buf[16];
+    int i, r;
+
+    for( i = 0; i <= nr; i++ )
+        rk[i] = _mm_loadu_si128( k + i );
+    for( i = 0; i < 8; i++ )
+        h[i] = _mm_loadu_si128( (const __m128i *) htable + i );
+
+    /* J0 = IV || 1; the counter is kept reflected so it sits in dword 0 */
+    memcpy( buf, iv, 12 );
+    buf[12] = buf[13] = buf[14] = 0;
+    buf[15] = 1;
+    j0 = _mm_loadu_si128( (const __m128i *) buf );
+    ctr = _mm_shuffle_epi8( j0, bswap );
+
+    x = _mm_setzero_si128();
+    for( ; add_len > 0; add_len -= ( add_len < 16 ) ? add_len : 16, add += 16 )
+    {
+        memset( buf, 0, 16 );
+        memcpy( buf, add, add_len < 16 ? add_len : 16 );
+        x = _mm_xor_si128( x, _mm_shuffle_epi8(
+                _mm_loadu_si128( (const __m128i *) buf ), bswap ) );
+        x = gcm_mult( x, h[0] );
+    }
+
+    for( ; length >= 128; length -= 128, input += 128, output += 128 )
+    {
+        const __m128i *src = (const __m128i *) input;
+        __m128i *dst = (__m128i *) output;
+        __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+        __m128i d0, d1, d2, d3, d4, d5, d6, d7;
+
+#define GCM_CTR( b )                                                    \
+        ctr = _mm_add_epi32( ctr, one );                                \
+        b = _mm_xor_si128( _mm_shuffle_epi8( ctr, bswap ), rk[0] )
+
+        GCM_CTR( b0 ); GCM_CTR( b1 ); GCM_CTR( b2 ); GCM_CTR( b3 );
+        GCM_CTR( b4 ); GCM_CTR( b5 ); GCM_CTR( b6 ); GCM_CTR( b7 );
+#undef GCM_CTR
+
+        for( r = 1; r < nr; r++ )
+        {
+            b0 = _mm_aesenc_si128( b0, rk[r] );
+            b1 = _mm_aesenc_si128( b1, rk[r] );
+            b2 = _mm_aesenc_si128( b2, rk[r] );
+            b3 = _mm_aesenc_si128( b3, rk[r] );
+            b4 = _mm_aesenc_si128( b4, rk[r] );
+            b5 = _mm_aesenc_si128( b5, rk[r] );
+            b6 = _mm_aesenc_si128( b6, rk[r] );
+            b7 = _mm_aesenc_si128( b7, rk[r] );
+        }
+
+#define GCM_LAST( b, d, i )                                             \
+        d = _mm_loadu_si128( src + i );                                 \
+        b = _mm_xor_si128( _mm_aesenclast_si128( b, rk[nr] ), d );      \
+        _mm_storeu_si128( dst + i, b )
+
+        GCM_LAST( b0, d0, 0 ); GCM_LAST( b1, d1, 1 );
+        GCM_LAST( b2, d2, 2 ); GCM_LAST( b3, d3, 3 );
+        GCM_LAST( b4, d4, 4 ); GCM_LAST( b5, d5, 5 );
+        GCM_LAST( b6, d6, 6 ); GCM_LAST( b7, d7, 7 );
+#undef GCM_LAST
+
+        if( mode != MBEDTLS_AES_ENCRYPT )
+        {
+            b0 = d0; b1 = d1; b2 = d2; b3 = d3;
+            b4 = d4; b5 = d5; b6 = d6; b7 = d7;
+        }
+
+        /* GHASH over the ciphertext, one reduction for the group */
+        lo = mid = hi = _mm_setzero_si128();
+        gcm_mul_acc( _mm_xor_si128( x, _mm_shuffle_epi8( b0, bswap ) ), h[7],
+                     &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b1, bswap ), h[6], &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b2, bswap ), h[5], &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b3, bswap ), h[4], &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b4, bswap ), h[3], &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b5, bswap ), h[2], &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b6, bswap ), h[1], &lo, &mid, &hi );
+        gcm_mul_acc( _mm_shuffle_epi8( b7, bswap ), h[0], &lo, &mid, &hi );
+        x = gcm_reduce( lo, mid, hi );
+    }
+
+    for( ; length > 0; length -= ( length < 16 ) ? length : 16,
+                       input += 16, output += 16 )
+    {
+        size_t n = length < 16 ? length : 16;
+        __m128i c;
+
+        ctr = _mm_add_epi32( ctr, one );
+        b = gcm_encrypt_block( _mm_shuffle_epi8( ctr, bswap ), rk, nr );
+
+        memset( buf, 0, 16 );
+        memcpy( buf, input, n );
+        d = _mm_loadu_si128( (const __m128i *) buf );
+        _mm_storeu_si128( (__m128i *) buf, _mm_xor_si128( b, d ) );
+        memcpy( output, buf, n );
+
+        /* Hash the zero padded ciphertext */
+        if( mode == MBEDTLS_AES_ENCRYPT )
+            memset( buf + n, 0, 16 - n );
+        c = mode == MBEDTLS_AES_ENCRYPT ?
+            _mm_loadu_si128( (const __m128i *) buf ) : d;
+        x = gcm_mult( _mm_xor_si128( x, _mm_shuffle_epi8( c, bswap ) ),
+                      h[0] );
+    }
+
+    /* Lengths block, reflected: len(C) in the low qword */
+    x = _mm_xor_si128( x, _mm_set_epi64x( (long long) ( add_total * 8 ),
+                                          (long long) ( total * 8 ) ) );
+    x = gcm_mult( x, h[0] );
+
+    x = _mm_xor_si128( _mm_shuffle_epi8( x, bswap ),
+                       gcm_encrypt_block( j0, rk, nr ) );
+    _mm_storeu_si128( (__m128i *) tag, x );
+
+    return( 0 );
+}
+
+#endif /* MBEDTLS_HAVE_X86_64 */
+
+#endif /* MBEDTLS_GCM_C && MBEDTLS_AESNI_C */
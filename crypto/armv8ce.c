@@ -0,0 +1,359 @@
+/*
+ *  ARMv8 Cryptography Extensions AES page kernels
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * The AES instructions are reached through the ACLE intrinsics of
+ * arm_neon.h. This file is compiled with the crypto extension enabled
+ * (-march=armv8-a+crypto, see CMakeLists.txt) but nothing here runs before
+ * mbedtls_armv8ce_has_support() says the CPU has it.
+ *
+ * AESE/AESD include the round key addition before (Inv)ShiftRows and
+ * (Inv)SubBytes, and AESMC/AESIMC do the (Inv)MixColumns, so the round
+ * keys of aes.c are used as they are: the decryption ones already are the
+ * equivalent inverse cipher keys.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_ARMV8CE_C)
+
+#include "mbedtls/armv8ce.h"
+
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+
+#include <arm_neon.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES ( 1 << 3 )
+#endif
+#endif
+
+/*
+ * ARMv8-CE support detection routine
+ */
+int mbedtls_armv8ce_has_support( void )
+{
+#if defined(__APPLE__)
+    /* Every Apple AArch64 core has them */
+    return( 1 );
+#elif defined(__linux__)
+    static int done = 0;
+    static int support = 0;
+
+    if( ! done )
+    {
+        support = ( getauxval( AT_HWCAP ) & HWCAP_AES ) != 0;
+        done = 1;
+    }
+
+    return( support );
+#else
+    return( 0 );
+#endif
+}
+
+/*
+ * Load the round keys
+ */
+static void armv8ce_load_keys( uint8x16_t rk[15],
+                               const mbedtls_aes_context *ctx )
+{
+    const uint8_t *k = (const uint8_t *) ctx->rk;
+    int i;
+
+    for( i = 0; i <= ctx->nr; i++ )
+        rk[i] = vld1q_u8( k + 16 * i );
+}
+
+static inline uint8x16_t armv8ce_encrypt( uint8x16_t x,
+                                          const uint8x16_t rk[15], int nr )
+{
+    int r;
+
+    for( r = 0; r < nr - 1; r++ )
+        x = vaesmcq_u8( vaeseq_u8( x, rk[r] ) );
+
+    return( veorq_u8( vaeseq_u8( x, rk[nr - 1] ), rk[nr] ) );
+}
+
+static inline uint8x16_t armv8ce_decrypt( uint8x16_t x,
+                                          const uint8x16_t rk[15], int nr )
+{
+    int r;
+
+    for( r = 0; r < nr - 1; r++ )
+        x = vaesimcq_u8( vaesdq_u8( x, rk[r] ) );
+
+    return( veorq_u8( vaesdq_u8( x, rk[nr - 1] ), rk[nr] ) );
+}
+
+/*
+ * One cipher on eight blocks, round by round so that the eight
+ * independent AESE/AESMC (AESD/AESIMC) chains overlap in the pipeline
+ */
+#define ARMV8CE_ROUNDS8( op, mix )                                      \
+    do {                                                                \
+        int r_;                                                         \
+        for( r_ = 0; r_ < nr - 1; r_++ )                                \
+        {                                                               \
+            b0 = mix( op( b0, rk[r_] ) );                               \
+            b1 = mix( op( b1, rk[r_] ) );                               \
+            b2 = mix( op( b2, rk[r_] ) );                               \
+            b3 = mix( op( b3, rk[r_] ) );                               \
+            b4 = mix( op( b4, rk[r_] ) );                               \
+            b5 = mix( op( b5, rk[r_] ) );                               \
+            b6 = mix( op( b6, rk[r_] ) );                               \
+            b7 = mix( op( b7, rk[r_] ) );                               \
+        }                                                               \
+        b0 = veorq_u8( op( b0, rk[nr - 1] ), rk[nr] );                  \
+        b1 = veorq_u8( op( b1, rk[nr - 1] ), rk[nr] );                  \
+        b2 = veorq_u8( op( b2, rk[nr - 1] ), rk[nr] );                  \
+        b3 = veorq_u8( op( b3, rk[nr - 1] ), rk[nr] );                  \
+        b4 = veorq_u8( op( b4, rk[nr - 1] ), rk[nr] );                  \
+        b5 = veorq_u8( op( b5, rk[nr - 1] ), rk[nr] );                  \
+        b6 = veorq_u8( op( b6, rk[nr - 1] ), rk[nr] );                  \
+        b7 = veorq_u8( op( b7, rk[nr - 1] ), rk[nr] );                  \
+    } while( 0 )
+
+/*
+ * ARMv8-CE AES-ECB block en(de)cryption
+ */
+int mbedtls_armv8ce_crypt_ecb( mbedtls_aes_context *ctx,
+                       int mode,
+                       const unsigned char input[16],
+                       unsigned char output[16] )
+{
+    uint8x16_t rk[15];
+    uint8x16_t x = vld1q_u8( input );
+
+    armv8ce_load_keys( rk, ctx );
+    if( mode == MBEDTLS_AES_ENCRYPT )
+        x = armv8ce_encrypt( x, rk, ctx->nr );
+    else
+        x = armv8ce_decrypt( x, rk, ctx->nr );
+    vst1q_u8( output, x );
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/*
+ * ARMv8-CE AES-CBC buffer encryption
+ * Each block depends on the previous one, so there is nothing to overlap.
+ */
+int mbedtls_armv8ce_cbc_encrypt( mbedtls_aes_context *ctx,
+                         size_t length,
+                         unsigned char iv[16],
+                         const unsigned char *input,
+                         unsigned char *output )
+{
+    uint8x16_t rk[15];
+    uint8x16_t x;
+    int nr = ctx->nr;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    armv8ce_load_keys( rk, ctx );
+    x = vld1q_u8( iv );
+    for( ; length > 0; length -= 16, input += 16, output += 16 )
+    {
+        x = armv8ce_encrypt( veorq_u8( x, vld1q_u8( input ) ), rk, nr );
+        vst1q_u8( output, x );
+    }
+    vst1q_u8( iv, x );
+
+    return( 0 );
+}
+
+/*
+ * ARMv8-CE AES-CBC buffer decryption
+ * The ciphertext of a group is loaded before any output is stored, so
+ * input and output may be the same buffer.
+ */
+int mbedtls_armv8ce_cbc_decrypt( mbedtls_aes_context *ctx,
+                         size_t length,
+                         unsigned char iv[16],
+                         const unsigned char *input,
+                         unsigned char *output )
+{
+    uint8x16_t rk[15];
+    uint8x16_t chain, c0, c1, c2, c3, c4, c5, c6, c7;
+    uint8x16_t b0, b1, b2, b3, b4, b5, b6, b7;
+    int nr = ctx->nr;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    armv8ce_load_keys( rk, ctx );
+    chain = vld1q_u8( iv );
+
+    for( ; length >= 128; length -= 128, input += 128, output += 128 )
+    {
+        b0 = c0 = vld1q_u8( input );
+        b1 = c1 = vld1q_u8( input + 16 );
+        b2 = c2 = vld1q_u8( input + 32 );
+        b3 = c3 = vld1q_u8( input + 48 );
+        b4 = c4 = vld1q_u8( input + 64 );
+        b5 = c5 = vld1q_u8( input + 80 );
+        b6 = c6 = vld1q_u8( input + 96 );
+        b7 = c7 = vld1q_u8( input + 112 );
+
+        ARMV8CE_ROUNDS8( vaesdq_u8, vaesimcq_u8 );
+
+        vst1q_u8( output,       veorq_u8( b0, chain ) );
+        vst1q_u8( output + 16,  veorq_u8( b1, c0 ) );
+        vst1q_u8( output + 32,  veorq_u8( b2, c1 ) );
+        vst1q_u8( output + 48,  veorq_u8( b3, c2 ) );
+        vst1q_u8( output + 64,  veorq_u8( b4, c3 ) );
+        vst1q_u8( output + 80,  veorq_u8( b5, c4 ) );
+        vst1q_u8( output + 96,  veorq_u8( b6, c5 ) );
+        vst1q_u8( output + 112, veorq_u8( b7, c6 ) );
+        chain = c7;
+    }
+
+    for( ; length > 0; length -= 16, input += 16, output += 16 )
+    {
+        c0 = vld1q_u8( input );
+        vst1q_u8( output, veorq_u8( armv8ce_decrypt( c0, rk, nr ), chain ) );
+        chain = c0;
+    }
+    vst1q_u8( iv, chain );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/*
+ * Multiplication of an XTS tweak by the primitive element alpha,
+ * little-endian as per IEEE P1619: both 64-bit halves are shifted left and
+ * the bit shifted out of each is put back into the other (reduced by the
+ * polynomial for the top one)
+ */
+static inline uint8x16_t armv8ce_xts_double( uint8x16_t t )
+{
+    static const uint64_t mask[2] = { 0x87, 1 };
+    uint64x2_t v = vreinterpretq_u64_u8( t );
+    int64x2_t carry = vshrq_n_s64( vreinterpretq_s64_u8( t ), 63 );
+
+    /* carry of the high half into the low one and vice versa */
+    carry = vextq_s64( carry, carry, 1 );
+    v = veorq_u64( vshlq_n_u64( v, 1 ),
+                   vandq_u64( vreinterpretq_u64_s64( carry ),
+                              vld1q_u64( mask ) ) );
+
+    return( vreinterpretq_u8_u64( v ) );
+}
+
+/*
+ * ARMv8-CE AES-XTS buffer encryption/decryption
+ *
+ * Each block is whitened with its own tweak before and after the cipher,
+ * so blocks are independent in both directions and eight of them are kept
+ * in flight, their tweaks in registers. Input and output may be the same
+ * buffer.
+ */
+int mbedtls_armv8ce_crypt_xts( mbedtls_aes_context *ctx,
+                       int mode,
+                       size_t length,
+                       unsigned char tweak[16],
+                       const unsigned char *input,
+                       unsigned char *output )
+{
+    uint8x16_t rk[15];
+    uint8x16_t t, t0, t1, t2, t3, t4, t5, t6, t7;
+    uint8x16_t b0, b1, b2, b3, b4, b5, b6, b7;
+    int nr = ctx->nr;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    armv8ce_load_keys( rk, ctx );
+    t = vld1q_u8( tweak );
+
+    for( ; length >= 128; length -= 128, input += 128, output += 128 )
+    {
+        t0 = t;
+        t1 = armv8ce_xts_double( t0 );
+        t2 = armv8ce_xts_double( t1 );
+        t3 = armv8ce_xts_double( t2 );
+        t4 = armv8ce_xts_double( t3 );
+        t5 = armv8ce_xts_double( t4 );
+        t6 = armv8ce_xts_double( t5 );
+        t7 = armv8ce_xts_double( t6 );
+        t = armv8ce_xts_double( t7 );
+
+        b0 = veorq_u8( vld1q_u8( input ), t0 );
+        b1 = veorq_u8( vld1q_u8( input + 16 ), t1 );
+        b2 = veorq_u8( vld1q_u8( input + 32 ), t2 );
+        b3 = veorq_u8( vld1q_u8( input + 48 ), t3 );
+        b4 = veorq_u8( vld1q_u8( input + 64 ), t4 );
+        b5 = veorq_u8( vld1q_u8( input + 80 ), t5 );
+        b6 = veorq_u8( vld1q_u8( input + 96 ), t6 );
+        b7 = veorq_u8( vld1q_u8( input + 112 ), t7 );
+
+        if( mode == MBEDTLS_AES_ENCRYPT )
+            ARMV8CE_ROUNDS8( vaeseq_u8, vaesmcq_u8 );
+        else
+            ARMV8CE_ROUNDS8( vaesdq_u8, vaesimcq_u8 );
+
+        vst1q_u8( output,       veorq_u8( b0, t0 ) );
+        vst1q_u8( output + 16,  veorq_u8( b1, t1 ) );
+        vst1q_u8( output + 32,  veorq_u8( b2, t2 ) );
+        vst1q_u8( output + 48,  veorq_u8( b3, t3 ) );
+        vst1q_u8( output + 64,  veorq_u8( b4, t4 ) );
+        vst1q_u8( output + 80,  veorq_u8( b5, t5 ) );
+        vst1q_u8( output + 96,  veorq_u8( b6, t6 ) );
+        vst1q_u8( output + 112, veorq_u8( b7, t7 ) );
+    }
+
+    for( ; length > 0; length -= 16, input += 16, output += 16 )
+    {
+        b0 = veorq_u8( vld1q_u8( input ), t );
+        if( mode == MBEDTLS_AES_ENCRYPT )
+            b0 = armv8ce_encrypt( b0, rk, nr );
+        else
+            b0 = armv8ce_decrypt( b0, rk, nr );
+        vst1q_u8( output, veorq_u8( b0, t ) );
+        t = armv8ce_xts_double( t );
+    }
+    vst1q_u8( tweak, t );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
+#else /* __ARM_FEATURE_CRYPTO */
+
+/*
+ * Built without the crypto extension: never used
+ */
+int mbedtls_armv8ce_has_support( void )
+{
+    return( 0 );
+}
+
+#endif /* __ARM_FEATURE_CRYPTO */
+
+#endif /* MBEDTLS_ARMV8CE_C */
@@ -65,6 +65,65 @@ int mbedtls_aesni_crypt_ecb( mbedtls_aes_context *ctx,
                      const unsigned char input[16],
                      unsigned char output[16] );
 
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/**
+ * \brief          AES-NI AES-CBC buffer encryption
+ *
+ * \param ctx      AES context (set up for encryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_aesni_cbc_encrypt( mbedtls_aes_context *ctx,
+                       size_t length,
+                       unsigned char iv[16],
+                       const unsigned char *input,
+                       unsigned char *output );
+
+/**
+ * \brief          AES-NI AES-CBC buffer decryption, eight blocks at a time
+ *
+ * \param ctx      AES context (set up for decryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_aesni_cbc_decrypt( mbedtls_aes_context *ctx,
+                       size_t length,
+                       unsigned char iv[16],
+                       const unsigned char *input,
+                       unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/**
+ * \brief          AES-NI AES-XTS buffer encryption/decryption,
+ *                 eight blocks at a time
+ *
+ * \param ctx      AES context of the data key (set up for mode)
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param length   length of the input data (multiple of 16)
+ * \param tweak    tweak of the first block, i.e. the data unit number
+ *                 already encrypted with the tweak key (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_aesni_crypt_xts( mbedtls_aes_context *ctx,
+                     int mode,
+                     size_t length,
+                     unsigned char tweak[16],
+                     const unsigned char *input,
+                     unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
 /**
  * \brief          GCM multiplication: c = a * b in GF(2^128)
  *
@@ -0,0 +1,78 @@
+/**
+ * \file aesni_gcm.h
+ *
+ * \brief AES-GCM page kernel using AES-NI and PCLMULQDQ
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MBEDTLS_AESNI_GCM_H
+#define MBEDTLS_AESNI_GCM_H
+
+#include "aesni.h"
+
+#if defined(MBEDTLS_HAVE_X86_64)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          Precompute the GHASH key powers H^1..H^8
+ *
+ * \param ctx      AES context (set up for encryption)
+ * \param htable   128-byte table, filled in the kernel's byte order
+ *
+ * \note           Requires MBEDTLS_AESNI_AES and MBEDTLS_AESNI_CLMUL
+ */
+void mbedtls_aesni_gcm_setkey( mbedtls_aes_context *ctx,
+                       unsigned char htable[128] );
+
+/**
+ * \brief          AES-GCM buffer encryption/decryption with a 96-bit IV
+ *
+ *                 Counter mode encryption and GHASH run in the same pass:
+ *                 eight blocks are encrypted at a time and hashed with a
+ *                 single reduction.
+ *
+ * \param ctx      AES context (set up for encryption, for both modes)
+ * \param htable   table from mbedtls_aesni_gcm_setkey()
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param length   length of the input data
+ * \param iv       96-bit initialization vector
+ * \param add      additional data
+ * \param add_len  length of the additional data
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ * \param tag      buffer for the computed 16-byte tag; when decrypting the
+ *                 caller compares it with the stored one
+ *
+ * \return         0 (cannot fail)
+ */
+int mbedtls_aesni_gcm_crypt( mbedtls_aes_context *ctx,
+                     const unsigned char htable[128],
+                     int mode,
+                     size_t length,
+                     const unsigned char iv[12],
+                     const unsigned char *add,
+                     size_t add_len,
+                     const unsigned char *input,
+                     unsigned char *output,
+                     unsigned char tag[16] );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBEDTLS_HAVE_X86_64 */
+
+#endif /* MBEDTLS_AESNI_GCM_H */
@@ -0,0 +1,117 @@
+/**
+ * \file armv8ce.h
+ *
+ * \brief ARMv8 Cryptography Extensions for hardware AES acceleration on
+ *        AArch64 processors
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MBEDTLS_ARMV8CE_H
+#define MBEDTLS_ARMV8CE_H
+
+#include "aes.h"
+
+#if defined(MBEDTLS_ARMV8CE_C)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          ARMv8 Cryptography Extensions detection routine
+ *
+ * \return         1 if the CPU has the AES instructions, 0 otherwise
+ */
+int mbedtls_armv8ce_has_support( void );
+
+/**
+ * \brief          ARMv8-CE AES-ECB block en(de)cryption
+ *
+ * \param ctx      AES context
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param input    16-byte input block
+ * \param output   16-byte output block
+ *
+ * \return         0 on success (cannot fail)
+ */
+int mbedtls_armv8ce_crypt_ecb( mbedtls_aes_context *ctx,
+                       int mode,
+                       const unsigned char input[16],
+                       unsigned char output[16] );
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/**
+ * \brief          ARMv8-CE AES-CBC buffer encryption
+ *
+ * \param ctx      AES context (set up for encryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_armv8ce_cbc_encrypt( mbedtls_aes_context *ctx,
+                         size_t length,
+                         unsigned char iv[16],
+                         const unsigned char *input,
+                         unsigned char *output );
+
+/**
+ * \brief          ARMv8-CE AES-CBC buffer decryption, eight blocks at a time
+ *
+ * \param ctx      AES context (set up for decryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_armv8ce_cbc_decrypt( mbedtls_aes_context *ctx,
+                         size_t length,
+                         unsigned char iv[16],
+                         const unsigned char *input,
+                         unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/**
+ * \brief          ARMv8-CE AES-XTS buffer encryption/decryption,
+ *                 eight blocks at a time
+ *
+ * \param ctx      AES context of the data key (set up for mode)
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param length   length of the input data (multiple of 16)
+ * \param tweak    tweak of the first block, i.e. the data unit number
+ *                 already encrypted with the tweak key (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_armv8ce_crypt_xts( mbedtls_aes_context *ctx,
+                       int mode,
+                       size_t length,
+                       unsigned char tweak[16],
+                       const unsigned char *input,
+                       unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBEDTLS_ARMV8CE_C */
+
+#endif /* MBEDTLS_ARMV8CE_H */
@@ -1,5 +1,15 @@
 #define MBEDTLS_SHA512_C
 #define MBEDTLS_AES_C
 #define MBEDTLS_CIPHER_MODE_CBC
+#define MBEDTLS_CIPHER_MODE_XTS
+#if defined(__amd64__) || defined(__x86_64__)
 #define MBEDTLS_HAVE_X86_64
 #define MBEDTLS_AESNI_C
+#define MBEDTLS_VAES_C
+#define MBEDTLS_VPAES_C
+#endif
+#if defined(__aarch64__)
+#define MBEDTLS_ARMV8CE_C
+#define MBEDTLS_VPAES_C
+#endif
+#define MBEDTLS_GCM_C
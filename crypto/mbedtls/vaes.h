@@ -0,0 +1,90 @@
+/**
+ * \file vaes.h
+ *
+ * \brief VAES/AVX-512 wide-vector AES page kernels
+ *
+ *  Four 128-bit blocks are processed per 512-bit instruction. The kernels
+ *  use the round keys prepared by mbedtls_aes_setkey_enc/dec on an AES-NI
+ *  capable CPU, and fall back to the AES-NI kernels for tails shorter
+ *  than one vector.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MBEDTLS_VAES_H
+#define MBEDTLS_VAES_H
+
+#include "aesni.h"
+
+#if defined(MBEDTLS_HAVE_X86_64)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          VAES features detection routine
+ *
+ * \return         1 if the CPU and OS support AVX-512F and VAES on 512-bit
+ *                 registers, 0 otherwise
+ */
+int mbedtls_vaes_has_support( void );
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/**
+ * \brief          VAES AES-CBC buffer decryption, sixteen blocks at a time
+ *
+ * \param ctx      AES context (set up for decryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_vaes_cbc_decrypt( mbedtls_aes_context *ctx,
+                      size_t length,
+                      unsigned char iv[16],
+                      const unsigned char *input,
+                      unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/**
+ * \brief          VAES AES-XTS buffer encryption/decryption,
+ *                 sixteen blocks at a time
+ *
+ * \param ctx      AES context of the data key (set up for mode)
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param length   length of the input data (multiple of 16)
+ * \param tweak    tweak of the first block, i.e. the data unit number
+ *                 already encrypted with the tweak key (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_vaes_crypt_xts( mbedtls_aes_context *ctx,
+                    int mode,
+                    size_t length,
+                    unsigned char tweak[16],
+                    const unsigned char *input,
+                    unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBEDTLS_HAVE_X86_64 */
+
+#endif /* MBEDTLS_VAES_H */
@@ -0,0 +1,117 @@
+/**
+ * \file vpaes.h
+ *
+ * \brief Constant-time AES with vector permute instructions (SSSE3 on
+ *        x86-64, NEON on AArch64), for CPUs without AES instructions
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MBEDTLS_VPAES_H
+#define MBEDTLS_VPAES_H
+
+#include "aes.h"
+
+#if defined(MBEDTLS_VPAES_C)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          Vector permute support detection routine
+ *
+ * \return         1 if the CPU has SSSE3 (x86-64) or NEON (AArch64),
+ *                 0 otherwise
+ */
+int mbedtls_vpaes_has_support( void );
+
+/**
+ * \brief          Vector permute AES-ECB block en(de)cryption
+ *
+ * \param ctx      AES context
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param input    16-byte input block
+ * \param output   16-byte output block
+ *
+ * \return         0 on success (cannot fail)
+ */
+int mbedtls_vpaes_crypt_ecb( mbedtls_aes_context *ctx,
+                       int mode,
+                       const unsigned char input[16],
+                       unsigned char output[16] );
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/**
+ * \brief          Vector permute AES-CBC buffer encryption
+ *
+ * \param ctx      AES context (set up for encryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_vpaes_cbc_encrypt( mbedtls_aes_context *ctx,
+                         size_t length,
+                         unsigned char iv[16],
+                         const unsigned char *input,
+                         unsigned char *output );
+
+/**
+ * \brief          Vector permute AES-CBC buffer decryption
+ *
+ * \param ctx      AES context (set up for decryption)
+ * \param length   length of the input data (multiple of 16)
+ * \param iv       initialization vector (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_vpaes_cbc_decrypt( mbedtls_aes_context *ctx,
+                         size_t length,
+                         unsigned char iv[16],
+                         const unsigned char *input,
+                         unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/**
+ * \brief          Vector permute AES-XTS buffer encryption/decryption
+ *
+ * \param ctx      AES context of the data key (set up for mode)
+ * \param mode     MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * \param length   length of the input data (multiple of 16)
+ * \param tweak    tweak of the first block, i.e. the data unit number
+ *                 already encrypted with the tweak key (updated after use)
+ * \param input    buffer holding the input data
+ * \param output   buffer holding the output data (may equal input)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH
+ */
+int mbedtls_vpaes_crypt_xts( mbedtls_aes_context *ctx,
+                       int mode,
+                       size_t length,
+                       unsigned char tweak[16],
+                       const unsigned char *input,
+                       unsigned char *output );
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBEDTLS_VPAES_C */
+
+#endif /* MBEDTLS_VPAES_H */
@@ -0,0 +1,360 @@
+/*
+ *  VAES/AVX-512 wide-vector AES page kernels
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Unlike aesni.c these kernels use compiler intrinsics: hand-encoding EVEX
+ * instructions is not practical, and any toolchain recent enough to target
+ * VAES understands them. Only the functions below are compiled for
+ * AVX-512, so the rest of the library keeps running on older CPUs.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_VAES_C)
+
+#include "mbedtls/vaes.h"
+
+#if defined(MBEDTLS_HAVE_X86_64) && \
+    ( defined(__clang__) || ( defined(__GNUC__) && __GNUC__ >= 8 ) )
+
+#include <immintrin.h>
+
+#ifndef asm
+#define asm __asm
+#endif
+
+#define VAES_TARGET __attribute__(( target( "avx512f,vaes" ) ))
+
+/*
+ * VAES support detection routine
+ */
+int mbedtls_vaes_has_support( void )
+{
+    static int done = 0;
+    static int support = 0;
+    unsigned int b, c, xcr0;
+
+    if( ! done )
+    {
+        asm( "movl  $1, %%eax   \n\t"
+             "cpuid             \n\t"
+             : "=c" (c)
+             :
+             : "eax", "ebx", "edx" );
+
+        /* The OS must save the opmask and ZMM state (XCR0 bits 1, 2, 5-7) */
+        if( c & ( 1u << 27 ) )
+        {
+            asm( ".byte 0x0F,0x01,0xD0  \n\t" // xgetbv
+                 : "=a" (xcr0)
+                 : "c" (0)
+                 : "edx" );
+
+            if( ( xcr0 & 0xE6 ) == 0xE6 )
+            {
+                asm( "movl  $7, %%eax   \n\t"
+                     "xorl  %%ecx, %%ecx\n\t"
+                     "cpuid             \n\t"
+                     : "=b" (b), "=c" (c)
+                     :
+                     : "eax", "edx" );
+
+                /* AVX512F is EBX bit 16, VAES is ECX bit 9 */
+                support = ( b & ( 1u << 16 ) ) != 0 && ( c & ( 1u << 9 ) ) != 0;
+            }
+        }
+        done = 1;
+    }
+
+    return( support );
+}
+
+/*
+ * Load the round keys, each broadcast to the four lanes
+ */
+VAES_TARGET
+static void vaes_load_keys( __m512i rk[15], const mbedtls_aes_context *ctx )
+{
+    const __m128i *k = (const __m128i *) ctx->rk;
+    int i;
+
+    for( i = 0; i <= ctx->nr; i++ )
+        rk[i] = _mm512_broadcast_i32x4( _mm_loadu_si128( k + i ) );
+}
+
+#define VAES_ROUNDS( op, oplast, x0, x1, x2, x3 )           \
+    do {                                                     \
+        int r_;                                              \
+        x0 = _mm512_xor_si512( x0, rk[0] );                  \
+        x1 = _mm512_xor_si512( x1, rk[0] );                  \
+        x2 = _mm512_xor_si512( x2, rk[0] );                  \
+        x3 = _mm512_xor_si512( x3, rk[0] );                  \
+        for( r_ = 1; r_ < nr; r_++ )                         \
+        {                                                    \
+            x0 = op( x0, rk[r_] );                           \
+            x1 = op( x1, rk[r_] );                           \
+            x2 = op( x2, rk[r_] );                           \
+            x3 = op( x3, rk[r_] );                           \
+        }                                                    \
+        x0 = oplast( x0, rk[nr] );                           \
+        x1 = oplast( x1, rk[nr] );                           \
+        x2 = oplast( x2, rk[nr] );                           \
+        x3 = oplast( x3, rk[nr] );                           \
+    } while( 0 )
+
+#define VAES_ROUNDS1( op, oplast, x0 )                      \
+    do {                                                     \
+        int r_;                                              \
+        x0 = _mm512_xor_si512( x0, rk[0] );                  \
+        for( r_ = 1; r_ < nr; r_++ )                         \
+            x0 = op( x0, rk[r_] );                           \
+        x0 = oplast( x0, rk[nr] );                           \
+    } while( 0 )
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/*
+ * VAES AES-CBC buffer decryption
+ *
+ * The chaining vector of each lane is the ciphertext of the lane before,
+ * built with alignr from the current and previous vectors.
+ */
+VAES_TARGET
+int mbedtls_vaes_cbc_decrypt( mbedtls_aes_context *ctx,
+                      size_t length,
+                      unsigned char iv[16],
+                      const unsigned char *input,
+                      unsigned char *output )
+{
+    __m512i rk[15];
+    __m512i prev, c0, c1, c2, c3, x0, x1, x2, x3;
+    int nr = ctx->nr;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    if( length < 64 )
+        return( mbedtls_aesni_cbc_decrypt( ctx, length, iv, input, output ) );
+
+    vaes_load_keys( rk, ctx );
+
+    /* Only lane 3 of prev is used */
+    prev = _mm512_broadcast_i32x4( _mm_loadu_si128( (const __m128i *) iv ) );
+
+    for( ; length >= 256; length -= 256, input += 256, output += 256 )
+    {
+        x0 = c0 = _mm512_loadu_si512( input );
+        x1 = c1 = _mm512_loadu_si512( input + 64 );
+        x2 = c2 = _mm512_loadu_si512( input + 128 );
+        x3 = c3 = _mm512_loadu_si512( input + 192 );
+
+        VAES_ROUNDS( _mm512_aesdec_epi128, _mm512_aesdeclast_epi128,
+                     x0, x1, x2, x3 );
+
+        x0 = _mm512_xor_si512( x0, _mm512_alignr_epi64( c0, prev, 6 ) );
+        x1 = _mm512_xor_si512( x1, _mm512_alignr_epi64( c1, c0, 6 ) );
+        x2 = _mm512_xor_si512( x2, _mm512_alignr_epi64( c2, c1, 6 ) );
+        x3 = _mm512_xor_si512( x3, _mm512_alignr_epi64( c3, c2, 6 ) );
+        prev = c3;
+
+        _mm512_storeu_si512( output, x0 );
+        _mm512_storeu_si512( output + 64, x1 );
+        _mm512_storeu_si512( output + 128, x2 );
+        _mm512_storeu_si512( output + 192, x3 );
+    }
+
+    for( ; length >= 64; length -= 64, input += 64, output += 64 )
+    {
+        x0 = c0 = _mm512_loadu_si512( input );
+
+        VAES_ROUNDS1( _mm512_aesdec_epi128, _mm512_aesdeclast_epi128, x0 );
+
+        x0 = _mm512_xor_si512( x0, _mm512_alignr_epi64( c0, prev, 6 ) );
+        prev = c0;
+
+        _mm512_storeu_si512( output, x0 );
+    }
+
+    _mm_storeu_si128( (__m128i *) iv, _mm512_extracti32x4_epi32( prev, 3 ) );
+
+    if( length > 0 )
+        return( mbedtls_aesni_cbc_decrypt( ctx, length, iv, input, output ) );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/*
+ * Four consecutive tweaks from the first one: lane i is the tweak times
+ * alpha^i, the same shift and reduction as below with a shift count of i
+ * per lane (a count of 64 shifts everything out, so lane 0 gets no carry).
+ * Done in registers: at 4 KiB per call, doubling the tweaks a byte at a
+ * time in memory cost as much as a tenth of the page.
+ */
+VAES_TARGET
+static inline __m512i vaes_xts_first_tweaks( const unsigned char tweak[16] )
+{
+    const __m512i lo = _mm512_set_epi64( 0, -1, 0, -1, 0, -1, 0, -1 );
+    const __m512i n = _mm512_set_epi64( 3, 3, 2, 2, 1, 1, 0, 0 );
+    __m512i t = _mm512_broadcast_i32x4(
+                    _mm_loadu_si128( (const __m128i *) tweak ) );
+    __m512i c = _mm512_srlv_epi64( t, _mm512_sub_epi64(
+                                          _mm512_set1_epi64( 64 ), n ) );
+
+    c = _mm512_shuffle_epi32( c, _MM_PERM_BADC );   // swap qwords in lanes
+    c = _mm512_xor_si512( c, _mm512_and_si512( lo,
+            _mm512_xor_si512( _mm512_slli_epi64( c, 7 ),
+                _mm512_xor_si512( _mm512_slli_epi64( c, 2 ),
+                                  _mm512_slli_epi64( c, 1 ) ) ) ) );
+
+    return( _mm512_xor_si512( _mm512_sllv_epi64( t, n ), c ) );
+}
+
+/*
+ * Multiply each lane by alpha^4, i.e. advance a vector of four consecutive
+ * tweaks to the next four. The four bits shifted out of the low qword move
+ * into the high qword; those shifted out of the high qword are reduced by
+ * x^7 + x^2 + x + 1, and since they are only four bits wide the carry-less
+ * product is a plain xor of shifts.
+ */
+VAES_TARGET
+static inline __m512i vaes_xts_mul_x4( __m512i t )
+{
+    const __m512i lo = _mm512_set_epi64( 0, -1, 0, -1, 0, -1, 0, -1 );
+    __m512i c = _mm512_srli_epi64( t, 60 );
+
+    c = _mm512_shuffle_epi32( c, _MM_PERM_BADC );   // swap qwords in lanes
+    c = _mm512_xor_si512( c, _mm512_and_si512( lo,
+            _mm512_xor_si512( _mm512_slli_epi64( c, 7 ),
+                _mm512_xor_si512( _mm512_slli_epi64( c, 2 ),
+                                  _mm512_slli_epi64( c, 1 ) ) ) ) );
+
+    return( _mm512_xor_si512( _mm512_slli_epi64( t, 4 ), c ) );
+}
+
+/*
+ * VAES AES-XTS buffer encryption/decryption
+ */
+VAES_TARGET
+int mbedtls_vaes_crypt_xts( mbedtls_aes_context *ctx,
+                    int mode,
+                    size_t length,
+                    unsigned char tweak[16],
+                    const unsigned char *input,
+                    unsigned char *output )
+{
+    __m512i rk[15];
+    __m512i t0, t1, t2, t3, x0, x1, x2, x3;
+    int nr = ctx->nr;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    if( length < 64 )
+        return( mbedtls_aesni_crypt_xts( ctx, mode, length, tweak,
+                                         input, output ) );
+
+    vaes_load_keys( rk, ctx );
+
+    t0 = vaes_xts_first_tweaks( tweak );
+
+    for( ; length >= 256; length -= 256, input += 256, output += 256 )
+    {
+        t1 = vaes_xts_mul_x4( t0 );
+        t2 = vaes_xts_mul_x4( t1 );
+        t3 = vaes_xts_mul_x4( t2 );
+
+        x0 = _mm512_xor_si512( _mm512_loadu_si512( input ), t0 );
+        x1 = _mm512_xor_si512( _mm512_loadu_si512( input + 64 ), t1 );
+        x2 = _mm512_xor_si512( _mm512_loadu_si512( input + 128 ), t2 );
+        x3 = _mm512_xor_si512( _mm512_loadu_si512( input + 192 ), t3 );
+
+        if( mode == MBEDTLS_AES_ENCRYPT )
+            VAES_ROUNDS( _mm512_aesenc_epi128, _mm512_aesenclast_epi128,
+                         x0, x1, x2, x3 );
+        else
+            VAES_ROUNDS( _mm512_aesdec_epi128, _mm512_aesdeclast_epi128,
+                         x0, x1, x2, x3 );
+
+        _mm512_storeu_si512( output, _mm512_xor_si512( x0, t0 ) );
+        _mm512_storeu_si512( output + 64, _mm512_xor_si512( x1, t1 ) );
+        _mm512_storeu_si512( output + 128, _mm512_xor_si512( x2, t2 ) );
+        _mm512_storeu_si512( output + 192, _mm512_xor_si512( x3, t3 ) );
+
+        t0 = vaes_xts_mul_x4( t3 );
+    }
+
+    for( ; length >= 64; length -= 64, input += 64, output += 64 )
+    {
+        x0 = _mm512_xor_si512( _mm512_loadu_si512( input ), t0 );
+
+        if( mode == MBEDTLS_AES_ENCRYPT )
+            VAES_ROUNDS1( _mm512_aesenc_epi128, _mm512_aesenclast_epi128,
+                          x0 );
+        else
+            VAES_ROUNDS1( _mm512_aesdec_epi128, _mm512_aesdeclast_epi128,
+                          x0 );
+
+        _mm512_storeu_si512( output, _mm512_xor_si512( x0, t0 ) );
+
+        t0 = vaes_xts_mul_x4( t0 );
+    }
+
+    _mm_storeu_si128( (__m128i *) tweak, _mm512_castsi512_si128( t0 ) );
+
+    if( length > 0 )
+        return( mbedtls_aesni_crypt_xts( ctx, mode, length, tweak,
+                                         input, output ) );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
+#else /* MBEDTLS_HAVE_X86_64 && compiler support */
+
+#if defined(MBEDTLS_HAVE_X86_64)
+/*
+ * Compiler cannot target VAES: never report support, so the callers keep
+ * using the AES-NI kernels
+ */
+int mbedtls_vaes_has_support( void )
+{
+    return( 0 );
+}
+
+int mbedtls_vaes_cbc_decrypt( mbedtls_aes_context *ctx, size_t length,
+                      unsigned char iv[16], const unsigned char *input,
+                      unsigned char *output )
+{
+    return( mbedtls_aesni_cbc_decrypt( ctx, length, iv, input, output ) );
+}
+
+int mbedtls_vaes_crypt_xts( mbedtls_aes_context *ctx, int mode, size_t length,
+                    unsigned char tweak[16], const unsigned char *input,
+                    unsigned char *output )
+{
+    return( mbedtls_aesni_crypt_xts( ctx, mode, length, tweak,
+                                     input, output ) );
+}
+#endif /* MBEDTLS_HAVE_X86_64 */
+
+#endif /* MBEDTLS_HAVE_X86_64 && compiler support */
+
+#endif /* MBEDTLS_VAES_C */
@@ -0,0 +1,653 @@
+/*
+ *  Constant-time vector permute AES kernels (SSSE3 and NEON)
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * After M. Hamburg, "Accelerating AES with Vector Permute Instructions",
+ * CHES 2009: the state is kept in a GF((2^4)^2) tower basis, where the
+ * S-box inversion only needs 4-bit lookups done with a byte shuffle
+ * (PSHUFB, TBL) of 16-byte constants. There is no memory access
+ * at a data dependent address, unlike the tables of aes.c, and nothing
+ * competes with the caller for L1.
+ *
+ * The round keys of aes.c are used: they are moved into the tower basis
+ * at the start of each call. The tables below were generated for the
+ * basis x = i * 0x01 + k * 0x12 over the subfield of GF(2^8), i and k
+ * being the high and low nibble.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_VPAES_C)
+
+#include "mbedtls/vpaes.h"
+
+#if defined(MBEDTLS_HAVE_X86_64) && \
+    ( defined(__clang__) || ( defined(__GNUC__) && __GNUC__ >= 5 ) )
+
+#include <immintrin.h>
+
+#ifndef asm
+#define asm __asm
+#endif
+
+#define VPAES_X86
+#define VPAES_TARGET __attribute__(( target( "ssse3" ) ))
+
+typedef __m128i vpaes_vec;
+
+#define VPAES_LOAD( p )         _mm_loadu_si128( (const __m128i *) ( p ) )
+#define VPAES_STORE( p, x )     _mm_storeu_si128( (__m128i *) ( p ), x )
+#define VPAES_XOR( a, b )       _mm_xor_si128( a, b )
+#define VPAES_SHUF( t, x )      _mm_shuffle_epi8( t, x )
+#define VPAES_LO( x )           _mm_and_si128( x, _mm_set1_epi8( 0x0F ) )
+#define VPAES_HI( x )           VPAES_LO( _mm_srli_epi16( x, 4 ) )
+
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define VPAES_NEON
+#define VPAES_TARGET
+
+typedef uint8x16_t vpaes_vec;
+
+#define VPAES_LOAD( p )         vld1q_u8( (const uint8_t *) ( p ) )
+#define VPAES_STORE( p, x )     vst1q_u8( (uint8_t *) ( p ), x )
+#define VPAES_XOR( a, b )       veorq_u8( a, b )
+#define VPAES_SHUF( t, x )      vqtbl1q_u8( t, x )
+#define VPAES_LO( x )           vandq_u8( x, vdupq_n_u8( 0x0F ) )
+#define VPAES_HI( x )           vshrq_n_u8( x, 4 )
+
+#endif
+
+#if defined(VPAES_X86) || defined(VPAES_NEON)
+
+/*
+ * Inversion in GF((2^4)^2): 1/x in GF(2^4) and a/x. The entry for 0 is
+ * 0x80, an index both PSHUFB and TBL turn into 0.
+ */
+static const unsigned char vpaes_inv[16] = {
+    0x80, 0x01, 0x08, 0x0D, 0x0F, 0x06, 0x05, 0x0E,
+    0x02, 0x0C, 0x0B, 0x0A, 0x09, 0x03, 0x07, 0x04 };
+static const unsigned char vpaes_inva[16] = {
+    0x80, 0x0D, 0x05, 0x06, 0x0A, 0x02, 0x03, 0x07,
+    0x0C, 0x0B, 0x04, 0x09, 0x08, 0x01, 0x0F, 0x0E };
+
+/*
+ * Encryption: standard to tower basis, then the S-box output in the tower
+ * basis (sb1, and doubled for MixColumns: sb2) and, for the last round,
+ * in the standard basis (sbo). The u tables are indexed by the first
+ * output of the inversion, the t tables by the second.
+ */
+static const unsigned char vpaes_ipt_lo[16] = {
+    0x00, 0x10, 0x36, 0x26, 0x7C, 0x6C, 0x4A, 0x5A,
+    0x5C, 0x4C, 0x6A, 0x7A, 0x20, 0x30, 0x16, 0x06 };
+static const unsigned char vpaes_ipt_hi[16] = {
+    0x00, 0x37, 0xA9, 0x9E, 0x77, 0x40, 0xDE, 0xE9,
+    0x1E, 0x29, 0xB7, 0x80, 0x69, 0x5E, 0xC0, 0xF7 };
+static const unsigned char vpaes_sb1u[16] = {
+    0x00, 0x3C, 0xDA, 0x10, 0xC1, 0x27, 0xCA, 0xFD,
+    0xD1, 0x2C, 0x37, 0x0B, 0xE6, 0xED, 0x1B, 0xF6 };
+static const unsigned char vpaes_sb1t[16] = {
+    0x00, 0x0D, 0xC3, 0xEC, 0x5F, 0x91, 0x2F, 0x52,
+    0xB3, 0xE1, 0x7D, 0x70, 0xCE, 0xBE, 0x9C, 0x22 };
+static const unsigned char vpaes_sb2u[16] = {
+    0x00, 0xEB, 0x85, 0x36, 0xF1, 0x9F, 0xB3, 0x1A,
+    0xC7, 0xDD, 0xA9, 0x42, 0x6E, 0x2C, 0x74, 0x58 };
+static const unsigned char vpaes_sb2t[16] = {
+    0x00, 0x63, 0x3C, 0xF9, 0x2F, 0x70, 0xC5, 0x4C,
+    0xD6, 0x9A, 0x89, 0xEA, 0x5F, 0xB5, 0x13, 0xA6 };
+static const unsigned char vpaes_sbou[16] = {
+    0x00, 0x54, 0xB7, 0x01, 0xF2, 0x11, 0xB6, 0xA6,
+    0xF3, 0x55, 0x10, 0x44, 0xE3, 0xA7, 0x45, 0xE2 };
+static const unsigned char vpaes_sbot[16] = {
+    0x00, 0x4B, 0x2A, 0xB5, 0xC2, 0xA3, 0x9F, 0x89,
+    0x77, 0xFE, 0x16, 0x5D, 0x61, 0x3C, 0xE8, 0xD4 };
+
+/*
+ * Decryption: standard to tower basis through the inverse affine map
+ * (its constant is folded into dipt_lo), then the inverse S-box output
+ * multiplied by 9, 13, 11 and 14 for InvMixColumns, and for the last round
+ */
+static const unsigned char vpaes_dipt_lo[16] = {
+    0x6C, 0x71, 0x39, 0x24, 0x89, 0x94, 0xDC, 0xC1,
+    0x1A, 0x07, 0x4F, 0x52, 0xFF, 0xE2, 0xAA, 0xB7 };
+static const unsigned char vpaes_dipt_hi[16] = {
+    0x00, 0xCB, 0x3B, 0xF0, 0x1F, 0xD4, 0x24, 0xEF,
+    0xC5, 0x0E, 0xFE, 0x35, 0xDA, 0x11, 0xE1, 0x2A };
+static const unsigned char vpaes_dsb9u[16] = {
+    0x00, 0x4C, 0x82, 0xA8, 0x04, 0xCA, 0x2A, 0x48,
+    0xAC, 0xE4, 0x62, 0x2E, 0xCE, 0xE0, 0x86, 0x66 };
+static const unsigned char vpaes_dsb9t[16] = {
+    0x00, 0x27, 0x30, 0x20, 0x3B, 0x2C, 0x10, 0x1C,
+    0x1B, 0x07, 0x0C, 0x2B, 0x17, 0x3C, 0x0B, 0x37 };
+static const unsigned char vpaes_dsbdu[16] = {
+    0x00, 0x30, 0x3B, 0x10, 0x37, 0x3C, 0x2B, 0x07,
+    0x27, 0x20, 0x2C, 0x1C, 0x0B, 0x17, 0x0C, 0x1B };
+static const unsigned char vpaes_dsbdt[16] = {
+    0x00, 0xBE, 0x13, 0x0D, 0x6D, 0xC0, 0x1E, 0xD3,
+    0x60, 0xB3, 0xCD, 0x73, 0xAD, 0xDE, 0x7E, 0xA0 };
+static const unsigned char vpaes_dsbbu[16] = {
+    0x00, 0x7A, 0xAB, 0x43, 0x6C, 0xBD, 0xE8, 0x16,
+    0x2F, 0x39, 0xFE, 0x84, 0xD1, 0x55, 0xC7, 0x92 };
+static const unsigned char vpaes_dsbbt[16] = {
+    0x00, 0x44, 0xC8, 0xB1, 0x94, 0x18, 0x79, 0xD0,
+    0x25, 0xF5, 0xA9, 0xED, 0x8C, 0x61, 0x5C, 0x3D };
+static const unsigned char vpaes_dsbeu[16] = {
+    0x00, 0x16, 0x39, 0xC7, 0x43, 0x6C, 0xFE, 0x55,
+    0x84, 0xD1, 0xAB, 0xBD, 0x2F, 0x92, 0x7A, 0xE8 };
+static const unsigned char vpaes_dsbet[16] = {
+    0x00, 0xD0, 0xF5, 0x5C, 0xB1, 0x94, 0xA9, 0x61,
+    0xED, 0x8C, 0xC8, 0x18, 0x25, 0x3D, 0x44, 0x79 };
+static const unsigned char vpaes_dsbou[16] = {
+    0x00, 0x1F, 0x3F, 0x4A, 0xCE, 0xEE, 0x75, 0xD1,
+    0x84, 0x55, 0xA4, 0xBB, 0x20, 0x9B, 0xF1, 0x6A };
+static const unsigned char vpaes_dsbot[16] = {
+    0x00, 0x1E, 0x8F, 0xAB, 0x23, 0xB2, 0x24, 0x3D,
+    0x88, 0xB5, 0x19, 0x07, 0x91, 0x96, 0xAC, 0x3A };
+
+/*
+ * ShiftRows is not done on its own: round r works on the state with its
+ * bytes moved by ShiftRows^-r (InvShiftRows^-r to decrypt), so it is
+ * folded into the rotations of MixColumns, conjugated the same way (by one,
+ * two and three rows, for r modulo 4), into the round keys and into a final
+ * shuffle by a power of ShiftRows.
+ */
+static const unsigned char vpaes_mix_enc[4][3][16] = {
+    { {  1,  2,  3,  0,  5,  6,  7,  4,  9, 10, 11,  8, 13, 14, 15, 12 },
+      {  2,  3,  0,  1,  6,  7,  4,  5, 10, 11,  8,  9, 14, 15, 12, 13 },
+      {  3,  0,  1,  2,  7,  4,  5,  6, 11,  8,  9, 10, 15, 12, 13, 14 } },
+    { {  5,  6,  7,  4,  9, 10, 11,  8, 13, 14, 15, 12,  1,  2,  3,  0 },
+      { 10, 11,  8,  9, 14, 15, 12, 13,  2,  3,  0,  1,  6,  7,  4,  5 },
+      { 15, 12, 13, 14,  3,  0,  1,  2,  7,  4,  5,  6, 11,  8,  9, 10 } },
+    { {  9, 10, 11,  8, 13, 14, 15, 12,  1,  2,  3,  0,  5,  6,  7,  4 },
+      {  2,  3,  0,  1,  6,  7,  4,  5, 10, 11,  8,  9, 14, 15, 12, 13 },
+      { 11,  8,  9, 10, 15, 12, 13, 14,  3,  0,  1,  2,  7,  4,  5,  6 } },
+    { { 13, 14, 15, 12,  1,  2,  3,  0,  5,  6,  7,  4,  9, 10, 11,  8 },
+      { 10, 11,  8,  9, 14, 15, 12, 13,  2,  3,  0,  1,  6,  7,  4,  5 },
+      {  7,  4,  5,  6, 11,  8,  9, 10, 15, 12, 13, 14,  3,  0,  1,  2 } } };
+
+static const unsigned char vpaes_mix_dec[4][3][16] = {
+    { {  1,  2,  3,  0,  5,  6,  7,  4,  9, 10, 11,  8, 13, 14, 15, 12 },
+      {  2,  3,  0,  1,  6,  7,  4,  5, 10, 11,  8,  9, 14, 15, 12, 13 },
+      {  3,  0,  1,  2,  7,  4,  5,  6, 11,  8,  9, 10, 15, 12, 13, 14 } },
+    { { 13, 14, 15, 12,  1,  2,  3,  0,  5,  6,  7,  4,  9, 10, 11,  8 },
+      { 10, 11,  8,  9, 14, 15, 12, 13,  2,  3,  0,  1,  6,  7,  4,  5 },
+      {  7,  4,  5,  6, 11,  8,  9, 10, 15, 12, 13, 14,  3,  0,  1,  2 } },
+    { {  9, 10, 11,  8, 13, 14, 15, 12,  1,  2,  3,  0,  5,  6,  7,  4 },
+      {  2,  3,  0,  1,  6,  7,  4,  5, 10, 11,  8,  9, 14, 15, 12, 13 },
+      { 11,  8,  9, 10, 15, 12, 13, 14,  3,  0,  1,  2,  7,  4,  5,  6 } },
+    { {  5,  6,  7,  4,  9, 10, 11,  8, 13, 14, 15, 12,  1,  2,  3,  0 },
+      { 10, 11,  8,  9, 14, 15, 12, 13,  2,  3,  0,  1,  6,  7,  4,  5 },
+      { 15, 12, 13, 14,  3,  0,  1,  2,  7,  4,  5,  6, 11,  8,  9, 10 } } };
+
+/* ShiftRows^m, InvShiftRows^m being ShiftRows^(4 - m) */
+static const unsigned char vpaes_sr[4][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    {  0,  5, 10, 15,  4,  9, 14,  3,  8, 13,  2,  7, 12,  1,  6, 11 },
+    {  0,  9,  2, 11,  4, 13,  6, 15,  8,  1, 10,  3, 12,  5, 14,  7 },
+    {  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3 } };
+
+static const unsigned char vpaes_s63[16] = {
+    0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63,
+    0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63 };
+
+#if defined(VPAES_X86)
+/*
+ * SSSE3 support detection routine
+ */
+int mbedtls_vpaes_has_support( void )
+{
+    static int done = 0;
+    static int support = 0;
+    unsigned int c;
+
+    if( ! done )
+    {
+        asm( "movl  $1, %%eax   \n\t"
+             "cpuid             \n\t"
+             : "=c" (c)
+             :
+             : "eax", "ebx", "edx" );
+
+        /* SSSE3 is ECX bit 9 */
+        support = ( c & ( 1u << 9 ) ) != 0;
+        done = 1;
+    }
+
+    return( support );
+}
+#else
+/*
+ * NEON support detection routine: part of every AArch64 core
+ */
+int mbedtls_vpaes_has_support( void )
+{
+    return( 1 );
+}
+#endif
+
+/*
+ * Linear map of every byte, given its images of the low and high nibbles
+ */
+VPAES_TARGET static inline vpaes_vec vpaes_transform( vpaes_vec x,
+                                                      const unsigned char *lo,
+                                                      const unsigned char *hi )
+{
+    return( VPAES_XOR( VPAES_SHUF( VPAES_LOAD( lo ), VPAES_LO( x ) ),
+                       VPAES_SHUF( VPAES_LOAD( hi ), VPAES_HI( x ) ) ) );
+}
+
+/*
+ * Inversion of every byte of x, in the tower basis. The inverse is
+ * returned as two indexes, io and jo, into the output tables.
+ */
+VPAES_TARGET static inline void vpaes_invert( vpaes_vec x,
+                                              vpaes_vec *io, vpaes_vec *jo )
+{
+    vpaes_vec inv = VPAES_LOAD( vpaes_inv );
+    vpaes_vec i = VPAES_HI( x );
+    vpaes_vec k = VPAES_LO( x );
+    vpaes_vec j = VPAES_XOR( i, k );
+    vpaes_vec ak = VPAES_SHUF( VPAES_LOAD( vpaes_inva ), k );
+    vpaes_vec iak = VPAES_XOR( VPAES_SHUF( inv, i ), ak );
+    vpaes_vec jak = VPAES_XOR( VPAES_SHUF( inv, j ), ak );
+
+    *io = VPAES_XOR( VPAES_SHUF( inv, iak ), j );
+    *jo = VPAES_XOR( VPAES_SHUF( inv, jak ), i );
+}
+
+#define VPAES_OUT( tab, io, jo ) \
+    VPAES_XOR( VPAES_SHUF( VPAES_LOAD( vpaes_##tab##u ), io ), \
+               VPAES_SHUF( VPAES_LOAD( vpaes_##tab##t ), jo ) )
+
+/*
+ * Round keys for encryption: the first and last ones are used in the
+ * standard basis, the others are moved to the tower basis, the S-box
+ * constant included, and to the byte order of their round
+ */
+VPAES_TARGET static void vpaes_encrypt_keys( vpaes_vec rk[15],
+                                             const mbedtls_aes_context *ctx )
+{
+    const unsigned char *k = (const unsigned char *) ctx->rk;
+    vpaes_vec s63 = VPAES_LOAD( vpaes_s63 );
+    vpaes_vec x;
+    int i;
+
+    rk[0] = VPAES_LOAD( k );
+    for( i = 1; i < ctx->nr; i++ )
+    {
+        x = VPAES_XOR( VPAES_LOAD( k + 16 * i ), s63 );
+        x = vpaes_transform( x, vpaes_ipt_lo, vpaes_ipt_hi );
+        rk[i] = VPAES_SHUF( x, VPAES_LOAD( vpaes_sr[( 4 - i ) & 3] ) );
+    }
+    rk[i] = VPAES_XOR( VPAES_LOAD( k + 16 * i ), s63 );
+}
+
+/*
+ * Round keys for decryption (aes.c's equivalent inverse cipher keys)
+ */
+VPAES_TARGET static void vpaes_decrypt_keys( vpaes_vec rk[15],
+                                             const mbedtls_aes_context *ctx )
+{
+    const unsigned char *k = (const unsigned char *) ctx->rk;
+    vpaes_vec x;
+    int i;
+
+    rk[0] = VPAES_LOAD( k );
+    for( i = 1; i < ctx->nr; i++ )
+    {
+        x = vpaes_transform( VPAES_LOAD( k + 16 * i ),
+                             vpaes_dipt_lo, vpaes_dipt_hi );
+        rk[i] = VPAES_SHUF( x, VPAES_LOAD( vpaes_sr[i & 3] ) );
+    }
+    rk[i] = VPAES_LOAD( k + 16 * i );
+}
+
+/*
+ * One middle round and the last round of encryption, mix being the
+ * rotations for the round and sr the final shuffle
+ */
+VPAES_TARGET static inline vpaes_vec vpaes_encrypt_round(
+    vpaes_vec x, vpaes_vec rk, const unsigned char mix[3][16] )
+{
+    vpaes_vec io, jo, s, d;
+
+    vpaes_invert( x, &io, &jo );
+    s = VPAES_OUT( sb1, io, jo );
+    d = VPAES_OUT( sb2, io, jo );
+
+    /* MixColumns: 2 a0 + 3 a1 + a2 + a3 */
+    return( VPAES_XOR(
+                VPAES_XOR( VPAES_XOR( d, rk ),
+                           VPAES_SHUF( VPAES_XOR( d, s ),
+                                       VPAES_LOAD( mix[0] ) ) ),
+                VPAES_XOR( VPAES_SHUF( s, VPAES_LOAD( mix[1] ) ),
+                           VPAES_SHUF( s, VPAES_LOAD( mix[2] ) ) ) ) );
+}
+
+VPAES_TARGET static inline vpaes_vec vpaes_encrypt_last(
+    vpaes_vec x, vpaes_vec rk, const unsigned char sr[16] )
+{
+    vpaes_vec io, jo;
+
+    vpaes_invert( x, &io, &jo );
+
+    return( VPAES_XOR( VPAES_SHUF( VPAES_OUT( sbo, io, jo ),
+                                   VPAES_LOAD( sr ) ), rk ) );
+}
+
+/*
+ * One middle round and the last round of decryption
+ */
+VPAES_TARGET static inline vpaes_vec vpaes_decrypt_round(
+    vpaes_vec x, vpaes_vec rk, const unsigned char mix[3][16] )
+{
+    vpaes_vec io, jo;
+
+    vpaes_invert( x, &io, &jo );
+
+    /* InvMixColumns: 14 a0 + 11 a1 + 13 a2 + 9 a3 */
+    return( VPAES_XOR(
+                VPAES_XOR( VPAES_XOR( VPAES_OUT( dsbe, io, jo ), rk ),
+                           VPAES_SHUF( VPAES_OUT( dsbb, io, jo ),
+                                       VPAES_LOAD( mix[0] ) ) ),
+                VPAES_XOR( VPAES_SHUF( VPAES_OUT( dsbd, io, jo ),
+                                       VPAES_LOAD( mix[1] ) ),
+                           VPAES_SHUF( VPAES_OUT( dsb9, io, jo ),
+                                       VPAES_LOAD( mix[2] ) ) ) ) );
+}
+
+VPAES_TARGET static inline vpaes_vec vpaes_decrypt_last(
+    vpaes_vec x, vpaes_vec rk, const unsigned char sr[16] )
+{
+    vpaes_vec io, jo;
+
+    vpaes_invert( x, &io, &jo );
+
+    return( VPAES_XOR( VPAES_SHUF( VPAES_OUT( dsbo, io, jo ),
+                                   VPAES_LOAD( sr ) ), rk ) );
+}
+
+VPAES_TARGET static inline vpaes_vec vpaes_encrypt( vpaes_vec x,
+                                                    const vpaes_vec rk[15],
+                                                    int nr )
+{
+    int r;
+
+    x = vpaes_transform( VPAES_XOR( x, rk[0] ), vpaes_ipt_lo, vpaes_ipt_hi );
+    for( r = 1; r < nr; r++ )
+        x = vpaes_encrypt_round( x, rk[r], vpaes_mix_enc[r & 3] );
+
+    return( vpaes_encrypt_last( x, rk[nr], vpaes_sr[nr & 3] ) );
+}
+
+VPAES_TARGET static inline vpaes_vec vpaes_decrypt( vpaes_vec x,
+                                                    const vpaes_vec rk[15],
+                                                    int nr )
+{
+    int r;
+
+    x = vpaes_transform( VPAES_XOR( x, rk[0] ), vpaes_dipt_lo, vpaes_dipt_hi );
+    for( r = 1; r < nr; r++ )
+        x = vpaes_decrypt_round( x, rk[r], vpaes_mix_dec[r & 3] );
+
+    return( vpaes_decrypt_last( x, rk[nr], vpaes_sr[( 4 - nr ) & 3] ) );
+}
+
+/*
+ * Four independent blocks, round by round: a single block is a chain of
+ * dependent shuffles, far from the shuffle throughput of the CPU
+ */
+VPAES_TARGET static void vpaes_crypt4( int mode, vpaes_vec x[4],
+                                       const vpaes_vec rk[15], int nr )
+{
+    vpaes_vec x0, x1, x2, x3;
+    const unsigned char *lo = vpaes_ipt_lo, *hi = vpaes_ipt_hi;
+    int r;
+
+    if( mode != MBEDTLS_AES_ENCRYPT )
+    {
+        lo = vpaes_dipt_lo;
+        hi = vpaes_dipt_hi;
+    }
+    x0 = vpaes_transform( VPAES_XOR( x[0], rk[0] ), lo, hi );
+    x1 = vpaes_transform( VPAES_XOR( x[1], rk[0] ), lo, hi );
+    x2 = vpaes_transform( VPAES_XOR( x[2], rk[0] ), lo, hi );
+    x3 = vpaes_transform( VPAES_XOR( x[3], rk[0] ), lo, hi );
+
+    if( mode == MBEDTLS_AES_ENCRYPT )
+    {
+        for( r = 1; r < nr; r++ )
+        {
+            x0 = vpaes_encrypt_round( x0, rk[r], vpaes_mix_enc[r & 3] );
+            x1 = vpaes_encrypt_round( x1, rk[r], vpaes_mix_enc[r & 3] );
+            x2 = vpaes_encrypt_round( x2, rk[r], vpaes_mix_enc[r & 3] );
+            x3 = vpaes_encrypt_round( x3, rk[r], vpaes_mix_enc[r & 3] );
+        }
+        x[0] = vpaes_encrypt_last( x0, rk[nr], vpaes_sr[nr & 3] );
+        x[1] = vpaes_encrypt_last( x1, rk[nr], vpaes_sr[nr & 3] );
+        x[2] = vpaes_encrypt_last( x2, rk[nr], vpaes_sr[nr & 3] );
+        x[3] = vpaes_encrypt_last( x3, rk[nr], vpaes_sr[nr & 3] );
+    }
+    else
+    {
+        for( r = 1; r < nr; r++ )
+        {
+            x0 = vpaes_decrypt_round( x0, rk[r], vpaes_mix_dec[r & 3] );
+            x1 = vpaes_decrypt_round( x1, rk[r], vpaes_mix_dec[r & 3] );
+            x2 = vpaes_decrypt_round( x2, rk[r], vpaes_mix_dec[r & 3] );
+            x3 = vpaes_decrypt_round( x3, rk[r], vpaes_mix_dec[r & 3] );
+        }
+        x[0] = vpaes_decrypt_last( x0, rk[nr], vpaes_sr[( 4 - nr ) & 3] );
+        x[1] = vpaes_decrypt_last( x1, rk[nr], vpaes_sr[( 4 - nr ) & 3] );
+        x[2] = vpaes_decrypt_last( x2, rk[nr], vpaes_sr[( 4 - nr ) & 3] );
+        x[3] = vpaes_decrypt_last( x3, rk[nr], vpaes_sr[( 4 - nr ) & 3] );
+    }
+}
+
+/*
+ * Vector permute AES-ECB block en(de)cryption
+ */
+VPAES_TARGET int mbedtls_vpaes_crypt_ecb( mbedtls_aes_context *ctx,
+                                  int mode,
+                                  const unsigned char input[16],
+                                  unsigned char output[16] )
+{
+    vpaes_vec rk[15];
+
+    if( mode == MBEDTLS_AES_ENCRYPT )
+    {
+        vpaes_encrypt_keys( rk, ctx );
+        VPAES_STORE( output, vpaes_encrypt( VPAES_LOAD( input ), rk,
+                                            ctx->nr ) );
+    }
+    else
+    {
+        vpaes_decrypt_keys( rk, ctx );
+        VPAES_STORE( output, vpaes_decrypt( VPAES_LOAD( input ), rk,
+                                            ctx->nr ) );
+    }
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+/*
+ * Vector permute AES-CBC buffer encryption
+ */
+VPAES_TARGET int mbedtls_vpaes_cbc_encrypt( mbedtls_aes_context *ctx,
+                                    size_t length,
+                                    unsigned char iv[16],
+                                    const unsigned char *input,
+                                    unsigned char *output )
+{
+    vpaes_vec rk[15];
+    vpaes_vec x;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    vpaes_encrypt_keys( rk, ctx );
+    x = VPAES_LOAD( iv );
+    for( ; length > 0; length -= 16, input += 16, output += 16 )
+    {
+        x = vpaes_encrypt( VPAES_XOR( x, VPAES_LOAD( input ) ), rk, ctx->nr );
+        VPAES_STORE( output, x );
+    }
+    VPAES_STORE( iv, x );
+
+    return( 0 );
+}
+
+/*
+ * Vector permute AES-CBC buffer decryption (input and output may be the
+ * same buffer)
+ */
+VPAES_TARGET int mbedtls_vpaes_cbc_decrypt( mbedtls_aes_context *ctx,
+                                    size_t length,
+                                    unsigned char iv[16],
+                                    const unsigned char *input,
+                                    unsigned char *output )
+{
+    vpaes_vec rk[15];
+    vpaes_vec chain, c[4], x[4];
+    int i;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    vpaes_decrypt_keys( rk, ctx );
+    chain = VPAES_LOAD( iv );
+    for( ; length >= 64; length -= 64, input += 64, output += 64 )
+    {
+        for( i = 0; i < 4; i++ )
+            c[i] = x[i] = VPAES_LOAD( input + 16 * i );
+        vpaes_crypt4( MBEDTLS_AES_DECRYPT, x, rk, ctx->nr );
+        VPAES_STORE( output, VPAES_XOR( x[0], chain ) );
+        for( i = 1; i < 4; i++ )
+            VPAES_STORE( output + 16 * i, VPAES_XOR( x[i], c[i - 1] ) );
+        chain = c[3];
+    }
+    for( ; length > 0; length -= 16, input += 16, output += 16 )
+    {
+        c[0] = VPAES_LOAD( input );
+        VPAES_STORE( output,
+                     VPAES_XOR( vpaes_decrypt( c[0], rk, ctx->nr ), chain ) );
+        chain = c[0];
+    }
+    VPAES_STORE( iv, chain );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_CBC */
+
+#if defined(MBEDTLS_CIPHER_MODE_XTS)
+/*
+ * Multiplication of an XTS tweak by alpha (little-endian, IEEE P1619)
+ */
+VPAES_TARGET static inline vpaes_vec vpaes_xts_double( vpaes_vec t )
+{
+#if defined(VPAES_X86)
+    /* Sign of the top dword of each half, swapped across the halves */
+    __m128i carry = _mm_shuffle_epi32( _mm_srai_epi32( t, 31 ),
+                                       _MM_SHUFFLE( 1, 1, 1, 3 ) );
+
+    return( _mm_xor_si128( _mm_slli_epi64( t, 1 ),
+                           _mm_and_si128( carry,
+                                          _mm_set_epi32( 0, 1, 0, 0x87 ) ) ) );
+#else
+    static const uint64_t mask[2] = { 0x87, 1 };
+    int64x2_t carry = vshrq_n_s64( vreinterpretq_s64_u8( t ), 63 );
+
+    carry = vextq_s64( carry, carry, 1 );
+
+    return( vreinterpretq_u8_u64(
+                veorq_u64( vshlq_n_u64( vreinterpretq_u64_u8( t ), 1 ),
+                           vandq_u64( vreinterpretq_u64_s64( carry ),
+                                      vld1q_u64( mask ) ) ) ) );
+#endif
+}
+
+/*
+ * Vector permute AES-XTS buffer encryption/decryption (input and output
+ * may be the same buffer)
+ */
+VPAES_TARGET int mbedtls_vpaes_crypt_xts( mbedtls_aes_context *ctx,
+                                  int mode,
+                                  size_t length,
+                                  unsigned char tweak[16],
+                                  const unsigned char *input,
+                                  unsigned char *output )
+{
+    vpaes_vec rk[15];
+    vpaes_vec t, tw[4], x[4];
+    int i;
+
+    if( length % 16 )
+        return( MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH );
+
+    if( mode == MBEDTLS_AES_ENCRYPT )
+        vpaes_encrypt_keys( rk, ctx );
+    else
+        vpaes_decrypt_keys( rk, ctx );
+
+    t = VPAES_LOAD( tweak );
+    for( ; length >= 64; length -= 64, input += 64, output += 64 )
+    {
+        for( i = 0; i < 4; i++ )
+        {
+            tw[i] = t;
+            x[i] = VPAES_XOR( VPAES_LOAD( input + 16 * i ), t );
+            t = vpaes_xts_double( t );
+        }
+        vpaes_crypt4( mode, x, rk, ctx->nr );
+        for( i = 0; i < 4; i++ )
+            VPAES_STORE( output + 16 * i, VPAES_XOR( x[i], tw[i] ) );
+    }
+    for( ; length > 0; length -= 16, input += 16, output += 16 )
+    {
+        x[0] = VPAES_XOR( VPAES_LOAD( input ), t );
+        if( mode == MBEDTLS_AES_ENCRYPT )
+            x[0] = vpaes_encrypt( x[0], rk, ctx->nr );
+        else
+            x[0] = vpaes_decrypt( x[0], rk, ctx->nr );
+        VPAES_STORE( output, VPAES_XOR( x[0], t ) );
+        t = vpaes_xts_double( t );
+    }
+    VPAES_STORE( tweak, t );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_XTS */
+
+#else /* VPAES_X86 || VPAES_NEON */
+
+/*
+ * No vector permute instruction to target: never report support
+ */
+int mbedtls_vpaes_has_support( void )
+{
+    return( 0 );
+}
+
+#endif /* VPAES_X86 || VPAES_NEON */
+
+#endif /* MBEDTLS_VPAES_C */
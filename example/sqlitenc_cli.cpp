@@ -1,19 +1,64 @@
 #include <iostream>
 #include <string>
+#include <thread>
 #include "../SQLiteWrapper.h"
+#include "../sqlite3crypt.h"
 
 using namespace sqlitewrapper;
 
+/**
+ * Offline mode: convert the file directly into output_file, on all cores.
+ * The database must be closed everywhere; if it was left with a hot
+ * journal or a WAL with frames, convert it in place instead (without
+ * output_file), which recovers them first
+ */
+static int convertFile(const std::string &input, const std::string &pwd,
+                       const std::string &op, const std::string &output)
+{
+    int rc;
+
+    sqlite3_codec_rekey_threads((int)std::thread::hardware_concurrency());
+    if (op == "enc") {
+        rc = sqlite3_codec_convert_file(input.c_str(), NULL, 0,
+                                        output.c_str(), pwd.data(),
+                                        (int)pwd.size());
+    } else if (op == "dec") {
+        rc = sqlite3_codec_convert_file(input.c_str(), pwd.data(),
+                                        (int)pwd.size(), output.c_str(),
+                                        NULL, 0);
+    } else {
+        std::cerr << "Unknown op " << op << std::endl;
+        return 1;
+    }
+    if (rc == SQLITE_NOTADB) {
+        std::cerr << "Failed to open with given passphrase" << std::endl;
+        return 1;
+    } else if (rc == SQLITE_BUSY) {
+        std::cerr << input << " is in use or has a journal or WAL to "
+                  << "recover, convert it without output_file" << std::endl;
+        return 1;
+    } else if (rc != SQLITE_OK) {
+        std::cerr << "Failed to convert " << input << ": "
+                  << sqlite3_errstr(rc) << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 4) {
-        std::cerr << "Usage: " << argv[0] << " sqlite_file passphrase enc|dec" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " sqlite_file passphrase enc|dec [output_file]" << std::endl;
         return 1;
     }
     std::string input(argv[1]);
     std::string pwd(argv[2]);
     std::string op(argv[3]);
 
+    if (argc > 4) {
+        return convertFile(input, pwd, op, argv[4]);
+    }
+
     SQLiteDatabase db;
     int rc = db.open(input);
     int error = -1;
@@ -28,8 +28,20 @@ THE SOFTWARE.
 #ifdef SQLITE_HAS_CODEC
 
 #include "crypto/mbedtls/aes.h"
+#include "crypto/mbedtls/aesni.h"
+#include "crypto/mbedtls/aesni_gcm.h"
+#include "crypto/mbedtls/armv8ce.h"
 #include "crypto/mbedtls/sha512.h"
+#include "crypto/mbedtls/vaes.h"
+#include "crypto/mbedtls/vpaes.h"
+#include "sqlite3crypt.h"
 #include <stdint.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,511 +49,4893 @@ extern "C" {
 
 /**
  * Encryption support for sqlite using the high level codec interface
- * This implementation uses AES 128 bit in CBC mode
+ * This implementation uses AES in XTS mode tweaked by the page number (128 or
+ * 256 bit, the former being the default for new databases), AES 256 bit in
+ * GCM mode with the nonce and tag in the page's reserved bytes, or AES 128
+ * bit in CBC mode (original format)
  */
 
 #define BLOCKSIZE 16
 
 /**
- * The CBC cipher context
+ * Page cipher formats
+ * An existing database is recognised by which format decrypts its header,
+ * see DecryptFirstPage
  */
-typedef struct
+#define CODEC_FORMAT_CBC 0    /* AES-128-CBC, same IV for every page */
+#define CODEC_FORMAT_XTS 1    /* AES-128-XTS, page number as the data unit */
+#define CODEC_FORMAT_XTS256 2 /* AES-256-XTS, page number as the data unit */
+#define CODEC_FORMAT_GCM 3    /* AES-256-GCM, authenticated */
+
+/**
+ * GCM page trailer, kept in the last GCM_RESERVE bytes of every page:
+ * unused (4) | nonce (12) | tag (16)
+ * The nonce is the page number followed by a 64 bit counter, so a page
+ * moved to another position fails authentication like a modified one.
+ * Reading a page that fails it returns SQLITE_CORRUPT: from the database
+ * file or the WAL (see CodecFileRead and CodecWalRead), or once the rekey
+ * workers have decrypted a batch. So does page 1 under a key it has
+ * authenticated with before; until then it can't be told from a wrong key,
+ * SQLITE_NOTADB.
+ */
+#define GCM_RESERVE 32
+#define GCM_NONCESIZE 12
+#define GCM_TAGSIZE 16
+
+#ifndef SQLITE_CODEC_DEFAULT_FORMAT
+#define SQLITE_CODEC_DEFAULT_FORMAT CODEC_FORMAT_XTS
+#endif
+
+/**
+ * Whether keys are parsed for the format prefixes and key forms of
+ * keyPrefixes from the start, see sqlite3_codec_key_forms
+ */
+#ifndef SQLITE_CODEC_KEY_FORMS
+#define SQLITE_CODEC_KEY_FORMS 0
+#endif
+
+/**
+ * Rekey parallelism: threads sharing the page cipher work (including the
+ * calling thread), see sqlite3_codec_rekey_threads, and the bytes of pages
+ * each of them handles per batch
+ */
+#ifndef SQLITE_CODEC_REKEY_THREADS
+#define SQLITE_CODEC_REKEY_THREADS 4
+#endif
+#define CODEC_REKEY_MAX_THREADS 64
+#define CODEC_REKEY_CHUNK (1 << 20)
+
+/**
+ * Read-ahead of sequential scans, see sqlite3_codec_readahead: the window
+ * in pages (0 is off), the consecutive loads that start it, its largest
+ * size in bytes and the bytes of pages per decrypting thread
+ */
+#ifndef SQLITE_CODEC_READAHEAD
+#define SQLITE_CODEC_READAHEAD 0
+#endif
+#define CODEC_READAHEAD_TRIGGER 4
+#define CODEC_READAHEAD_MAX_BYTES (1 << 25)
+#define CODEC_READAHEAD_CHUNK (1 << 18)
+
+/**
+ * Encryption of the dirty pages written together (commit, cache spill, WAL
+ * frames) on the sqlite3_codec_rekey_threads threads: the bytes of pages
+ * each thread handles per batch, also the fewest worth starting it for
+ */
+#define CODEC_WRITE_CHUNK (1 << 18)
+
+/**
+ * Alignment of the page buffers of a crypto block, a cache line
+ */
+#define CODEC_BUFFER_ALIGN 64
+
+/**
+ * Incremental rekey progress, kept in a file named after the database with
+ * CODEC_PROGRESS_SUFFIX while a rekey is in progress. It holds two records
+ * of CODEC_PROGRESS_SIZE bytes, at 0 and CODEC_PROGRESS_SLOT, written in
+ * turn and synced so that a torn write leaves the other one: magic (16) |
+ * sequence (4) | watermark (4) | target (4) | witness page (4) | check value
+ * of the write key (8) | hash of the witness page as stored (16) | checksum
+ * of the rest (8), big-endian. A step records its target and the hash of
+ * one of its pages before it commits, so that after a crash that page tells
+ * whether it did.
+ */
+#define CODEC_PROGRESS_SUFFIX "-rekey"
+#define CODEC_PROGRESS_SLOT 512
+#define CODEC_PROGRESS_SIZE 64
+#define CODEC_KEYCHECKSIZE 8
+#define CODEC_PAGEHASHSIZE 16
+
+typedef struct SQLiteCipherContext SQLiteCipherContext;
+
+/**
+ * Whole page encryption/decryption routine of a cipher backend
+ * Returns SQLITE_OK, or SQLITE_CORRUPT if the page fails authentication
+ */
+typedef int (*SQLitePageCipher)(SQLiteCipherContext *ctx, Pgno pgno,
+                                const uint8_t *in, uint8_t *out, int size);
+
+/**
+ * GCM encryption/decryption of a buffer by a cipher backend, returning the
+ * computed tag
+ */
+typedef void (*SQLiteGcmCipher)(SQLiteCipherContext *ctx, int mode,
+                                const uint8_t nonce[GCM_NONCESIZE],
+                                const uint8_t *in, uint8_t *out, int length,
+                                uint8_t tag[GCM_TAGSIZE]);
+
+/**
+ * The cipher context
+ * The backend is resolved once when the context is created, so the page
+ * routines don't have to dispatch again for every block
+ * Contexts are shared by all the pagers of the process using the same key,
+ * see CipherContextNew, and don't change once created but for the nonce
+ * counter.
+ */
+struct SQLiteCipherContext
 {
-    uint8_t orgIV[BLOCKSIZE];
-    mbedtls_aes_context encrypt;
-    mbedtls_aes_context decrypt;
-} SQLiteCipherContext;
+    uint8_t cacheKey[64];         /* Keyed digest of the pass phrase */
+    int refs;                     /* References, under the key cache mutex */
+    SQLiteCipherContext *next;    /* Next context of the key cache */
+    int format;                   /* CODEC_FORMAT_* */
+    uint8_t keyMaterial[64];      /* Derived from the pass phrase */
+    uint8_t orgIV[BLOCKSIZE];     /* CBC: IV of every page */
+    mbedtls_aes_context encrypt;  /* Data key, encryption schedule */
+    mbedtls_aes_context decrypt;  /* Data key, decryption schedule */
+    mbedtls_aes_context tweak;    /* XTS: tweak key */
+    uint8_t gcmH[BLOCKSIZE];      /* GCM: hash key */
+    uint8_t gcmHTable[128];       /* GCM: hash key powers for AES-NI */
+    uint64_t nonceCounter;        /* GCM: next nonce, randomly seeded */
+    SQLitePageCipher encryptPage; /* Backend page encryption */
+    SQLitePageCipher decryptPage; /* Backend page decryption */
+    SQLiteGcmCipher gcmCrypt;     /* GCM: backend buffer encryption */
+};
 
 /**
- * Data encryption
- * @param ctx
- * @param in
- * @param out
- * @param size
+ * XTS data unit of a page: the page number, little-endian
+ * @param pgno
+ * @param unit
+ */
+static void XtsDataUnit(Pgno pgno, uint8_t unit[BLOCKSIZE])
+{
+    memset(unit, 0, BLOCKSIZE);
+    unit[0] = (uint8_t)(pgno);
+    unit[1] = (uint8_t)(pgno >> 8);
+    unit[2] = (uint8_t)(pgno >> 16);
+    unit[3] = (uint8_t)(pgno >> 24);
+}
+
+#if defined(MBEDTLS_AESNI_C) && defined(MBEDTLS_HAVE_X86_64)
+/**
+ * AES-NI backend: CBC page encryption
  */
-void SQLiteEncrypt(SQLiteCipherContext *ctx, const char *in, char *out,
-                   int size)
+static int AesniEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                            const uint8_t *in, uint8_t *out, int size)
 {
     uint8_t iv[BLOCKSIZE];
     memcpy(iv, ctx->orgIV, BLOCKSIZE);
-    mbedtls_aes_crypt_cbc(&ctx->encrypt, 1, size, iv, in, out);
+    mbedtls_aesni_cbc_encrypt(&ctx->encrypt, size, iv, in, out);
+    return SQLITE_OK;
 }
 
 /**
- * Data decryption
- * @param ctx
- * @param in
- * @param out
- * @param size
+ * AES-NI backend: CBC page decryption
  */
-void SQLiteDecrypt(SQLiteCipherContext *ctx, const char *in, char *out,
-                   int size)
+static int AesniDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                            const uint8_t *in, uint8_t *out, int size)
 {
     uint8_t iv[BLOCKSIZE];
     memcpy(iv, ctx->orgIV, BLOCKSIZE);
-    mbedtls_aes_crypt_cbc(&ctx->decrypt, 0, size, iv, in, out);
+    mbedtls_aesni_cbc_decrypt(&ctx->decrypt, size, iv, in, out);
+    return SQLITE_OK;
 }
 
 /**
- * Crypto block associating with each sqlite Pager
+ * AES-NI backend: XTS page encryption
  */
-typedef struct
+static int AesniXtsEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                               const uint8_t *in, uint8_t *out, int size)
 {
-    Pager *pager;                  /* Pager this crypto block belongs to */
-    int32_t pageSize;              /* Size of pages */
-    SQLiteCipherContext *readCtx;  /* CipherContext for reading */
-    SQLiteCipherContext *writeCtx; /* CipherContext for writing */
-    uint8_t *cryptBuffer; /* Buffer for encrypted and/or decrypted data */
-} CodecCryptBlock;
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_aesni_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_aesni_crypt_xts(&ctx->encrypt, MBEDTLS_AES_ENCRYPT, size, tweak,
+                            in, out);
+    return SQLITE_OK;
+}
 
 /**
- * Create new cipher context
- * Key and IV are derived from the pass phrase using SHA256
- * The context should be freed with sqlite3_free when done
- * @param passPhrase
- * @param length
- * @return
+ * AES-NI backend: XTS page decryption
  */
-SQLiteCipherContext *CipherContextNew(const uint8_t *passphrase, int length)
+static int AesniXtsDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                               const uint8_t *in, uint8_t *out, int size)
 {
-    static char salt[] = "ab$0lutelydistingu1sh";
-    uint8_t ivkey[64];
-    if (passphrase == NULL || length <= 0) {
-        return NULL;
-    }
-    SQLiteCipherContext *ctx =
-        (SQLiteCipherContext *)sqlite3_malloc(sizeof(SQLiteCipherContext));
-    if (ctx == NULL) {
-        return NULL;
-    }
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_aesni_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_aesni_crypt_xts(&ctx->decrypt, MBEDTLS_AES_DECRYPT, size, tweak,
+                            in, out);
+    return SQLITE_OK;
+}
+#endif
 
-    mbedtls_sha512_context hashCtx;
-    mbedtls_sha512_init(&hashCtx);
-    mbedtls_sha512_starts(&hashCtx, 0);
-    mbedtls_sha512_update(&hashCtx, passphrase, length);
-    mbedtls_sha512_update(&hashCtx, salt, strlen(salt));
-    mbedtls_sha512_finish(&hashCtx, ivkey);
+#if defined(MBEDTLS_VAES_C) && defined(MBEDTLS_HAVE_X86_64)
+/**
+ * VAES backend: CBC page decryption
+ * (CBC encryption is serial and stays on AES-NI)
+ */
+static int VaesDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                           const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t iv[BLOCKSIZE];
+    memcpy(iv, ctx->orgIV, BLOCKSIZE);
+    mbedtls_vaes_cbc_decrypt(&ctx->decrypt, size, iv, in, out);
+    return SQLITE_OK;
+}
 
-    mbedtls_aes_init(&ctx->encrypt);
-    mbedtls_aes_setkey_enc(&ctx->encrypt, ivkey + BLOCKSIZE, BLOCKSIZE << 3);
-    mbedtls_aes_init(&ctx->decrypt);
-    mbedtls_aes_setkey_dec(&ctx->decrypt, ivkey + BLOCKSIZE, BLOCKSIZE << 3);
+/**
+ * VAES backend: XTS page encryption
+ */
+static int VaesXtsEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                              const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_aesni_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_vaes_crypt_xts(&ctx->encrypt, MBEDTLS_AES_ENCRYPT, size, tweak,
+                           in, out);
+    return SQLITE_OK;
+}
 
-    memcpy(ctx->orgIV, ivkey, BLOCKSIZE);
+/**
+ * VAES backend: XTS page decryption
+ */
+static int VaesXtsDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                              const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_aesni_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_vaes_crypt_xts(&ctx->decrypt, MBEDTLS_AES_DECRYPT, size, tweak,
+                           in, out);
+    return SQLITE_OK;
+}
+#endif
 
-    return ctx;
+#if defined(MBEDTLS_VPAES_C)
+/**
+ * Vector permute backend: CBC page encryption
+ */
+static int VpaesEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                            const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t iv[BLOCKSIZE];
+    memcpy(iv, ctx->orgIV, BLOCKSIZE);
+    mbedtls_vpaes_cbc_encrypt(&ctx->encrypt, size, iv, in, out);
+    return SQLITE_OK;
 }
 
 /**
- * Duplicate a cipher context
- * @param org
- * @return
+ * Vector permute backend: CBC page decryption
  */
-SQLiteCipherContext *CipherContextClone(SQLiteCipherContext *org)
+static int VpaesDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                            const uint8_t *in, uint8_t *out, int size)
 {
-    SQLiteCipherContext *ctx =
-        (SQLiteCipherContext *)sqlite3_malloc(sizeof(SQLiteCipherContext));
-    if (ctx != NULL) {
-        memcpy(ctx, org, sizeof(SQLiteCipherContext));
-    }
-    return ctx;
+    uint8_t iv[BLOCKSIZE];
+    memcpy(iv, ctx->orgIV, BLOCKSIZE);
+    mbedtls_vpaes_cbc_decrypt(&ctx->decrypt, size, iv, in, out);
+    return SQLITE_OK;
 }
 
 /**
- * Create or update existing crypto block
- * @param ctx cipher context to be used
- * @param pager sqlite Pager to be associated with
- * @param pageSize current page size (to be updated if changed)
- * @param existed existing crypt block to be updated if any
- * @return
+ * Vector permute backend: XTS page encryption
  */
-CodecCryptBlock *CreateCodeCryptBlock(SQLiteCipherContext *ctx, Pager *pager,
-                                      int32_t pageSize,
-                                      CodecCryptBlock *existing)
+static int VpaesXtsEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                               const uint8_t *in, uint8_t *out, int size)
 {
-    CodecCryptBlock *block = existing;
-    if (existing == NULL) {
-        block = (CodecCryptBlock *)sqlite3_malloc(sizeof(CodecCryptBlock));
-        if (block == NULL) {
-            return NULL;
-        }
-        block->readCtx = ctx;
-        block->writeCtx = ctx;
-        block->cryptBuffer = NULL;
-        block->pageSize = 0;
-    }
-    if (pageSize == -1) {
-        pageSize = pager->pageSize;
-    }
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_vpaes_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_vpaes_crypt_xts(&ctx->encrypt, MBEDTLS_AES_ENCRYPT, size, tweak,
+                            in, out);
+    return SQLITE_OK;
+}
 
-    block->pager = pager;
-    if (block->pageSize != pageSize) {
-        block->pageSize = pageSize;
-        if (block->cryptBuffer) {
-            sqlite3_free(block->cryptBuffer);
-        }
-        block->cryptBuffer = sqlite3_malloc(pageSize);
-        if (block->cryptBuffer == NULL) {
-            return NULL;
-        }
-    }
-    return block;
+/**
+ * Vector permute backend: XTS page decryption
+ */
+static int VpaesXtsDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                               const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_vpaes_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_vpaes_crypt_xts(&ctx->decrypt, MBEDTLS_AES_DECRYPT, size, tweak,
+                            in, out);
+    return SQLITE_OK;
 }
+#endif
 
+#if defined(MBEDTLS_ARMV8CE_C)
 /**
- * Destroy the crypto block created with CreateCodecCryptBlock
- * @param block
+ * ARMv8 Crypto Extensions backend: CBC page encryption
  */
-void FreeCodecCryptBlock(CodecCryptBlock *block)
+static int Armv8ceEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                              const uint8_t *in, uint8_t *out, int size)
 {
-    if (block->cryptBuffer) {
-        sqlite3_free(block->cryptBuffer);
-        block->cryptBuffer = NULL;
-    }
+    uint8_t iv[BLOCKSIZE];
+    memcpy(iv, ctx->orgIV, BLOCKSIZE);
+    mbedtls_armv8ce_cbc_encrypt(&ctx->encrypt, size, iv, in, out);
+    return SQLITE_OK;
+}
 
-    /* Destroy the read key if there is one */
-    if (block->readCtx) {
-        sqlite3_free(block->readCtx);
-    }
-    if (block->writeCtx != NULL && block->writeCtx != block->readCtx) {
-        sqlite3_free(block->writeCtx);
-    }
-    block->readCtx = NULL;
-    block->writeCtx = NULL;
+/**
+ * ARMv8 Crypto Extensions backend: CBC page decryption
+ */
+static int Armv8ceDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                              const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t iv[BLOCKSIZE];
+    memcpy(iv, ctx->orgIV, BLOCKSIZE);
+    mbedtls_armv8ce_cbc_decrypt(&ctx->decrypt, size, iv, in, out);
+    return SQLITE_OK;
+}
 
-    sqlite3_free(block);
+/**
+ * ARMv8 Crypto Extensions backend: XTS page encryption
+ */
+static int Armv8ceXtsEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                                 const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_armv8ce_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_armv8ce_crypt_xts(&ctx->encrypt, MBEDTLS_AES_ENCRYPT, size, tweak,
+                              in, out);
+    return SQLITE_OK;
 }
 
 /**
- * Destroy crypto block callback
- * @param pv
+ * ARMv8 Crypto Extensions backend: XTS page decryption
  */
-static void SQLite3CodecFreeCallback(void *pv)
+static int Armv8ceXtsDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                                 const uint8_t *in, uint8_t *out, int size)
 {
-    CodecCryptBlock *block = (CodecCryptBlock *)pv;
-    FreeCodecCryptBlock(block);
+    uint8_t tweak[BLOCKSIZE];
+    XtsDataUnit(pgno, tweak);
+    mbedtls_armv8ce_crypt_ecb(&ctx->tweak, MBEDTLS_AES_ENCRYPT, tweak, tweak);
+    mbedtls_armv8ce_crypt_xts(&ctx->decrypt, MBEDTLS_AES_DECRYPT, size, tweak,
+                              in, out);
+    return SQLITE_OK;
 }
+#endif
 
 /**
- * Page size changed callback
- * @param pArg the associated crypto block
- * @param pageSize updated pageSize
- * @param reservedSize
+ * Table based backend: CBC page encryption
+ * Calls the block functions of aes.c directly, bypassing the per-block
+ * dispatch of mbedtls_aes_crypt_ecb
  */
-void SQLite3CodecSizeChangedCallback(void *pArg, int pageSize, int reservedSize)
+static int TableEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                            const uint8_t *in, uint8_t *out, int size)
 {
-    CodecCryptBlock *block = (CodecCryptBlock *)pArg;
-    if (block->pageSize != pageSize) {
-        block->pageSize = pageSize;
+    const uint8_t *chain = ctx->orgIV;
+    int i, n;
+
+    for (n = 0; n < size; n += BLOCKSIZE) {
+        for (i = 0; i < BLOCKSIZE; i++) {
+            out[n + i] = in[n + i] ^ chain[i];
+        }
+        mbedtls_aes_encrypt(&ctx->encrypt, out + n, out + n);
+        chain = out + n;
     }
+    return SQLITE_OK;
 }
 
 /**
- * Encrypting or decrypting a page callback
- * to be called by CODEC1 and CODEC2 in pager.c
- *
- * Note:
- * Decrypting is called via CODEC1 and doesn't care about returned value
- * (therefore need to replace input data)
- * Encrypting is called via CODEC2, taking returned value as buffer data to
- * write (DO NOT replace input data)
- * @param pArg the associated crypto block
- * @param data data to be encrypted/decrypted
- * @param nPageNum page number
- * @param nMode
- * @return
+ * Table based backend: CBC page decryption (in and out may be the same
+ * buffer)
  */
-void *SQLite3CodecCallback(void *pArg, void *data, Pgno nPageNum, int nMode)
+static int TableDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                            const uint8_t *in, uint8_t *out, int size)
 {
-    CodecCryptBlock *block = (CodecCryptBlock *)pArg;
-    if (!block)
-        return data;
-    char *retVal = data;
-    int32_t pageSize = block->pageSize;
+    uint8_t chain[BLOCKSIZE];
+    uint8_t next[BLOCKSIZE];
+    int i, n;
 
-    switch (nMode) {
-    case 0: /* Undo a "case 7" journal file encryption */
-    case 2: /* Reload a page */
-    case 3: /* Load a page */
-        if (!block->readCtx)
-            break;
-        SQLiteDecrypt(block->readCtx, data, data, pageSize);
-        break;
-    case 6: /* Encrypt a page for the main database file */
-        if (!block->writeCtx)
-            break;
-        SQLiteEncrypt(block->writeCtx, data, block->cryptBuffer, pageSize);
-        retVal = block->cryptBuffer;
-        break;
-    case 7: /* Encrypt a page for the journal file */
-        /* Under normal circumstances, the readkey is the same as the writekey.
-        However,
-        when the database is being rekeyed, the readkey is not the same as the
-        writekey.
-        The rollback journal must be written using the original key for the
-        database file because it is, by nature, a rollback journal.
-        Therefore, for case 7, when the rollback is being written, always
-        encrypt using
-        the database's readkey, which is guaranteed to be the same key that was
-        used to
-        read the original data.
-        */
-        if (!block->readCtx)
-            break;
-        SQLiteEncrypt(block->readCtx, data, block->cryptBuffer, pageSize);
-        retVal = block->cryptBuffer;
-        break;
+    memcpy(chain, ctx->orgIV, BLOCKSIZE);
+    for (n = 0; n < size; n += BLOCKSIZE) {
+        memcpy(next, in + n, BLOCKSIZE);
+        mbedtls_aes_decrypt(&ctx->decrypt, in + n, out + n);
+        for (i = 0; i < BLOCKSIZE; i++) {
+            out[n + i] ^= chain[i];
+        }
+        memcpy(chain, next, BLOCKSIZE);
     }
+    return SQLITE_OK;
+}
 
-    return retVal;
+/**
+ * Multiply an XTS tweak by alpha in GF(2^128)
+ * @param t
+ */
+static void XtsNextTweak(uint8_t t[BLOCKSIZE])
+{
+    uint8_t carry = t[BLOCKSIZE - 1] >> 7;
+    int i;
+
+    for (i = BLOCKSIZE - 1; i > 0; i--) {
+        t[i] = (uint8_t)((t[i] << 1) | (t[i - 1] >> 7));
+    }
+    t[0] = (uint8_t)((t[0] << 1) ^ (0x87 & -carry));
 }
 
 /**
- * Called to attach a key to a database
- * in (attach.c)
- * @param db
- * @param nDb
- * @param pKey
- * @param nKeyLen
- * @return
+ * Table based backend: XTS page encryption/decryption
+ * @param ctx
+ * @param mode MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT
+ * @param pgno
+ * @param in
+ * @param out
+ * @param size
  */
-int sqlite3CodecAttach(sqlite3 *db, int nDb, const void *pKey, int nKeyLen)
+static void TableXtsCryptPage(SQLiteCipherContext *ctx, int mode, Pgno pgno,
+                              const uint8_t *in, uint8_t *out, int size)
 {
-    int rc = SQLITE_ERROR;
-    SQLiteCipherContext *ctx = NULL;
+    uint8_t tweak[BLOCKSIZE];
+    uint8_t buf[BLOCKSIZE];
+    int i, n;
 
-    /* No key specified, could mean either use the main db's encryption or no
-     * encryption */
-    if (pKey == NULL || nKeyLen == 0) {
-        if (nDb == 0) {
-            /* Main database, no key specified so not encrypted */
-            return SQLITE_OK;
+    XtsDataUnit(pgno, tweak);
+    mbedtls_aes_encrypt(&ctx->tweak, tweak, tweak);
+    for (n = 0; n < size; n += BLOCKSIZE) {
+        for (i = 0; i < BLOCKSIZE; i++) {
+            buf[i] = in[n + i] ^ tweak[i];
+        }
+        if (mode == MBEDTLS_AES_ENCRYPT) {
+            mbedtls_aes_encrypt(&ctx->encrypt, buf, buf);
         } else {
-            /*
-             * Attached database, use the main database's key
-             * Get the encryption block for the main database and attempt to
-             * duplicate the key
-             * for use by the attached database
-             */
-            Pager *pager = sqlite3BtreePager(db->aDb[0].pBt);
+            mbedtls_aes_decrypt(&ctx->decrypt, buf, buf);
+        }
+        for (i = 0; i < BLOCKSIZE; i++) {
+            out[n + i] = buf[i] ^ tweak[i];
+        }
+        XtsNextTweak(tweak);
+    }
+}
+
+static int TableXtsEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                               const uint8_t *in, uint8_t *out, int size)
+{
+    TableXtsCryptPage(ctx, MBEDTLS_AES_ENCRYPT, pgno, in, out, size);
+    return SQLITE_OK;
+}
+
+static int TableXtsDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                               const uint8_t *in, uint8_t *out, int size)
+{
+    TableXtsCryptPage(ctx, MBEDTLS_AES_DECRYPT, pgno, in, out, size);
+    return SQLITE_OK;
+}
+
+#if defined(MBEDTLS_GCM_C) && defined(MBEDTLS_AESNI_C) &&                     \
+    defined(MBEDTLS_HAVE_X86_64)
+/**
+ * AES-NI backend: GCM, CTR and PCLMULQDQ GHASH fused in one pass
+ */
+static void AesniGcmCrypt(SQLiteCipherContext *ctx, int mode,
+                          const uint8_t nonce[GCM_NONCESIZE],
+                          const uint8_t *in, uint8_t *out, int length,
+                          uint8_t tag[GCM_TAGSIZE])
+{
+    mbedtls_aesni_gcm_crypt(&ctx->encrypt, ctx->gcmHTable, mode, length,
+                            nonce, NULL, 0, in, out, tag);
+}
+#endif
+
+/**
+ * Multiply x by the hash key in GF(2^128), bit by bit without branching
+ * on secret data (NIST SP 800-38D algorithm 1)
+ * @param x
+ * @param h
+ */
+static void GcmMult(uint8_t x[BLOCKSIZE], const uint8_t h[BLOCKSIZE])
+{
+    uint8_t z[BLOCKSIZE];
+    uint8_t v[BLOCKSIZE];
+    uint8_t mask, lsb;
+    int i, j;
+
+    memset(z, 0, BLOCKSIZE);
+    memcpy(v, h, BLOCKSIZE);
+    for (i = 0; i < 128; i++) {
+        mask = (uint8_t)-((x[i >> 3] >> (7 - (i & 7))) & 1);
+        for (j = 0; j < BLOCKSIZE; j++) {
+            z[j] ^= v[j] & mask;
+        }
+        lsb = v[BLOCKSIZE - 1] & 1;
+        for (j = BLOCKSIZE - 1; j > 0; j--) {
+            v[j] = (uint8_t)((v[j] >> 1) | (v[j - 1] << 7));
+        }
+        v[0] = (uint8_t)((v[0] >> 1) ^ (0xe1 & -lsb));
+    }
+    memcpy(x, z, BLOCKSIZE);
+}
+
+/**
+ * Single block encryption, for the GCM counter blocks
+ */
+typedef void (*SQLiteBlockCipher)(mbedtls_aes_context *aes,
+                                  const uint8_t in[BLOCKSIZE],
+                                  uint8_t out[BLOCKSIZE]);
+
+/**
+ * GCM of the backends without a fused kernel: one counter block at a time
+ * through block, then the portable GHASH
+ */
+static void GcmCryptBlocks(SQLiteCipherContext *ctx, SQLiteBlockCipher block,
+                           int mode, const uint8_t nonce[GCM_NONCESIZE],
+                           const uint8_t *in, uint8_t *out, int length,
+                           uint8_t tag[GCM_TAGSIZE])
+{
+    uint8_t counter[BLOCKSIZE];
+    uint8_t stream[BLOCKSIZE];
+    uint8_t hash[BLOCKSIZE];
+    uint32_t n;
+    int i, j, len;
+
+    memset(hash, 0, BLOCKSIZE);
+    memcpy(counter, nonce, GCM_NONCESIZE);
+    for (n = 2, i = 0; i < length; i += BLOCKSIZE, n++) {
+        len = (length - i < BLOCKSIZE) ? length - i : BLOCKSIZE;
+        counter[12] = (uint8_t)(n >> 24);
+        counter[13] = (uint8_t)(n >> 16);
+        counter[14] = (uint8_t)(n >> 8);
+        counter[15] = (uint8_t)(n);
+        block(&ctx->encrypt, counter, stream);
+        for (j = 0; j < len; j++) {
+            uint8_t c = (mode == MBEDTLS_AES_ENCRYPT) ? in[i + j] ^ stream[j]
+                                                      : in[i + j];
+            out[i + j] = in[i + j] ^ stream[j];
+            hash[j] ^= c;
+        }
+        GcmMult(hash, ctx->gcmH);
+    }
+
+    /* Lengths block: no additional data, then the bit length of the text */
+    memset(stream, 0, BLOCKSIZE);
+    stream[12] = (uint8_t)((uint32_t)length >> 21);
+    stream[13] = (uint8_t)((uint32_t)length >> 13);
+    stream[14] = (uint8_t)((uint32_t)length >> 5);
+    stream[15] = (uint8_t)((uint32_t)length << 3);
+    for (j = 0; j < BLOCKSIZE; j++) {
+        hash[j] ^= stream[j];
+    }
+    GcmMult(hash, ctx->gcmH);
+
+    counter[12] = counter[13] = counter[14] = 0;
+    counter[15] = 1;
+    block(&ctx->encrypt, counter, stream);
+    for (j = 0; j < GCM_TAGSIZE; j++) {
+        tag[j] = hash[j] ^ stream[j];
+    }
+}
+
+/**
+ * Table based backend: GCM
+ */
+static void TableGcmCrypt(SQLiteCipherContext *ctx, int mode,
+                          const uint8_t nonce[GCM_NONCESIZE],
+                          const uint8_t *in, uint8_t *out, int length,
+                          uint8_t tag[GCM_TAGSIZE])
+{
+    GcmCryptBlocks(ctx, mbedtls_aes_encrypt, mode, nonce, in, out, length,
+                   tag);
+}
+
+#if defined(MBEDTLS_VPAES_C)
+static void VpaesBlockEncrypt(mbedtls_aes_context *aes,
+                              const uint8_t in[BLOCKSIZE],
+                              uint8_t out[BLOCKSIZE])
+{
+    mbedtls_vpaes_crypt_ecb(aes, MBEDTLS_AES_ENCRYPT, in, out);
+}
+
+/**
+ * Vector permute backend: GCM, constant time like its GHASH
+ */
+static void VpaesGcmCrypt(SQLiteCipherContext *ctx, int mode,
+                          const uint8_t nonce[GCM_NONCESIZE],
+                          const uint8_t *in, uint8_t *out, int length,
+                          uint8_t tag[GCM_TAGSIZE])
+{
+    GcmCryptBlocks(ctx, VpaesBlockEncrypt, mode, nonce, in, out, length, tag);
+}
+#endif
+
+/**
+ * GCM page encryption: the usable part of the page is encrypted and the
+ * trailer filled in with a fresh nonce and the tag
+ */
+static int GcmEncryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                          const uint8_t *in, uint8_t *out, int size)
+{
+    uint8_t *trailer = out + size - GCM_RESERVE;
+    uint8_t *nonce = trailer + GCM_RESERVE - GCM_TAGSIZE - GCM_NONCESIZE;
+    uint64_t counter;
+    int i;
+
+#if defined(__GNUC__)
+    counter = __atomic_fetch_add(&ctx->nonceCounter, 1, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER) && defined(_WIN64)
+    counter = (uint64_t)_InterlockedExchangeAdd64(
+        (volatile __int64 *)&ctx->nonceCounter, 1);
+#else
+    counter = ctx->nonceCounter++;
+#endif
+    memset(trailer, 0, GCM_RESERVE - GCM_TAGSIZE - GCM_NONCESIZE);
+    for (i = 0; i < 4; i++) {
+        nonce[i] = (uint8_t)(pgno >> (8 * i));
+    }
+    for (i = 0; i < 8; i++) {
+        nonce[4 + i] = (uint8_t)(counter >> (8 * i));
+    }
+
+    ctx->gcmCrypt(ctx, MBEDTLS_AES_ENCRYPT, nonce, in, out,
+                  size - GCM_RESERVE, nonce + GCM_NONCESIZE);
+    return SQLITE_OK;
+}
+
+/**
+ * GCM page decryption (in and out may be the same buffer)
+ */
+static int GcmDecryptPage(SQLiteCipherContext *ctx, Pgno pgno,
+                          const uint8_t *in, uint8_t *out, int size)
+{
+    const uint8_t *nonce = in + size - GCM_TAGSIZE - GCM_NONCESIZE;
+    uint8_t stored[GCM_NONCESIZE + GCM_TAGSIZE];
+    uint8_t tag[GCM_TAGSIZE];
+    uint8_t diff = 0;
+    int i;
+
+    memcpy(stored, nonce, sizeof(stored));
+    ctx->gcmCrypt(ctx, MBEDTLS_AES_DECRYPT, stored, in, out,
+                  size - GCM_RESERVE, tag);
+    if (out != in) {
+        memcpy(out + size - GCM_RESERVE, in + size - GCM_RESERVE,
+               GCM_RESERVE);
+    }
+
+    /* The nonce must name this page */
+    for (i = 0; i < 4; i++) {
+        diff |= stored[i] ^ (uint8_t)(pgno >> (8 * i));
+    }
+    for (i = 0; i < GCM_TAGSIZE; i++) {
+        diff |= stored[GCM_NONCESIZE + i] ^ tag[i];
+    }
+    return diff ? SQLITE_CORRUPT : SQLITE_OK;
+}
+
+/**
+ * Page cipher backends, from the most portable one
+ */
+#define CODEC_BACKEND_TABLE 0   /* aes.c lookup tables */
+#define CODEC_BACKEND_VPAES 1   /* SSSE3/NEON vector permute, constant time */
+#define CODEC_BACKEND_ARMV8CE 2 /* ARMv8 AESE/AESD, not for GCM */
+#define CODEC_BACKEND_AESNI 3   /* AES-NI, CLMUL for GCM */
+#define CODEC_BACKEND_VAES 4    /* VAES/AVX-512, not for GCM */
+#define CODEC_BACKEND_COUNT 5
+
+static const char *const codecBackendNames[CODEC_BACKEND_COUNT] = {
+    "table", "vpaes", "armv8ce", "aesni", "vaes"};
+
+/**
+ * Set the page routines of a backend for the context's format
+ * Must agree with the round key layout chosen by mbedtls_aes_setkey_enc/dec
+ * @param ctx
+ * @param backend CODEC_BACKEND_*
+ * @return 0 if the backend isn't built in, isn't supported by the running
+ * CPU or doesn't implement the format (the context is left unchanged)
+ */
+static int CipherContextUseBackend(SQLiteCipherContext *ctx, int backend)
+{
+    int xts = (ctx->format != CODEC_FORMAT_CBC);
+    int gcm = (ctx->format == CODEC_FORMAT_GCM);
+
+    switch (backend) {
+    case CODEC_BACKEND_TABLE:
+        if (gcm) {
+            ctx->gcmCrypt = TableGcmCrypt;
+            break;
+        }
+        ctx->encryptPage = xts ? TableXtsEncryptPage : TableEncryptPage;
+        ctx->decryptPage = xts ? TableXtsDecryptPage : TableDecryptPage;
+        break;
+#if defined(MBEDTLS_VPAES_C)
+    case CODEC_BACKEND_VPAES:
+        if (!mbedtls_vpaes_has_support()) {
+            return 0;
+        }
+        if (gcm) {
+            ctx->gcmCrypt = VpaesGcmCrypt;
+            break;
+        }
+        ctx->encryptPage = xts ? VpaesXtsEncryptPage : VpaesEncryptPage;
+        ctx->decryptPage = xts ? VpaesXtsDecryptPage : VpaesDecryptPage;
+        break;
+#endif
+#if defined(MBEDTLS_ARMV8CE_C)
+    case CODEC_BACKEND_ARMV8CE:
+        if (gcm || !mbedtls_armv8ce_has_support()) {
+            return 0;
+        }
+        ctx->encryptPage = xts ? Armv8ceXtsEncryptPage : Armv8ceEncryptPage;
+        ctx->decryptPage = xts ? Armv8ceXtsDecryptPage : Armv8ceDecryptPage;
+        break;
+#endif
+#if defined(MBEDTLS_AESNI_C) && defined(MBEDTLS_HAVE_X86_64)
+    case CODEC_BACKEND_AESNI:
+        if (!mbedtls_aesni_has_support(MBEDTLS_AESNI_AES)) {
+            return 0;
+        }
+        if (gcm) {
+#if defined(MBEDTLS_GCM_C)
+            if (!mbedtls_aesni_has_support(MBEDTLS_AESNI_CLMUL)) {
+                return 0;
+            }
+            ctx->gcmCrypt = AesniGcmCrypt;
+            break;
+#else
+            return 0;
+#endif
+        }
+        ctx->encryptPage = xts ? AesniXtsEncryptPage : AesniEncryptPage;
+        ctx->decryptPage = xts ? AesniXtsDecryptPage : AesniDecryptPage;
+        break;
+#endif
+#if defined(MBEDTLS_VAES_C) && defined(MBEDTLS_HAVE_X86_64)
+    case CODEC_BACKEND_VAES:
+        if (gcm || !mbedtls_aesni_has_support(MBEDTLS_AESNI_AES) ||
+            !mbedtls_vaes_has_support()) {
+            return 0;
+        }
+        ctx->encryptPage = xts ? VaesXtsEncryptPage : AesniEncryptPage;
+        ctx->decryptPage = xts ? VaesXtsDecryptPage : VaesDecryptPage;
+        break;
+#endif
+    default:
+        return 0;
+    }
+    if (gcm) {
+        ctx->encryptPage = GcmEncryptPage;
+        ctx->decryptPage = GcmDecryptPage;
+    }
+    return 1;
+}
+
+/**
+ * Resolve the page routines for the running CPU and the context's format:
+ * the fastest backend that supports them
+ * @param ctx
+ */
+static void CipherContextSelectBackend(SQLiteCipherContext *ctx)
+{
+    int backend = CODEC_BACKEND_COUNT;
+
+    while (--backend > CODEC_BACKEND_TABLE &&
+           !CipherContextUseBackend(ctx, backend)) {
+    }
+    if (backend == CODEC_BACKEND_TABLE) {
+        CipherContextUseBackend(ctx, CODEC_BACKEND_TABLE);
+    }
+}
+
+/**
+ * Switch the page cipher format of a context, setting up the key schedules
+ * from the derived key material:
+ * CBC and XTS:  IV (16) | data key (16) | tweak key (16) | unused (16)
+ * XTS256:       data key (32) | tweak key (32)
+ * GCM:          data key (32) | unused (32)
+ * @param ctx
+ * @param format CODEC_FORMAT_*
+ */
+static void CipherContextSetFormat(SQLiteCipherContext *ctx, int format)
+{
+    const uint8_t *key = ctx->keyMaterial + BLOCKSIZE;
+    const uint8_t *tweakKey = ctx->keyMaterial + 2 * BLOCKSIZE;
+    unsigned int keyBits = BLOCKSIZE << 3;
+
+    if (format == CODEC_FORMAT_XTS256 || format == CODEC_FORMAT_GCM) {
+        key = ctx->keyMaterial;
+        keyBits = 256;
+    }
+
+    mbedtls_aes_init(&ctx->encrypt);
+    mbedtls_aes_setkey_enc(&ctx->encrypt, key, keyBits);
+    mbedtls_aes_init(&ctx->decrypt);
+    mbedtls_aes_setkey_dec(&ctx->decrypt, key, keyBits);
+    mbedtls_aes_init(&ctx->tweak);
+    mbedtls_aes_setkey_enc(&ctx->tweak, tweakKey, keyBits);
+    memcpy(ctx->orgIV, ctx->keyMaterial, BLOCKSIZE);
+
+    if (format == CODEC_FORMAT_GCM) {
+        memset(ctx->gcmH, 0, BLOCKSIZE);
+        mbedtls_aes_crypt_ecb(&ctx->encrypt, MBEDTLS_AES_ENCRYPT, ctx->gcmH,
+                              ctx->gcmH);
+#if defined(MBEDTLS_GCM_C) && defined(MBEDTLS_AESNI_C) &&                     \
+    defined(MBEDTLS_HAVE_X86_64)
+        if (mbedtls_aesni_has_support(MBEDTLS_AESNI_AES) &&
+            mbedtls_aesni_has_support(MBEDTLS_AESNI_CLMUL)) {
+            mbedtls_aesni_gcm_setkey(&ctx->encrypt, ctx->gcmHTable);
+        }
+#endif
+    }
+
+    ctx->format = format;
+    CipherContextSelectBackend(ctx);
+}
+
+/**
+ * Reserved bytes per page needed by the context's format
+ * @param ctx
+ * @return
+ */
+static int CipherContextReserve(const SQLiteCipherContext *ctx)
+{
+    return (ctx->format == CODEC_FORMAT_GCM) ? GCM_RESERVE : 0;
+}
+
+/**
+ * Data encryption
+ * @param ctx
+ * @param pgno page number (XTS tweak, GCM nonce)
+ * @param in
+ * @param out may be in
+ * @param size
+ * @return SQLITE_OK
+ */
+int SQLiteEncrypt(SQLiteCipherContext *ctx, Pgno pgno, const char *in,
+                  char *out, int size)
+{
+    return ctx->encryptPage(ctx, pgno, (const uint8_t *)in, (uint8_t *)out,
+                            size);
+}
+
+/**
+ * Data decryption
+ * @param ctx
+ * @param pgno page number (XTS tweak, GCM nonce)
+ * @param in
+ * @param out
+ * @param size
+ * @return SQLITE_OK, or SQLITE_CORRUPT if the page fails authentication
+ */
+int SQLiteDecrypt(SQLiteCipherContext *ctx, Pgno pgno, const char *in,
+                  char *out, int size)
+{
+    return ctx->decryptPage(ctx, pgno, (const uint8_t *)in, (uint8_t *)out,
+                            size);
+}
+
+/**
+ * Whether decrypted page 1 is acceptable: it must authenticate and start
+ * with the SQLite header
+ * @param data decrypted page 1
+ * @param rc result of the decryption
+ * @return
+ */
+static int FirstPageMatches(const char *data, int rc)
+{
+    return rc == SQLITE_OK &&
+           memcmp(data, SQLITE_FILE_HEADER, sizeof(SQLITE_FILE_HEADER)) == 0;
+}
+
+/**
+ * GCM keeps the nonce at the end of the page, so page 1 of a database whose
+ * page size differs from the one the pager assumes (sqlite can't read it
+ * from the encrypted header) doesn't decrypt at all. It is read from the
+ * file again at each page size instead; sqlite then reads page 1 once more
+ * at the size found in the header, and that read authenticates normally.
+ * @param ctx GCM context
+ * @param fd database file
+ * @param data receives the start of page 1
+ * @param size
+ * @return whether page 1 was found
+ */
+static int GcmReadFirstPage(SQLiteCipherContext *ctx, sqlite3_file *fd,
+                            char *data, int size)
+{
+    char *page;
+    int pageSize, found = 0;
+
+    if (fd == NULL || fd->pMethods == NULL) {
+        return 0;
+    }
+    page = (char *)sqlite3_malloc(SQLITE_MAX_PAGE_SIZE);
+    if (page == NULL) {
+        return 0;
+    }
+    for (pageSize = 512; pageSize <= SQLITE_MAX_PAGE_SIZE && !found;
+         pageSize <<= 1) {
+        if (pageSize == size) {
+            continue;
+        }
+        if (sqlite3OsRead(fd, page, pageSize, 0) != SQLITE_OK) {
+            break; /* File is shorter, so are larger pages */
+        }
+        if (FirstPageMatches(page,
+                             SQLiteDecrypt(ctx, 1, page, page, pageSize))) {
+            memcpy(data, page, pageSize < size ? pageSize : size);
+            found = 1;
+        }
+    }
+    sqlite3_free(page);
+    return found;
+}
+
+/**
+ * Decrypt page 1 with the context's current format
+ * @param ctx
+ * @param fd database file, may be NULL
+ * @param in
+ * @param data receives the decrypted page
+ * @param size
+ * @return whether it matched
+ */
+static int TryFirstPage(SQLiteCipherContext *ctx, sqlite3_file *fd,
+                        const char *in, char *data, int size)
+{
+    if (FirstPageMatches(data, SQLiteDecrypt(ctx, 1, in, data, size))) {
+        return 1;
+    }
+    return ctx->format == CODEC_FORMAT_GCM &&
+           GcmReadFirstPage(ctx, fd, data, size);
+}
+
+static SQLiteCipherContext *CipherContextWithFormat(SQLiteCipherContext *ctx,
+                                                    int format);
+void CipherContextRelease(SQLiteCipherContext *ctx);
+
+/**
+ * Decrypt page 1 in place, recognising the cipher format from the database
+ * header. If the context's format doesn't yield the SQLite header the other
+ * formats are tried, and the context of the one that does is returned, to
+ * be used for the database from then on, so databases written in any
+ * supported format keep working.
+ * @param ctx
+ * @param fd database file, may be NULL
+ * @param data page 1 as read from the file
+ * @param scratch page sized buffer
+ * @param size
+ * @return a new reference to the context of the format found, NULL if it
+ * is the format of ctx or none matches (wrong key, sqlite will report it)
+ */
+static SQLiteCipherContext *DecryptFirstPage(SQLiteCipherContext *ctx,
+                                             sqlite3_file *fd, char *data,
+                                             char *scratch, int size)
+{
+    static const int formats[] = {CODEC_FORMAT_XTS, CODEC_FORMAT_XTS256,
+                                  CODEC_FORMAT_GCM, CODEC_FORMAT_CBC};
+    SQLiteCipherContext *other;
+    int i;
+
+    memcpy(scratch, data, size);
+    if (TryFirstPage(ctx, fd, scratch, data, size)) {
+        return NULL;
+    }
+
+    for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+        if (formats[i] == ctx->format) {
+            continue;
+        }
+        other = CipherContextWithFormat(ctx, formats[i]);
+        if (other == NULL) {
+            break;
+        }
+        if (TryFirstPage(other, fd, scratch, data, size)) {
+            return other;
+        }
+        CipherContextRelease(other);
+    }
+    return NULL;
+}
+
+/**
+ * Pages being rekeyed together
+ * While a batch is set on the crypto block, pages of it loaded from the file
+ * are left encrypted, so their journal copy is the ciphertext as read. The
+ * workers then decrypt them in place and encrypt them with the write key
+ * into output, which is what gets written back.
+ */
+typedef struct
+{
+    Pgno first;       /* First page of the batch */
+    int count;        /* Number of pages */
+    int capacity;     /* Allocated number of pages */
+    int ready;        /* output holds the pages encrypted with the writeCtx */
+    DbPage **pages;   /* Per page: reference held, NULL if skipped */
+    uint8_t **data;   /* Per page: pager buffer */
+    uint8_t *loaded;  /* Per page: still holds the ciphertext from the file */
+    uint8_t *output;  /* capacity * pageSize bytes */
+} CodecRekeyBatch;
+
+/**
+ * Pages read and decrypted ahead of a sequential scan
+ * The pager's reads of the database file are served from the window
+ * instead of the file, so it must hold what the file does: it is dropped
+ * on writes and truncation of the file, and as the read transaction ends
+ * (unlocking the file, or the WAL read lock) since other connections may
+ * write it then. Pages the pager finds in the WAL don't come through it.
+ */
+typedef struct
+{
+    Pgno next;        /* Page a sequential scan loads next */
+    int run;          /* Consecutive loads up to next */
+    Pgno first;       /* First page of the window */
+    int count;        /* Pages in the window, 0 if none */
+    int capacity;     /* Allocated number of pages */
+    int32_t pageSize; /* Page size of the buffer */
+    uint8_t *plain;   /* capacity * pageSize bytes: pages decrypted */
+    uint8_t *ok;      /* Per page: decrypted (and authenticated) */
+} CodecReadAhead;
+
+/**
+ * Dirty pages encrypted ahead of their write
+ * The pager writes a list of dirty pages (linked by PgHdr.pDirty) calling
+ * the codec for each in list order. At a page followed by enough others
+ * in the list, they are encrypted together on several threads, each into
+ * its own output slot, and the calls for them return their slot. A page is
+ * only served from the batch if it still is the plaintext that was
+ * encrypted, under the same key, as a failed write leaves the rest of the
+ * batch behind.
+ */
+typedef struct
+{
+    int count;                 /* Pages in the batch, 0 if none */
+    int next;                  /* Index of the page written next */
+    int capacity;              /* Allocated number of pages */
+    int32_t pageSize;          /* Page size of the buffers */
+    SQLiteCipherContext *ctx;  /* Key of the batch, a reference */
+    PgHdr **pages;             /* Per page: pager page, while encrypting */
+    Pgno *pgnos;               /* Per page: page number */
+    uint8_t *plain;            /* capacity * pageSize bytes: plaintext */
+    uint8_t *output;           /* capacity * pageSize bytes: ciphertext */
+} CodecWriteBatch;
+
+/**
+ * Page buffers of a crypto block, in one allocation sized by the page size
+ * callback: the page encrypted for the database file and the one encrypted
+ * for the journal are returned to the pager in separate buffers, so that
+ * neither overwrites the other while the pager still writes it.
+ */
+typedef struct
+{
+    void *arena;      /* Allocation holding the buffers */
+    uint8_t *main;    /* Page encrypted for the database file, aligned */
+    uint8_t *journal; /* Page encrypted for the journal, aligned */
+    int32_t size;     /* Page size the buffers are for, 0 if none */
+} CodecBuffers;
+
+/**
+ * Reads of the database file by the pager
+ * The file's methods are swapped for a copy whose xRead decrypts the pages
+ * the pager loads under the single key straight into their buffer, so that
+ * a page failing authentication fails the read with SQLITE_CORRUPT (a codec
+ * call can only fail with SQLITE_NOMEM). While sqlite3_codec_mmap is on,
+ * it reads from the mapping instead of calling read: the pager doesn't use
+ * the mapping of an encrypted database. The codec call loading that page
+ * then has nothing left to do. Its other methods keep the read-ahead
+ * window in step with the file. The WAL file gets a copy of its own, whose
+ * xRead does the same for the frames the pager loads (pgno and data are
+ * those of the database file's).
+ */
+typedef struct
+{
+    sqlite3_io_methods methods;       /* The file's methods while installed */
+    const sqlite3_io_methods *orig;   /* The VFS's methods */
+    Pgno pgno;                        /* Page decrypted by the last read */
+    void *data;                       /* Its buffer, NULL if none */
+    int bypass;                       /* Reads of the codec, just copied */
+} CodecFileMethods;
+
+/**
+ * Crypto block associating with each sqlite Pager
+ */
+typedef struct
+{
+    Pager *pager;                  /* Pager this crypto block belongs to */
+    int32_t pageSize;              /* Size of pages */
+    int32_t reserve;               /* Reserved bytes at the end of pages */
+    SQLiteCipherContext *readCtx;  /* CipherContext for reading */
+    SQLiteCipherContext *writeCtx; /* CipherContext for writing */
+    CodecBuffers buffers;          /* Encrypted page output */
+    CodecRekeyBatch *batch; /* Rekey batch in progress, if any */
+    /* Incremental rekey: pages from the watermark on are stored under the
+     * writeCtx, the ones before it under the readCtx. Pages from the target
+     * on are written under the writeCtx (the target is below the watermark
+     * while a step is in progress). */
+    Pgno rekeyWatermark; /* 0 if no incremental rekey is in progress */
+    Pgno rekeyTarget;
+    int rekeyKeyed;      /* The writeCtx is known */
+    int rekeySession;    /* Between sqlite3_rekey_start and _finish */
+    int rekeyThreads;    /* Threads of a rekey, 0 for the process setting */
+    uint8_t rekeyCheck[CODEC_KEYCHECKSIZE]; /* Check value of the write key */
+    u32 rekeySequence; /* Of the last progress record written */
+    sqlite3_codec_stats stats; /* Page cipher statistics */
+    CodecReadAhead readAhead;  /* Sequential scan read-ahead */
+    CodecWriteBatch writeBatch; /* Dirty pages encrypted ahead */
+    CodecFileMethods file;      /* Page reads of the database file */
+    CodecFileMethods wal;       /* Frame reads of the WAL file */
+    /* GCM context page 1 last authenticated under, NULL if none; not a
+     * reference, cleared as the block drops it */
+    SQLiteCipherContext *headerCtx;
+} CodecCryptBlock;
+
+/**
+ * Index of a page in the rekey batch in progress, -1 if it isn't in one
+ * @param block
+ * @param pgno
+ * @return
+ */
+static int CodecBatchIndex(CodecCryptBlock *block, Pgno pgno)
+{
+    CodecRekeyBatch *batch = block->batch;
+    if (batch == NULL || pgno < batch->first ||
+        pgno >= batch->first + (Pgno)batch->count) {
+        return -1;
+    }
+    return (int)(pgno - batch->first);
+}
+
+/**
+ * Key prefixes choosing the format of new databases, as in
+ * "aes256-gcm:passphrase" (the same convention as SEE), while
+ * sqlite3_codec_key_forms is on. The prefix is not part of the pass phrase,
+ * and existing databases are always read in their own format.
+ * What follows the prefix is one of, see CodecDeriveKey:
+ * - x'<hex>': a raw key of 32 or 64 bytes, not derived from anything
+ * - pbkdf2:<iterations>:passphrase: the key is derived with
+ *   PBKDF2-HMAC-SHA512, as slow as wanted
+ * - passphrase: the key is a salted SHA512 of it
+ */
+static const struct
+{
+    const char *prefix;
+    int format;
+} keyPrefixes[] = {
+    {"aes128-cbc:", CODEC_FORMAT_CBC},
+    {"aes128-xts:", CODEC_FORMAT_XTS},
+    {"aes256-xts:", CODEC_FORMAT_XTS256},
+    {"aes256-gcm:", CODEC_FORMAT_GCM},
+};
+
+/**
+ * Cipher contexts are cached for the whole process, one per pass phrase and
+ * format, so that connections opened under the same key share the key
+ * schedules instead of deriving them again. A context is found by an HMAC
+ * of the pass phrase under a random secret of the process, which doesn't
+ * need the key derivation. It is wiped and freed with its last reference.
+ * The GCM nonce counter is shared as well, so files under the same key
+ * never repeat a nonce.
+ */
+static SQLiteCipherContext *codecKeyCache;
+/* By sqlite3_codec_key_forms setting, the same key string means another
+ * key under each */
+static uint8_t codecKeyCacheSecret[2][64];
+/* The cache has a static mutex of its own, not one SQLite takes itself.
+ * SQLITE_MUTEX_STATIC_MAIN doesn't exist before 3.33, which no longer has
+ * the codec hooks. Define to another SQLITE_MUTEX_STATIC_APPn if the
+ * application uses APP1. */
+#ifndef CODEC_KEY_CACHE_MUTEX
+#define CODEC_KEY_CACHE_MUTEX SQLITE_MUTEX_STATIC_APP1
+#endif
+static int codecKeyCacheSeeded;
+
+static int codecKeyForms = SQLITE_CODEC_KEY_FORMS;
+
+/**
+ * Parse keys for the forms of keyPrefixes. They are off by default: a pass
+ * phrase of one of these forms meant the hash of the whole of it before,
+ * and keys the database with another key once they are on. Applies to the
+ * whole process.
+ * @param onoff 1 or 0, or a negative value to only query it
+ * @return the previous setting
+ */
+SQLITE_API int sqlite3_codec_key_forms(int onoff)
+{
+    int previous = codecKeyForms;
+    if (onoff >= 0) {
+        codecKeyForms = onoff != 0;
+    }
+    return previous;
+}
+
+/**
+ * Wipe a buffer holding key material, in a way the compiler can't drop
+ * @param buffer
+ * @param length
+ */
+static void CodecZeroize(void *buffer, size_t length)
+{
+    volatile uint8_t *p = (volatile uint8_t *)buffer;
+    while (length--) {
+        *p++ = 0;
+    }
+}
+
+/**
+ * Set up HMAC-SHA512 (RFC 2104) for a key: the hash states after the inner
+ * and the outer padded key, so that each MAC under it costs only the
+ * message
+ * @param pads receives the inner and the outer state
+ * @param key
+ * @param keyLength
+ */
+static void CodecHmacSha512Init(mbedtls_sha512_context pads[2],
+                                const uint8_t *key, size_t keyLength)
+{
+    uint8_t pad[128];
+    uint8_t hashedKey[64];
+    size_t i;
+
+    if (keyLength > sizeof(pad)) {
+        mbedtls_sha512(key, keyLength, hashedKey, 0);
+        key = hashedKey;
+        keyLength = sizeof(hashedKey);
+    }
+
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < keyLength; i++) {
+        pad[i] ^= key[i];
+    }
+    mbedtls_sha512_init(&pads[0]);
+    mbedtls_sha512_starts(&pads[0], 0);
+    mbedtls_sha512_update(&pads[0], pad, sizeof(pad));
+
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    mbedtls_sha512_init(&pads[1]);
+    mbedtls_sha512_starts(&pads[1], 0);
+    mbedtls_sha512_update(&pads[1], pad, sizeof(pad));
+
+    CodecZeroize(pad, sizeof(pad));
+    CodecZeroize(hashedKey, sizeof(hashedKey));
+}
+
+/**
+ * HMAC-SHA512 of a message under the key of CodecHmacSha512Init
+ * @param pads
+ * @param data
+ * @param length
+ * @param mac receives the 64 bytes MAC, may be data
+ */
+static void CodecHmacSha512Mac(const mbedtls_sha512_context pads[2],
+                               const uint8_t *data, size_t length,
+                               uint8_t mac[64])
+{
+    mbedtls_sha512_context hashCtx;
+
+    mbedtls_sha512_clone(&hashCtx, &pads[0]);
+    mbedtls_sha512_update(&hashCtx, data, length);
+    mbedtls_sha512_finish(&hashCtx, mac);
+    mbedtls_sha512_clone(&hashCtx, &pads[1]);
+    mbedtls_sha512_update(&hashCtx, mac, 64);
+    mbedtls_sha512_finish(&hashCtx, mac);
+    mbedtls_sha512_free(&hashCtx);
+}
+
+/**
+ * HMAC-SHA512
+ * @param key
+ * @param keyLength
+ * @param data
+ * @param length
+ * @param mac receives the 64 bytes MAC
+ */
+static void CodecHmacSha512(const uint8_t *key, size_t keyLength,
+                            const uint8_t *data, size_t length,
+                            uint8_t mac[64])
+{
+    mbedtls_sha512_context pads[2];
+
+    CodecHmacSha512Init(pads, key, keyLength);
+    CodecHmacSha512Mac(pads, data, length, mac);
+    mbedtls_sha512_free(&pads[0]);
+    mbedtls_sha512_free(&pads[1]);
+}
+
+/**
+ * PBKDF2-HMAC-SHA512 (RFC 8018), the first 64 bytes
+ * @param passphrase
+ * @param length
+ * @param salt at most 60 bytes
+ * @param saltLength
+ * @param iterations
+ * @param key receives the derived key
+ */
+static void CodecPbkdf2Sha512(const uint8_t *passphrase, size_t length,
+                              const uint8_t *salt, size_t saltLength,
+                              int iterations, uint8_t key[64])
+{
+    mbedtls_sha512_context pads[2];
+    uint8_t u[64];
+    int i, j;
+
+    CodecHmacSha512Init(pads, passphrase, length);
+    /* U1 = HMAC(salt | INT(1)), the block index being big-endian */
+    memcpy(u, salt, saltLength);
+    memcpy(u + saltLength, "\0\0\0\1", 4);
+    CodecHmacSha512Mac(pads, u, saltLength + 4, u);
+    memcpy(key, u, sizeof(u));
+    for (i = 1; i < iterations; i++) {
+        CodecHmacSha512Mac(pads, u, sizeof(u), u);
+        for (j = 0; j < (int)sizeof(u); j++) {
+            key[j] ^= u[j];
+        }
+    }
+    mbedtls_sha512_free(&pads[0]);
+    mbedtls_sha512_free(&pads[1]);
+    CodecZeroize(u, sizeof(u));
+}
+
+/**
+ * Find a context in the key cache and take a reference to it
+ * Must be called with the key cache mutex held.
+ * @param cacheKey
+ * @param format
+ * @return NULL if there is none
+ */
+static SQLiteCipherContext *CodecKeyCacheFind(const uint8_t cacheKey[64],
+                                              int format)
+{
+    SQLiteCipherContext *ctx;
+
+    for (ctx = codecKeyCache; ctx != NULL; ctx = ctx->next) {
+        uint8_t diff = 0;
+        int i;
+        for (i = 0; i < 64; i++) {
+            diff |= ctx->cacheKey[i] ^ cacheKey[i];
+        }
+        if (diff == 0 && ctx->format == format) {
+            ctx->refs++;
+            return ctx;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Look a context up in the key cache
+ * @param cacheKey
+ * @param format
+ * @return a new reference, NULL if there is none
+ */
+static SQLiteCipherContext *CodecKeyCacheLookup(const uint8_t cacheKey[64],
+                                                int format)
+{
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(CODEC_KEY_CACHE_MUTEX);
+    SQLiteCipherContext *ctx;
+
+    sqlite3_mutex_enter(mutex);
+    ctx = CodecKeyCacheFind(cacheKey, format);
+    sqlite3_mutex_leave(mutex);
+    return ctx;
+}
+
+/**
+ * Create a cipher context and add it to the key cache, unless another
+ * thread added the same one meanwhile
+ * @param cacheKey
+ * @param keyMaterial derived from the pass phrase
+ * @param format CODEC_FORMAT_*
+ * @return a new reference, NULL if out of memory
+ */
+static SQLiteCipherContext *CodecKeyCacheAdd(const uint8_t cacheKey[64],
+                                             const uint8_t keyMaterial[64],
+                                             int format)
+{
+    sqlite3_mutex *mutex = sqlite3_mutex_alloc(CODEC_KEY_CACHE_MUTEX);
+    SQLiteCipherContext *ctx, *found;
+
+    ctx = (SQLiteCipherContext *)sqlite3_malloc(sizeof(SQLiteCipherContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    memcpy(ctx->cacheKey, cacheKey, sizeof(ctx->cacheKey));
+    memcpy(ctx->keyMaterial, keyMaterial, sizeof(ctx->keyMaterial));
+    sqlite3_randomness(sizeof(ctx->nonceCounter), &ctx->nonceCounter);
+    CipherContextSetFormat(ctx, format);
+    ctx->refs = 1;
+
+    sqlite3_mutex_enter(mutex);
+    found = CodecKeyCacheFind(cacheKey, format);
+    if (found == NULL) {
+        ctx->next = codecKeyCache;
+        codecKeyCache = ctx;
+    }
+    sqlite3_mutex_leave(mutex);
+
+    if (found != NULL) {
+        CodecZeroize(ctx, sizeof(SQLiteCipherContext));
+        sqlite3_free(ctx);
+        ctx = found;
+    }
+    return ctx;
+}
+
+/**
+ * Value of a hexadecimal digit
+ * @param c
+ * @return -1 if it isn't one
+ */
+static int CodecHexDigit(uint8_t c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/**
+ * Derive the key material from what follows the format prefix of a key,
+ * while sqlite3_codec_key_forms is on:
+ * - x'<hex>' of 64 bytes is the key material itself, laid out as
+ *   CipherContextSetFormat describes. One of 32 bytes (an AES-256 key) is
+ *   expanded to the key material with HMAC-SHA512, keyed with it, of the
+ *   salt.
+ * - pbkdf2:<iterations>:passphrase derives it with PBKDF2-HMAC-SHA512 of
+ *   the pass phrase and the salt. There is nowhere in the database to keep
+ *   a salt of its own, so it is fixed: the iterations are what makes
+ *   guessing costly.
+ * - Anything else, including malformed forms of the above, is a pass
+ *   phrase, hashed with SHA512 along with the salt. So is every key while
+ *   the forms are off.
+ * @param passphrase
+ * @param length
+ * @param keyForms the sqlite3_codec_key_forms setting
+ * @param keyMaterial receives the 64 bytes key material
+ */
+static void CodecDeriveKey(const uint8_t *passphrase, int length,
+                           int keyForms, uint8_t keyMaterial[64])
+{
+    static const char salt[] = "ab$0lutelydistingu1sh";
+    static const char pbkdf2[] = "pbkdf2:";
+    int pbkdf2Length = (int)sizeof(pbkdf2) - 1;
+    int i;
+
+    if (keyForms && (length == 64 + 3 || length == 128 + 3) &&
+        passphrase[0] == 'x' &&
+        passphrase[1] == '\'' && passphrase[length - 1] == '\'') {
+        int n = (length - 3) / 2;
+        uint8_t raw[64];
+        for (i = 0; i < n; i++) {
+            int hi = CodecHexDigit(passphrase[2 + 2 * i]);
+            int lo = CodecHexDigit(passphrase[3 + 2 * i]);
+            if (hi < 0 || lo < 0) {
+                break;
+            }
+            raw[i] = (uint8_t)((hi << 4) | lo);
+        }
+        if (i == n) {
+            if (n == 64) {
+                memcpy(keyMaterial, raw, 64);
+            } else {
+                CodecHmacSha512(raw, (size_t)n, (const uint8_t *)salt,
+                                sizeof(salt) - 1, keyMaterial);
+            }
+            CodecZeroize(raw, sizeof(raw));
+            return;
+        }
+        CodecZeroize(raw, sizeof(raw));
+    }
+
+    if (keyForms && length > pbkdf2Length &&
+        memcmp(passphrase, pbkdf2, pbkdf2Length) == 0) {
+        int iterations = 0;
+        /* At most 9 digits, then something to derive from */
+        for (i = pbkdf2Length; i < length && i < pbkdf2Length + 9 &&
+                               passphrase[i] >= '0' && passphrase[i] <= '9';
+             i++) {
+            iterations = iterations * 10 + (passphrase[i] - '0');
+        }
+        if (iterations > 0 && i + 1 < length && passphrase[i] == ':') {
+            CodecPbkdf2Sha512(passphrase + i + 1, (size_t)(length - i - 1),
+                              (const uint8_t *)salt, sizeof(salt) - 1,
+                              iterations, keyMaterial);
+            return;
+        }
+    }
+
+    mbedtls_sha512_context hashCtx;
+    mbedtls_sha512_init(&hashCtx);
+    mbedtls_sha512_starts(&hashCtx, 0);
+    mbedtls_sha512_update(&hashCtx, passphrase, length);
+    mbedtls_sha512_update(&hashCtx, (const uint8_t *)salt, sizeof(salt) - 1);
+    mbedtls_sha512_finish(&hashCtx, keyMaterial);
+    mbedtls_sha512_free(&hashCtx);
+}
+
+/**
+ * Get the cipher context of a pass phrase
+ * Keys and IV are derived from the pass phrase, see CodecDeriveKey, unless
+ * the context is in the key cache already.
+ * The reference should be dropped with CipherContextRelease when done
+ * @param passPhrase optionally prefixed with the cipher, see keyPrefixes
+ * (while sqlite3_codec_key_forms is on)
+ * @param length
+ * @return
+ */
+SQLiteCipherContext *CipherContextNew(const uint8_t *passphrase, int length)
+{
+    sqlite3_mutex *mutex;
+    SQLiteCipherContext *ctx;
+    uint8_t cacheKey[64];
+    uint8_t ivkey[64];
+    uint8_t secret[2][64];
+    int format = SQLITE_CODEC_DEFAULT_FORMAT;
+    int keyForms = codecKeyForms;
+    int i;
+    if (passphrase == NULL || length <= 0) {
+        return NULL;
+    }
+    for (i = 0; keyForms &&
+                i < (int)(sizeof(keyPrefixes) / sizeof(keyPrefixes[0]));
+         i++) {
+        int n = (int)strlen(keyPrefixes[i].prefix);
+        if (length > n && memcmp(passphrase, keyPrefixes[i].prefix, n) == 0) {
+            format = keyPrefixes[i].format;
+            passphrase += n;
+            length -= n;
+            break;
+        }
+    }
+
+    /* Drawn outside the mutex, sqlite3_randomness may initialize sqlite */
+    sqlite3_randomness(sizeof(secret), secret);
+    mutex = sqlite3_mutex_alloc(CODEC_KEY_CACHE_MUTEX);
+    sqlite3_mutex_enter(mutex);
+    if (!codecKeyCacheSeeded) {
+        memcpy(codecKeyCacheSecret, secret, sizeof(codecKeyCacheSecret));
+        codecKeyCacheSeeded = 1;
+    }
+    sqlite3_mutex_leave(mutex);
+    CodecZeroize(secret, sizeof(secret));
+
+    CodecHmacSha512(codecKeyCacheSecret[keyForms],
+                    sizeof(codecKeyCacheSecret[keyForms]), passphrase,
+                    (size_t)length, cacheKey);
+    ctx = CodecKeyCacheLookup(cacheKey, format);
+    if (ctx != NULL) {
+        return ctx;
+    }
+
+    CodecDeriveKey(passphrase, length, keyForms, ivkey);
+    ctx = CodecKeyCacheAdd(cacheKey, ivkey, format);
+    CodecZeroize(ivkey, sizeof(ivkey));
+    return ctx;
+}
+
+/**
+ * Get the context of the same key in another format
+ * @param ctx
+ * @param format CODEC_FORMAT_*
+ * @return a new reference, NULL if out of memory
+ */
+static SQLiteCipherContext *CipherContextWithFormat(SQLiteCipherContext *ctx,
+                                                    int format)
+{
+    SQLiteCipherContext *other = CodecKeyCacheLookup(ctx->cacheKey, format);
+    if (other == NULL) {
+        other = CodecKeyCacheAdd(ctx->cacheKey, ctx->keyMaterial, format);
+    }
+    return other;
+}
+
+/**
+ * Take another reference to a cipher context
+ * @param ctx may be NULL
+ * @return ctx
+ */
+SQLiteCipherContext *CipherContextRetain(SQLiteCipherContext *ctx)
+{
+    if (ctx != NULL) {
+        sqlite3_mutex *mutex = sqlite3_mutex_alloc(CODEC_KEY_CACHE_MUTEX);
+        sqlite3_mutex_enter(mutex);
+        ctx->refs++;
+        sqlite3_mutex_leave(mutex);
+    }
+    return ctx;
+}
+
+/**
+ * Drop a reference to a cipher context, wiping and freeing it with the last
+ * @param ctx may be NULL
+ */
+void CipherContextRelease(SQLiteCipherContext *ctx)
+{
+    sqlite3_mutex *mutex;
+    SQLiteCipherContext **link;
+    int last;
+
+    if (ctx == NULL) {
+        return;
+    }
+    mutex = sqlite3_mutex_alloc(CODEC_KEY_CACHE_MUTEX);
+    sqlite3_mutex_enter(mutex);
+    last = (--ctx->refs == 0);
+    if (last) {
+        for (link = &codecKeyCache; *link != ctx; link = &(*link)->next) {
+        }
+        *link = ctx->next;
+    }
+    sqlite3_mutex_leave(mutex);
+
+    if (last) {
+        CodecZeroize(ctx, sizeof(SQLiteCipherContext));
+        sqlite3_free(ctx);
+    }
+}
+
+static void CodecFileInstall(CodecCryptBlock *block);
+static void CodecFileRemove(CodecCryptBlock *block);
+static void CodecWalInstall(CodecCryptBlock *block);
+void FreeCodecCryptBlock(CodecCryptBlock *block);
+void SQLite3CodecSizeChangedCallback(void *pArg, int pageSize,
+                                     int reservedSize);
+
+/**
+ * Size the page buffers of a crypto block for a page size
+ * They are only reallocated when the size changes. On failure there are no
+ * buffers, so that pages aren't encrypted into ones too small.
+ * @param buffers
+ * @param pageSize new page size, 0 to free them
+ * @return SQLITE_OK, SQLITE_NOMEM
+ */
+static int CodecBuffersResize(CodecBuffers *buffers, int32_t pageSize)
+{
+    uintptr_t base;
+
+    if (buffers->size == pageSize) {
+        return SQLITE_OK;
+    }
+    sqlite3_free(buffers->arena);
+    memset(buffers, 0, sizeof(*buffers));
+    if (pageSize <= 0) {
+        return SQLITE_OK;
+    }
+    /* Two pages, each starting on a cache line */
+    buffers->arena =
+        sqlite3_malloc64(2 * ((sqlite3_uint64)pageSize + CODEC_BUFFER_ALIGN));
+    if (buffers->arena == NULL) {
+        return SQLITE_NOMEM;
+    }
+    base = ((uintptr_t)buffers->arena + CODEC_BUFFER_ALIGN - 1) &
+           ~(uintptr_t)(CODEC_BUFFER_ALIGN - 1);
+    buffers->main = (uint8_t *)base;
+    buffers->journal =
+        buffers->main + (((size_t)pageSize + CODEC_BUFFER_ALIGN - 1) &
+                         ~(size_t)(CODEC_BUFFER_ALIGN - 1));
+    buffers->size = pageSize;
+    return SQLITE_OK;
+}
+
+/**
+ * Create or update existing crypto block
+ * @param ctx cipher context to be used
+ * @param pager sqlite Pager to be associated with
+ * @param pageSize current page size (to be updated if changed)
+ * @param existed existing crypt block to be updated if any
+ * @return
+ */
+CodecCryptBlock *CreateCodeCryptBlock(SQLiteCipherContext *ctx, Pager *pager,
+                                      int32_t pageSize,
+                                      CodecCryptBlock *existing)
+{
+    CodecCryptBlock *block = existing;
+    if (existing == NULL) {
+        block = (CodecCryptBlock *)sqlite3_malloc(sizeof(CodecCryptBlock));
+        if (block == NULL) {
+            return NULL;
+        }
+        block->readCtx = ctx;
+        block->writeCtx = ctx;
+        memset(&block->buffers, 0, sizeof(block->buffers));
+        block->pageSize = 0;
+        block->reserve = pager->nReserve;
+        block->batch = NULL;
+        block->rekeyWatermark = 0;
+        block->rekeyTarget = 0;
+        block->rekeyKeyed = 0;
+        block->rekeySession = 0;
+        block->rekeyThreads = 0;
+        block->rekeySequence = 0;
+        memset(&block->stats, 0, sizeof(block->stats));
+        memset(&block->readAhead, 0, sizeof(block->readAhead));
+        memset(&block->writeBatch, 0, sizeof(block->writeBatch));
+        memset(&block->file, 0, sizeof(block->file));
+        memset(&block->wal, 0, sizeof(block->wal));
+        block->headerCtx = NULL;
+        block->pager = pager;
+        CodecFileInstall(block);
+    }
+    if (pageSize == -1) {
+        pageSize = pager->pageSize;
+    }
+
+    block->pager = pager;
+    SQLite3CodecSizeChangedCallback(block, pageSize, block->reserve);
+    if (block->buffers.size != pageSize) {
+        if (existing == NULL) {
+            /* The key stays the caller's */
+            block->readCtx = NULL;
+            block->writeCtx = NULL;
+            FreeCodecCryptBlock(block);
+        }
+        return NULL;
+    }
+    return block;
+}
+
+/**
+ * Destroy the crypto block created with CreateCodecCryptBlock
+ * @param block
+ */
+void FreeCodecCryptBlock(CodecCryptBlock *block)
+{
+    CodecBuffersResize(&block->buffers, 0);
+    sqlite3_free(block->readAhead.plain);
+    sqlite3_free(block->readAhead.ok);
+    sqlite3_free(block->writeBatch.pages);
+    sqlite3_free(block->writeBatch.pgnos);
+    sqlite3_free(block->writeBatch.plain);
+    sqlite3_free(block->writeBatch.output);
+    CipherContextRelease(block->writeBatch.ctx);
+    CodecFileRemove(block);
+
+    /* Drop the keys, one reference each */
+    CipherContextRelease(block->readCtx);
+    if (block->writeCtx != block->readCtx) {
+        CipherContextRelease(block->writeCtx);
+    }
+    block->readCtx = NULL;
+    block->writeCtx = NULL;
+
+    sqlite3_free(block);
+}
+
+/**
+ * Replace the read or write key of a crypto block
+ * The block holds one reference per distinct context in readCtx and
+ * writeCtx, which may well be the same: the reference passed in is taken
+ * over (or dropped if the block holds one already), and the one of the
+ * replaced context dropped unless the other key is the same.
+ * @param block
+ * @param pCtx &block->readCtx or &block->writeCtx
+ * @param ctx a reference to the new context, may be NULL
+ */
+static void CodecBlockSetContext(CodecCryptBlock *block,
+                                 SQLiteCipherContext **pCtx,
+                                 SQLiteCipherContext *ctx)
+{
+    SQLiteCipherContext *other =
+        (pCtx == &block->readCtx) ? block->writeCtx : block->readCtx;
+    SQLiteCipherContext *old = *pCtx;
+
+    if (ctx != NULL && (ctx == other || ctx == old)) {
+        CipherContextRelease(ctx);
+    }
+    if (old != NULL && old != other && old != ctx) {
+        if (block->headerCtx == old) {
+            block->headerCtx = NULL;
+        }
+        if (block->writeBatch.ctx == old) {
+            /* Nor does the write batch keep the dropped key alive */
+            block->writeBatch.count = 0;
+            block->writeBatch.ctx = NULL;
+            CipherContextRelease(old);
+        }
+        CipherContextRelease(old);
+    }
+    *pCtx = ctx;
+}
+
+/**
+ * Destroy crypto block callback
+ * @param pv
+ */
+static void SQLite3CodecFreeCallback(void *pv)
+{
+    CodecCryptBlock *block = (CodecCryptBlock *)pv;
+    FreeCodecCryptBlock(block);
+}
+
+/**
+ * Page size changed callback
+ * @param pArg the associated crypto block
+ * @param pageSize updated pageSize
+ * @param reservedSize
+ */
+void SQLite3CodecSizeChangedCallback(void *pArg, int pageSize, int reservedSize)
+{
+    CodecCryptBlock *block = (CodecCryptBlock *)pArg;
+    if (block->pageSize != pageSize) {
+        block->pageSize = pageSize;
+    }
+    /* Without buffers for it, the codec fails to encrypt pages with
+     * SQLITE_NOMEM rather than overflow them */
+    CodecBuffersResize(&block->buffers, pageSize);
+    block->reserve = reservedSize;
+    block->readAhead.count = 0;
+    block->writeBatch.count = 0;
+}
+
+/**
+ * Whether pages can be written with a cipher context: GCM needs the trailer
+ * to fit in the reserved bytes, otherwise page content would be overwritten
+ * @param block
+ * @param ctx
+ * @return
+ */
+static int CodecCanWrite(CodecCryptBlock *block, SQLiteCipherContext *ctx)
+{
+    if (CipherContextReserve(ctx) <= block->reserve) {
+        return 1;
+    }
+    sqlite3_log(SQLITE_ERROR, "codec: %s has %d reserved bytes, %d needed",
+                block->pager->zFilename, block->reserve,
+                CipherContextReserve(ctx));
+    return 0;
+}
+
+/**
+ * Cipher context of a page
+ * Outside of an incremental rekey that is the given one, during it the
+ * writeCtx for pages from the boundary on and the readCtx for the others
+ * @param block
+ * @param pgno
+ * @param boundary rekeyWatermark for pages as stored, rekeyTarget for pages
+ * being written
+ * @param ctx the context used outside of an incremental rekey
+ * @param pCtx receives the context, NULL for no encryption
+ * @return 0 if the page is under a write key that isn't known (the rekey was
+ * interrupted and not resumed yet)
+ */
+static int CodecPageContext(CodecCryptBlock *block, Pgno pgno, Pgno boundary,
+                            SQLiteCipherContext *ctx,
+                            SQLiteCipherContext **pCtx)
+{
+    *pCtx = ctx;
+    if (block->rekeyWatermark == 0) {
+        return 1;
+    }
+    if (pgno < boundary) {
+        *pCtx = block->readCtx;
+        return 1;
+    }
+    if (!block->rekeyKeyed) {
+        sqlite3_log(SQLITE_ERROR, "codec: page %u of %s is under the new key "
+                                  "of an interrupted rekey, resume it with "
+                                  "sqlite3_rekey_start",
+                    pgno, block->pager->zFilename);
+        return 0;
+    }
+    *pCtx = block->writeCtx;
+    return 1;
+}
+
+/**
+ * Record of the incremental rekey progress file
+ */
+typedef struct
+{
+    u32 sequence;   /* The latest record has the highest */
+    Pgno watermark; /* 0 if no incremental rekey is in progress */
+    Pgno target;    /* Below the watermark while a step may have committed */
+    Pgno witness;   /* Page of that step, 0 if none */
+    uint8_t check[CODEC_KEYCHECKSIZE]; /* Check value of the write key */
+    uint8_t hash[CODEC_PAGEHASHSIZE];  /* Of the witness page as stored */
+} CodecRekeyProgress;
+
+static const uint8_t codecProgressMagic[16] = "xsqlite rekey";
+
+/**
+ * Checksum of a progress record, also the hash of a page as stored
+ * @param data
+ * @param size
+ * @param out receives the first bytes of its SHA-512
+ * @param outSize
+ */
+static void CodecProgressHash(const uint8_t *data, size_t size, uint8_t *out,
+                              int outSize)
+{
+    uint8_t digest[64];
+
+    mbedtls_sha512(data, size, digest, 0);
+    memcpy(out, digest, outSize);
+}
+
+/**
+ * Decode a record of the progress file
+ * @param record CODEC_PROGRESS_SIZE bytes
+ * @param progress
+ * @return 0 if it is torn or was never written
+ */
+static int CodecProgressDecode(const uint8_t *record,
+                               CodecRekeyProgress *progress)
+{
+    uint8_t checksum[8];
+
+    CodecProgressHash(record, CODEC_PROGRESS_SIZE - 8, checksum, 8);
+    if (memcmp(record, codecProgressMagic, 16) != 0 ||
+        memcmp(record + CODEC_PROGRESS_SIZE - 8, checksum, 8) != 0) {
+        return 0;
+    }
+    progress->sequence = sqlite3Get4byte(record + 16);
+    progress->watermark = sqlite3Get4byte(record + 20);
+    progress->target = sqlite3Get4byte(record + 24);
+    progress->witness = sqlite3Get4byte(record + 28);
+    memcpy(progress->check, record + 32, CODEC_KEYCHECKSIZE);
+    memcpy(progress->hash, record + 40, CODEC_PAGEHASHSIZE);
+    return progress->watermark != 0 && progress->target != 0 &&
+           progress->target <= progress->watermark;
+}
+
+/**
+ * Read the progress file of a database
+ * No valid record (the file is missing, or a crash tore the first write)
+ * means no page has been rewritten yet.
+ * @param vfs
+ * @param zDb the database file name
+ * @param progress receives the latest record, a zero watermark if none
+ * @return
+ */
+static int CodecProgressRead(sqlite3_vfs *vfs, const char *zDb,
+                             CodecRekeyProgress *progress)
+{
+    char *zName = sqlite3_mprintf("%s" CODEC_PROGRESS_SUFFIX, zDb);
+    sqlite3_file *fd = NULL;
+    int exists = 0, flags, i;
+    int rc;
+
+    memset(progress, 0, sizeof(*progress));
+    if (zName == NULL) {
+        return SQLITE_NOMEM;
+    }
+    rc = sqlite3OsAccess(vfs, zName, SQLITE_ACCESS_EXISTS, &exists);
+    if (rc == SQLITE_OK && exists) {
+        rc = sqlite3OsOpenMalloc(vfs, zName, &fd,
+                                 SQLITE_OPEN_READONLY |
+                                     SQLITE_OPEN_MAIN_JOURNAL,
+                                 &flags);
+    }
+    for (i = 0; fd != NULL && rc == SQLITE_OK && i < 2; i++) {
+        uint8_t record[CODEC_PROGRESS_SIZE];
+        CodecRekeyProgress read;
+
+        rc = sqlite3OsRead(fd, record, CODEC_PROGRESS_SIZE,
+                           (i64)i * CODEC_PROGRESS_SLOT);
+        if (rc == SQLITE_IOERR_SHORT_READ) {
+            rc = SQLITE_OK;
+        } else if (rc == SQLITE_OK && CodecProgressDecode(record, &read) &&
+                   (progress->watermark == 0 ||
+                    read.sequence > progress->sequence)) {
+            *progress = read;
+        }
+    }
+    if (fd != NULL) {
+        sqlite3OsCloseFree(fd);
+    }
+    sqlite3_free(zName);
+    return rc;
+}
+
+/**
+ * Write the next record of the progress file of a database, or remove the
+ * file when the rekey is done
+ * @param vfs
+ * @param zDb the database file name
+ * @param progress its sequence is advanced; a zero watermark when done
+ * @param sync whether to sync it, unless the pager doesn't
+ * @return
+ */
+static int CodecProgressWrite(sqlite3_vfs *vfs, const char *zDb,
+                              CodecRekeyProgress *progress, int sync)
+{
+    char *zName = sqlite3_mprintf("%s" CODEC_PROGRESS_SUFFIX, zDb);
+    uint8_t record[CODEC_PROGRESS_SIZE];
+    sqlite3_file *fd = NULL;
+    int flags;
+    int rc;
+
+    if (zName == NULL) {
+        return SQLITE_NOMEM;
+    }
+    if (progress->watermark == 0) {
+        rc = sqlite3OsDelete(vfs, zName, sync);
+        sqlite3_free(zName);
+        return rc == SQLITE_IOERR_DELETE_NOENT ? SQLITE_OK : rc;
+    }
+
+    progress->sequence++;
+    memset(record, 0, sizeof(record));
+    memcpy(record, codecProgressMagic, 16);
+    sqlite3Put4byte(record + 16, progress->sequence);
+    sqlite3Put4byte(record + 20, progress->watermark);
+    sqlite3Put4byte(record + 24, progress->target);
+    sqlite3Put4byte(record + 28, progress->witness);
+    memcpy(record + 32, progress->check, CODEC_KEYCHECKSIZE);
+    memcpy(record + 40, progress->hash, CODEC_PAGEHASHSIZE);
+    CodecProgressHash(record, CODEC_PROGRESS_SIZE - 8,
+                      record + CODEC_PROGRESS_SIZE - 8, 8);
+
+    /* As a journal: created with the permissions of the database, and its
+     * directory synced with it */
+    rc = sqlite3OsOpenMalloc(vfs, zName, &fd,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                 SQLITE_OPEN_MAIN_JOURNAL,
+                             &flags);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3OsWrite(fd, record, CODEC_PROGRESS_SIZE,
+                            (i64)(progress->sequence & 1) *
+                                CODEC_PROGRESS_SLOT);
+        if (rc == SQLITE_OK && sync) {
+            rc = sqlite3OsSync(fd, SQLITE_SYNC_NORMAL);
+        }
+        sqlite3OsCloseFree(fd);
+    }
+    sqlite3_free(zName);
+    return rc;
+}
+
+/**
+ * File of a database that a progress file can go with
+ * @param pager
+ * @return NULL for an in-memory or temporary database, whose rekey progress
+ * is kept by the crypto block only
+ */
+static const char *CodecProgressFile(Pager *pager)
+{
+    if (pager->memDb || pager->zFilename == NULL ||
+        pager->zFilename[0] == 0) {
+        return NULL;
+    }
+    return pager->zFilename;
+}
+
+/**
+ * Incremental rekey progress of the database of a crypto block
+ * @param block
+ * @param progress
+ * @return
+ */
+static int CodecRekeyLoad(CodecCryptBlock *block, CodecRekeyProgress *progress)
+{
+    const char *zDb = CodecProgressFile(block->pager);
+
+    if (zDb == NULL) {
+        memset(progress, 0, sizeof(*progress));
+        progress->watermark = block->rekeyWatermark;
+        progress->target = block->rekeyWatermark;
+        memcpy(progress->check, block->rekeyCheck, CODEC_KEYCHECKSIZE);
+        return SQLITE_OK;
+    }
+    return CodecProgressRead(block->pager->pVfs, zDb, progress);
+}
+
+/**
+ * Record the incremental rekey progress of the database of a crypto block
+ * @param block
+ * @param watermark 0 when done
+ * @param target
+ * @param witness page of a step whose commit is pending, 0 if none
+ * @param hash of it as stored, NULL if none
+ * @return
+ */
+static int CodecRekeyStore(CodecCryptBlock *block, Pgno watermark,
+                           Pgno target, Pgno witness, const uint8_t *hash)
+{
+    const char *zDb = CodecProgressFile(block->pager);
+    CodecRekeyProgress progress;
+    int rc;
+
+    if (zDb == NULL) {
+        return SQLITE_OK;
+    }
+    memset(&progress, 0, sizeof(progress));
+    progress.sequence = block->rekeySequence;
+    progress.watermark = watermark;
+    progress.target = target;
+    progress.witness = witness;
+    memcpy(progress.check, block->rekeyCheck, CODEC_KEYCHECKSIZE);
+    if (hash != NULL) {
+        memcpy(progress.hash, hash, CODEC_PAGEHASHSIZE);
+    }
+    rc = CodecProgressWrite(block->pager->pVfs, zDb, &progress,
+                            !block->pager->noSync);
+    block->rekeySequence = progress.sequence;
+    return rc;
+}
+
+/**
+ * Pick up the progress of an incremental rekey when page 1 is loaded, so
+ * that one interrupted or going on in another connection is noticed: pages
+ * from the lower of its watermark and target on fail to read
+ * @param block
+ */
+static void CodecRekeyNotice(CodecCryptBlock *block)
+{
+    CodecRekeyProgress progress;
+
+    if (block->rekeyKeyed || CodecRekeyLoad(block, &progress) != SQLITE_OK) {
+        return;
+    }
+    block->rekeyWatermark = progress.target;
+    block->rekeyTarget = progress.target;
+    memcpy(block->rekeyCheck, progress.check, CODEC_KEYCHECKSIZE);
+}
+
+/**
+ * Page cipher statistics
+ * The counters are updated with relaxed atomics as the pager of a shared
+ * cache serves several connections, and read without synchronisation.
+ */
+#if defined(__GNUC__)
+#define CODEC_STAT_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define CODEC_STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define CODEC_STAT_TAKE(x) __atomic_exchange_n(&(x), 0, __ATOMIC_RELAXED)
+#else
+#define CODEC_STAT_ADD(x, n) ((x) += (n))
+#define CODEC_STAT_GET(x) (x)
+#define CODEC_STAT_TAKE(x) CodecStatTake(&(x))
+#endif
+
+static int codecTiming = 0;
+
+/**
+ * Monotonic clock for the statistics
+ * @return nanoseconds
+ */
+static sqlite3_uint64 CodecNanotime(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (sqlite3_uint64)((double)now.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Count a page ciphered by the codec callback
+ * @param block
+ * @param stat SQLITE_CODEC_STAT_DECRYPT, _ENCRYPT or _JOURNAL
+ * @param start CodecNanotime before the cipher, 0 if not timed
+ */
+static void CodecStatRecord(CodecCryptBlock *block, int stat,
+                            sqlite3_uint64 start)
+{
+    sqlite3_codec_stats *stats = &block->stats;
+
+    CODEC_STAT_ADD(stats->nPage[stat], 1);
+    CODEC_STAT_ADD(stats->nByte[stat], (sqlite3_uint64)block->pageSize);
+    if (start != 0) {
+        sqlite3_uint64 ns = CodecNanotime() - start;
+        sqlite3_uint64 v = ns >> 8;
+        int bucket = 0;
+        while (v != 0 && bucket < SQLITE_CODEC_STAT_BUCKETS - 1) {
+            v >>= 1;
+            bucket++;
+        }
+        CODEC_STAT_ADD(stats->nNanosecond[stat], ns);
+        CODEC_STAT_ADD(stats->aHistogram[stat][bucket], 1);
+    }
+}
+
+#if !defined(__GNUC__)
+/**
+ * Read a statistics counter and reset it
+ * @param x
+ * @return
+ */
+static sqlite3_uint64 CodecStatTake(sqlite3_uint64 *x)
+{
+    sqlite3_uint64 v = *x;
+    *x = 0;
+    return v;
+}
+#endif
+
+/**
+ * Crypto block of a database of the connection
+ * @param db
+ * @param iDb
+ * @return NULL if the database isn't encrypted
+ */
+static CodecCryptBlock *CodecDbBlock(sqlite3 *db, int iDb)
+{
+    if (iDb < 0 || iDb >= db->nDb || db->aDb[iDb].pBt == NULL) {
+        return NULL;
+    }
+    return (CodecCryptBlock *)sqlite3PagerGetCodec(
+        sqlite3BtreePager(db->aDb[iDb].pBt));
+}
+
+/**
+ * Index of a database of the connection by schema name
+ * @param db
+ * @param zDbName "main", "temp" or the name of an attached database, NULL
+ * for main
+ * @return -1 if there is no such database (or "temp" isn't open yet)
+ */
+static int CodecDbIndex(sqlite3 *db, const char *zDbName)
+{
+    int iDb = zDbName != NULL ? sqlite3FindDbName(db, zDbName) : 0;
+
+    if (iDb < 0 || iDb >= db->nDb || db->aDb[iDb].pBt == NULL) {
+        return -1;
+    }
+    return iDb;
+}
+
+static const char *const codecStatNames[SQLITE_CODEC_STAT_COUNT] = {
+    "decrypt", "encrypt", "journal"};
+
+/**
+ * Read the page cipher statistics of a crypto block
+ * @param block
+ * @param pStats receives the counters, may be NULL
+ * @param resetFlag reset the counters after reading them
+ */
+static void CodecStatsRead(CodecCryptBlock *block, sqlite3_codec_stats *pStats,
+                           int resetFlag)
+{
+    sqlite3_uint64 *counters = (sqlite3_uint64 *)&block->stats;
+    sqlite3_uint64 *out = (sqlite3_uint64 *)pStats;
+    int i, n = (int)(sizeof(sqlite3_codec_stats) / sizeof(sqlite3_uint64));
+
+    for (i = 0; i < n; i++) {
+        sqlite3_uint64 v = resetFlag ? CODEC_STAT_TAKE(counters[i])
+                                     : CODEC_STAT_GET(counters[i]);
+        if (out != NULL) {
+            out[i] = v;
+        }
+    }
+}
+
+/**
+ * Page cipher statistics of a crypto block as the text of PRAGMA
+ * codec_stats: a line per operation, its pages, bytes, nanoseconds and
+ * histogram buckets
+ * @param block
+ * @param resetFlag reset the counters after reading them
+ * @return the text, to be freed with sqlite3_free, NULL if out of memory
+ */
+static char *CodecStatsText(CodecCryptBlock *block, int resetFlag)
+{
+    char text[SQLITE_CODEC_STAT_COUNT * (SQLITE_CODEC_STAT_BUCKETS + 4) * 21];
+    sqlite3_codec_stats stats;
+    int stat, b, n = 0;
+
+    CodecStatsRead(block, &stats, resetFlag);
+    for (stat = 0; stat < SQLITE_CODEC_STAT_COUNT; stat++) {
+        sqlite3_snprintf((int)sizeof(text) - n, text + n,
+                         "%s%s pages=%llu bytes=%llu nanoseconds=%llu "
+                         "histogram=",
+                         stat ? "\n" : "", codecStatNames[stat],
+                         stats.nPage[stat], stats.nByte[stat],
+                         stats.nNanosecond[stat]);
+        n += (int)strlen(text + n);
+        for (b = 0; b < SQLITE_CODEC_STAT_BUCKETS; b++) {
+            sqlite3_snprintf((int)sizeof(text) - n, text + n,
+                             b ? ",%llu" : "%llu", stats.aHistogram[stat][b]);
+            n += (int)strlen(text + n);
+        }
+    }
+    return sqlite3_mprintf("%s", text);
+}
+
+static int codecReadAhead = SQLITE_CODEC_READAHEAD;
+
+/**
+ * Set the read-ahead window of sequential scans, in pages. Once the pager
+ * of an encrypted database loads CODEC_READAHEAD_TRIGGER pages in a row,
+ * the next pages are read at once and decrypted on the
+ * sqlite3_codec_rekey_threads threads, so that they only have to be copied
+ * when the pager gets to them instead of read. Pages read from the WAL or
+ * through sqlite3_codec_mmap don't use it. Applies to the whole process.
+ * @param nPages new window, 0 to turn it off, or a negative value to only
+ * query it
+ * @return the previous window
+ */
+SQLITE_API int sqlite3_codec_readahead(int nPages)
+{
+    int prev = codecReadAhead;
+    if (nPages >= 0) {
+        codecReadAhead = nPages;
+    }
+    return prev;
+}
+
+static void CodecRunTasks(void *(*xWork)(void *), void *aTask, size_t taskSize,
+                          int nTask);
+static int CodecFileIo(sqlite3_file *fd, char *buffer, i64 amount, i64 offset,
+                       int write);
+
+/**
+ * Share of a read-ahead window decrypted by one thread
+ */
+typedef struct
+{
+    CodecReadAhead *readAhead;
+    SQLiteCipherContext *ctx;
+    int start; /* First index in the window */
+    int end;   /* One past the last index */
+} CodecReadAheadTask;
+
+/**
+ * Read-ahead worker: decrypt the pages of the window
+ * @param pArg CodecReadAheadTask
+ * @return NULL
+ */
+static void *CodecReadAheadWork(void *pArg)
+{
+    CodecReadAheadTask *task = (CodecReadAheadTask *)pArg;
+    CodecReadAhead *ra = task->readAhead;
+    size_t pageSize = (size_t)ra->pageSize;
+    int i;
+
+    for (i = task->start; i < task->end; i++) {
+        char *page = (char *)ra->plain + i * pageSize;
+        ra->ok[i] = SQLiteDecrypt(task->ctx, ra->first + (Pgno)i, page, page,
+                                  (int)pageSize) == SQLITE_OK;
+    }
+    return NULL;
+}
+
+/**
+ * Fill the read-ahead window from a page on: read the pages up to the
+ * window size or the end of the file, and decrypt them
+ * @param block
+ * @param ctx key of the pages
+ * @param first
+ */
+static void CodecReadAheadFill(CodecCryptBlock *block, SQLiteCipherContext *ctx,
+                               Pgno first)
+{
+    CodecReadAheadTask tasks[CODEC_REKEY_MAX_THREADS];
+    CodecReadAhead *ra = &block->readAhead;
+    sqlite3_file *fd = sqlite3PagerFile(block->pager);
+    i64 pageSize = block->pageSize;
+    i64 fileSize;
+    int count = codecReadAhead;
+    int nThreads, i, rc;
+
+    ra->count = 0;
+    if (count > CODEC_READAHEAD_MAX_BYTES / pageSize) {
+        count = (int)(CODEC_READAHEAD_MAX_BYTES / pageSize);
+    }
+    if (sqlite3OsFileSize(fd, &fileSize) != SQLITE_OK) {
+        return;
+    }
+    if (count > fileSize / pageSize - (i64)(first - 1)) {
+        count = (int)(fileSize / pageSize - (i64)(first - 1));
+    }
+    if (count <= 0) {
+        return;
+    }
+
+    if (ra->capacity < count || ra->pageSize != block->pageSize) {
+        sqlite3_free(ra->plain);
+        sqlite3_free(ra->ok);
+        ra->plain = (uint8_t *)sqlite3_malloc64((sqlite3_uint64)count *
+                                                pageSize);
+        ra->ok = (uint8_t *)sqlite3_malloc(count);
+        ra->capacity = count;
+        ra->pageSize = block->pageSize;
+        if (ra->plain == NULL || ra->ok == NULL) {
+            /* Loads go on one page at a time */
+            ra->capacity = 0;
+            return;
+        }
+    }
+    block->file.bypass = 1;
+    rc = CodecFileIo(fd, (char *)ra->plain, count * pageSize,
+                     (i64)(first - 1) * pageSize, 0);
+    block->file.bypass = 0;
+    if (rc != SQLITE_OK) {
+        return;
+    }
+
+    /* Enough pages per thread to be worth starting it */
+    nThreads = (int)(count * pageSize / CODEC_READAHEAD_CHUNK);
+    if (nThreads > sqlite3_codec_rekey_threads(-1)) {
+        nThreads = sqlite3_codec_rekey_threads(-1);
+    }
+    if (nThreads < 1) {
+        nThreads = 1;
+    }
+    ra->first = first;
+    for (i = 0; i < nThreads; i++) {
+        tasks[i].readAhead = ra;
+        tasks[i].ctx = ctx;
+        tasks[i].start = (int)((int64_t)count * i / nThreads);
+        tasks[i].end = (int)((int64_t)count * (i + 1) / nThreads);
+    }
+    CodecRunTasks(CodecReadAheadWork, tasks, sizeof(tasks[0]), nThreads);
+    ra->count = count;
+}
+
+/**
+ * Load a page from the read-ahead window instead of the file, filling the
+ * window from it once a sequential scan gets past the window
+ * @param block
+ * @param ctx key of the page
+ * @param pgno
+ * @param data receives the page decrypted if served
+ * @return whether the page was served from the window
+ */
+static int CodecReadAheadLoad(CodecCryptBlock *block, SQLiteCipherContext *ctx,
+                              Pgno pgno, char *data)
+{
+    CodecReadAhead *ra = &block->readAhead;
+    size_t pageSize = (size_t)block->pageSize;
+    int inWindow, served = 0;
+    int i;
+
+    /* The window holds pages under the read key only */
+    if (codecReadAhead <= 0 || ctx != block->readCtx || block->batch != NULL ||
+        block->rekeyWatermark != 0) {
+        return 0;
+    }
+    sqlite3_file *fd = sqlite3PagerFile(block->pager);
+    if (fd == NULL || fd->pMethods == NULL) {
+        return 0;
+    }
+
+    inWindow = ra->count > 0 && pgno >= ra->first &&
+               pgno - ra->first < (Pgno)ra->count;
+    ra->run = (pgno == ra->next) ? ra->run + 1 : 1;
+    ra->next = pgno + 1;
+    if (!inWindow && ra->run >= CODEC_READAHEAD_TRIGGER) {
+        CodecReadAheadFill(block, ctx, pgno);
+        inWindow = ra->count > 0;
+    }
+
+    i = inWindow ? (int)(pgno - ra->first) : -1;
+    if (inWindow && ra->ok[i]) {
+        /* Failing pages are read again, to fail as the file's */
+        memcpy(data, ra->plain + i * pageSize, pageSize);
+        served = 1;
+    }
+    return served;
+}
+
+/**
+ * Share of a write batch encrypted by one thread
+ */
+typedef struct
+{
+    CodecWriteBatch *writeBatch;
+    SQLiteCipherContext *ctx;
+    int start; /* First index in the batch */
+    int end;   /* One past the last index */
+} CodecWriteTask;
+
+/**
+ * Write batch worker: copy the plaintext of the pages and encrypt it
+ * @param pArg CodecWriteTask
+ * @return NULL
+ */
+static void *CodecWriteWork(void *pArg)
+{
+    CodecWriteTask *task = (CodecWriteTask *)pArg;
+    CodecWriteBatch *wb = task->writeBatch;
+    size_t pageSize = (size_t)wb->pageSize;
+    int i;
+
+    for (i = task->start; i < task->end; i++) {
+        char *plain = (char *)wb->plain + i * pageSize;
+        memcpy(plain, wb->pages[i]->pData, pageSize);
+        SQLiteEncrypt(task->ctx, wb->pgnos[i], plain,
+                      (char *)wb->output + i * pageSize, (int)pageSize);
+    }
+    return NULL;
+}
+
+/**
+ * Encrypt a page and the ones following it in the pager's write list as a
+ * batch, if there are enough of them to share between threads
+ * @param block
+ * @param ctx write key
+ * @param pgno page being written
+ * @param data its content
+ */
+static void CodecWriteBatchFill(CodecCryptBlock *block,
+                                SQLiteCipherContext *ctx, Pgno pgno,
+                                void *data)
+{
+    CodecWriteTask tasks[CODEC_REKEY_MAX_THREADS];
+    CodecWriteBatch *wb = &block->writeBatch;
+    size_t pageSize = (size_t)block->pageSize;
+    int perThread = (int)(CODEC_WRITE_CHUNK / pageSize);
+    int nThreads = sqlite3_codec_rekey_threads(-1);
+    int capacity, count, i;
+    sqlite3_pcache_page *page;
+    PgHdr *pg;
+
+    wb->count = 0;
+    /* A rekey in progress writes under two keys, batch or not */
+    if (nThreads < 2 || block->batch != NULL || block->rekeyWatermark != 0) {
+        return;
+    }
+    if (perThread < 1) {
+        perThread = 1;
+    }
+    capacity = nThreads * perThread;
+
+    /* Pages being written are dirty, so pinned: the lookup changes
+     * nothing in the cache */
+    page = sqlite3PcacheFetch(block->pager->pPCache, pgno, 0);
+    if (page == NULL) {
+        return;
+    }
+    pg = (PgHdr *)page->pExtra;
+    if (pg->pPage != page || pg->pData != data) {
+        return;
+    }
+    for (count = 0; pg != NULL && count < capacity; pg = pg->pDirty) {
+        count++;
+    }
+    nThreads = count / perThread;
+    if (nThreads < 2) {
+        return;
+    }
+
+    if (wb->capacity < capacity || wb->pageSize != block->pageSize) {
+        sqlite3_free(wb->pages);
+        sqlite3_free(wb->pgnos);
+        sqlite3_free(wb->plain);
+        sqlite3_free(wb->output);
+        wb->pages = (PgHdr **)sqlite3_malloc64(capacity * sizeof(PgHdr *));
+        wb->pgnos = (Pgno *)sqlite3_malloc64(capacity * sizeof(Pgno));
+        wb->plain = (uint8_t *)sqlite3_malloc64(capacity * pageSize);
+        wb->output = (uint8_t *)sqlite3_malloc64(capacity * pageSize);
+        wb->capacity = capacity;
+        wb->pageSize = block->pageSize;
+        if (wb->pages == NULL || wb->pgnos == NULL || wb->plain == NULL ||
+            wb->output == NULL) {
+            /* Pages go on being encrypted one at a time */
+            wb->capacity = 0;
+            return;
+        }
+    }
+    pg = (PgHdr *)page->pExtra;
+    for (i = 0; i < count; i++, pg = pg->pDirty) {
+        wb->pages[i] = pg;
+        wb->pgnos[i] = pg->pgno;
+    }
+    for (i = 0; i < nThreads; i++) {
+        tasks[i].writeBatch = wb;
+        tasks[i].ctx = ctx;
+        tasks[i].start = (int)((int64_t)count * i / nThreads);
+        tasks[i].end = (int)((int64_t)count * (i + 1) / nThreads);
+    }
+    CodecRunTasks(CodecWriteWork, tasks, sizeof(tasks[0]), nThreads);
+
+    /* Contexts are per key and format, and the reference keeps this one
+     * from being freed and its address reused for another key */
+    if (wb->ctx != ctx) {
+        CipherContextRelease(wb->ctx);
+        wb->ctx = CipherContextRetain(ctx);
+    }
+    wb->count = count;
+    wb->next = 0;
+}
+
+/**
+ * Encrypted page to write from the write batch, starting a batch from the
+ * page if it isn't in the current one
+ * Pages of the list the pager skips (past the end of the database, or not
+ * to be written) are skipped in the batch too.
+ * @param block
+ * @param ctx write key
+ * @param pgno
+ * @param data page content
+ * @return ciphertext to write, NULL to encrypt the page alone
+ */
+static const uint8_t *CodecWriteBatchLoad(CodecCryptBlock *block,
+                                          SQLiteCipherContext *ctx, Pgno pgno,
+                                          void *data)
+{
+    CodecWriteBatch *wb = &block->writeBatch;
+    size_t pageSize = (size_t)block->pageSize;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (wb->count > 0 && wb->ctx == ctx) {
+            int j = wb->next;
+            while (j < wb->count && wb->pgnos[j] != pgno) {
+                j++;
+            }
+            if (j < wb->count &&
+                memcmp(data, wb->plain + j * pageSize, pageSize) == 0) {
+                wb->next = j + 1;
+                return wb->output + j * pageSize;
+            }
+        }
+        if (i == 0) {
+            CodecWriteBatchFill(block, ctx, pgno, data);
+        }
+    }
+    wb->count = 0;
+    return NULL;
+}
+
+static int codecMmap = 0;
+
+/**
+ * Read the pages of encrypted databases through the memory mapping of the
+ * file, as allowed by PRAGMA mmap_size, decrypting them from it straight
+ * into the page cache: loading a page then costs no system call nor copy.
+ * Applies to the whole process.
+ * @param onoff 1 or 0, or a negative value to only query it
+ * @return the previous setting
+ */
+SQLITE_API int sqlite3_codec_mmap(int onoff)
+{
+    int previous = codecMmap;
+    if (onoff >= 0) {
+        codecMmap = onoff != 0;
+    }
+    return previous;
+}
+
+/**
+ * Check page 1 as read, which the codec call decrypts as it recognises the
+ * format: under the GCM key it last authenticated with, a failure is a
+ * modified page rather than a wrong key
+ * @param block
+ * @param data page 1 as read
+ * @param amount bytes read
+ * @return SQLITE_OK, SQLITE_CORRUPT if it fails authentication
+ */
+static int CodecCheckFirstPage(CodecCryptBlock *block, void *data,
+                               int amount)
+{
+    SQLiteCipherContext *ctx;
+
+    if (block->headerCtx == NULL || amount != block->pageSize ||
+        block->buffers.size != amount ||
+        !CodecPageContext(block, 1, block->rekeyWatermark, block->readCtx,
+                          &ctx) ||
+        ctx != block->headerCtx) {
+        return SQLITE_OK;
+    }
+    if (SQLiteDecrypt(ctx, 1, (const char *)data,
+                      (char *)block->buffers.main, amount) == SQLITE_OK) {
+        return SQLITE_OK;
+    }
+    sqlite3_log(SQLITE_CORRUPT, "codec: page 1 of %s failed authentication",
+                block->pager->zFilename);
+    /* Nothing for the codec call to recognise */
+    block->file.pgno = 1;
+    block->file.data = data;
+    return SQLITE_CORRUPT;
+}
+
+/**
+ * xRead of the database file: decrypt a page the pager loads, copying it
+ * from the mapping while sqlite3_codec_mmap is on
+ * @param fd
+ * @param buffer
+ * @param amount
+ * @param offset
+ * @return SQLITE_CORRUPT if the page fails authentication, SQLITE_NOTADB if
+ * it is under the new key of an interrupted rekey
+ */
+static int CodecFileRead(sqlite3_file *fd, void *buffer, int amount,
+                         sqlite3_int64 offset)
+{
+    CodecFileMethods *file = (CodecFileMethods *)fd->pMethods;
+    CodecCryptBlock *block =
+        (CodecCryptBlock *)((char *)file - offsetof(CodecCryptBlock, file));
+    const sqlite3_io_methods *orig = file->orig;
+    void *map = NULL;
+    SQLiteCipherContext *ctx = NULL;
+    sqlite3_uint64 start;
+    Pgno pgno = 0;
+    int rc;
+
+    if (codecMmap && orig->iVersion >= 3 && orig->xFetch != NULL &&
+        orig->xFetch(fd, offset, amount, &map) == SQLITE_OK && map == NULL &&
+        offset + amount <= block->pager->szMmap) {
+        /* The pager never remaps an encrypted database: map it again if it
+         * grew past the mapping */
+        orig->xUnfetch(fd, 0, NULL);
+        orig->xFetch(fd, offset, amount, &map);
+    }
+
+    /* Only whole pages loaded by the pager outside of a rekey batch, but
+     * page 1, whose decryption recognises the format */
+    if (!file->bypass && amount == block->pageSize && offset % amount == 0 &&
+        offset >= amount && block->batch == NULL) {
+        pgno = (Pgno)(offset / amount) + 1;
+        if (!CodecPageContext(block, pgno, block->rekeyWatermark,
+                              block->readCtx, &ctx)) {
+            if (map != NULL) {
+                orig->xUnfetch(fd, offset, map);
+            }
+            file->pgno = pgno;
+            file->data = buffer;
+            return SQLITE_NOTADB;
+        }
+    }
+    if (ctx == NULL) {
+        if (map == NULL) {
+            rc = orig->xRead(fd, buffer, amount, offset);
+        } else {
+            memcpy(buffer, map, amount);
+            orig->xUnfetch(fd, offset, map);
+            rc = SQLITE_OK;
+        }
+        if (rc == SQLITE_OK && !file->bypass && offset == 0) {
+            rc = CodecCheckFirstPage(block, buffer, amount);
+        }
+        return rc;
+    }
+
+    start = codecTiming ? CodecNanotime() : 0;
+    if (map == NULL && CodecReadAheadLoad(block, ctx, pgno, (char *)buffer)) {
+        rc = SQLITE_OK;
+    } else {
+        if (map == NULL) {
+            rc = orig->xRead(fd, buffer, amount, offset);
+            if (rc != SQLITE_OK) {
+                /* Short reads included: left to the codec call */
+                return rc;
+            }
+            start = codecTiming ? CodecNanotime() : 0;
+        }
+        rc = SQLiteDecrypt(ctx, pgno,
+                           map != NULL ? (const char *)map
+                                       : (const char *)buffer,
+                           (char *)buffer, amount);
+    }
+    if (map != NULL) {
+        orig->xUnfetch(fd, offset, map);
+    }
+    /* Nothing left for the codec call either way, the pager reporting the
+     * error of the read */
+    file->pgno = pgno;
+    file->data = buffer;
+    if (rc != SQLITE_OK) {
+        sqlite3_log(SQLITE_CORRUPT, "codec: page %u of %s failed "
+                                    "authentication",
+                    pgno, block->pager->zFilename);
+        return SQLITE_CORRUPT;
+    }
+    CodecStatRecord(block, SQLITE_CODEC_STAT_DECRYPT, start);
+    return SQLITE_OK;
+}
+
+/**
+ * Crypto block of a database file whose methods are installed
+ * @param fd
+ * @return
+ */
+static CodecCryptBlock *CodecFileBlock(sqlite3_file *fd)
+{
+    return (CodecCryptBlock *)((char *)fd->pMethods -
+                               offsetof(CodecCryptBlock, file));
+}
+
+/**
+ * xWrite of the database file: drop the read-ahead window
+ * @param fd
+ * @param buffer
+ * @param amount
+ * @param offset
+ * @return
+ */
+static int CodecFileWrite(sqlite3_file *fd, const void *buffer, int amount,
+                          sqlite3_int64 offset)
+{
+    CodecCryptBlock *block = CodecFileBlock(fd);
+    block->readAhead.count = 0;
+    return block->file.orig->xWrite(fd, buffer, amount, offset);
+}
+
+/**
+ * xTruncate of the database file: drop the read-ahead window
+ * @param fd
+ * @param size
+ * @return
+ */
+static int CodecFileTruncate(sqlite3_file *fd, sqlite3_int64 size)
+{
+    CodecCryptBlock *block = CodecFileBlock(fd);
+    block->readAhead.count = 0;
+    return block->file.orig->xTruncate(fd, size);
+}
+
+/**
+ * xUnlock of the database file: drop the read-ahead window with the last
+ * lock, as the file can be written once it is released
+ * @param fd
+ * @param level
+ * @return
+ */
+static int CodecFileUnlock(sqlite3_file *fd, int level)
+{
+    CodecCryptBlock *block = CodecFileBlock(fd);
+    if (level == NO_LOCK) {
+        block->readAhead.count = 0;
+    }
+    return block->file.orig->xUnlock(fd, level);
+}
+
+/**
+ * xShmLock of the database file: drop the read-ahead window as WAL locks
+ * are released, ending a read transaction among them (in WAL mode the file
+ * stays locked from one transaction to the next), and hook the WAL file as
+ * they are taken
+ * @param fd
+ * @param offset
+ * @param n
+ * @param flags
+ * @return
+ */
+static int CodecFileShmLock(sqlite3_file *fd, int offset, int n, int flags)
+{
+    CodecCryptBlock *block = CodecFileBlock(fd);
+    if (flags & SQLITE_SHM_UNLOCK) {
+        block->readAhead.count = 0;
+    } else {
+        CodecWalInstall(block);
+    }
+    return block->file.orig->xShmLock(fd, offset, n, flags);
+}
+
+/**
+ * xFileControl of the database file: answer PRAGMA codec_stats, with
+ * "reset" as argument to reset the counters after reading them
+ * @param fd
+ * @param op
+ * @param pArg
+ * @return
+ */
+static int CodecFileControl(sqlite3_file *fd, int op, void *pArg)
+{
+    CodecCryptBlock *block = CodecFileBlock(fd);
+
+    if (op == SQLITE_FCNTL_PRAGMA &&
+        sqlite3_stricmp(((char **)pArg)[1], "codec_stats") == 0) {
+        char **azArg = (char **)pArg;
+        int reset = azArg[2] != NULL && sqlite3_stricmp(azArg[2], "reset") == 0;
+        if (azArg[2] != NULL && !reset) {
+            azArg[0] = sqlite3_mprintf("codec_stats takes no argument but "
+                                       "reset");
+            return SQLITE_ERROR;
+        }
+        azArg[0] = CodecStatsText(block, reset);
+        return azArg[0] != NULL ? SQLITE_OK : SQLITE_NOMEM;
+    }
+    return block->file.orig->xFileControl(fd, op, pArg);
+}
+
+#ifndef SQLITE_OMIT_WAL
+/**
+ * xRead of the WAL file: decrypt the page of a frame the pager loads. The
+ * checkpointer copies frames to the database file as they are, through
+ * pTmpSpace; other reads take whole frames or headers.
+ * @param fd
+ * @param buffer
+ * @param amount
+ * @param offset
+ * @return SQLITE_CORRUPT if the page fails authentication, SQLITE_NOTADB if
+ * it is under the new key of an interrupted rekey
+ */
+static int CodecWalRead(sqlite3_file *fd, void *buffer, int amount,
+                        sqlite3_int64 offset)
+{
+    CodecCryptBlock *block =
+        (CodecCryptBlock *)((char *)fd->pMethods -
+                            offsetof(CodecCryptBlock, wal));
+    Wal *wal = block->pager->pWal;
+    i64 frameSize = (i64)amount + WAL_FRAME_HDRSIZE;
+    SQLiteCipherContext *ctx = NULL;
+    sqlite3_uint64 start;
+    u32 frame;
+    int hash;
+    Pgno pgno;
+    int rc;
+
+    rc = block->wal.orig->xRead(fd, buffer, amount, offset);
+    if (rc != SQLITE_OK || block->file.bypass || amount != block->pageSize ||
+        wal == NULL || wal->pWalFd != fd || buffer == block->pager->pTmpSpace ||
+        block->batch != NULL || offset < WAL_HDRSIZE + WAL_FRAME_HDRSIZE ||
+        (offset - WAL_HDRSIZE) % frameSize != WAL_FRAME_HDRSIZE) {
+        return rc;
+    }
+    /* The page number of the frame, from the wal-index the pager found it
+     * in */
+    frame = (u32)((offset - WAL_HDRSIZE) / frameSize) + 1;
+    hash = walFramePage(frame);
+    if (hash >= wal->nWiData || wal->apWiData[hash] == NULL) {
+        return rc;
+    }
+    pgno = walFramePgno(wal, frame);
+    if (pgno == 1) {
+        return CodecCheckFirstPage(block, buffer, amount);
+    }
+    if (!CodecPageContext(block, pgno, block->rekeyWatermark, block->readCtx,
+                          &ctx)) {
+        block->file.pgno = pgno;
+        block->file.data = buffer;
+        return SQLITE_NOTADB;
+    }
+    if (ctx == NULL) {
+        return rc;
+    }
+
+    start = codecTiming ? CodecNanotime() : 0;
+    rc = SQLiteDecrypt(ctx, pgno, (const char *)buffer, (char *)buffer,
+                       amount);
+    block->file.pgno = pgno;
+    block->file.data = buffer;
+    if (rc != SQLITE_OK) {
+        sqlite3_log(SQLITE_CORRUPT, "codec: page %u of %s failed "
+                                    "authentication in frame %u of the WAL",
+                    pgno, block->pager->zFilename, frame);
+        return SQLITE_CORRUPT;
+    }
+    CodecStatRecord(block, SQLITE_CODEC_STAT_DECRYPT, start);
+    return SQLITE_OK;
+}
+#endif
+
+/**
+ * Swap the methods of the WAL file, once the pager has one open, for the
+ * ones decrypting the frames it loads. Called as read transactions start,
+ * since the pager opens and closes the WAL as the journal mode changes.
+ * @param block
+ */
+static void CodecWalInstall(CodecCryptBlock *block)
+{
+#ifndef SQLITE_OMIT_WAL
+    Wal *wal = block->pager->pWal;
+    const sqlite3_io_methods *orig;
+
+    if (wal == NULL || wal->pWalFd->pMethods == NULL ||
+        wal->pWalFd->pMethods == &block->wal.methods) {
+        return;
+    }
+    orig = wal->pWalFd->pMethods;
+    if (orig->xRead == CodecWalRead) {
+        /* Installed by the codec being replaced */
+        orig = ((const CodecFileMethods *)orig)->orig;
+    }
+    block->wal.methods = *orig;
+    block->wal.methods.xRead = CodecWalRead;
+    block->wal.orig = orig;
+    wal->pWalFd->pMethods = &block->wal.methods;
+#else
+    (void)block;
+#endif
+}
+
+/**
+ * Swap the methods of the database file for the ones decrypting the pages
+ * it reads
+ * @param block
+ */
+static void CodecFileInstall(CodecCryptBlock *block)
+{
+    sqlite3_file *fd = sqlite3PagerFile(block->pager);
+    const sqlite3_io_methods *orig;
+
+    if (fd == NULL || fd->pMethods == NULL) {
+        return;
+    }
+    orig = fd->pMethods;
+    if (orig->xRead == CodecFileRead) {
+        /* Installed by the codec being replaced */
+        orig = ((const CodecFileMethods *)orig)->orig;
+    }
+    block->file.methods = *orig;
+    block->file.methods.xRead = CodecFileRead;
+    block->file.methods.xWrite = CodecFileWrite;
+    block->file.methods.xTruncate = CodecFileTruncate;
+    block->file.methods.xUnlock = CodecFileUnlock;
+    block->file.methods.xFileControl = CodecFileControl;
+    if (orig->iVersion >= 2 && orig->xShmLock != NULL) {
+        block->file.methods.xShmLock = CodecFileShmLock;
+    }
+    block->file.orig = orig;
+    fd->pMethods = &block->file.methods;
+}
+
+/**
+ * Give the database file its own methods back
+ * @param block
+ */
+static void CodecFileRemove(CodecCryptBlock *block)
+{
+    sqlite3_file *fd = sqlite3PagerFile(block->pager);
+
+    if (fd != NULL && fd->pMethods == &block->file.methods) {
+        fd->pMethods = block->file.orig;
+    }
+#ifndef SQLITE_OMIT_WAL
+    if (block->pager->pWal != NULL &&
+        block->pager->pWal->pWalFd->pMethods == &block->wal.methods) {
+        block->pager->pWal->pWalFd->pMethods = block->wal.orig;
+    }
+#endif
+}
+
+/**
+ * Encrypting or decrypting a page callback
+ * to be called by CODEC1 and CODEC2 in pager.c
+ *
+ * Note:
+ * Decrypting is called via CODEC1 and only checks the returned value for
+ * NULL, which fails the read (therefore need to replace input data)
+ * Encrypting is called via CODEC2, taking returned value as buffer data to
+ * write (DO NOT replace input data)
+ * @param pArg the associated crypto block
+ * @param data data to be encrypted/decrypted
+ * @param nPageNum page number
+ * @param nMode
+ * @return
+ */
+void *SQLite3CodecCallback(void *pArg, void *data, Pgno nPageNum, int nMode)
+{
+    CodecCryptBlock *block = (CodecCryptBlock *)pArg;
+    if (!block)
+        return data;
+    char *retVal = data;
+    int32_t pageSize = block->pageSize;
+    int batchIndex = CodecBatchIndex(block, nPageNum);
+    sqlite3_uint64 start = codecTiming ? CodecNanotime() : 0;
+    int stat = -1;
+    SQLiteCipherContext *ctx;
+
+    switch (nMode) {
+    case 0: /* Undo a "case 7" journal file encryption */
+    case 2: /* Reload a page */
+    case 3: /* Load a page */
+        /* In heap memory WAL mode no shm lock hooks the WAL file: the
+         * frames loaded after this one are decrypted by it */
+        CodecWalInstall(block);
+        if (block->file.data != NULL) {
+            int direct = (nMode == 3 && block->file.data == data &&
+                          block->file.pgno == nPageNum);
+            block->file.data = NULL;
+            if (direct) {
+                /* Decrypted (or failed) by CodecFileRead */
+                break;
+            }
+        }
+        if (!CodecPageContext(block, nPageNum, block->rekeyWatermark,
+                              block->readCtx, &ctx))
+            return NULL;
+        if (!ctx)
+            break;
+        stat = SQLITE_CODEC_STAT_DECRYPT;
+        if (nPageNum == 1) {
+            SQLiteCipherContext *found;
+            SQLiteCipherContext *used;
+            if (block->buffers.size != pageSize)
+                return NULL;
+            found = DecryptFirstPage(ctx, sqlite3PagerFile(block->pager), data,
+                                     (char *)block->buffers.main, pageSize);
+            /* Kept by the block either way */
+            used = found != NULL ? found : ctx;
+            block->headerCtx = (used->format == CODEC_FORMAT_GCM &&
+                                FirstPageMatches(data, SQLITE_OK))
+                                   ? used
+                                   : NULL;
+            if (found != NULL) {
+                /* Read and written in that format from now on */
+                int write = (block->writeCtx == ctx);
+                if (block->readCtx == ctx) {
+                    CodecBlockSetContext(block, &block->readCtx,
+                                         CipherContextRetain(found));
+                }
+                if (write) {
+                    CodecBlockSetContext(block, &block->writeCtx,
+                                         CipherContextRetain(found));
+                }
+                CipherContextRelease(found);
+            }
+            CodecRekeyNotice(block);
+            break;
+        }
+        if (nMode == 3 && batchIndex >= 0) {
+            /* Rekey batch: decrypted by the workers */
+            block->batch->loaded[batchIndex] = 1;
+            stat = -1;
+            break;
+        }
+        if (SQLiteDecrypt(ctx, nPageNum, data, data, pageSize) != SQLITE_OK) {
+            /* Fail the read rather than hand sqlite a forged page. Pages
+             * loaded from the files fail in their xRead as SQLITE_CORRUPT,
+             * the ones that get here (read before the WAL was hooked,
+             * reloaded from the journal) fail as SQLITE_NOMEM */
+            sqlite3_log(SQLITE_CORRUPT, "codec: page %u of %s failed "
+                                        "authentication",
+                        nPageNum, block->pager->zFilename);
+            retVal = NULL;
+        }
+        break;
+    case 6: /* Encrypt a page for the main database file */
+        if (!CodecPageContext(block, nPageNum, block->rekeyTarget,
+                              block->writeCtx, &ctx))
+            return NULL;
+        if (!ctx)
+            break;
+        if (!CodecCanWrite(block, ctx))
+            return NULL;
+        if (batchIndex >= 0 && block->batch->ready &&
+            block->batch->data[batchIndex] == data) {
+            /* Rekey batch: encrypted by the workers */
+            return block->batch->output + (size_t)batchIndex * pageSize;
+        }
+        stat = SQLITE_CODEC_STAT_ENCRYPT;
+        retVal = (char *)CodecWriteBatchLoad(block, ctx, nPageNum, data);
+        if (retVal != NULL) {
+            break;
+        }
+        if (block->buffers.size != pageSize)
+            return NULL;
+        SQLiteEncrypt(ctx, nPageNum, data, (char *)block->buffers.main,
+                      pageSize);
+        retVal = (char *)block->buffers.main;
+        break;
+    case 7: /* Encrypt a page for the journal file */
+        /* Under normal circumstances, the readkey is the same as the writekey.
+        However,
+        when the database is being rekeyed, the readkey is not the same as the
+        writekey.
+        The rollback journal must be written using the original key for the
+        database file because it is, by nature, a rollback journal.
+        Therefore, for case 7, when the rollback is being written, always
+        encrypt using
+        the database's readkey, which is guaranteed to be the same key that was
+        used to
+        read the original data.
+        (During an incremental rekey that is the key the page is stored under)
+        */
+        if (!CodecPageContext(block, nPageNum, block->rekeyWatermark,
+                              block->readCtx, &ctx))
+            return NULL;
+        if (!ctx)
+            break;
+        if (!CodecCanWrite(block, ctx))
+            return NULL;
+        if (batchIndex >= 0 && block->batch->loaded[batchIndex]) {
+            /* Rekey batch: the page still is the ciphertext from the file */
+            break;
+        }
+        if (block->buffers.size != pageSize)
+            return NULL;
+        SQLiteEncrypt(ctx, nPageNum, data, (char *)block->buffers.journal,
+                      pageSize);
+        retVal = (char *)block->buffers.journal;
+        stat = SQLITE_CODEC_STAT_JOURNAL;
+        break;
+    }
+
+    if (stat >= 0) {
+        CodecStatRecord(block, stat, start);
+    }
+    return retVal;
+}
+
+/**
+ * Create a new encryption block with a key and assign the codec to a
+ * database of the connection
+ * @param db
+ * @param nDb
+ * @param ctx the key, whose reference is taken over
+ * @return SQLITE_OK, SQLITE_NOMEM
+ */
+static int CodecAttachContext(sqlite3 *db, int nDb, SQLiteCipherContext *ctx)
+{
+    Pager *pager = sqlite3BtreePager(db->aDb[nDb].pBt);
+    CodecCryptBlock *block = CreateCodeCryptBlock(ctx, pager, -1, NULL);
+    if (!block) {
+        CipherContextRelease(ctx);
+        return SQLITE_NOMEM;
+    }
+
+    sqlite3PagerSetCodec(pager, SQLite3CodecCallback,
+                         SQLite3CodecSizeChangedCallback,
+                         SQLite3CodecFreeCallback, block);
+
+    /* Ask for room for the GCM trailer. This only takes effect for a new
+     * database, an existing one keeps the reserve recorded in its header
+     * (and is read in its own format anyway) */
+    if (CipherContextReserve(ctx) > 0) {
+        sqlite3BtreeSetPageSize(db->aDb[nDb].pBt, 0,
+                                CipherContextReserve(ctx), 0);
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Called to attach a key to a database
+ * in (attach.c)
+ * @param db
+ * @param nDb
+ * @param pKey
+ * @param nKeyLen
+ * @return
+ */
+int sqlite3CodecAttach(sqlite3 *db, int nDb, const void *pKey, int nKeyLen)
+{
+    int rc = SQLITE_ERROR;
+    SQLiteCipherContext *ctx = NULL;
+
+    /* No key specified, could mean either use the main db's encryption or no
+     * encryption */
+    if (pKey == NULL || nKeyLen == 0) {
+        if (nDb == 0) {
+            /* Main database, no key specified so not encrypted */
+            return SQLITE_OK;
+        } else {
+            /*
+             * Attached database, use the main database's key
+             * Get the encryption block for the main database and attempt to
+             * duplicate the key
+             * for use by the attached database
+             */
+            Pager *pager = sqlite3BtreePager(db->aDb[0].pBt);
             CodecCryptBlock *pBlock =
                 (CodecCryptBlock *)sqlite3PagerGetCodec(pager);
 
-            if (!pBlock)
-                return SQLITE_OK; /* Main database is not encrypted so neither
-                                     will be any attached database */
-            if (!pBlock->readCtx)
-                return SQLITE_OK; /* Not encrypted */
+            if (!pBlock)
+                return SQLITE_OK; /* Main database is not encrypted so neither
+                                     will be any attached database */
+            if (!pBlock->readCtx)
+                return SQLITE_OK; /* Not encrypted */
+
+            ctx = CipherContextRetain(pBlock->readCtx);
+        }
+    } else { /* User-supplied passphrase, so create a cryptographic key out of
+                it */
+        ctx = CipherContextNew(pKey, nKeyLen);
+        if (ctx == NULL) {
+            return SQLITE_NOMEM;
+        }
+    }
+
+    if (ctx != NULL) {
+        rc = CodecAttachContext(db, nDb, ctx);
+    }
+    return rc;
+}
+
+/**
+ * Get the stored crypto key
+ * Once a password has been supplied and a key created, we don't keep the
+ * original password for security purposes.  Therefore return NULL.
+ * @param db
+ * @param nDb
+ * @param ppKey
+ * @param pnKeyLen
+ */
+void sqlite3CodecGetKey(sqlite3 *db, int nDb, void **ppKey, int *pnKeyLen)
+{
+    Btree *pbt = db->aDb[0].pBt;
+    Pager *p = sqlite3BtreePager(pbt);
+    CodecCryptBlock *pBlock = (CodecCryptBlock *)sqlite3PagerGetCodec(p);
+
+    if (ppKey != NULL) {
+        *ppKey = 0;
+    }
+    if (pnKeyLen != NULL && pBlock != NULL) {
+        *pnKeyLen = 1;
+    }
+}
+
+/**
+ * Deprecated. Use sqlite3_key_v2.
+ *
+ * @param db
+ * @param pKey
+ * @param nKey
+ * @return
+ */
+SQLITE_API int sqlite3_key(sqlite3 *db, /* Database to be rekeyed */
+                           const void *pKey, int nKey /* The key */
+                           )
+{
+    return sqlite3_key_v2(db, NULL, pKey, nKey);
+}
+
+/**
+ * Specify the key for an encrypted database.  This routine should be called
+ * right after sqlite3_open(), or right after ATTACH for an attached
+ * database.
+ *
+ * The code to implement this API is not available in the public release
+ * of SQLite.
+ * @param db
+ * @param zDbName schema name, NULL for main
+ * @param pKey
+ * @param nKey
+ * @return
+ */
+SQLITE_API int sqlite3_key_v2(sqlite3 *db,         /* Database to be rekeyed */
+                              const char *zDbName, /* Name of the database */
+                              const void *pKey, int nKey /* The key */
+                              )
+{
+    int iDb = CodecDbIndex(db, zDbName);
+
+    if (iDb < 0) {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "unknown database %s", zDbName);
+        return SQLITE_ERROR;
+    }
+    return sqlite3CodecAttach(db, iDb, pKey, nKey);
+}
+
+static int codecRekeyThreads = SQLITE_CODEC_REKEY_THREADS;
+
+/**
+ * Set the number of threads sqlite3_rekey_v2 spreads the page cipher work
+ * over, including the calling thread. The pager I/O stays on the calling
+ * thread. Applies to the whole process, like sqlite3_config.
+ * @param nThreads new count, or a negative value to only query it
+ * @return the previous count
+ */
+SQLITE_API int sqlite3_codec_rekey_threads(int nThreads)
+{
+    int prev = codecRekeyThreads;
+    if (nThreads >= 0) {
+        if (nThreads < 1) {
+            nThreads = 1;
+        }
+        if (nThreads > CODEC_REKEY_MAX_THREADS) {
+            nThreads = CODEC_REKEY_MAX_THREADS;
+        }
+        codecRekeyThreads = nThreads;
+    }
+    return prev;
+}
+
+/**
+ * Share of a rekey batch handled by one thread
+ */
+typedef struct
+{
+    CodecCryptBlock *block;
+    int start;   /* First index in the batch */
+    int end;     /* One past the last index */
+    int encrypt; /* Also encrypt into the batch output */
+    int rc;
+} CodecRekeyTask;
+
+/**
+ * Rekey worker: decrypt the pages left encrypted in place, then encrypt
+ * them with the write key into the batch output
+ * @param pArg CodecRekeyTask
+ * @return NULL
+ */
+static void *CodecRekeyWork(void *pArg)
+{
+    CodecRekeyTask *task = (CodecRekeyTask *)pArg;
+    CodecCryptBlock *block = task->block;
+    CodecRekeyBatch *batch = block->batch;
+    int pageSize = block->pageSize;
+    int i;
+
+    for (i = task->start; i < task->end; i++) {
+        Pgno pgno = batch->first + (Pgno)i;
+        char *data = (char *)batch->data[i];
+        if (batch->pages[i] == NULL) {
+            continue;
+        }
+        if (batch->loaded[i]) {
+            if (SQLiteDecrypt(block->readCtx, pgno, data, data, pageSize) !=
+                    SQLITE_OK &&
+                task->rc == SQLITE_OK) {
+                sqlite3_log(SQLITE_CORRUPT,
+                            "codec: page %u of %s failed authentication",
+                            pgno, block->pager->zFilename);
+                task->rc = SQLITE_CORRUPT;
+            }
+            batch->loaded[i] = 0;
+        }
+        if (task->encrypt && block->writeCtx != NULL) {
+            SQLiteEncrypt(block->writeCtx, pgno, data,
+                          (char *)batch->output + (size_t)i * pageSize,
+                          pageSize);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run a worker over an array of tasks, each on its own thread
+ * The calling thread takes the first task itself.
+ * @param xWork worker
+ * @param aTask tasks
+ * @param taskSize size of a task
+ * @param nTask number of tasks, at most CODEC_REKEY_MAX_THREADS
+ */
+static void CodecRunTasks(void *(*xWork)(void *), void *aTask, size_t taskSize,
+                          int nTask)
+{
+    char *tasks = (char *)aTask;
+#if SQLITE_MAX_WORKER_THREADS > 0
+    SQLiteThread *threads[CODEC_REKEY_MAX_THREADS];
+    int i;
+
+    for (i = 1; i < nTask; i++) {
+        /* Runs the task synchronously if no thread can be started */
+        if (sqlite3ThreadCreate(&threads[i], xWork, tasks + i * taskSize) !=
+            SQLITE_OK) {
+            threads[i] = NULL;
+            xWork(tasks + i * taskSize);
+        }
+    }
+    xWork(tasks);
+    for (i = 1; i < nTask; i++) {
+        if (threads[i] != NULL) {
+            void *out;
+            sqlite3ThreadJoin(threads[i], &out);
+        }
+    }
+#else
+    int i;
+
+    for (i = 0; i < nTask; i++) {
+        xWork(tasks + i * taskSize);
+    }
+#endif
+}
+
+/**
+ * Run the rekey workers over the batch in progress
+ * @param block
+ * @param nThreads
+ * @param encrypt whether to encrypt with the write key too
+ * @return SQLITE_OK or SQLITE_CORRUPT
+ */
+static int CodecRekeyRun(CodecCryptBlock *block, int nThreads, int encrypt)
+{
+    CodecRekeyTask tasks[CODEC_REKEY_MAX_THREADS];
+    int count = block->batch->count;
+    int rc = SQLITE_OK;
+    int i;
+
+    if (nThreads > count) {
+        nThreads = count > 0 ? count : 1;
+    }
+    for (i = 0; i < nThreads; i++) {
+        tasks[i].block = block;
+        tasks[i].start = (int)((int64_t)count * i / nThreads);
+        tasks[i].end = (int)((int64_t)count * (i + 1) / nThreads);
+        tasks[i].encrypt = encrypt;
+        tasks[i].rc = SQLITE_OK;
+    }
+
+    CodecRunTasks(CodecRekeyWork, tasks, sizeof(tasks[0]), nThreads);
+
+    for (i = 0; i < nThreads; i++) {
+        if (tasks[i].rc != SQLITE_OK) {
+            rc = tasks[i].rc;
+        }
+    }
+    return rc;
+}
+
+/**
+ * Threads sharing the page cipher work of a rekey of the block
+ * @param block
+ * @return
+ */
+static int CodecRekeyThreads(CodecCryptBlock *block)
+{
+    return block->rekeyThreads > 0 ? block->rekeyThreads : codecRekeyThreads;
+}
+
+/**
+ * Pages per rekey batch: CODEC_REKEY_CHUNK bytes per thread, but at most
+ * half the page cache as the whole batch stays referenced
+ * @param block
+ * @return
+ */
+static int CodecBatchCapacity(CodecCryptBlock *block)
+{
+    int perThread = CODEC_REKEY_CHUNK / block->pageSize;
+    int cachePages = numberOfCachePages(block->pager->pPCache) / 2;
+    int capacity = CodecRekeyThreads(block) * (perThread > 0 ? perThread : 1);
+
+    if (capacity > cachePages) {
+        capacity = cachePages > 0 ? cachePages : 1;
+    }
+    return capacity;
+}
+
+/**
+ * Allocate a rekey batch and set it on the crypto block
+ * @param block
+ * @param batch
+ * @param capacity
+ * @return
+ */
+static int CodecBatchInit(CodecCryptBlock *block, CodecRekeyBatch *batch,
+                          int capacity)
+{
+    memset(batch, 0, sizeof(CodecRekeyBatch));
+    batch->capacity = capacity;
+    batch->pages = (DbPage **)sqlite3_malloc64(sizeof(DbPage *) * capacity);
+    batch->data = (uint8_t **)sqlite3_malloc64(sizeof(uint8_t *) * capacity);
+    batch->loaded = (uint8_t *)sqlite3_malloc64(capacity);
+    batch->output = (uint8_t *)sqlite3_malloc64((sqlite3_uint64)capacity *
+                                                block->pageSize);
+    if (batch->pages == NULL || batch->data == NULL ||
+        batch->loaded == NULL || batch->output == NULL) {
+        return SQLITE_NOMEM;
+    }
+    block->batch = batch;
+    return SQLITE_OK;
+}
+
+/**
+ * Free a rekey batch and take it off the crypto block
+ * @param block
+ * @param batch
+ */
+static void CodecBatchFree(CodecCryptBlock *block, CodecRekeyBatch *batch)
+{
+    block->batch = NULL;
+    sqlite3_free(batch->pages);
+    sqlite3_free(batch->data);
+    sqlite3_free(batch->loaded);
+    sqlite3_free(batch->output);
+}
+
+/**
+ * Load and journal pages first..first+count-1 into the batch, in the open
+ * write transaction
+ * @param block
+ * @param first
+ * @param count
+ * @return
+ */
+static int CodecBatchLoad(CodecCryptBlock *block, Pgno first, int count)
+{
+    CodecRekeyBatch *batch = block->batch;
+    Pager *p = block->pager;
+    Pgno nSkip = PAGER_MJ_PGNO(p);
+    int rc = SQLITE_OK;
+    int i;
+
+    batch->first = first;
+    batch->count = count;
+    batch->ready = 0;
+    memset(batch->pages, 0, sizeof(DbPage *) * count);
+    memset(batch->loaded, 0, count);
+
+    for (i = 0; i < count && rc == SQLITE_OK; i++) {
+        if (first + (Pgno)i == nSkip) {
+            continue;
+        }
+        rc = sqlite3PagerGet(p, first + (Pgno)i, &batch->pages[i], 0);
+        if (rc == SQLITE_OK) {
+            batch->data[i] = (uint8_t *)sqlite3PagerGetData(batch->pages[i]);
+        } else {
+            batch->pages[i] = NULL;
+        }
+    }
+    for (i = 0; i < count && rc == SQLITE_OK; i++) {
+        if (batch->pages[i] != NULL) {
+            rc = sqlite3PagerWrite(batch->pages[i]);
+        }
+    }
+    return rc;
+}
+
+/**
+ * Cipher the loaded batch on the workers. This must run even if loading
+ * failed, pages left encrypted must not stay in the cache.
+ * @param block
+ * @param rc result of loading
+ * @return
+ */
+static int CodecBatchCipher(CodecCryptBlock *block, int rc)
+{
+    int rc2 = CodecRekeyRun(block, CodecRekeyThreads(block), rc == SQLITE_OK);
+    if (rc == SQLITE_OK) {
+        rc = rc2;
+    }
+    block->batch->ready = (rc == SQLITE_OK);
+    return rc;
+}
+
+/**
+ * Drop the references held on the batch pages
+ * @param block
+ */
+static void CodecBatchRelease(CodecCryptBlock *block)
+{
+    CodecRekeyBatch *batch = block->batch;
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->pages[i] != NULL) {
+            sqlite3PagerUnref(batch->pages[i]);
+            batch->pages[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Rewrite pages 2..nPage in the open write transaction, in batches: load
+ * and journal them on this thread, cipher them on the workers, then have the
+ * pager write them out
+ * @param block
+ * @param nPage
+ * @return
+ */
+static int CodecRekeyPages(CodecCryptBlock *block, Pgno nPage)
+{
+    CodecRekeyBatch batch;
+    int capacity = CodecBatchCapacity(block);
+    int rc;
+    Pgno n;
+
+    if (nPage > 1 && (Pgno)capacity > nPage - 1) {
+        capacity = (int)(nPage - 1);
+    }
+    rc = CodecBatchInit(block, &batch, capacity);
+    for (n = 2; n <= nPage && rc == SQLITE_OK; n += capacity) {
+        int count = capacity;
+        if (nPage - n + 1 < (Pgno)count) {
+            count = (int)(nPage - n + 1);
+        }
+        rc = CodecBatchCipher(block, CodecBatchLoad(block, n, count));
+        CodecBatchRelease(block);
+
+        /* Write the pages while their encrypted copies are at hand; pages
+         * the pager won't spill now are encrypted again when committing */
+        if (rc == SQLITE_OK) {
+            rc = sqlite3PagerFlush(block->pager);
+        }
+        batch.ready = 0;
+    }
+    CodecBatchFree(block, &batch);
+    return rc;
+}
+
+static int CodecRekey(sqlite3 *db, int iDb, SQLiteCipherContext *ctx,
+                      int nThreads);
+
+/**
+ * Deprecated. Use sqlite3_rekey_v2.
+ */
+SQLITE_API int sqlite3_rekey(sqlite3 *db, /* Database to be rekeyed */
+                             const void *pKey, int nKey /* The new key */
+                             )
+{
+    return sqlite3_rekey_v2(db, NULL, pKey, nKey);
+}
+
+/**
+ * Change the key on an open database.
+ *
+ * If the current database is not encrypted, this routine will encrypt it. If
+ * pNew==0 or nNew==0,
+ * the database is decrypted.
+ *
+ * The pages are rewritten in batches whose decryption and encryption is
+ * spread over sqlite3_codec_rekey_threads threads.
+ *
+ * The code to implement this API is not available in the public release of
+ * SQLite.
+ * @param db
+ * @param zDbName schema name, NULL for main
+ * @param pKey
+ * @param nKey
+ * @return
+ */
+SQLITE_API int sqlite3_rekey_v2(sqlite3 *db, /* Database to be rekeyed */
+                                const char *zDbName, /* Name of the database */
+                                const void *pKey, int nKey /* The new key */
+                                )
+{
+    int iDb = CodecDbIndex(db, zDbName);
+    SQLiteCipherContext *ctx = NULL;
+
+    if (iDb < 0) {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "unknown database %s", zDbName);
+        return SQLITE_ERROR;
+    }
+    if (pKey != NULL && nKey > 0) {
+        ctx = CipherContextNew(pKey, nKey);
+        if (ctx == NULL) {
+            return SQLITE_NOMEM;
+        }
+    }
+    return CodecRekey(db, iDb, ctx, 0);
+}
+
+/**
+ * Rewrite a database of the connection under a new key in one transaction,
+ * see sqlite3_rekey_v2
+ * @param db
+ * @param iDb
+ * @param ctx the new key, whose reference is taken over, NULL to decrypt
+ * @param nThreads threads sharing the page cipher work, 0 for
+ * sqlite3_codec_rekey_threads
+ * @return
+ */
+static int CodecRekey(sqlite3 *db, int iDb, SQLiteCipherContext *ctx,
+                      int nThreads)
+{
+    Btree *pbt = db->aDb[iDb].pBt;
+    Pager *p = sqlite3BtreePager(pbt);
+    CodecCryptBlock *block = (CodecCryptBlock *)sqlite3PagerGetCodec(p);
+    int rc = SQLITE_ERROR;
+
+    if (block != NULL && block->rekeyWatermark != 0) {
+        CipherContextRelease(ctx);
+        sqlite3ErrorWithMsg(db, SQLITE_MISUSE, "an incremental rekey is in "
+                                               "progress");
+        return SQLITE_MISUSE;
+    }
+
+    /* To rekey a database, we change the writekey for the pager.  The readkey
+     * remains the same */
+
+    if (block == NULL) /* Encrypt an unencrypted database */
+    {
+        block = CreateCodeCryptBlock(ctx, p, -1, NULL);
+        if (block == NULL) {
+            CipherContextRelease(ctx);
+            return SQLITE_NOMEM;
+        }
+
+        block->readCtx = NULL; /* Original database is not encrypted */
+        sqlite3PagerSetCodec(sqlite3BtreePager(pbt), SQLite3CodecCallback,
+                             SQLite3CodecSizeChangedCallback,
+                             SQLite3CodecFreeCallback, block);
+    } else {
+        /* Change the writekey for an already-encrypted database */
+        CodecBlockSetContext(block, &block->writeCtx, ctx);
+    }
+    block->rekeyThreads = nThreads;
+
+    /* Rewrite the whole database to ensure new writekey is used */
+    sqlite3_mutex_enter(db->mutex);
+
+    /* A new database gets room for the GCM trailer, an existing one must
+     * already have it */
+    if (ctx != NULL && CipherContextReserve(ctx) > 0) {
+        sqlite3BtreeSetPageSize(pbt, 0, CipherContextReserve(ctx), 0);
+    }
+
+    /* Start a transaction */
+    rc = sqlite3BtreeBeginTrans(pbt, 1);
+
+    if (rc == SQLITE_OK && ctx != NULL &&
+        CipherContextReserve(ctx) > block->reserve) {
+        rc = SQLITE_ERROR;
+        sqlite3ErrorWithMsg(db, rc, "database has %d reserved bytes per page, "
+                                    "the cipher needs %d",
+                            block->reserve, CipherContextReserve(ctx));
+    }
+
+    if (rc == SQLITE_OK) {
+        /* Rewrite all the pages in the database using the new encryption key,
+         * page 1 on its own as its decryption recognises the format */
+        CodecRekeyProgress progress;
+        DbPage *pPage;
+        int count;
+
+        sqlite3PagerPagecount(p, &count);
+
+        /* An interrupted incremental rekey must be resumed first, also
+         * when this connection has no codec to have noticed */
+        rc = CodecRekeyLoad(block, &progress);
+        if (rc == SQLITE_OK && progress.watermark != 0) {
+            rc = SQLITE_MISUSE;
+            sqlite3ErrorWithMsg(db, rc, "an incremental rekey is in "
+                                        "progress");
+        }
+        if (rc == SQLITE_OK && count > 0) {
+            rc = sqlite3PagerGet(p, 1, &pPage, 0);
+            if (!rc) {
+                rc = sqlite3PagerWrite(pPage);
+                sqlite3PagerUnref(pPage);
+            }
+        }
+        if (rc == SQLITE_OK && count > 1) {
+            rc = CodecRekeyPages(block, (Pgno)count);
+        }
+    }
+
+    /* If we succeeded, try and commit the transaction */
+    if (rc == SQLITE_OK) {
+        rc = sqlite3BtreeCommit(pbt);
+    } else {
+        /* If we failed, rollback */
+        sqlite3BtreeRollback(pbt, SQLITE_OK, 1);
+    }
+
+    /* If we succeeded, destroy any previous read key this database used and
+     * make the readkey equal to the writekey */
+    if (rc == SQLITE_OK) {
+        CodecBlockSetContext(block, &block->readCtx,
+                             CipherContextRetain(block->writeCtx));
+    }
+    /* We failed.  Destroy the new writekey (if there was one) and revert it
+       back to the original readkey */
+    else {
+        CodecBlockSetContext(block, &block->writeCtx,
+                             CipherContextRetain(block->readCtx));
+    }
+
+    block->rekeyThreads = 0;
+
+    /* If the readkey and writekey are both empty, there's no need for a codec
+     * on this pager anymore. Remove the codec from the pager.
+     * sqlite3PagerSetCodec calls FreeCodecCryptBlock for this block
+     */
+    if (block->readCtx == NULL && block->writeCtx == NULL) {
+        sqlite3PagerSetCodec(p, NULL, NULL, NULL, NULL);
+    }
+    
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+/**
+ * Check value of a write key: a constant block encrypted with it, recorded
+ * with the progress of an incremental rekey so that it can only be resumed
+ * with the same key
+ * @param ctx write key, NULL for decryption
+ * @param check
+ */
+static void CodecKeyCheck(SQLiteCipherContext *ctx,
+                          uint8_t check[CODEC_KEYCHECKSIZE])
+{
+    static const uint8_t constant[BLOCKSIZE] = "xsqlite rekey";
+    uint8_t out[BLOCKSIZE];
+
+    memset(check, 0, CODEC_KEYCHECKSIZE);
+    if (ctx != NULL) {
+        mbedtls_aes_crypt_ecb(&ctx->encrypt, MBEDTLS_AES_ENCRYPT, constant,
+                              out);
+        memcpy(check, out, CODEC_KEYCHECKSIZE);
+    }
+}
+
+/**
+ * Hash of a page as stored, in the WAL if it has a frame of it, in the open
+ * transaction
+ * @param block
+ * @param pgno
+ * @param hash
+ * @return
+ */
+static int CodecStoredHash(CodecCryptBlock *block, Pgno pgno,
+                           uint8_t hash[CODEC_PAGEHASHSIZE])
+{
+    Pager *pager = block->pager;
+    uint8_t *page = (uint8_t *)sqlite3_malloc(block->pageSize);
+    u32 frame = 0;
+    int rc = SQLITE_OK;
+
+    if (page == NULL) {
+        return SQLITE_NOMEM;
+    }
+    /* As it is, not decrypted by the file methods */
+    block->file.bypass = 1;
+#ifndef SQLITE_OMIT_WAL
+    if (pager->pWal != NULL) {
+        rc = sqlite3WalFindFrame(pager->pWal, pgno, &frame);
+    }
+    if (rc == SQLITE_OK && frame != 0) {
+        rc = sqlite3WalReadFrame(pager->pWal, frame, block->pageSize, page);
+    }
+#endif
+    if (rc == SQLITE_OK && frame == 0) {
+        rc = sqlite3OsRead(sqlite3PagerFile(pager), page, block->pageSize,
+                           (i64)(pgno - 1) * block->pageSize);
+        if (rc == SQLITE_IOERR_SHORT_READ) {
+            rc = SQLITE_OK; /* Zero filled */
+        }
+    }
+    block->file.bypass = 0;
+    if (rc == SQLITE_OK) {
+        CodecProgressHash(page, (size_t)block->pageSize, hash,
+                          CODEC_PAGEHASHSIZE);
+    }
+    sqlite3_free(page);
+    return rc;
+}
+
+/**
+ * Settle the progress of an interrupted rekey whose last step may have
+ * committed: its witness page is rewritten if it no longer hashes the same
+ * @param block
+ * @param progress
+ * @return
+ */
+static int CodecRekeySettle(CodecCryptBlock *block,
+                            CodecRekeyProgress *progress)
+{
+    uint8_t hash[CODEC_PAGEHASHSIZE];
+    int rc = SQLITE_OK;
+
+    if (progress->target == progress->watermark) {
+        return SQLITE_OK;
+    }
+    if (progress->witness != 0) {
+        rc = CodecStoredHash(block, progress->witness, hash);
+    }
+    if (rc == SQLITE_OK) {
+        if (progress->witness != 0 &&
+            memcmp(hash, progress->hash, CODEC_PAGEHASHSIZE) != 0) {
+            progress->watermark = progress->target;
+        } else {
+            progress->target = progress->watermark;
+        }
+    }
+    return rc;
+}
+
+/**
+ * Start or resume an incremental rekey
+ *
+ * Unlike sqlite3_rekey_v2 the database is rewritten by sqlite3_rekey_step,
+ * a bounded number of pages per transaction, from the last page down.
+ * Pages from the watermark on are under the new key. The watermark is
+ * recorded in a "-rekey" file next to the database, synced before and
+ * after each step commits, so after a crash the rekey is resumed by calling
+ * this again with the same new key. Until then pages under the new key
+ * can't be read (SQLITE_NOTADB). The file is removed when the rekey is
+ * done, and must be kept with the database until then.
+ * @param db
+ * @param zDbName
+ * @param pKey the new key, NULL to decrypt
+ * @param nKey
+ * @return SQLITE_OK, SQLITE_MISUSE if a rekey is in progress on the
+ * connection or the key doesn't match the interrupted one
+ */
+SQLITE_API int sqlite3_rekey_start(sqlite3 *db, const char *zDbName,
+                                   const void *pKey, int nKey)
+{
+    int iDb = CodecDbIndex(db, zDbName);
+    Btree *pbt;
+    Pager *p;
+    CodecCryptBlock *block;
+    SQLiteCipherContext *ctx = NULL;
+    CodecRekeyProgress progress;
+    uint8_t check[CODEC_KEYCHECKSIZE];
+    Pgno watermark = 0;
+    int created = 0, recorded = 0;
+    int count = 0;
+    int rc;
+
+    if (iDb < 0) {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "unknown database %s", zDbName);
+        return SQLITE_ERROR;
+    }
+    pbt = db->aDb[iDb].pBt;
+    p = sqlite3BtreePager(pbt);
+    block = (CodecCryptBlock *)sqlite3PagerGetCodec(p);
+
+    if (block != NULL && block->rekeySession) {
+        return SQLITE_MISUSE;
+    }
+    if (pKey != NULL && nKey > 0) {
+        ctx = CipherContextNew(pKey, nKey);
+        if (ctx == NULL) {
+            return SQLITE_NOMEM;
+        }
+    }
+
+    if (block == NULL) /* Encrypt an unencrypted database */
+    {
+        if (ctx == NULL) {
+            return SQLITE_OK;
+        }
+        block = CreateCodeCryptBlock(ctx, p, -1, NULL);
+        if (block == NULL) {
+            CipherContextRelease(ctx);
+            return SQLITE_NOMEM;
+        }
+        /* Stays unencrypted until the new key is in place */
+        block->readCtx = NULL;
+        block->writeCtx = NULL;
+        sqlite3PagerSetCodec(p, SQLite3CodecCallback,
+                             SQLite3CodecSizeChangedCallback,
+                             SQLite3CodecFreeCallback, block);
+        created = 1;
+    }
+
+    sqlite3_mutex_enter(db->mutex);
+
+    if (ctx != NULL && CipherContextReserve(ctx) > 0) {
+        sqlite3BtreeSetPageSize(pbt, 0, CipherContextReserve(ctx), 0);
+    }
+
+    rc = sqlite3BtreeBeginTrans(pbt, 1);
+
+    if (rc == SQLITE_OK && ctx != NULL &&
+        CipherContextReserve(ctx) > block->reserve) {
+        rc = SQLITE_ERROR;
+        sqlite3ErrorWithMsg(db, rc, "database has %d reserved bytes per page, "
+                                    "the cipher needs %d",
+                            block->reserve, CipherContextReserve(ctx));
+    }
+
+    /* Read in the write transaction, so that no other step is under way */
+    if (rc == SQLITE_OK) {
+        sqlite3PagerPagecount(p, &count);
+        CodecKeyCheck(ctx, check);
+        rc = CodecRekeyLoad(block, &progress);
+    }
+
+    if (rc == SQLITE_OK && progress.watermark != 0) {
+        /* Resume */
+        if (memcmp(check, progress.check, CODEC_KEYCHECKSIZE) != 0) {
+            rc = SQLITE_MISUSE;
+            sqlite3ErrorWithMsg(db, rc, "key does not match the "
+                                        "interrupted rekey");
+        } else {
+            memcpy(block->rekeyCheck, check, CODEC_KEYCHECKSIZE);
+            block->rekeySequence = progress.sequence;
+        }
+        if (rc == SQLITE_OK && progress.target != progress.watermark) {
+            /* Interrupted around the commit of a step */
+            rc = CodecRekeySettle(block, &progress);
+            if (rc == SQLITE_OK && progress.watermark == 1) {
+                progress.watermark = 0; /* It was the last one */
+            }
+            if (rc == SQLITE_OK) {
+                rc = CodecRekeyStore(block, progress.watermark,
+                                     progress.watermark, 0, NULL);
+            }
+        }
+        watermark = progress.watermark;
+    } else if (rc == SQLITE_OK && count > 0) {
+        memcpy(block->rekeyCheck, check, CODEC_KEYCHECKSIZE);
+        block->rekeySequence = 0;
+        watermark = (Pgno)count + 1;
+        rc = CodecRekeyStore(block, watermark, watermark, 0, NULL);
+        recorded = 1;
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = sqlite3BtreeCommit(pbt);
+    } else {
+        sqlite3BtreeRollback(pbt, SQLITE_OK, 1);
+    }
+    if (rc != SQLITE_OK && recorded) {
+        CodecRekeyStore(block, 0, 0, 0, NULL);
+    }
+
+    if (rc == SQLITE_OK) {
+        CodecBlockSetContext(block, &block->writeCtx, ctx);
+        if (watermark == 0) {
+            /* Nothing to rewrite, or the interrupted rekey was done */
+            CodecBlockSetContext(block, &block->readCtx,
+                                 CipherContextRetain(ctx));
+            block->rekeyWatermark = 0;
+            block->rekeyTarget = 0;
+            block->rekeyKeyed = 0;
+        } else {
+            block->rekeyWatermark = watermark;
+            block->rekeyTarget = watermark;
+            block->rekeyKeyed = 1;
+            block->rekeySession = 1;
+        }
+    } else {
+        CipherContextRelease(ctx);
+    }
+
+    /* Remove a codec that has nothing left to do */
+    if (block->readCtx == NULL && block->writeCtx == NULL &&
+        block->rekeyWatermark == 0) {
+        sqlite3PagerSetCodec(p, NULL, NULL, NULL, NULL);
+    } else if (created && rc != SQLITE_OK) {
+        sqlite3PagerSetCodec(p, NULL, NULL, NULL, NULL);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+    return rc;
+}
+
+/**
+ * Rewrite up to nPage pages under the new key in one transaction
+ * Normal reads and writes can go on between steps. If the commit fails, it
+ * may still have made it: the session ends, and sqlite3_rekey_start tells
+ * from the progress file when it resumes the rekey.
+ * @param db
+ * @param zDbName
+ * @param nPage pages to rewrite, at most what half the page cache holds;
+ * 0 or less for that maximum
+ * @return SQLITE_OK if pages remain, SQLITE_DONE when the database is
+ * rewritten (the new key is then the only one), SQLITE_MISUSE without
+ * sqlite3_rekey_start
+ */
+SQLITE_API int sqlite3_rekey_step(sqlite3 *db, const char *zDbName, int nPage)
+{
+    int iDb = CodecDbIndex(db, zDbName);
+    Btree *pbt;
+    Pager *p;
+    CodecCryptBlock *block;
+    CodecRekeyBatch batch;
+    uint8_t hash[CODEC_PAGEHASHSIZE];
+    Pgno lo = 0, hi = 0, witness;
+    int recorded = 0, committing = 0;
+    int capacity, count;
+    int rc;
+
+    if (iDb < 0) {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "unknown database %s", zDbName);
+        return SQLITE_ERROR;
+    }
+    pbt = db->aDb[iDb].pBt;
+    p = sqlite3BtreePager(pbt);
+    block = (CodecCryptBlock *)sqlite3PagerGetCodec(p);
+
+    if (block == NULL || !block->rekeySession) {
+        return SQLITE_MISUSE;
+    }
+    if (block->rekeyWatermark == 0) {
+        return SQLITE_DONE;
+    }
+
+    sqlite3_mutex_enter(db->mutex);
+
+    rc = sqlite3BtreeBeginTrans(pbt, 1);
+
+    if (rc == SQLITE_OK) {
+        sqlite3PagerPagecount(p, &count);
+        hi = block->rekeyWatermark;
+        if (hi > (Pgno)count + 1) {
+            hi = (Pgno)count + 1; /* The database shrank */
+        }
+        capacity = CodecBatchCapacity(block);
+        if (nPage <= 0 || nPage > capacity) {
+            nPage = capacity;
+        }
+        lo = (hi > (Pgno)nPage + 1) ? hi - (Pgno)nPage : 1;
+
+        /* Record the step before any of its pages changes, with the hash of
+         * one of them as stored to tell later whether it committed */
+        witness = lo != PAGER_MJ_PGNO(p) ? lo : lo + 1;
+        if (witness >= hi) {
+            witness = 0;
+        }
+        if (witness != 0) {
+            rc = CodecStoredHash(block, witness, hash);
+        }
+        if (rc == SQLITE_OK) {
+            rc = CodecRekeyStore(block, hi, lo, witness, hash);
+            recorded = rc == SQLITE_OK;
+        }
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = CodecBatchInit(block, &batch, (int)(hi - lo));
+        if (rc == SQLITE_OK) {
+            block->rekeyTarget = lo;
+            rc = CodecBatchLoad(block, lo, (int)(hi - lo));
+            rc = CodecBatchCipher(block, rc);
+            /* Commit while the encrypted copies are at hand */
+            if (rc == SQLITE_OK) {
+                committing = 1;
+                rc = sqlite3BtreeCommit(pbt);
+            }
+            CodecBatchRelease(block);
+        }
+        CodecBatchFree(block, &batch);
+    }
+
+    if (rc != SQLITE_OK) {
+        block->rekeyTarget = block->rekeyWatermark;
+        sqlite3BtreeRollback(pbt, SQLITE_OK, 1);
+        if (recorded && (committing || CodecRekeyStore(block, hi, hi, 0,
+                                                       NULL) != SQLITE_OK)) {
+            /* The step may have committed: until sqlite3_rekey_start
+             * settles it from the record, its pages can't be read or
+             * written, here as in other connections */
+            block->rekeyWatermark = lo;
+            block->rekeyTarget = lo;
+            block->rekeyKeyed = 0;
+            block->rekeySession = 0;
+        }
+    } else if (lo > 1) {
+        block->rekeyWatermark = lo;
+        rc = CodecRekeyStore(block, lo, lo, 0, NULL);
+    } else {
+        /* Done, the new key is the only one */
+        CodecBlockSetContext(block, &block->readCtx,
+                             CipherContextRetain(block->writeCtx));
+        block->rekeyWatermark = 0;
+        block->rekeyTarget = 0;
+        block->rekeyKeyed = 0;
+        rc = CodecRekeyStore(block, 0, 0, 0, NULL);
+        if (rc == SQLITE_OK) {
+            rc = SQLITE_DONE;
+        }
+        if (block->readCtx == NULL) {
+            sqlite3PagerSetCodec(p, NULL, NULL, NULL, NULL);
+        }
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+    return rc;
+}
+
+/**
+ * Pages an incremental rekey has yet to rewrite
+ * @param db
+ * @param zDbName
+ * @return
+ */
+SQLITE_API int sqlite3_rekey_remaining(sqlite3 *db, const char *zDbName)
+{
+    CodecCryptBlock *block = CodecDbBlock(db, CodecDbIndex(db, zDbName));
+
+    if (block == NULL || block->rekeyWatermark == 0) {
+        return 0;
+    }
+    return (int)block->rekeyWatermark - 1;
+}
+
+/**
+ * End an incremental rekey session
+ * If the rekey isn't done, its progress stays recorded in its file and
+ * the connection keeps both keys, so the database remains usable; it is
+ * resumed with sqlite3_rekey_start.
+ * @param db
+ * @param zDbName
+ * @return SQLITE_OK
+ */
+SQLITE_API int sqlite3_rekey_finish(sqlite3 *db, const char *zDbName)
+{
+    CodecCryptBlock *block = CodecDbBlock(db, CodecDbIndex(db, zDbName));
+
+    if (block != NULL) {
+        block->rekeySession = 0;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Rekey of one database by sqlite3_rekey_schemas, on a connection of its own
+ */
+typedef struct
+{
+    const char *zFilename;
+    const char *zVfs;
+    SQLiteCipherContext *readCtx;  /* Current key, NULL if plain */
+    SQLiteCipherContext *writeCtx; /* New key, NULL to decrypt */
+    int nThreads;  /* Threads sharing its page cipher work */
+    int rc;
+    char *zErrMsg; /* From sqlite3_mprintf */
+} CodecShard;
 
-            ctx = CipherContextClone(pBlock->readCtx);
-            if (ctx == NULL) {
-                return SQLITE_NOMEM;
-            }
-        }
-    } else { /* User-supplied passphrase, so create a cryptographic key out of
-                it */
-        ctx = CipherContextNew(pKey, nKeyLen);
+/**
+ * Shards rekeyed one after the other by one thread
+ */
+typedef struct
+{
+    CodecShard *shards;
+    int first; /* Index of the first shard */
+    int step;  /* Distance to the next one */
+    int count; /* Number of shards */
+} CodecShardTask;
+
+/**
+ * Rekey a database on a connection of its own, so that it has its own pager
+ * and transaction
+ * @param shard
+ */
+static void CodecShardRekey(CodecShard *shard)
+{
+    sqlite3 *h = NULL;
+    int rc = sqlite3_open_v2(shard->zFilename, &h, SQLITE_OPEN_READWRITE,
+                             shard->zVfs);
+
+    if (rc == SQLITE_OK && shard->readCtx != NULL) {
+        rc = CodecAttachContext(h, 0, CipherContextRetain(shard->readCtx));
+    }
+    if (rc == SQLITE_OK) {
+        rc = CodecRekey(h, 0, CipherContextRetain(shard->writeCtx),
+                        shard->nThreads);
+    }
+    if (rc != SQLITE_OK) {
+        shard->zErrMsg = sqlite3_mprintf(
+            "%s: %s", shard->zFilename,
+            h != NULL ? sqlite3_errmsg(h) : sqlite3_errstr(rc));
+    }
+    shard->rc = rc;
+    sqlite3_close(h);
+}
+
+/**
+ * sqlite3_rekey_schemas worker
+ * @param pArg CodecShardTask
+ * @return NULL
+ */
+static void *CodecShardWork(void *pArg)
+{
+    CodecShardTask *task = (CodecShardTask *)pArg;
+    int i;
+
+    for (i = task->first; i < task->count; i += task->step) {
+        CodecShardRekey(&task->shards[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Rekey several databases of a connection at once, each on a connection of
+ * its own, see sqlite3crypt.h
+ * @param db
+ * @param azDbName schema names
+ * @param nDb
+ * @param pKey the new key, NULL to decrypt
+ * @param nKey
+ * @return SQLITE_OK, or the error of the first database that failed
+ */
+SQLITE_API int sqlite3_rekey_schemas(sqlite3 *db, const char *const *azDbName,
+                                     int nDb, const void *pKey, int nKey)
+{
+    CodecShardTask tasks[CODEC_REKEY_MAX_THREADS];
+    CodecShard *shards;
+    SQLiteCipherContext *ctx = NULL;
+    int *aiDb;
+    int nParallel, nThreads, i, j;
+    int rc = SQLITE_OK;
+
+    if (nDb <= 0) {
+        return SQLITE_OK;
+    }
+    shards = (CodecShard *)sqlite3_malloc64(nDb * (sizeof(CodecShard) +
+                                                   sizeof(int)));
+    if (shards == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(shards, 0, nDb * sizeof(CodecShard));
+    aiDb = (int *)(shards + nDb);
+    if (pKey != NULL && nKey > 0) {
+        ctx = CipherContextNew(pKey, nKey);
         if (ctx == NULL) {
+            sqlite3_free(shards);
             return SQLITE_NOMEM;
         }
     }
 
-    /* Create a new encryption block and assign the codec to the new attached
-     * database */
-    if (ctx != NULL) {
-        Pager *pager = sqlite3BtreePager(db->aDb[nDb].pBt);
-        CodecCryptBlock *block = CreateCodeCryptBlock(ctx, pager, -1, NULL);
-        if (!block) {
-            return SQLITE_NOMEM;
+    sqlite3_mutex_enter(db->mutex);
+
+    /* The other connections need the files unlocked */
+    if (!sqlite3_get_autocommit(db)) {
+        rc = SQLITE_MISUSE;
+        sqlite3ErrorWithMsg(db, rc, "cannot rekey within a transaction");
+    }
+    for (i = 0; rc == SQLITE_OK && i < nDb; i++) {
+        CodecCryptBlock *block;
+
+        aiDb[i] = CodecDbIndex(db, azDbName[i]);
+        if (aiDb[i] < 0) {
+            rc = SQLITE_ERROR;
+            sqlite3ErrorWithMsg(db, rc, "unknown database %s", azDbName[i]);
+            break;
+        }
+        for (j = 0; j < i; j++) {
+            if (aiDb[j] == aiDb[i]) {
+                rc = SQLITE_MISUSE;
+                sqlite3ErrorWithMsg(db, rc, "database %s given twice",
+                                    azDbName[i]);
+            }
+        }
+        shards[i].zFilename = sqlite3_db_filename(db, azDbName[i]);
+        if (rc == SQLITE_OK &&
+            (shards[i].zFilename == NULL || shards[i].zFilename[0] == 0)) {
+            rc = SQLITE_MISUSE;
+            sqlite3ErrorWithMsg(db, rc, "database %s has no file",
+                                azDbName[i]);
         }
+        block = CodecDbBlock(db, aiDb[i]);
+        if (rc == SQLITE_OK && block != NULL &&
+            (block->rekeyWatermark != 0 || block->readCtx != block->writeCtx)) {
+            rc = SQLITE_MISUSE;
+            sqlite3ErrorWithMsg(db, rc, "an incremental rekey is in "
+                                        "progress");
+        }
+        shards[i].zVfs =
+            sqlite3PagerVfs(sqlite3BtreePager(db->aDb[aiDb[i]].pBt))->zName;
+        shards[i].readCtx = block != NULL ? block->readCtx : NULL;
+        shards[i].writeCtx = ctx;
+    }
 
-        sqlite3PagerSetCodec(pager, SQLite3CodecCallback,
-                             SQLite3CodecSizeChangedCallback,
-                             SQLite3CodecFreeCallback, block);
+    if (rc == SQLITE_OK) {
+        /* Split the threads between the shards rekeyed at the same time */
+        nParallel = nDb < codecRekeyThreads ? nDb : codecRekeyThreads;
+        if (nParallel > CODEC_REKEY_MAX_THREADS) {
+            nParallel = CODEC_REKEY_MAX_THREADS;
+        }
+        if (nParallel < 1) {
+            nParallel = 1;
+        }
+        nThreads = codecRekeyThreads / nParallel;
+        for (i = 0; i < nDb; i++) {
+            shards[i].nThreads = nThreads > 1 ? nThreads : 1;
+        }
+        for (i = 0; i < nParallel; i++) {
+            tasks[i].shards = shards;
+            tasks[i].first = i;
+            tasks[i].step = nParallel;
+            tasks[i].count = nDb;
+        }
+        CodecRunTasks(CodecShardWork, tasks, sizeof(tasks[0]), nParallel);
 
-        rc = SQLITE_OK;
+        /* Switch this connection over to the new key of the databases that
+         * were rekeyed; its cache is dropped as the files changed */
+        for (i = 0; i < nDb; i++) {
+            Pager *pager = sqlite3BtreePager(db->aDb[aiDb[i]].pBt);
+            CodecCryptBlock *block = CodecDbBlock(db, aiDb[i]);
+
+            if (shards[i].rc != SQLITE_OK) {
+                if (rc == SQLITE_OK) {
+                    rc = shards[i].rc;
+                    sqlite3ErrorWithMsg(db, rc, "%s", shards[i].zErrMsg);
+                }
+            } else if (ctx == NULL) {
+                if (block != NULL) {
+                    sqlite3PagerSetCodec(pager, NULL, NULL, NULL, NULL);
+                }
+            } else if (block == NULL) {
+                if (CodecAttachContext(db, aiDb[i],
+                                       CipherContextRetain(ctx)) != SQLITE_OK &&
+                    rc == SQLITE_OK) {
+                    rc = SQLITE_NOMEM;
+                }
+            } else {
+                CodecBlockSetContext(block, &block->writeCtx,
+                                     CipherContextRetain(ctx));
+                CodecBlockSetContext(block, &block->readCtx,
+                                     CipherContextRetain(ctx));
+                block->readAhead.count = 0;
+                block->writeBatch.count = 0;
+            }
+            sqlite3_free(shards[i].zErrMsg);
+        }
     }
+
+    sqlite3_mutex_leave(db->mutex);
+    CipherContextRelease(ctx);
+    sqlite3_free(shards);
     return rc;
 }
 
 /**
- * Get the stored crypto key
- * Once a password has been supplied and a key created, we don't keep the
- * original password for security purposes.  Therefore return NULL.
- * @param db
- * @param nDb
- * @param ppKey
- * @param pnKeyLen
+ * Share of a file conversion chunk handled by one thread
  */
-void sqlite3CodecGetKey(sqlite3 *db, int nDb, void **ppKey, int *pnKeyLen)
+typedef struct
 {
-    Btree *pbt = db->aDb[0].pBt;
-    Pager *p = sqlite3BtreePager(pbt);
-    CodecCryptBlock *pBlock = (CodecCryptBlock *)sqlite3PagerGetCodec(p);
+    SQLiteCipherContext *readCtx;  /* Key of the input, NULL if plain */
+    SQLiteCipherContext *writeCtx; /* Key of the output, NULL if plain */
+    Pgno first;     /* Page number of the first page of the share */
+    Pgno lockPage;  /* Page holding the lock bytes, never encrypted */
+    int count;      /* Number of pages */
+    int pageSize;
+    char *input;    /* Pages as read, decrypted in place */
+    char *output;   /* Pages to write */
+    int rc;
+} CodecFileTask;
 
-    if (ppKey != NULL) {
-        *ppKey = 0;
-    }
-    if (pnKeyLen != NULL && pBlock != NULL) {
-        *pnKeyLen = 1;
+/**
+ * File conversion worker: decrypt the pages with the input key, then
+ * encrypt them with the output key
+ * @param pArg CodecFileTask
+ * @return NULL
+ */
+static void *CodecFileWork(void *pArg)
+{
+    CodecFileTask *task = (CodecFileTask *)pArg;
+    int i;
+
+    for (i = 0; i < task->count; i++) {
+        Pgno pgno = task->first + (Pgno)i;
+        char *in = task->input + (size_t)i * task->pageSize;
+        char *out = task->output + (size_t)i * task->pageSize;
+        if (pgno == task->lockPage) {
+            memcpy(out, in, task->pageSize);
+            continue;
+        }
+        if (task->readCtx != NULL &&
+            SQLiteDecrypt(task->readCtx, pgno, in, in, task->pageSize) !=
+                SQLITE_OK) {
+            if (task->rc == SQLITE_OK) {
+                sqlite3_log(SQLITE_CORRUPT,
+                            "codec: page %u failed authentication", pgno);
+            }
+            task->rc = SQLITE_CORRUPT;
+            continue;
+        }
+        if (task->writeCtx != NULL) {
+            SQLiteEncrypt(task->writeCtx, pgno, in, out, task->pageSize);
+        } else {
+            memcpy(out, in, task->pageSize);
+        }
     }
+    return NULL;
 }
 
 /**
- * Deprecated. Use sqlite3_key_v2.
- *
- * @param db
- * @param pKey
- * @param nKey
+ * Read or write a run of pages, in pieces the size of the largest page as
+ * VFSes only expect page sized accesses (unix caps a write at 128KiB)
+ * @param fd
+ * @param buffer
+ * @param amount
+ * @param offset
+ * @param write
  * @return
  */
-SQLITE_API int sqlite3_key(sqlite3 *db, /* Database to be rekeyed */
-                           const void *pKey, int nKey /* The key */
-                           )
+static int CodecFileIo(sqlite3_file *fd, char *buffer, i64 amount, i64 offset,
+                       int write)
 {
-    return sqlite3_key_v2(db, NULL, pKey, nKey);
+    int rc = SQLITE_OK;
+
+    while (rc == SQLITE_OK && amount > 0) {
+        int n = amount < SQLITE_MAX_PAGE_SIZE ? (int)amount
+                                              : SQLITE_MAX_PAGE_SIZE;
+        rc = write ? sqlite3OsWrite(fd, buffer, n, offset)
+                   : sqlite3OsRead(fd, buffer, n, offset);
+        buffer += n;
+        offset += n;
+        amount -= n;
+    }
+    return rc;
 }
 
 /**
- * Specify the key for an encrypted database.  This routine should be called
- * right after sqlite3_open().
- *
- * The code to implement this API is not available in the public release
- * of SQLite.
- * @param db
- * @param pKey
- * @param nKey
- * @return
+ * Find the page size and reserve of a database file from its header,
+ * decrypting page 1 if it has a key (which also settles its format)
+ * @param fd
+ * @param pCtx key of the file, NULL if plain; replaced by the context of
+ * the format found
+ * @param page SQLITE_MAX_PAGE_SIZE bytes buffer
+ * @param pPageSize
+ * @param pReserve
+ * @return SQLITE_OK, SQLITE_NOTADB if it isn't a database or the key is wrong
  */
-SQLITE_API int sqlite3_key_v2(sqlite3 *db,         /* Database to be rekeyed */
-                              const char *zDbName, /* Name of the database */
-                              const void *pKey, int nKey /* The key */
-                              )
+static int CodecFileHeader(sqlite3_file *fd, SQLiteCipherContext **pCtx,
+                           char *page, int *pPageSize, int *pReserve)
 {
-    return sqlite3CodecAttach(db, 0, pKey, nKey);
+    const uint8_t *header = (const uint8_t *)page;
+    int pageSize;
+    int rc;
+
+    rc = sqlite3OsRead(fd, page, 512, 0);
+    if (rc != SQLITE_OK) {
+        return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_NOTADB : rc;
+    }
+    if (*pCtx != NULL) {
+        /* The start of page 1 decrypts the same whatever the page size */
+        SQLiteCipherContext *found =
+            DecryptFirstPage(*pCtx, fd, page, page + 512, 512);
+        if (found != NULL) {
+            CipherContextRelease(*pCtx);
+            *pCtx = found;
+        }
+    }
+    if (memcmp(page, SQLITE_FILE_HEADER, sizeof(SQLITE_FILE_HEADER)) != 0) {
+        return SQLITE_NOTADB;
+    }
+    pageSize = (header[16] << 8) | header[17];
+    if (pageSize == 1) {
+        pageSize = 65536;
+    }
+    if (pageSize < 512 || pageSize > SQLITE_MAX_PAGE_SIZE ||
+        (pageSize & (pageSize - 1)) != 0) {
+        return SQLITE_NOTADB;
+    }
+    *pPageSize = pageSize;
+    *pReserve = header[20];
+    return SQLITE_OK;
 }
 
 /**
- * Deprecated. Use sqlite3_rekey_v2.
+ * Check that nothing of a database is outside of its file: no connection
+ * is writing it, and it has neither a hot journal to roll back nor a WAL
+ * with frames to checkpoint, nor an incremental rekey in progress
+ * @param vfs
+ * @param fd the database file, SHARED locked
+ * @param zName its name
+ * @return SQLITE_OK, SQLITE_BUSY if there is, SQLITE_MISUSE for a rekey
  */
-SQLITE_API int sqlite3_rekey(sqlite3 *db, /* Database to be rekeyed */
-                             const void *pKey, int nKey /* The new key */
-                             )
+static int CodecFileSettled(sqlite3_vfs *vfs, sqlite3_file *fd,
+                            const char *zName)
 {
-    return sqlite3_rekey_v2(db, NULL, pKey, nKey);
+    static const char *const suffixes[] = {"-journal", "-wal"};
+    int reserved = 0, i;
+    int rc;
+
+    rc = sqlite3OsCheckReservedLock(fd, &reserved);
+    if (rc == SQLITE_OK && reserved) {
+        rc = SQLITE_BUSY;
+    }
+    for (i = 0; rc == SQLITE_OK && i < 2; i++) {
+        char *zSide = sqlite3_mprintf("%s%s", zName, suffixes[i]);
+        sqlite3_file *side = NULL;
+        i64 size = 0;
+        u8 first = 0;
+        int exists = 0, flags;
+
+        if (zSide == NULL) {
+            return SQLITE_NOMEM;
+        }
+        rc = sqlite3OsAccess(vfs, zSide, SQLITE_ACCESS_EXISTS, &exists);
+        if (rc == SQLITE_OK && exists) {
+            rc = sqlite3OsOpenMalloc(vfs, zSide, &side,
+                                     SQLITE_OPEN_READONLY |
+                                         (i == 0 ? SQLITE_OPEN_MAIN_JOURNAL
+                                                 : SQLITE_OPEN_WAL),
+                                     &flags);
+        }
+        if (side != NULL) {
+            rc = sqlite3OsFileSize(side, &size);
+            if (rc == SQLITE_OK && i == 0 && size > 0) {
+                rc = sqlite3OsRead(side, &first, 1, 0);
+            }
+            sqlite3OsCloseFree(side);
+            /* A journal is hot unless zeroed out (journal_mode PERSIST);
+             * a WAL has frames past its header until reset */
+            if (rc == SQLITE_OK &&
+                (i == 0 ? first != 0 : size > WAL_HDRSIZE)) {
+                sqlite3_log(SQLITE_BUSY, "codec: %s must be %s first", zSide,
+                            i == 0 ? "rolled back" : "checkpointed");
+                rc = SQLITE_BUSY;
+            }
+        }
+        sqlite3_free(zSide);
+    }
+    if (rc == SQLITE_OK) {
+        CodecRekeyProgress progress;
+        rc = CodecProgressRead(vfs, zName, &progress);
+        if (rc == SQLITE_OK && progress.watermark != 0) {
+            sqlite3_log(SQLITE_MISUSE, "codec: %s is part way through an "
+                                       "incremental rekey",
+                        zName);
+            rc = SQLITE_MISUSE; /* Half rekeyed, two keys */
+        }
+    }
+    return rc;
 }
 
 /**
- * Change the key on an open database.
- *
- * If the current database is not encrypted, this routine will encrypt it. If
- * pNew==0 or nNew==0,
- * the database is decrypted.
- *
- * The code to implement this API is not available in the public release of
- * SQLite.
- * @param db
- * @param pKey
- * @param nKey
- * @return
+ * Encrypt, decrypt or rekey a database file into a new file, without going
+ * through the pager: the file is streamed in chunks and the pages of each
+ * chunk are converted on sqlite3_codec_rekey_threads threads. The pages
+ * come out as the pager would write them. There is no journal, so the
+ * output is deleted if the conversion fails; the input must not be
+ * written to meanwhile. Only the database file is read: a hot journal or
+ * a WAL with frames fails it, they have to be rolled back or checkpointed
+ * by opening the database first.
+ * @param zIn input database file
+ * @param pInKey its key, NULL if it isn't encrypted
+ * @param nInKey
+ * @param zOut output file, replaced
+ * @param pOutKey key to encrypt with, NULL to write it decrypted
+ * @param nOutKey
+ * @return SQLITE_OK, SQLITE_NOTADB if the input key is wrong, SQLITE_CORRUPT
+ * if a page fails authentication, SQLITE_MISUSE if an incremental rekey of
+ * the input is in progress, SQLITE_BUSY if the input is being written or
+ * has a hot journal or a WAL with frames
  */
-SQLITE_API int sqlite3_rekey_v2(sqlite3 *db, /* Database to be rekeyed */
-                                const char *zDbName, /* Name of the database */
-                                const void *pKey, int nKey /* The new key */
-                                )
+SQLITE_API int sqlite3_codec_convert_file(const char *zIn, const void *pInKey,
+                                          int nInKey, const char *zOut,
+                                          const void *pOutKey, int nOutKey)
 {
-    Btree *pbt = db->aDb[0].pBt;
-    Pager *p = sqlite3BtreePager(pbt);
-    CodecCryptBlock *block = (CodecCryptBlock *)sqlite3PagerGetCodec(p);
-    SQLiteCipherContext *ctx = NULL;
-    int rc = SQLITE_ERROR;
+    CodecFileTask tasks[CODEC_REKEY_MAX_THREADS];
+    sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+    sqlite3_file *in = NULL, *out = NULL;
+    SQLiteCipherContext *readCtx = NULL, *writeCtx = NULL;
+    char *input = NULL, *output = NULL;
+    int nThreads = codecRekeyThreads;
+    int pageSize = 0, reserve = 0, chunkPages, flags, i;
+    i64 fileSize = 0, offset;
+    int rc;
 
-    ctx = CipherContextNew(pKey, nKey);
-
-    /* To rekey a database, we change the writekey for the pager.  The readkey
-     * remains the same */
-
-    if (block == NULL) /* Encrypt an unencrypted database */
-    {
-        block = CreateCodeCryptBlock(ctx, p, -1, NULL);
-        if (block == NULL)
+    if (zIn == NULL || zOut == NULL || strcmp(zIn, zOut) == 0) {
+        return SQLITE_MISUSE;
+    }
+    if (vfs == NULL) {
+        return SQLITE_ERROR;
+    }
+    if (pInKey != NULL && nInKey > 0) {
+        readCtx = CipherContextNew(pInKey, nInKey);
+        if (readCtx == NULL) {
+            return SQLITE_NOMEM;
+        }
+    }
+    if (pOutKey != NULL && nOutKey > 0) {
+        writeCtx = CipherContextNew(pOutKey, nOutKey);
+        if (writeCtx == NULL) {
+            CipherContextRelease(readCtx);
             return SQLITE_NOMEM;
+        }
+    }
 
-        block->readCtx = NULL; /* Original database is not encrypted */
-        sqlite3PagerSetCodec(sqlite3BtreePager(pbt), SQLite3CodecCallback,
-                             SQLite3CodecSizeChangedCallback,
-                             SQLite3CodecFreeCallback, block);
-    } else {
-        /* Change the writekey for an already-encrypted database */
-        block->writeCtx = ctx;
+    rc = sqlite3OsOpenMalloc(vfs, zIn, &in,
+                             SQLITE_OPEN_READONLY | SQLITE_OPEN_MAIN_DB,
+                             &flags);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3OsLock(in, SHARED_LOCK);
+    }
+    if (rc == SQLITE_OK) {
+        rc = CodecFileSettled(vfs, in, zIn);
     }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3OsFileSize(in, &fileSize);
+    }
+    if (rc == SQLITE_OK) {
+        input = (char *)sqlite3_malloc(SQLITE_MAX_PAGE_SIZE);
+        rc = input != NULL ? SQLITE_OK : SQLITE_NOMEM;
+    }
+    if (rc == SQLITE_OK && fileSize > 0) {
+        rc = CodecFileHeader(in, &readCtx, input, &pageSize, &reserve);
+        if (rc == SQLITE_OK && fileSize % pageSize != 0) {
+            rc = SQLITE_CORRUPT;
+        }
+        if (rc == SQLITE_OK && writeCtx != NULL &&
+            CipherContextReserve(writeCtx) > reserve) {
+            sqlite3_log(SQLITE_ERROR, "codec: %s has %d reserved bytes per "
+                                      "page, the cipher needs %d",
+                        zIn, reserve, CipherContextReserve(writeCtx));
+            rc = SQLITE_ERROR;
+        }
+    }
+    sqlite3_free(input);
+    input = NULL;
 
-    /* Rewrite the whole database to ensure new writekey is used */
-    sqlite3_mutex_enter(db->mutex);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3OsOpenMalloc(vfs, zOut, &out,
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                     SQLITE_OPEN_MAIN_DB,
+                                 &flags);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3OsTruncate(out, 0);
+        }
+    }
 
-    /* Start a transaction */
-    rc = sqlite3BtreeBeginTrans(pbt, 1);
+    if (rc == SQLITE_OK && fileSize > 0) {
+        chunkPages = (int)(((int64_t)nThreads * CODEC_REKEY_CHUNK) / pageSize);
+        if (chunkPages < nThreads) {
+            chunkPages = nThreads;
+        }
+        input = (char *)sqlite3_malloc64((sqlite3_uint64)chunkPages *
+                                         pageSize);
+        output = (char *)sqlite3_malloc64((sqlite3_uint64)chunkPages *
+                                          pageSize);
+        if (input == NULL || output == NULL) {
+            rc = SQLITE_NOMEM;
+        }
 
-    if (rc == SQLITE_OK) {
-        /* Rewrite all the pages in the database using the new encryption key */
-        Pgno nPage;
-        Pgno nSkip = PAGER_MJ_PGNO(p);
-        DbPage *pPage;
-        Pgno n;
-        int count;
+        for (offset = 0; rc == SQLITE_OK && offset < fileSize;) {
+            int count = chunkPages;
+            int n = nThreads;
+            if ((i64)count * pageSize > fileSize - offset) {
+                count = (int)((fileSize - offset) / pageSize);
+            }
+            rc = CodecFileIo(in, input, (i64)count * pageSize, offset, 0);
+            if (rc != SQLITE_OK) {
+                break;
+            }
 
-        sqlite3PagerPagecount(p, &count);
-        nPage = (Pgno)count;
+            if (n > count) {
+                n = count;
+            }
+            for (i = 0; i < n; i++) {
+                int start = (int)((int64_t)count * i / n);
+                int end = (int)((int64_t)count * (i + 1) / n);
+                tasks[i].readCtx = readCtx;
+                tasks[i].writeCtx = writeCtx;
+                tasks[i].first = (Pgno)(offset / pageSize) + 1 + (Pgno)start;
+                tasks[i].lockPage = (Pgno)(PENDING_BYTE / pageSize) + 1;
+                tasks[i].count = end - start;
+                tasks[i].pageSize = pageSize;
+                tasks[i].input = input + (size_t)start * pageSize;
+                tasks[i].output = output + (size_t)start * pageSize;
+                tasks[i].rc = SQLITE_OK;
+            }
+            CodecRunTasks(CodecFileWork, tasks, sizeof(tasks[0]), n);
+            for (i = 0; i < n; i++) {
+                if (tasks[i].rc != SQLITE_OK) {
+                    rc = tasks[i].rc;
+                }
+            }
 
-        for (n = 1; n <= nPage; n++) {
-            if (n == nSkip)
-                continue;
-            rc = sqlite3PagerGet(p, n, &pPage, 0);
-            if (!rc) {
-                rc = sqlite3PagerWrite(pPage);
-                sqlite3PagerUnref(pPage);
+            if (rc == SQLITE_OK) {
+                rc = CodecFileIo(out, output, (i64)count * pageSize, offset,
+                                 1);
             }
+            offset += (i64)count * pageSize;
         }
     }
 
-    /* If we succeeded, try and commit the transaction */
-    if (rc == SQLITE_OK) {
-        rc = sqlite3BtreeCommit(pbt);
-    } else {
-        /* If we failed, rollback */
-        sqlite3BtreeRollback(pbt, SQLITE_OK, 1);
+    if (rc == SQLITE_OK && out != NULL) {
+        rc = sqlite3OsSync(out, SQLITE_SYNC_NORMAL);
     }
 
-    /* If we succeeded, destroy any previous read key this database used and
-     * make the readkey equal to the writekey */
-    if (rc == SQLITE_OK) {
-        if (block->readCtx != NULL) {
-            sqlite3_free(block->readCtx);
+    sqlite3_free(input);
+    sqlite3_free(output);
+    if (out != NULL) {
+        sqlite3OsCloseFree(out);
+        if (rc != SQLITE_OK) {
+            sqlite3OsDelete(vfs, zOut, 0);
         }
-        block->readCtx = block->writeCtx;
     }
-    /* We failed.  Destroy the new writekey (if there was one) and revert it
-       back to the original readkey */
-    else {
-        if (block->writeCtx != NULL) {
-            sqlite3_free(block->writeCtx);
-        }
-        block->writeCtx = block->readCtx;
+    if (in != NULL) {
+        sqlite3OsUnlock(in, NO_LOCK);
+        sqlite3OsCloseFree(in);
     }
+    CipherContextRelease(readCtx);
+    CipherContextRelease(writeCtx);
+    return rc;
+}
 
-    /* If the readkey and writekey are both empty, there's no need for a codec
-     * on this pager anymore. Remove the codec from the pager.
-     * sqlite3PagerSetCodec calls FreeCodecCryptBlock for this block
-     */
-    if (block->readCtx == NULL && block->writeCtx == NULL) {
-        sqlite3PagerSetCodec(p, NULL, NULL, NULL, NULL);
+/**
+ * Read the page cipher statistics of a database
+ * @param db
+ * @param zDbName database name, NULL for main
+ * @param pStats receives the counters, may be NULL
+ * @param resetFlag reset the counters after reading them
+ * @return SQLITE_OK, SQLITE_ERROR if the database isn't encrypted
+ */
+SQLITE_API int sqlite3_codec_status(sqlite3 *db, const char *zDbName,
+                                    sqlite3_codec_stats *pStats,
+                                    int resetFlag)
+{
+    CodecCryptBlock *block;
+    int rc = SQLITE_OK;
+
+    sqlite3_mutex_enter(db->mutex);
+    block = CodecDbBlock(db, zDbName ? sqlite3FindDbName(db, zDbName) : 0);
+    if (block == NULL) {
+        rc = SQLITE_ERROR;
+    } else {
+        CodecStatsRead(block, pStats, resetFlag);
     }
-    
     sqlite3_mutex_leave(db->mutex);
-
     return rc;
 }
 
+/**
+ * Turn timing of the page cipher statistics on or off
+ * @param onoff 1 or 0, negative to query
+ * @return the previous setting
+ */
+SQLITE_API int sqlite3_codec_timing(int onoff)
+{
+    int previous = codecTiming;
+    if (onoff >= 0) {
+        codecTiming = onoff != 0;
+    }
+    return previous;
+}
+
 /**
  * Specify the activation key for a SEE database.  Unless
  * activated, none of the SEE routines will work.
@@ -0,0 +1,205 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2013 mudzot
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+ */
+
+#ifndef SQLITE3CRYPT_H
+#define SQLITE3CRYPT_H
+
+/**
+ * Codec interfaces beyond the sqlite3_key/sqlite3_rekey family declared
+ * by sqlite3.h
+ */
+
+#ifdef SQLITE_HAS_CODEC
+
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Key forms: while on, sqlite3_key and the other calls taking a key parse
+ * it for
+ * - a prefix choosing the format of a new database: "aes128-cbc:",
+ *   "aes128-xts:", "aes256-xts:" or "aes256-gcm:";
+ * - then, in place of a pass phrase, x'<64 or 128 hex digits>' for a raw
+ *   key, or pbkdf2:<iterations>:passphrase for a PBKDF2-HMAC-SHA512
+ *   derivation.
+ * Off, every key is a pass phrase as a whole. Turning it on changes the key
+ * of databases keyed with a pass phrase of one of these forms: they no
+ * longer open, and have to be rekeyed with it off, to a pass phrase of no
+ * such form, first. Off by default unless built with SQLITE_CODEC_KEY_FORMS=1.
+ * Applies to the whole process.
+ * @param onoff 1 or 0, or a negative value to only query it
+ * @return the previous setting
+ */
+SQLITE_API int sqlite3_codec_key_forms(int onoff);
+
+/**
+ * Set the number of threads sqlite3_rekey_v2 spreads the page cipher work
+ * over, including the calling thread, and that sqlite3_rekey_schemas shares
+ * between its databases. Also used by the file conversion, the
+ * read-ahead, and to encrypt the dirty pages of a commit or WAL write in
+ * batches when there are enough of them. Applies to the whole process.
+ * @param nThreads new count, or a negative value to only query it
+ * @return the previous count
+ */
+SQLITE_API int sqlite3_codec_rekey_threads(int nThreads);
+
+/**
+ * Read-ahead of sequential scans: once the pager of an encrypted database
+ * loads a few pages in a row, the next nPages pages are read from the file
+ * at once and decrypted on sqlite3_codec_rekey_threads threads, and the
+ * pager loads them from memory instead of reading them. This happens
+ * within the load that triggers it, not in the background; pages read
+ * from the WAL or the mapping of sqlite3_codec_mmap don't use it. Applies
+ * to the whole process.
+ * @param nPages new window in pages, 0 (the default) to turn it off, or a
+ * negative value to only query it
+ * @return the previous window
+ */
+SQLITE_API int sqlite3_codec_readahead(int nPages);
+
+/**
+ * Memory mapped reads of encrypted databases: the pager doesn't map an
+ * encrypted database itself, so while this is on the codec reads the
+ * database file through the mapping PRAGMA mmap_size allows, decrypting
+ * pages from it straight into the page cache. Off by default. Applies to
+ * the whole process.
+ * @param onoff 1 or 0, or a negative value to only query it
+ * @return the previous setting
+ */
+SQLITE_API int sqlite3_codec_mmap(int onoff);
+
+/**
+ * Incremental rekey: sqlite3_rekey_start installs the new key, each
+ * sqlite3_rekey_step rewrites a bounded number of pages in its own
+ * transaction until it returns SQLITE_DONE, and sqlite3_rekey_finish ends
+ * the session. Progress is kept in a "-rekey" file next to the database,
+ * synced around each step, so an interrupted rekey is resumed by calling
+ * sqlite3_rekey_start with the same key. Until then, reading a page already
+ * under the new key fails with SQLITE_NOTADB. The file goes with the
+ * database until the rekey is done: copying the database without it loses
+ * track of which pages are under which key.
+ */
+SQLITE_API int sqlite3_rekey_start(sqlite3 *db, const char *zDbName,
+                                   const void *pKey, int nKey);
+SQLITE_API int sqlite3_rekey_step(sqlite3 *db, const char *zDbName,
+                                  int nPage);
+SQLITE_API int sqlite3_rekey_remaining(sqlite3 *db, const char *zDbName);
+SQLITE_API int sqlite3_rekey_finish(sqlite3 *db, const char *zDbName);
+
+/**
+ * Rekey several databases of the connection, typically attached shards, at
+ * the same time: each is rewritten under the new key by a thread of its own
+ * on a separate connection to its file, with its own pager and transaction.
+ * Up to sqlite3_codec_rekey_threads databases are rekeyed at once, sharing
+ * those threads. The connection must not be in a transaction, and the files
+ * must not be locked by other connections. If a database fails, the others
+ * keep their new key and this connection is switched over to it for them.
+ * @param db
+ * @param azDbName schema names, "main" or those given to ATTACH
+ * @param nDb
+ * @param pKey the new key, NULL to decrypt
+ * @param nKey
+ * @return SQLITE_OK, or the error of the first database that failed (its
+ * message is the connection's), SQLITE_MISUSE within a transaction or during
+ * an incremental rekey
+ */
+SQLITE_API int sqlite3_rekey_schemas(sqlite3 *db, const char *const *azDbName,
+                                     int nDb, const void *pKey, int nKey);
+
+/**
+ * Encrypt, decrypt or rekey a database file into a new file offline, page
+ * by page on sqlite3_codec_rekey_threads threads, bypassing the pager and
+ * its journal. The input must not be in use, and must have no hot journal
+ * or WAL frames: open and close it once to roll back or checkpoint them.
+ * @param zIn input database file
+ * @param pInKey its key, NULL if it isn't encrypted
+ * @param nInKey
+ * @param zOut output file, replaced
+ * @param pOutKey key of the output, NULL to decrypt
+ * @param nOutKey
+ * @return SQLITE_OK, SQLITE_NOTADB if pInKey is wrong, SQLITE_CORRUPT if a
+ * page fails authentication, SQLITE_MISUSE if an incremental rekey of the
+ * input is in progress, SQLITE_BUSY if the input is being written or has a
+ * hot journal or WAL frames
+ */
+SQLITE_API int sqlite3_codec_convert_file(const char *zIn, const void *pInKey,
+                                          int nInKey, const char *zOut,
+                                          const void *pOutKey, int nOutKey);
+
+/**
+ * Page cipher statistics of a database, see sqlite3_codec_status
+ * Counters are indexed by operation: pages decrypted on load (codec modes
+ * 0, 2 and 3), encrypted for the database file (6) and for the journal (7).
+ * The time is only accumulated while sqlite3_codec_timing is on; histogram
+ * bucket 0 counts pages taking under 256ns, bucket i (1..14) those taking
+ * [2^(7+i), 2^(8+i)) ns and the last one the rest.
+ */
+#define SQLITE_CODEC_STAT_DECRYPT 0
+#define SQLITE_CODEC_STAT_ENCRYPT 1
+#define SQLITE_CODEC_STAT_JOURNAL 2
+#define SQLITE_CODEC_STAT_COUNT 3
+#define SQLITE_CODEC_STAT_BUCKETS 16
+
+typedef struct sqlite3_codec_stats {
+    sqlite3_uint64 nPage[SQLITE_CODEC_STAT_COUNT];
+    sqlite3_uint64 nByte[SQLITE_CODEC_STAT_COUNT];
+    sqlite3_uint64 nNanosecond[SQLITE_CODEC_STAT_COUNT];
+    sqlite3_uint64 aHistogram[SQLITE_CODEC_STAT_COUNT]
+                             [SQLITE_CODEC_STAT_BUCKETS];
+} sqlite3_codec_stats;
+
+/**
+ * Read the page cipher statistics of a database
+ * PRAGMA [schema.]codec_stats returns them as text, a line per operation
+ * ("decrypt pages=... bytes=... nanoseconds=... histogram=b0,b1,...");
+ * PRAGMA codec_stats = reset resets them after reading. Like the pragmas
+ * of a VFS, it is answered as the statement is prepared.
+ * @param db
+ * @param zDbName database name, NULL for main
+ * @param pStats receives the counters, may be NULL to only reset them
+ * @param resetFlag reset the counters after reading them
+ * @return SQLITE_OK, SQLITE_ERROR if the database isn't encrypted
+ */
+SQLITE_API int sqlite3_codec_status(sqlite3 *db, const char *zDbName,
+                                    sqlite3_codec_stats *pStats,
+                                    int resetFlag);
+
+/**
+ * Turn timing of the page cipher statistics on or off, for the whole
+ * process. It costs two clock reads per page, so it is off by default.
+ * @param onoff 1 or 0, or a negative value to only query it
+ * @return the previous setting
+ */
+SQLITE_API int sqlite3_codec_timing(int onoff);
+
+#ifdef __cplusplus
+} /* end of the 'extern "C"' block */
+#endif
+
+#endif /* SQLITE_HAS_CODEC */
+
+#endif /* SQLITE3CRYPT_H */